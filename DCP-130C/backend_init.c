@@ -11,6 +11,8 @@
  *   - Whether the usblp kernel module is bound to the scanner
  *   - Whether QEMU binfmt_misc handlers are registered (can cause
  *     USB contention on ARM when i386 helpers touch device nodes)
+ * The probe results are cached between loads (see "USB environment
+ * probe" below).
  */
 #include <signal.h>
 #include <unistd.h>
@@ -19,12 +21,19 @@
 #include <stdlib.h>
 #include <dirent.h>
 #include <time.h>
+#include <sys/stat.h>
 
 /* Brother USB vendor ID */
 #define BROTHER_VID "04f9"
 
 /* Path to Brother SANE config — must match BROTHER_SANE_DIR in brscan2 source */
+#ifndef BROTHER_INI_PATH
 #define BROTHER_INI_PATH "/usr/local/Brother/sane/Brsane2.ini"
+#endif
+
+#ifndef USB_DEVICES_DIR
+#define USB_DEVICES_DIR "/sys/bus/usb/devices"
+#endif
 
 /*
  * Format current wall-clock time as "HH:MM:SS.mmm" into a static buffer.
@@ -69,58 +78,302 @@ static int read_sysfs(const char *path, char *buf, int bufsz) {
 }
 
 /*
- * Probe USB environment for Brother devices.
- * Reports bus speed, usblp binding status, and product info.
+ * USB environment probe
+ *
+ * probe_collect() gathers the facts in one pass over USB_DEVICES_DIR,
+ * plus Brsane2.ini and binfmt_misc; probe_report() prints them.  AirSane
+ * and saned load the backend for every discovery and scan, so the facts
+ * are cached in BROTHER_PROBE_CACHE (default PROBE_CACHE_PATH) and a
+ * load with a valid cache costs one small read and a devnum read per
+ * cached device.  The cache is used while it is from this boot, younger
+ * than BROTHER_PROBE_CACHE_AGE seconds (default 3600, 0 always probes),
+ * Brsane2.ini has the same mtime and each cached device still has the
+ * same devnum, which changes on a replug.  The udev rule installed by
+ * install_scanner.sh also deletes it when a Brother device comes or goes.
+ * A cache in a directory everyone can write is neither read nor written.
  */
-static void probe_usb_environment(void) {
-    DIR *d = opendir("/sys/bus/usb/devices");
-    if (!d) {
-        fprintf(stderr, "%s [BROTHER2] usb: cannot read /sys/bus/usb/devices\n", debug_ts());
-        return;
+#define PROBE_CACHE_PATH  "/var/cache/brother2/usbprobe.cache"
+#define PROBE_CACHE_MAGIC "brother-usbprobe 1"
+#define PROBE_CACHE_AGE   3600
+#define PROBE_MAX_DEV     8
+#define PROBE_MAX_USBLP   8
+
+typedef struct {
+    char name[64];                  /* sysfs device name, e.g. "1-1.2" */
+    char pid[16], product[128], speed[16], version[16];
+    char host_speed[16];            /* parent port; "" if unreadable */
+    int  devnum;
+    int  n_usblp;
+    char usblp[PROBE_MAX_USBLP][64];    /* interfaces bound to usblp */
+} PROBE_DEV;
+
+typedef struct {
+    char      boot_id[40];
+    long long time;                 /* when probed, seconds since epoch */
+    long long ini_mtime;            /* -1: no Brsane2.ini */
+    int       compression;          /* [Driver] compression=; -1 no key,
+                                       -2 Brsane2.ini unreadable */
+    int       qemu;                 /* binfmt_misc qemu-* handlers found */
+    int       ndev;
+    PROBE_DEV dev[PROBE_MAX_DEV];
+} PROBE;
+
+static long long ini_mtime(void) {
+    struct stat st;
+    return stat(BROTHER_INI_PATH, &st) == 0 ? (long long)st.st_mtime : -1;
+}
+
+/* compression= from the [Driver] section of Brsane2.ini */
+static int read_ini_compression(void) {
+    FILE *ini = fopen(BROTHER_INI_PATH, "r");
+    if (!ini)
+        return -2;
+    char line[256];
+    int in_driver = 0, val = -1;
+    while (fgets(line, sizeof(line), ini)) {
+        if (line[0] == '[')
+            in_driver = (strncmp(line, "[Driver]", 8) == 0);
+        if (in_driver && strncmp(line, "compression=", 12) == 0) {
+            val = atoi(line + 12);
+            break;
+        }
     }
+    fclose(ini);
+    return val;
+}
+
+/* Is the interface bound to the usblp driver? */
+static int bound_to_usblp(const char *intf) {
+    char driver_link[512], driver_target[256];
+    snprintf(driver_link, sizeof(driver_link), USB_DEVICES_DIR "/%s/driver", intf);
+    int dlen = (int)readlink(driver_link, driver_target, sizeof(driver_target) - 1);
+    if (dlen <= 0)
+        return 0;
+    driver_target[dlen] = '\0';
+    /* basename of the link target is the driver name */
+    const char *drv = strrchr(driver_target, '/');
+    drv = drv ? drv + 1 : driver_target;
+    return strcmp(drv, "usblp") == 0;
+}
+
+/*
+ * Fill p from sysfs, Brsane2.ini and binfmt_misc.
+ * Returns 0 if USB_DEVICES_DIR cannot be read.
+ */
+static int probe_collect(PROBE *p) {
+    DIR *d = opendir(USB_DEVICES_DIR);
+    if (!d)
+        return 0;
+    memset(p, 0, sizeof(*p));
+    read_sysfs("/proc/sys/kernel/random/boot_id", p->boot_id, sizeof(p->boot_id));
+    p->time = (long long)time(NULL);
+
+    /* Interfaces bound to usblp, matched to their devices after the walk */
+    char usblp[PROBE_MAX_USBLP][64];
+    int n_usblp = 0;
 
-    int found = 0;
     struct dirent *ent;
     while ((ent = readdir(d)) != NULL) {
-        /* Skip . and .. and interfaces (contain ':') */
-        if (ent->d_name[0] == '.' || strchr(ent->d_name, ':'))
+        if (ent->d_name[0] == '.')
             continue;
+        /* Interfaces contain ':'.  sysfs names are short; one that does
+         * not fit the cache's fields is skipped rather than cut. */
+        if (strchr(ent->d_name, ':')) {
+            if (n_usblp < PROBE_MAX_USBLP && bound_to_usblp(ent->d_name) &&
+                snprintf(usblp[n_usblp], sizeof(usblp[0]), "%s",
+                         ent->d_name) < (int)sizeof(usblp[0]))
+                n_usblp++;
+            continue;
+        }
 
         char path[512], val[128];
 
-        snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/idVendor", ent->d_name);
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/idVendor", ent->d_name);
         if (read_sysfs(path, val, sizeof(val)) == 0)
             continue;
-        if (strcmp(val, BROTHER_VID) != 0)
+        if (strcmp(val, BROTHER_VID) != 0 || p->ndev == PROBE_MAX_DEV)
             continue;
 
-        found = 1;
-
-        /* Read product ID */
-        char pid[16] = "????";
-        snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/idProduct", ent->d_name);
-        read_sysfs(path, pid, sizeof(pid));
-
-        /* Read product name */
-        char product[128] = "";
-        snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/product", ent->d_name);
-        read_sysfs(path, product, sizeof(product));
-
-        /* Read USB speed (link rate in Mbit/s) */
-        char speed[16] = "?";
-        snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/speed", ent->d_name);
-        read_sysfs(path, speed, sizeof(speed));
+        PROBE_DEV *dv = &p->dev[p->ndev];
+        if (snprintf(dv->name, sizeof(dv->name), "%s", ent->d_name) >=
+            (int)sizeof(dv->name))
+            continue;
+        p->ndev++;
+        strcpy(dv->pid, "????");
+        strcpy(dv->speed, "?");
 
-        /* Read USB spec version from device descriptor (e.g. "2.00", "1.10") */
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/idProduct", ent->d_name);
+        read_sysfs(path, dv->pid, sizeof(dv->pid));
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/product", ent->d_name);
+        read_sysfs(path, dv->product, sizeof(dv->product));
+        /* USB speed (link rate in Mbit/s) */
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/speed", ent->d_name);
+        read_sysfs(path, dv->speed, sizeof(dv->speed));
+        /* USB spec version from device descriptor (e.g. "2.00", "1.10"),
+         * without the spaces sysfs pads it with */
         char version[16] = "";
-        snprintf(path, sizeof(path), "/sys/bus/usb/devices/%s/version", ent->d_name);
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/version", ent->d_name);
         read_sysfs(path, version, sizeof(version));
-        /* Trim leading whitespace (sysfs pads with spaces) */
         const char *ver = version;
         while (*ver == ' ') ver++;
+        snprintf(dv->version, sizeof(dv->version), "%s", ver);
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/devnum", ent->d_name);
+        if (read_sysfs(path, val, sizeof(val)) > 0)
+            dv->devnum = atoi(val);
+
+        /* Parent hub/port: strip last component after the final '.' or '-' */
+        char parent_path[512];
+        snprintf(parent_path, sizeof(parent_path), "%s", ent->d_name);
+        char *sep = strrchr(parent_path, '.');
+        if (!sep) sep = strrchr(parent_path, '-');
+        if (sep) {
+            *sep = '\0';
+            snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/speed", parent_path);
+            read_sysfs(path, dv->host_speed, sizeof(dv->host_speed));
+        }
+    }
+    closedir(d);
 
+    for (int i = 0; i < n_usblp; i++) {
+        for (int k = 0; k < p->ndev; k++) {
+            PROBE_DEV *dv = &p->dev[k];
+            size_t len = strlen(dv->name);
+            if (strncmp(usblp[i], dv->name, len) == 0 && usblp[i][len] == ':' &&
+                dv->n_usblp < PROBE_MAX_USBLP)
+                memcpy(dv->usblp[dv->n_usblp++], usblp[i], sizeof(usblp[0]));
+        }
+    }
+
+    p->ini_mtime = ini_mtime();
+    p->compression = read_ini_compression();
+
+    /* QEMU binfmt_misc registration */
+    DIR *binfmt = opendir("/proc/sys/fs/binfmt_misc");
+    if (binfmt) {
+        struct dirent *bf;
+        while ((bf = readdir(binfmt)) != NULL)
+            if (strncmp(bf->d_name, "qemu-", 5) == 0)
+                p->qemu = 1;
+        closedir(binfmt);
+    }
+    return 1;
+}
+
+/* Cache fields are space-separated; "-" stands for an empty one */
+static const char *field(const char *s) {
+    return s[0] ? s : "-";
+}
+
+static void unfield(char *s) {
+    if (strcmp(s, "-") == 0)
+        s[0] = '\0';
+}
+
+static int probe_load(const char *path, PROBE *p) {
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return 0;
+    memset(p, 0, sizeof(*p));
+    char line[512];
+    int ok = fgets(line, sizeof(line), f) && strcmp(line, PROBE_CACHE_MAGIC "\n") == 0;
+    while (ok && fgets(line, sizeof(line), f)) {
+        PROBE_DEV *dv = &p->dev[p->ndev];
+        char intf[64];
+        if (sscanf(line, "boot %39s", p->boot_id) == 1) {
+            unfield(p->boot_id);
+        } else if (sscanf(line, "time %lld", &p->time) == 1 ||
+                   sscanf(line, "ini %lld %d", &p->ini_mtime, &p->compression) == 2 ||
+                   sscanf(line, "qemu %d", &p->qemu) == 1) {
+            continue;
+        } else if (strncmp(line, "dev ", 4) == 0 && p->ndev < PROBE_MAX_DEV &&
+                   sscanf(line, "dev %63s %d %15s %15s %15s %15s %127[^\n]",
+                          dv->name, &dv->devnum, dv->pid, dv->speed,
+                          dv->version, dv->host_speed, dv->product) == 7) {
+            unfield(dv->version);
+            unfield(dv->host_speed);
+            unfield(dv->product);
+            p->ndev++;
+        } else if (sscanf(line, "usblp %63s", intf) == 1 && p->ndev > 0 &&
+                   p->dev[p->ndev - 1].n_usblp < PROBE_MAX_USBLP) {
+            dv = &p->dev[p->ndev - 1];
+            memcpy(dv->usblp[dv->n_usblp++], intf, sizeof(intf));
+        } else {
+            ok = 0;
+        }
+    }
+    fclose(f);
+    return ok;
+}
+
+static int probe_cache_valid(const PROBE *p, int max_age) {
+    char boot_id[40] = "";
+    read_sysfs("/proc/sys/kernel/random/boot_id", boot_id, sizeof(boot_id));
+    long long now = (long long)time(NULL);
+    if (strcmp(boot_id, p->boot_id) != 0 || now < p->time ||
+        now - p->time >= max_age || ini_mtime() != p->ini_mtime)
+        return 0;
+    for (int i = 0; i < p->ndev; i++) {
+        char path[512], val[16];
+        snprintf(path, sizeof(path), USB_DEVICES_DIR "/%s/devnum", p->dev[i].name);
+        if (read_sysfs(path, val, sizeof(val)) == 0 || atoi(val) != p->dev[i].devnum)
+            return 0;
+    }
+    return 1;
+}
+
+/* 0 if everyone may write the directory holding path */
+static int probe_cache_trusted(const char *path) {
+    char dir[512];
+    const char *slash = strrchr(path, '/');
+    snprintf(dir, sizeof(dir), "%.*s", slash ? (int)(slash - path) + 1 : 1,
+             slash ? path : ".");
+    struct stat st;
+    return stat(dir, &st) == 0 && !(st.st_mode & S_IWOTH);
+}
+
+/* Write the cache through a temporary file and rename(); 0 on failure */
+static int probe_save(const char *path, const PROBE *p) {
+    char tmp[512];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return 0;
+    fchmod(fd, 0644);
+    FILE *f = fdopen(fd, "w");
+    if (!f) {
+        close(fd);
+        unlink(tmp);
+        return 0;
+    }
+    fprintf(f, PROBE_CACHE_MAGIC "\nboot %s\ntime %lld\nini %lld %d\nqemu %d\n",
+            field(p->boot_id), p->time, p->ini_mtime, p->compression, p->qemu);
+    for (int i = 0; i < p->ndev; i++) {
+        const PROBE_DEV *dv = &p->dev[i];
+        fprintf(f, "dev %s %d %s %s %s %s %s\n", dv->name, dv->devnum, dv->pid,
+                dv->speed, field(dv->version), field(dv->host_speed),
+                field(dv->product));
+        for (int k = 0; k < dv->n_usblp; k++)
+            fprintf(f, "usblp %s\n", dv->usblp[k]);
+    }
+    int ok = !ferror(f);
+    ok &= fclose(f) == 0;
+    if (!ok || rename(tmp, path) != 0) {
+        unlink(tmp);
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Report Brother devices: bus speed, usblp binding status and product
+ * info, then QEMU binfmt_misc handlers.
+ */
+static void probe_report(const PROBE *p) {
+    for (int i = 0; i < p->ndev; i++) {
+        const PROBE_DEV *dv = &p->dev[i];
+        const char *ver = dv->version;
         const char *speed_label = "unknown";
-        int speed_mbit = atoi(speed);
+        int speed_mbit = atoi(dv->speed);
         int usb_ver_major = atoi(ver);  /* "2.00" → 2, "1.10" → 1 */
 
         if (speed_mbit == 12) {
@@ -137,10 +390,11 @@ static void probe_usb_environment(void) {
         }
         else if (speed_mbit == 480)  speed_label = "USB 2.0 High-Speed (480 Mbit/s)";
         else if (speed_mbit == 5000) speed_label = "USB 3.0 SuperSpeed (5 Gbit/s)";
-        else if (strcmp(speed, "1.5") == 0) { speed_mbit = 1; speed_label = "USB 1.0 Low-Speed (1.5 Mbit/s)"; }
+        else if (strcmp(dv->speed, "1.5") == 0) { speed_mbit = 1; speed_label = "USB 1.0 Low-Speed (1.5 Mbit/s)"; }
 
         fprintf(stderr, "%s [BROTHER2] usb: found %s (04f9:%s) at %s, speed: %s\n",
-                debug_ts(), product[0] ? product : "Brother device", pid, ent->d_name, speed_label);
+                debug_ts(), dv->product[0] ? dv->product : "Brother device", dv->pid,
+                dv->name, speed_label);
         if (ver[0])
             fprintf(stderr, "%s [BROTHER2] usb: device descriptor version: USB %s\n", debug_ts(), ver);
 
@@ -168,32 +422,18 @@ static void probe_usb_environment(void) {
                     "[BROTHER2] data: and compression flag (bits[1:0]). For color planes (R/G/B), the firmware\n"
                     "[BROTHER2] data: always clears the compression bits. This is a firmware-level decision\n"
                     "[BROTHER2] data: that cannot be changed from the driver side.\n", debug_ts());
-            /* Check actual compression setting in Brsane2.ini */
-            {
-                FILE *ini = fopen(BROTHER_INI_PATH, "r");
-                if (ini) {
-                    char line[256];
-                    int in_driver = 0, found_comp = 0;
-                    while (fgets(line, sizeof(line), ini)) {
-                        if (line[0] == '[')
-                            in_driver = (strncmp(line, "[Driver]", 8) == 0);
-                        if (in_driver && strncmp(line, "compression=", 12) == 0) {
-                            int val = atoi(line + 12);
-                            fprintf(stderr, "%s [BROTHER2] ini: Brsane2.ini [Driver] compression=%d (%s)\n",
-                                    debug_ts(), val, val ? "C=RLENGTH requested" : "C=NONE — compression disabled!");
-                            if (!val)
-                                fprintf(stderr, "%s [BROTHER2] ini: WARNING — compression=0 means no compression is requested.\n"
-                                        "[BROTHER2] ini: Set compression=1 in %s to request PackBits.\n", debug_ts(), BROTHER_INI_PATH);
-                            found_comp = 1;
-                            break;
-                        }
-                    }
-                    fclose(ini);
-                    if (!found_comp)
-                        fprintf(stderr, "%s [BROTHER2] ini: WARNING — no compression= key found in Brsane2.ini [Driver] section\n", debug_ts());
-                } else {
-                    fprintf(stderr, "%s [BROTHER2] ini: cannot read %s\n", debug_ts(), BROTHER_INI_PATH);
-                }
+            /* Compression setting in Brsane2.ini */
+            if (p->compression >= 0) {
+                int val = p->compression;
+                fprintf(stderr, "%s [BROTHER2] ini: Brsane2.ini [Driver] compression=%d (%s)\n",
+                        debug_ts(), val, val ? "C=RLENGTH requested" : "C=NONE — compression disabled!");
+                if (!val)
+                    fprintf(stderr, "%s [BROTHER2] ini: WARNING — compression=0 means no compression is requested.\n"
+                            "[BROTHER2] ini: Set compression=1 in %s to request PackBits.\n", debug_ts(), BROTHER_INI_PATH);
+            } else if (p->compression == -1) {
+                fprintf(stderr, "%s [BROTHER2] ini: WARNING — no compression= key found in Brsane2.ini [Driver] section\n", debug_ts());
+            } else {
+                fprintf(stderr, "%s [BROTHER2] ini: cannot read %s\n", debug_ts(), BROTHER_INI_PATH);
             }
             fprintf(stderr, "%s [BROTHER2] windows: The original Windows driver had the SAME USB speed limit.\n"
                     "[BROTHER2] windows: The ~60 sec post-scan transfer is normal for Full-Speed USB.\n"
@@ -202,85 +442,79 @@ static void probe_usb_environment(void) {
                     "[BROTHER2] windows: The physical USB transfer speed is identical on all platforms.\n", debug_ts());
         }
 
-        /* Check host controller port speed */
-        {
-            char parent_path[512], parent_speed[16];
-            /* Parent hub/port: strip last component after the final '.' or '-' */
-            snprintf(parent_path, sizeof(parent_path), "%s", ent->d_name);
-            char *sep = strrchr(parent_path, '.');
-            if (!sep) sep = strrchr(parent_path, '-');
-            if (sep) {
-                *sep = '\0';
-                char hpath[512];
-                snprintf(hpath, sizeof(hpath), "/sys/bus/usb/devices/%s/speed", parent_path);
-                if (read_sysfs(hpath, parent_speed, sizeof(parent_speed)) > 0) {
-                    int host_speed = atoi(parent_speed);
-                    fprintf(stderr, "%s [BROTHER2] usb: host port speed: %s Mbit/s", debug_ts(), parent_speed);
-                    if (host_speed >= 480)
-                        fprintf(stderr, " — host supports High-Speed; device is the bottleneck\n");
-                    else
-                        fprintf(stderr, "\n");
-                }
-            }
-        }
 
-        /* Check if usblp is bound to any interface */
-        DIR *d2 = opendir("/sys/bus/usb/devices");
-        if (d2) {
-            struct dirent *ent2;
-            while ((ent2 = readdir(d2)) != NULL) {
-                /* Look for interfaces of this device: name starts with device name + ':' */
-                if (strncmp(ent2->d_name, ent->d_name, strlen(ent->d_name)) != 0
-                    || ent2->d_name[strlen(ent->d_name)] != ':')
-                    continue;
-
-                char driver_link[512], driver_target[256];
-                snprintf(driver_link, sizeof(driver_link),
-                         "/sys/bus/usb/devices/%s/driver", ent2->d_name);
-                int dlen = (int)readlink(driver_link, driver_target, sizeof(driver_target) - 1);
-                if (dlen > 0) {
-                    driver_target[dlen] = '\0';
-                    /* basename of the link target is the driver name */
-                    const char *drv = strrchr(driver_target, '/');
-                    drv = drv ? drv + 1 : driver_target;
-                    if (strcmp(drv, "usblp") == 0) {
-                        fprintf(stderr, "%s [BROTHER2] usb: WARNING — usblp driver is bound to %s. "
-                                "This can block SANE USB access. Run: "
-                                "echo '%s' | sudo tee /sys/bus/usb/drivers/usblp/unbind\n",
-                                debug_ts(), ent2->d_name, ent2->d_name);
-                    }
-                }
-            }
-            closedir(d2);
+        /* Host controller port speed */
+        if (dv->host_speed[0]) {
+            int host_speed = atoi(dv->host_speed);
+            fprintf(stderr, "%s [BROTHER2] usb: host port speed: %s Mbit/s", debug_ts(), dv->host_speed);
+            if (host_speed >= 480)
+                fprintf(stderr, " — host supports High-Speed; device is the bottleneck\n");
+            else
+                fprintf(stderr, "\n");
         }
+
+        for (int k = 0; k < dv->n_usblp; k++)
+            fprintf(stderr, "%s [BROTHER2] usb: WARNING — usblp driver is bound to %s. "
+                    "This can block SANE USB access. Run: "
+                    "echo '%s' | sudo tee /sys/bus/usb/drivers/usblp/unbind\n",
+                    debug_ts(), dv->usblp[k], dv->usblp[k]);
     }
-    closedir(d);
 
-    if (!found)
+    if (!p->ndev)
         fprintf(stderr, "%s [BROTHER2] usb: no Brother device (vendor %s) found on USB bus\n",
                 debug_ts(), BROTHER_VID);
 
-    /* Check for QEMU binfmt_misc registration */
-    DIR *binfmt = opendir("/proc/sys/fs/binfmt_misc");
-    if (binfmt) {
-        struct dirent *bf;
-        int qemu_found = 0;
-        while ((bf = readdir(binfmt)) != NULL) {
-            if (strncmp(bf->d_name, "qemu-", 5) == 0) {
-                if (!qemu_found) {
-                    fprintf(stderr, "%s [BROTHER2] qemu: binfmt_misc QEMU handlers detected\n", debug_ts());
-                    qemu_found = 1;
-                }
-            }
-        }
-        if (qemu_found) {
-            fprintf(stderr, "%s [BROTHER2] qemu: i386 binaries (e.g. brsaneconfig2) run via QEMU. "
-                    "This is normal for configuration but should NOT affect scan speed.\n"
-                    "[BROTHER2] qemu: if QEMU processes access the USB device during scanning, "
-                    "contention may slow I/O. Check with: ps aux | grep qemu\n", debug_ts());
+    if (p->qemu) {
+        fprintf(stderr, "%s [BROTHER2] qemu: binfmt_misc QEMU handlers detected\n", debug_ts());
+        fprintf(stderr, "%s [BROTHER2] qemu: i386 binaries (e.g. brsaneconfig2) run via QEMU. "
+                "This is normal for configuration but should NOT affect scan speed.\n"
+                "[BROTHER2] qemu: if QEMU processes access the USB device during scanning, "
+                "contention may slow I/O. Check with: ps aux | grep qemu\n", debug_ts());
+    }
+}
+
+static double elapsed_ms(const struct timespec *start, const struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_nsec - start->tv_nsec) / 1e6;
+}
+
+/*
+ * Probe the USB environment, from the cache when it is still valid.
+ */
+static void probe_usb_environment(void) {
+    static PROBE p;
+    const char *path = getenv("BROTHER_PROBE_CACHE");
+    const char *age_env = getenv("BROTHER_PROBE_CACHE_AGE");
+    int max_age = age_env && *age_env ? atoi(age_env) : PROBE_CACHE_AGE;
+    if (!path || !*path)
+        path = PROBE_CACHE_PATH;
+    if (max_age > 0 && !probe_cache_trusted(path)) {
+        fprintf(stderr, "%s [BROTHER2] probe: %s is in a directory everyone can "
+                "write, not using it\n", debug_ts(), path);
+        max_age = 0;
+    }
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    int cached = max_age > 0 && probe_load(path, &p) && probe_cache_valid(&p, max_age);
+    int saved = 0;
+    if (!cached) {
+        if (!probe_collect(&p)) {
+            fprintf(stderr, "%s [BROTHER2] usb: cannot read " USB_DEVICES_DIR "\n", debug_ts());
+            return;
         }
-        closedir(binfmt);
+        saved = max_age > 0 && probe_save(path, &p);
     }
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
+    if (cached)
+        fprintf(stderr, "%s [BROTHER2] probe: using results cached in %s %llds ago (%.2f ms)\n",
+                debug_ts(), path, (long long)time(NULL) - p.time, elapsed_ms(&t0, &t1));
+    else
+        fprintf(stderr, "%s [BROTHER2] probe: USB environment probed (%.2f ms), %s%s\n",
+                debug_ts(), elapsed_ms(&t0, &t1), saved ? "cached in " : "not cached",
+                saved ? path : "");
+    probe_report(&p);
 }
 
 __attribute__((constructor))
@@ -1,11 +1,27 @@
 /*
- * ARM stub for libbrcolm2 — color matching (pass-through)
+ * ARM stub for libbrcolm2 — color matching
  *
  * This replaces Brother's proprietary i386-only libbrcolm2.so with a
- * native ARM pass-through implementation. Color matching is a cosmetic
- * adjustment (ICC profile application) that is not essential for
- * scanning. Returning TRUE without modification produces uncorrected
- * but valid scan data.
+ * native ARM implementation. Brother's own colour tables are in an
+ * undocumented format, so colour correction comes from a 3D LUT in the
+ * common .cube text format instead:
+ *
+ *   $BROTHER_LUT_DIR/<name>-<paper>.cube   (default dir
+ *   $BROTHER_LUT_DIR/<name>.cube            /usr/local/Brother/sane/colorlut)
+ *
+ * where <name> is the basename of lpLutName without its extension
+ * ("default" when the backend passes none) and <paper> is nPaperType.
+ * Parsed tables are kept in one versioned binary store, brtables.bin
+ * under $BROTHER_LUT_CACHE (default /var/cache/brother2), which later
+ * sessions mmap instead of re-parsing; an entry whose .cube source has
+ * changed, or a store of another version, is rebuilt.  Without a LUT,
+ * ColorMatching() is a pass-through as before, producing uncorrected
+ * but valid scan output.
+ *
+ * ColorMatching() applies the LUT with fixed-point tetrahedral
+ * interpolation to cnt lines of len bytes of interleaved RGB.  Grid
+ * offsets and weights per input value are precomputed at init, so each
+ * pixel costs three table reads, one compare tree and four node reads.
  *
  * Function signatures must match the typedefs in brcolor.h:
  *   typedef BOOL (*COLORINIT)(CMATCH_INIT);
@@ -13,12 +29,20 @@
  *   typedef BOOL (*COLORMATCHING)(BYTE *, long, long);
  *
  * Debug diagnostics: set BROTHER_DEBUG=1 to enable call tracking on stderr.
+ * The call and byte counts also go to brother_exporter's segment when it
+ * exists (brother_stats.h).
  *
  * Copyright: 2026, based on Brother brscan2-src-0.2.5-1 API
  */
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "brother_stats.h"
 
 typedef int           BOOL;
 typedef unsigned char BYTE;
@@ -28,6 +52,8 @@ typedef char         *LPSTR;
 #define FALSE 0
 
 static int g_colm_debug = 0;
+static int g_colm_count = 0;          /* debug or exporter segment */
+static BRSTATS *g_colm_brstats = NULL;
 static unsigned long g_colm_calls = 0;
 static unsigned long g_colm_bytes = 0;
 
@@ -55,18 +81,426 @@ typedef struct {
 } CMATCH_INIT;
 #pragma pack()
 
+/*
+ * 3D LUT: grid^3 nodes of R,G,B in 8.8 fixed point, red varying fastest
+ * (the .cube order).  For each input value v, off_*[v] is the offset of
+ * the node below v along that axis and frac[v] the 0..256 weight of the
+ * node above it.
+ */
+#define LUT_MAX_GRID   65
+
+static struct {
+    int                   grid;
+    const unsigned short *node; /* grid^3 * 3 entries, NULL = pass-through */
+    unsigned short       *owned;/* node when parsed this session, else NULL */
+    unsigned              off_r[256], off_g[256], off_b[256];
+    unsigned short        frac[256];
+    unsigned              step_r, step_g, step_b; /* node offset to the next one */
+} g_lut;
+
+/*
+ * Table store: every parsed LUT lives in one file, brtables.bin in the
+ * cache directory, which is mapped read-only and shared so a session
+ * start costs one mmap and the node data comes straight from the page
+ * cache.  Layout, all native-endian:
+ *
+ *   STORE_HEADER                 magic, version, entry count, file size
+ *                                and an FNV-1a hash of the directory
+ *   STORE_ENTRY[count]           name, source mtime/size, grid, offset
+ *   node data                    8-byte aligned, grid^3 * 3 uint16 each
+ *
+ * A file with the wrong magic, version, size or hash is ignored and
+ * rewritten; an entry whose source stamp differs from the .cube file is
+ * stale and replaced.  Updates write a new file and rename() it over
+ * the old one, so mappings held by other sessions stay valid.
+ *
+ * Whoever can write the cache directory can replace the store, whose
+ * node data is used in place, so the store is only used in a directory
+ * that not everyone can write (the installer makes /var/cache/brother2
+ * root:scanner, mode 2775).  Elsewhere the LUT is parsed every session.
+ */
+#define STORE_NAME     "brtables.bin"
+#define STORE_MAGIC    "BRTBLSTR"
+#define STORE_VERSION  1
+#define STORE_MAX_ENTRIES 64
+
+typedef struct {
+    char          magic[8];
+    unsigned      version;
+    unsigned      count;
+    unsigned long long dir_hash;
+    unsigned long long file_size;
+} STORE_HEADER;
+
+typedef struct {
+    char          name[40];
+    long long     src_mtime;    /* ns */
+    long long     src_size;
+    unsigned      grid;
+    unsigned      offset;
+} STORE_ENTRY;
+
+static struct {
+    const unsigned char *base;  /* mapping, NULL when not mapped */
+    size_t               size;
+} g_store;
+
+static double elapsed_ms(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000.0 +
+           (end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static void free_lut(void)
+{
+    free(g_lut.owned);
+    g_lut.owned = NULL;
+    g_lut.node = NULL;
+    g_lut.grid = 0;
+    if (g_store.base)
+        munmap((void *)g_store.base, g_store.size);
+    g_store.base = NULL;
+    g_store.size = 0;
+}
+
+/* Fill the per-value offset and weight tables for g_lut.grid */
+static void prepare_axes(void)
+{
+    int n = g_lut.grid;
+    g_lut.step_r = 3;
+    g_lut.step_g = 3 * n;
+    g_lut.step_b = 3 * n * n;
+    for (int v = 0; v < 256; v++) {
+        /* Position in 1/256 grid steps; the top value sits on the last
+         * node, so use the cell below it with weight 256 */
+        unsigned pos = (unsigned)(v * (n - 1) * 256 + 127) / 255;
+        unsigned i = pos >> 8;
+        unsigned f = pos & 255;
+        if (i >= (unsigned)(n - 1)) {
+            i = n - 2;
+            f = 256;
+        }
+        g_lut.off_r[v] = i * g_lut.step_r;
+        g_lut.off_g[v] = i * g_lut.step_g;
+        g_lut.off_b[v] = i * g_lut.step_b;
+        g_lut.frac[v] = (unsigned short)f;
+    }
+}
+
+/*
+ * Parse a .cube file (LUT_3D_SIZE, optional DOMAIN_MIN/MAX, then
+ * size^3 "r g b" rows).  Returns a malloc'd node table or NULL.
+ */
+static unsigned short *parse_cube(const char *path, int *grid_out)
+{
+    FILE *f = fopen(path, "r");
+    if (!f)
+        return NULL;
+
+    char line[256];
+    int grid = 0;
+    double lo[3] = { 0, 0, 0 }, hi[3] = { 1, 1, 1 };
+    unsigned short *node = NULL;
+    long want = 0, got = 0;
+
+    while (fgets(line, sizeof(line), f)) {
+        char *p = line;
+        while (*p == ' ' || *p == '\t')
+            p++;
+        if (*p == '#' || *p == '\n' || *p == '\r' || *p == '\0')
+            continue;
+        if (!strncmp(p, "TITLE", 5) || !strncmp(p, "LUT_1D_SIZE", 11))
+            continue;
+        if (!strncmp(p, "LUT_3D_SIZE", 11)) {
+            grid = atoi(p + 11);
+            if (grid < 2 || grid > LUT_MAX_GRID || node)
+                break;
+            want = (long)grid * grid * grid;
+            node = (unsigned short *)malloc(want * 3 * sizeof(*node));
+            if (!node)
+                break;
+            continue;
+        }
+        if (!strncmp(p, "DOMAIN_MIN", 10)) {
+            sscanf(p + 10, "%lf %lf %lf", &lo[0], &lo[1], &lo[2]);
+            continue;
+        }
+        if (!strncmp(p, "DOMAIN_MAX", 10)) {
+            sscanf(p + 10, "%lf %lf %lf", &hi[0], &hi[1], &hi[2]);
+            continue;
+        }
+        double rgb[3];
+        if (!node || got >= want ||
+            sscanf(p, "%lf %lf %lf", &rgb[0], &rgb[1], &rgb[2]) != 3)
+            break;
+        for (int c = 0; c < 3; c++) {
+            double v = hi[c] > lo[c] ? (rgb[c] - lo[c]) / (hi[c] - lo[c]) : 0;
+            v = v < 0 ? 0 : v > 1 ? 1 : v;
+            node[got * 3 + c] = (unsigned short)(v * 255.0 * 256.0 + 0.5);
+        }
+        got++;
+    }
+    fclose(f);
+    if (!node || got != want) {
+        free(node);
+        return NULL;
+    }
+    *grid_out = grid;
+    return node;
+}
+
+static unsigned long long fnv1a(const void *p, size_t n)
+{
+    const unsigned char *b = (const unsigned char *)p;
+    unsigned long long h = 1469598103934665603ULL;
+    while (n--)
+        h = (h ^ *b++) * 1099511628211ULL;
+    return h;
+}
+
+static size_t node_bytes(unsigned grid)
+{
+    return (size_t)grid * grid * grid * 3 * sizeof(unsigned short);
+}
+
+/* Directory of a valid mapped store, NULL (count 0) when it is unusable */
+static const STORE_ENTRY *store_dir(const unsigned char *base, size_t size,
+                                    unsigned *count)
+{
+    const STORE_HEADER *h = (const STORE_HEADER *)base;
+    *count = 0;
+    if (!base || size < sizeof(*h) || memcmp(h->magic, STORE_MAGIC, 8) ||
+        h->version != STORE_VERSION || h->file_size != size ||
+        h->count > STORE_MAX_ENTRIES ||
+        sizeof(*h) + (size_t)h->count * sizeof(STORE_ENTRY) > size)
+        return NULL;
+    const STORE_ENTRY *e = (const STORE_ENTRY *)(base + sizeof(*h));
+    if (fnv1a(e, h->count * sizeof(*e)) != h->dir_hash)
+        return NULL;
+    for (unsigned i = 0; i < h->count; i++)
+        if (e[i].grid < 2 || e[i].grid > LUT_MAX_GRID ||
+            e[i].offset % 8 || e[i].offset > size ||
+            node_bytes(e[i].grid) > size - e[i].offset)
+            return NULL;
+    *count = h->count;
+    return e;
+}
+
+/* Map the store read-only into g_store; 0 if absent or invalid */
+static int store_map(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return 0;
+    struct stat st;
+    void *m = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+        m = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (m == MAP_FAILED)
+        return 0;
+    unsigned count;
+    if (!store_dir(m, st.st_size, &count)) {
+        munmap(m, st.st_size);
+        return 0;
+    }
+    g_store.base = m;
+    g_store.size = st.st_size;
+    return 1;
+}
+
+/*
+ * Rewrite the store with the entries of the current mapping (if any)
+ * plus name -> node, dropping an older entry of the same name and the
+ * oldest ones beyond STORE_MAX_ENTRIES.  Failures are not fatal.
+ */
+static void store_put(const char *path, const char *name, long long mtime,
+                      long long size, const unsigned short *node, unsigned grid)
+{
+    unsigned old_n = 0;
+    const STORE_ENTRY *old = store_dir(g_store.base, g_store.size, &old_n);
+    STORE_ENTRY dir[STORE_MAX_ENTRIES];
+    const void *src[STORE_MAX_ENTRIES];
+    unsigned n = 0;
+    for (unsigned i = 0; i < old_n; i++) {
+        if (!strncmp(old[i].name, name, sizeof(old[i].name)))
+            continue;
+        dir[n] = old[i];
+        src[n++] = g_store.base + old[i].offset;
+    }
+    if (n == STORE_MAX_ENTRIES) {
+        memmove(dir, dir + 1, (n - 1) * sizeof(*dir));
+        memmove(src, src + 1, (n - 1) * sizeof(*src));
+        n--;
+    }
+    memset(&dir[n], 0, sizeof(dir[n]));
+    snprintf(dir[n].name, sizeof(dir[n].name), "%s", name);
+    dir[n].src_mtime = mtime;
+    dir[n].src_size = size;
+    dir[n].grid = grid;
+    src[n++] = node;
+
+    size_t off = sizeof(STORE_HEADER) + n * sizeof(STORE_ENTRY);
+    for (unsigned i = 0; i < n; i++) {
+        off = (off + 7) & ~(size_t)7;
+        dir[i].offset = (unsigned)off;
+        off += node_bytes(dir[i].grid);
+    }
+    STORE_HEADER h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, STORE_MAGIC, 8);
+    h.version = STORE_VERSION;
+    h.count = n;
+    h.dir_hash = fnv1a(dir, n * sizeof(*dir));
+    h.file_size = off;
+
+    char tmp[544];
+    snprintf(tmp, sizeof(tmp), "%s.XXXXXX", path);
+    int fd = mkstemp(tmp);
+    if (fd < 0)
+        return;
+    fchmod(fd, 0644);           /* sessions run as other users map it */
+    FILE *f = fdopen(fd, "wb");
+    if (!f) {
+        close(fd);
+        remove(tmp);
+        return;
+    }
+    static const char pad[8];
+    int ok = fwrite(&h, sizeof(h), 1, f) == 1 &&
+             fwrite(dir, sizeof(*dir), n, f) == n;
+    size_t pos = sizeof(h) + n * sizeof(*dir);
+    for (unsigned i = 0; ok && i < n; i++) {
+        ok = fwrite(pad, 1, dir[i].offset - pos, f) == dir[i].offset - pos &&
+             fwrite(src[i], 1, node_bytes(dir[i].grid), f) ==
+                 node_bytes(dir[i].grid);
+        pos = dir[i].offset + node_bytes(dir[i].grid);
+    }
+    ok = (fclose(f) == 0) && ok;
+    if (!ok || rename(tmp, path) != 0)
+        remove(tmp);
+}
+
+/* Modification time in ns and size: an edit within the same second as
+ * the store was written still changes the stamp */
+static int file_stamp(const char *path, long long *mt, long long *size)
+{
+    struct stat st;
+    if (stat(path, &st) != 0)
+        return 0;
+    *mt = (long long)st.st_mtim.tv_sec * 1000000000LL + st.st_mtim.tv_nsec;
+    *size = st.st_size;
+    return 1;
+}
+
+/* 0 if everyone may write dir, so anyone could swap the store in it */
+static int cache_dir_trusted(const char *dir)
+{
+    struct stat st;
+    return stat(dir, &st) == 0 && !(st.st_mode & S_IWOTH);
+}
+
+/*
+ * Find and load the LUT for this session: straight from the mapped
+ * store when its entry matches the .cube source's stamp, otherwise
+ * parse the source and refresh the store.  Leaves g_lut.node NULL when
+ * there is no LUT.
+ */
+static void load_lut(const CMATCH_INIT *d)
+{
+    const char *dir = getenv("BROTHER_LUT_DIR");
+    const char *cache_dir = getenv("BROTHER_LUT_CACHE");
+    if (!dir || !*dir)
+        dir = "/usr/local/Brother/sane/colorlut";
+    if (!cache_dir || !*cache_dir)
+        cache_dir = "/var/cache/brother2";
+
+    /* <name>: basename of lpLutName without its extension */
+    char name[128] = "default";
+    if (d->lpLutName && d->lpLutName[0]) {
+        const char *b = strrchr(d->lpLutName, '/');
+        b = b ? b + 1 : d->lpLutName;
+        snprintf(name, sizeof(name), "%s", b);
+        char *dot = strrchr(name, '.');
+        if (dot && dot != name)
+            *dot = '\0';
+    }
+
+    char src[512], store[512], key[40];
+    long long src_mt = 0, src_size = 0;
+    snprintf(src, sizeof(src), "%s/%s-%d.cube", dir, name, d->nPaperType);
+    if (!file_stamp(src, &src_mt, &src_size)) {
+        snprintf(src, sizeof(src), "%s/%s.cube", dir, name);
+        if (!file_stamp(src, &src_mt, &src_size))
+            return;
+    }
+    const char *leaf = strrchr(src, '/') + 1;
+    snprintf(key, sizeof(key), "%.*s", (int)(strlen(leaf) - 5), leaf);
+    snprintf(store, sizeof(store), "%s/" STORE_NAME, cache_dir);
+
+    unsigned count = 0;
+    const STORE_ENTRY *e = NULL;
+    int trusted = cache_dir_trusted(cache_dir);
+    if (!trusted && g_colm_debug)
+        fprintf(stderr, "%s [BRCOLOR] %s is writable by everyone, not using "
+                STORE_NAME "\n", debug_ts(), cache_dir);
+    if (trusted && store_map(store))
+        e = store_dir(g_store.base, g_store.size, &count);
+    for (unsigned i = 0; i < count; i++) {
+        if (!strncmp(e[i].name, key, sizeof(e[i].name)) &&
+            e[i].src_mtime == src_mt && e[i].src_size == src_size) {
+            g_lut.node = (const unsigned short *)(g_store.base + e[i].offset);
+            g_lut.grid = e[i].grid;
+            break;
+        }
+    }
+
+    int cached = g_lut.node != NULL;
+    if (!cached) {
+        int grid = 0;
+        unsigned short *node = parse_cube(src, &grid);
+        if (!node) {
+            if (g_colm_debug)
+                fprintf(stderr, "%s [BRCOLOR] %s: not a valid 3D .cube LUT, "
+                        "pass-through\n", debug_ts(), src);
+            return;
+        }
+        if (trusted)
+            store_put(store, key, src_mt, src_size, node, grid);
+        g_lut.node = g_lut.owned = node;
+        g_lut.grid = grid;
+    }
+
+    prepare_axes();
+    if (g_colm_debug)
+        fprintf(stderr, "%s [BRCOLOR] LUT %s: %d^3 grid (%s)\n", debug_ts(),
+                src, g_lut.grid, cached ? "mapped from " STORE_NAME :
+                                 trusted ? "parsed, " STORE_NAME " refreshed"
+                                         : "parsed");
+}
+
 BOOL ColorMatchingInit(CMATCH_INIT d)
 {
     const char *env = getenv("BROTHER_DEBUG");
     g_colm_debug = (env && env[0] == '1');
+    g_colm_brstats = brstats_attach();
+    g_colm_count = g_colm_debug || g_colm_brstats;
     g_colm_calls = 0;
     g_colm_bytes = 0;
+
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    free_lut();
+    load_lut(&d);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+
     if (g_colm_debug) {
         fprintf(stderr, "%s [BRCOLOR] ColorMatchingInit: rgbLine=%d paperType=%d "
-                "machineId=%d (pass-through, no ICC applied)\n",
-                debug_ts(), d.nRgbLine, d.nPaperType, d.nMachineId);
+                "machineId=%d lut=%s (%s, %.2f ms)\n",
+                debug_ts(), d.nRgbLine, d.nPaperType, d.nMachineId,
+                d.lpLutName ? d.lpLutName : "(none)",
+                g_lut.node ? "3D LUT" : "pass-through, no LUT found",
+                elapsed_ms(&t0, &t1));
     }
-    (void)d;
     return TRUE;
 }
 
@@ -74,19 +508,72 @@ void ColorMatchingEnd(void)
 {
     if (g_colm_debug) {
         fprintf(stderr, "%s [BRCOLOR] ColorMatchingEnd: %lu calls, %lu bytes processed "
-                "(pass-through)\n", debug_ts(), g_colm_calls, g_colm_bytes);
+                "(%s)\n", debug_ts(), g_colm_calls, g_colm_bytes,
+                g_lut.node ? "3D LUT" : "pass-through");
+    }
+    if (g_colm_brstats) {
+        BRSTATS_ADD(g_colm_brstats, colm_sessions, 1);
+        BRSTATS_ADD(g_colm_brstats, colm_calls, g_colm_calls);
+        BRSTATS_ADD(g_colm_brstats, colm_bytes, g_colm_bytes);
+        g_colm_calls = g_colm_bytes = 0;
+    }
+    free_lut();
+}
+
+/*
+ * Tetrahedral interpolation of n pixels in place.  The cell is split
+ * into six tetrahedra by the order of the three weights; each output
+ * channel is c000 + fa*(ca - c000) + fb*(cb - ca) + fc*(c111 - cb) for
+ * the corners a, b visited along that order.
+ */
+static void apply_lut(BYTE *p, long n)
+{
+    const unsigned short *node = g_lut.node;
+    const unsigned sr = g_lut.step_r, sg = g_lut.step_g, sb = g_lut.step_b;
+
+    for (long i = 0; i < n; i++, p += 3) {
+        unsigned r = p[0], g = p[1], b = p[2];
+        const unsigned short *c0 = node + g_lut.off_r[r] + g_lut.off_g[g] +
+                                   g_lut.off_b[b];
+        int fr = g_lut.frac[r], fg = g_lut.frac[g], fb = g_lut.frac[b];
+        unsigned o1, o2;        /* first and second corner offsets */
+        int w0, w1, w2;         /* weights fa, fb, fc in visiting order */
+        if (fr >= fg) {
+            if (fg >= fb)      { o1 = sr;      o2 = sr + sg; w0 = fr; w1 = fg; w2 = fb; }
+            else if (fr >= fb) { o1 = sr;      o2 = sr + sb; w0 = fr; w1 = fb; w2 = fg; }
+            else               { o1 = sb;      o2 = sr + sb; w0 = fb; w1 = fr; w2 = fg; }
+        } else {
+            if (fb >= fg)      { o1 = sb;      o2 = sg + sb; w0 = fb; w1 = fg; w2 = fr; }
+            else if (fb >= fr) { o1 = sg;      o2 = sg + sb; w0 = fg; w1 = fb; w2 = fr; }
+            else               { o1 = sg;      o2 = sr + sg; w0 = fg; w1 = fr; w2 = fb; }
+        }
+        const unsigned short *c1 = c0 + o1, *c2 = c0 + o2, *c3 = c0 + sr + sg + sb;
+        for (int c = 0; c < 3; c++) {
+            /* 8.8 nodes times 0..256 weights: 16 fractional bits */
+            int v = (c0[c] << 8) + w0 * (c1[c] - c0[c]) +
+                    w1 * (c2[c] - c1[c]) + w2 * (c3[c] - c2[c]);
+            v = (v + (1 << 15)) >> 16;
+            p[c] = (BYTE)(v < 0 ? 0 : v > 255 ? 255 : v);
+        }
     }
 }
 
 BOOL ColorMatching(BYTE *d, long len, long cnt)
 {
-    if (g_colm_debug) {
+    if (g_colm_count) {
         g_colm_calls++;
         g_colm_bytes += (unsigned long)(len > 0 ? len : 0) *
                         (unsigned long)(cnt > 0 ? cnt : 0);
     }
-    (void)d;
-    (void)len;
-    (void)cnt;
+    if (!g_lut.node || !d || len < 3 || cnt < 1)
+        return TRUE;
+    /* cnt lines of len bytes each; apply_lut() walks them as one run
+     * when len holds whole pixels */
+    if (len % 3 == 0) {
+        apply_lut(d, len / 3 * cnt);
+    } else {
+        for (long l = 0; l < cnt; l++)
+            apply_lut(d + l * len, len / 3);
+    }
     return TRUE;
 }
@@ -0,0 +1,298 @@
+/*
+ * brother_exporter — serve the scanner and printer counters to Prometheus
+ *
+ * Creates the shared counter segment (brother_stats.h) that the scan
+ * decoder, colour matching, the backend's USB reads and both sides of the
+ * USB link arbitration add to, and serves it over HTTP as Prometheus text format on
+ * GET /metrics.  The segment lives in tmpfs, so the totals last until
+ * reboot; restarting the exporter keeps them.  -o prints the metrics
+ * once to stdout instead of serving them.
+ *
+ * Build, next to the stubs:
+ *   gcc -O2 -o brother_exporter brother_exporter.c
+ *
+ * Usage:
+ *   brother_exporter [-b addr] [-p port]
+ *   brother_exporter -o
+ *
+ * BROTHER_STATS_PATH overrides the segment path (/dev/shm/brother-stats).
+ *
+ * Copyright: 2026, written for the DCP-130C ARM port
+ */
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include "brother_stats.h"
+
+#define DEFAULT_PORT 9632
+
+/*
+ * Map the segment, creating it or resetting it when it is missing, the
+ * wrong size or another layout.  Mode 0666 so that saned and CUPS
+ * filters, which run as other users, can add to it.
+ */
+static BRSTATS *segment_open(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) {
+        perror(path);
+        return NULL;
+    }
+    fchmod(fd, 0666);
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)sizeof(BRSTATS)) {
+        if (ftruncate(fd, 0) != 0 || ftruncate(fd, sizeof(BRSTATS)) != 0) {
+            perror(path);
+            close(fd);
+            return NULL;
+        }
+    }
+    BRSTATS *s = mmap(NULL, sizeof(BRSTATS), PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, 0);
+    close(fd);
+    if (s == MAP_FAILED) {
+        perror(path);
+        return NULL;
+    }
+    if (memcmp(s->magic, BRSTATS_MAGIC, sizeof(s->magic)) != 0 ||
+        s->version != BRSTATS_VERSION || s->size != sizeof(BRSTATS)) {
+        memset(s, 0, sizeof(BRSTATS));
+        s->version = BRSTATS_VERSION;
+        s->size = sizeof(BRSTATS);
+        /* magic last: writers only attach once it is there */
+        __atomic_thread_fence(__ATOMIC_RELEASE);
+        memcpy(s->magic, BRSTATS_MAGIC, sizeof(s->magic));
+    }
+    return s;
+}
+
+static uint64_t get(const uint64_t *p)
+{
+    return __atomic_load_n(p, __ATOMIC_RELAXED);
+}
+
+static void counter(FILE *f, const char *name, const char *help, uint64_t v)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s counter\n%s %llu\n",
+            name, help, name, name, (unsigned long long)v);
+}
+
+static void seconds(FILE *f, const char *name, const char *help,
+                    const char *type, uint64_t ns)
+{
+    fprintf(f, "# HELP %s %s\n# TYPE %s %s\n%s %.9g\n",
+            name, help, name, type, name, ns / 1e9);
+}
+
+static void histogram(FILE *f, const char *name, const char *help,
+                      const uint64_t *le, int nle, const uint64_t *bucket,
+                      uint64_t count, uint64_t sum_ns)
+{
+    uint64_t cum = 0;
+    fprintf(f, "# HELP %s %s\n# TYPE %s histogram\n", name, help, name);
+    for (int i = 0; i < nle; i++) {
+        cum += get(&bucket[i]);
+        fprintf(f, "%s_bucket{le=\"%g\"} %llu\n", name, le[i] / 1e9,
+                (unsigned long long)cum);
+    }
+    cum += get(&bucket[nle]);
+    fprintf(f, "%s_bucket{le=\"+Inf\"} %llu\n%s_sum %.9g\n%s_count %llu\n",
+            name, (unsigned long long)cum, name, sum_ns / 1e9, name,
+            (unsigned long long)count);
+}
+
+static void render(FILE *f, BRSTATS *s)
+{
+    counter(f, "brother_scan_sessions_total",
+            "Scan decoder sessions closed", get(&s->scan_sessions));
+    fprintf(f, "# HELP brother_scan_active Scan decoder sessions open\n"
+            "# TYPE brother_scan_active gauge\nbrother_scan_active %llu\n",
+            (unsigned long long)get(&s->scan_active));
+    counter(f, "brother_scan_pages_total", "Pages scanned",
+            get(&s->scan_pages));
+    counter(f, "brother_scan_lines_total", "Decoded lines returned",
+            get(&s->scan_lines));
+    fprintf(f, "# HELP brother_scan_input_lines_total Scanner lines by "
+            "compression\n# TYPE brother_scan_input_lines_total counter\n");
+    fprintf(f, "brother_scan_input_lines_total{compression=\"white\"} %llu\n"
+            "brother_scan_input_lines_total{compression=\"noncomp\"} %llu\n"
+            "brother_scan_input_lines_total{compression=\"pack\"} %llu\n"
+            "brother_scan_input_lines_total{compression=\"unknown\"} %llu\n",
+            (unsigned long long)get(&s->scan_in_white),
+            (unsigned long long)get(&s->scan_in_noncomp),
+            (unsigned long long)get(&s->scan_in_pack),
+            (unsigned long long)get(&s->scan_in_unknown));
+    counter(f, "brother_scan_input_bytes_total",
+            "Compressed bytes from the scanner", get(&s->scan_bytes_in));
+    counter(f, "brother_scan_output_bytes_total",
+            "Decoded bytes returned to the backend", get(&s->scan_bytes_out));
+    seconds(f, "brother_scan_decode_seconds_total",
+            "Time decoding in ScanDecWrite", "counter",
+            get(&s->scan_decode_ns));
+    seconds(f, "brother_scan_packbits_seconds_total",
+            "Time in PackBits decoding", "counter",
+            get(&s->scan_packbits_ns));
+    seconds(f, "brother_scan_max_write_gap_seconds",
+            "Longest gap between writes in the last session", "gauge",
+            get(&s->scan_max_gap_ns));
+    histogram(f, "brother_scan_write_gap_seconds",
+              "Time between ScanDecWrite calls", brstats_gap_le,
+              BRSTATS_GAP_BUCKETS, s->scan_gap_bucket,
+              get(&s->scan_gap_count), get(&s->scan_gap_sum_ns));
+    histogram(f, "brother_scan_line_seconds",
+              "Time from a write to the line it completes", brstats_line_le,
+              BRSTATS_LINE_BUCKETS, s->scan_line_bucket,
+              get(&s->scan_line_count), get(&s->scan_line_sum_ns));
+
+    counter(f, "brother_colm_sessions_total", "Colour matching sessions",
+            get(&s->colm_sessions));
+    counter(f, "brother_colm_calls_total", "ColorMatching calls",
+            get(&s->colm_calls));
+    counter(f, "brother_colm_bytes_total", "Bytes colour matched",
+            get(&s->colm_bytes));
+
+    counter(f, "brother_usb_reads_total", "Backend USB bulk reads",
+            get(&s->usb_reads));
+    counter(f, "brother_usb_zero_reads_total", "USB reads returning no data",
+            get(&s->usb_zero_reads));
+    counter(f, "brother_usb_bytes_total", "Bytes read from the scanner",
+            get(&s->usb_bytes));
+    counter(f, "brother_usb_stalls_total", "Scans ended by the stall timeout",
+            get(&s->usb_stalls));
+    fprintf(f, "# HELP brother_usb_arbitration_waits_total Transfers that "
+            "waited for the other side of the link\n"
+            "# TYPE brother_usb_arbitration_waits_total counter\n"
+            "brother_usb_arbitration_waits_total{side=\"scan\"} %llu\n"
+            "brother_usb_arbitration_waits_total{side=\"print\"} %llu\n",
+            (unsigned long long)get(&s->arb_scan_waits),
+            (unsigned long long)get(&s->arb_print_waits));
+    fprintf(f, "# HELP brother_usb_arbitration_wait_seconds_total Time "
+            "waiting for the other side of the link\n"
+            "# TYPE brother_usb_arbitration_wait_seconds_total counter\n"
+            "brother_usb_arbitration_wait_seconds_total{side=\"scan\"} %.9g\n"
+            "brother_usb_arbitration_wait_seconds_total{side=\"print\"} %.9g\n",
+            get(&s->arb_scan_wait_ns) / 1e9, get(&s->arb_print_wait_ns) / 1e9);
+}
+
+static void write_all(int fd, const char *p, size_t n)
+{
+    while (n) {
+        ssize_t w = write(fd, p, n);
+        if (w <= 0)
+            return;
+        p += w;
+        n -= (size_t)w;
+    }
+}
+
+/* Answer one request: /metrics (or /) gets the counters, the rest 404 */
+static void serve(int fd, BRSTATS *s)
+{
+    char req[2048];
+    size_t n = 0;
+    while (n < sizeof(req) - 1) {
+        ssize_t r = read(fd, req + n, sizeof(req) - 1 - n);
+        if (r <= 0)
+            break;
+        n += (size_t)r;
+        req[n] = '\0';
+        if (strstr(req, "\r\n\r\n") || strstr(req, "\n\n"))
+            break;
+    }
+    req[n] = '\0';
+
+    char *body = NULL, head[160];
+    size_t len = 0;
+    int ok = strncmp(req, "GET /metrics ", 13) == 0 ||
+             strncmp(req, "GET / ", 6) == 0;
+    FILE *f = open_memstream(&body, &len);
+    if (!f)
+        return;
+    if (ok)
+        render(f, s);
+    else
+        fputs("not found\n", f);
+    fclose(f);
+    snprintf(head, sizeof(head), "HTTP/1.0 %s\r\n"
+             "Content-Type: text/plain; version=0.0.4\r\n"
+             "Content-Length: %zu\r\nConnection: close\r\n\r\n",
+             ok ? "200 OK" : "404 Not Found", len);
+    write_all(fd, head, strlen(head));
+    write_all(fd, body, len);
+    free(body);
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: brother_exporter [-b addr] [-p port]\n"
+            "       brother_exporter -o\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *addr = "0.0.0.0";
+    int port = DEFAULT_PORT, once = 0, opt;
+
+    while ((opt = getopt(argc, argv, "b:p:o")) != -1) {
+        switch (opt) {
+        case 'b': addr = optarg; break;
+        case 'p': port = atoi(optarg); break;
+        case 'o': once = 1; break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind != argc || port <= 0 || port > 65535) {
+        usage();
+        return 2;
+    }
+    BRSTATS *s = segment_open(brstats_path());
+    if (!s)
+        return 1;
+    if (once) {
+        render(stdout, s);
+        return 0;
+    }
+
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((unsigned short)port);
+    if (inet_pton(AF_INET, addr, &sa.sin_addr) != 1) {
+        fprintf(stderr, "brother_exporter: bad address %s\n", addr);
+        return 2;
+    }
+    int ls = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0), one = 1;
+    if (ls < 0) {
+        perror("socket");
+        return 1;
+    }
+    setsockopt(ls, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (bind(ls, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(ls, 8) != 0) {
+        fprintf(stderr, "brother_exporter: cannot listen on %s:%d: %s\n",
+                addr, port, strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    fprintf(stderr, "brother_exporter: serving %s on http://%s:%d/metrics\n",
+            brstats_path(), addr, port);
+
+    for (;;) {
+        int fd = accept(ls, NULL, NULL);
+        if (fd < 0)
+            continue;
+        /* one client at a time: do not let a silent one hold the rest */
+        struct timeval tv = { 2, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        serve(fd, s);
+        close(fd);
+    }
+}
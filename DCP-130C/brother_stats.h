@@ -0,0 +1,132 @@
+/*
+ * Shared pipeline counters (brother_stats.h).
+ *
+ * The scan decoder (scandec_stubs.c), colour matching (brcolor_stubs.c),
+ * the backend's ReadDeviceData() (patched in by install_scanner.sh) and
+ * both sides of the USB link arbitration (usb_async.c, usb_print_arb.c)
+ * all add their counters to one small shared file, BROTHER_STATS_PATH (default /dev/shm/brother-stats).
+ * brother_exporter creates it and serves it in Prometheus text format.
+ *
+ * Publishing is switched on by the file existing: with no exporter
+ * running there is nothing to map and the counters cost nothing.  Every
+ * process maps the same segment and updates it with atomic adds, so
+ * concurrent saned children and CUPS filter runs accumulate into the
+ * same totals.  Fields only grow unless marked as a gauge.
+ */
+#ifndef BROTHER_STATS_H
+#define BROTHER_STATS_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BRSTATS_MAGIC   "BRSTAT01"
+#define BRSTATS_VERSION 3
+#define BRSTATS_PATH    "/dev/shm/brother-stats"
+
+/* Upper bounds (ns) of the exported histogram buckets; one more
+ * bucket holds everything above the last bound */
+#define BRSTATS_GAP_BUCKETS  11
+#define BRSTATS_LINE_BUCKETS 11
+__attribute__((unused))
+static const uint64_t brstats_gap_le[BRSTATS_GAP_BUCKETS] = {
+    1000000, 2000000, 5000000, 10000000, 20000000, 50000000,
+    100000000, 200000000, 500000000, 1000000000, 5000000000ull
+};
+__attribute__((unused))
+static const uint64_t brstats_line_le[BRSTATS_LINE_BUCKETS] = {
+    10000, 20000, 50000, 100000, 200000, 500000,
+    1000000, 2000000, 5000000, 10000000, 100000000
+};
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t size;              /* sizeof(BRSTATS) */
+
+    /* Scan decoder, added at ScanDecClose() */
+    uint64_t scan_sessions;
+    uint64_t scan_active;       /* gauge: sessions open now */
+    uint64_t scan_pages;
+    uint64_t scan_lines;        /* output lines */
+    uint64_t scan_in_white;     /* scanner lines by compression */
+    uint64_t scan_in_noncomp;
+    uint64_t scan_in_pack;
+    uint64_t scan_in_unknown;
+    uint64_t scan_bytes_in;
+    uint64_t scan_bytes_out;
+    uint64_t scan_decode_ns;    /* time in ScanDecWrite decoding lines */
+    uint64_t scan_packbits_ns;  /* of which PackBits */
+    uint64_t scan_max_gap_ns;   /* gauge: longest gap, last session */
+    uint64_t scan_gap_count;    /* gaps between writes ... */
+    uint64_t scan_gap_sum_ns;
+    uint64_t scan_gap_bucket[BRSTATS_GAP_BUCKETS + 1];
+    uint64_t scan_line_count;   /* write-to-line times ... */
+    uint64_t scan_line_sum_ns;
+    uint64_t scan_line_bucket[BRSTATS_LINE_BUCKETS + 1];
+
+    /* Colour matching, added at ColorMatchingEnd() */
+    uint64_t colm_sessions;
+    uint64_t colm_calls;
+    uint64_t colm_bytes;
+
+    /* Backend USB reads (ReadDeviceData) */
+    uint64_t usb_reads;
+    uint64_t usb_zero_reads;
+    uint64_t usb_bytes;
+    uint64_t usb_stalls;        /* scans ended by the stall timeout */
+
+    /* Turns on the shared link (brother_usb_arb.h), added per page or job */
+    uint64_t arb_scan_waits;    /* scan reads that waited for printing */
+    uint64_t arb_scan_wait_ns;
+    uint64_t arb_print_waits;   /* print writes that waited for scanning */
+    uint64_t arb_print_wait_ns;
+} BRSTATS;
+
+#define BRSTATS_ADD(s, field, n) \
+    __atomic_fetch_add(&(s)->field, (uint64_t)(n), __ATOMIC_RELAXED)
+#define BRSTATS_SET(s, field, v) \
+    __atomic_store_n(&(s)->field, (uint64_t)(v), __ATOMIC_RELAXED)
+
+static inline const char *brstats_path(void)
+{
+    const char *p = getenv("BROTHER_STATS_PATH");
+    return p && *p ? p : BRSTATS_PATH;
+}
+
+/*
+ * Map the segment if it exists and has this layout; NULL otherwise.
+ * Tried once per process (the backend runs a process per scan).
+ */
+static inline BRSTATS *brstats_attach(void)
+{
+    static BRSTATS *seg;
+    static int tried;
+    if (tried)
+        return seg;
+    tried = 1;
+    int fd = open(brstats_path(), O_RDWR | O_CLOEXEC);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    if (fstat(fd, &st) == 0 && st.st_size == (off_t)sizeof(BRSTATS)) {
+        void *m = mmap(NULL, sizeof(BRSTATS), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+            seg = m;
+            if (memcmp(seg->magic, BRSTATS_MAGIC, sizeof(seg->magic)) != 0 ||
+                seg->version != BRSTATS_VERSION) {
+                munmap(m, sizeof(BRSTATS));
+                seg = NULL;
+            }
+        }
+    }
+    close(fd);
+    return seg;
+}
+
+#endif /* BROTHER_STATS_H */
@@ -0,0 +1,348 @@
+/*
+ * Scan/print arbitration for the shared USB link (brother_usb_arb.h).
+ *
+ * The DCP-130C's scanner and printer share one Full-Speed link.  When a
+ * print job's bulk writes and a scan's bulk reads both go out as fast as
+ * they can, each stalls the other: scan reads see long gaps (the
+ * scanner's buffer fills and its head stops) and neither finishes at link
+ * speed.  The two places that move data over the link therefore bracket
+ * every transfer with brarb_enter() and brarb_leave() and take turns:
+ *
+ *   - scan: brusb_bulk_read() (usb_async.c), which every bulk read of the
+ *     brother2 backend goes through.  With BROTHER_USB_ASYNC=1 its queue
+ *     of posted transfers counts as one transfer, checked with
+ *     brarb_wanted() while it waits and cancelled to hand the link over.
+ *   - print: libbrusbarb.so (usb_print_arb.c), preloaded into CUPS's usb
+ *     backend by install_printer.sh, around each bulk-OUT transfer
+ *
+ * brarb_enter() waits for this side's turn and marks a transfer in
+ * progress; brarb_leave() ends it.  A turn never changes hands while a
+ * transfer is in progress:
+ *
+ *   - With the other side idle, a side keeps the link: uncontended
+ *     scans and prints run as before, at the cost of two atomic updates
+ *     per transfer.
+ *   - Once the other side waits, the holder keeps the link for at most
+ *     its slice, counted from when it took it, and hands it over at its
+ *     next transfer; the waiter also takes it itself between transfers.
+ *     A holder that has not transferred anything for BRARB_IDLE_MS has
+ *     gone quiet (a page being rendered, a scan ended) and loses the link
+ *     straight away.
+ *   - A holder killed in the middle of a transfer (a cancelled job) is
+ *     noticed by its pid once the transfer has run for BRARB_STALE_MS.
+ *
+ * So neither side waits much longer than the other side's slice plus one
+ * transfer, and the link is only idle between turns for the polling
+ * interval.  brarb_done() gives the turn up at the end of a page or job.
+ *
+ * State is one small shared file, BROTHER_USB_ARB_PATH (default
+ * /dev/shm/brother-usb-arb), created by whichever side comes first.  The
+ * holder, whether it is transferring and the time it took the link are
+ * one atomic word, so a turn changes hands with a single compare-and-swap.
+ *
+ * BROTHER_USB_PRIORITY=scan|print|fair (default fair) sets the slices:
+ * BROTHER_USB_SLICE_MS (default 100) for both, or three times that for
+ * the favoured side.  Each process publishes only its own side's slice,
+ * so set the same priority for CUPS (SetEnv in cupsd.conf) and for the
+ * scanning service.  BROTHER_USB_ARB=0 turns arbitration off.
+ */
+#ifndef BROTHER_USB_ARB_H
+#define BROTHER_USB_ARB_H
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define BRARB_MAGIC     "BRARB002"
+#define BRARB_VERSION   2
+#define BRARB_PATH      "/dev/shm/brother-usb-arb"
+#define BRARB_IDLE_MS   30          /* no transfer for this long: link free */
+#define BRARB_POLL_US   1000        /* waiter's polling interval */
+#define BRARB_STALE_MS  1000        /* a transfer this old: is its holder alive? */
+
+/* state: (ns the turn started << 3) | BRARB_BUSY | holder */
+#define BRARB_HOLDER    3ull
+#define BRARB_BUSY      4ull
+
+enum { BRARB_SCAN = 1, BRARB_PRINT = 2 };
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t size;              /* sizeof(BRARB) */
+    uint64_t state;             /* (ns the turn started << 3) | busy | holder */
+    uint64_t last_use_ns[3];    /* per side: took the link or ended a transfer */
+    uint64_t waiting_ns[3];     /* per side: last poll while waiting, 0 if not */
+    uint64_t slice_ns[3];       /* per side, published by that side */
+    uint64_t pid[3];            /* per side: process that took the link */
+    uint64_t handovers;         /* turns passed on from a holder */
+} BRARB;
+
+/* One per process */
+typedef struct {
+    BRARB   *seg;               /* NULL: not arbitrating */
+    unsigned side;
+    uint64_t waits;             /* transfers that had to wait ... */
+    uint64_t wait_ns;           /* ... and for how long in all */
+    uint64_t max_wait_ns;
+} BRARB_CLIENT;
+
+static inline uint64_t brarb_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static inline const char *brarb_path(void)
+{
+    const char *p = getenv("BROTHER_USB_ARB_PATH");
+    return p && *p ? p : BRARB_PATH;
+}
+
+/* This process's slice, from BROTHER_USB_PRIORITY and BROTHER_USB_SLICE_MS */
+static inline uint64_t brarb_slice_ns(unsigned side)
+{
+    const char *e = getenv("BROTHER_USB_SLICE_MS");
+    long ms = e && atol(e) > 0 ? atol(e) : 100;
+    const char *prio = getenv("BROTHER_USB_PRIORITY");
+    if (prio && ((side == BRARB_SCAN && strcmp(prio, "scan") == 0) ||
+                 (side == BRARB_PRINT && strcmp(prio, "print") == 0)))
+        ms *= 3;
+    return (uint64_t)ms * 1000000ull;
+}
+
+/*
+ * Map the shared state, creating it if it is missing or another layout
+ * (under flock, so two first comers do not both initialise it).  The
+ * file is opened without O_CREAT first: with fs.protected_regular, O_CREAT
+ * fails on a file in /dev/shm that another user (lp, saned) created.
+ * Returns 0, leaving c->seg NULL, when arbitration is off or unavailable.
+ */
+static inline int brarb_open(BRARB_CLIENT *c, unsigned side)
+{
+    memset(c, 0, sizeof(*c));
+    c->side = side;
+    const char *e = getenv("BROTHER_USB_ARB");
+    if (e && strcmp(e, "0") == 0)
+        return 0;
+
+    const char *path = brarb_path();
+    int fd = open(path, O_RDWR | O_CLOEXEC);
+    if (fd < 0 && errno == ENOENT) {
+        fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+        if (fd < 0 && errno == EEXIST)
+            fd = open(path, O_RDWR | O_CLOEXEC);
+        if (fd >= 0)
+            fchmod(fd, 0666);   /* the other side runs as another user */
+    }
+    if (fd < 0)
+        return 0;
+
+    BRARB *a = NULL;
+    struct stat st;
+    flock(fd, LOCK_EX);
+    if (fstat(fd, &st) == 0 && (st.st_size == (off_t)sizeof(BRARB) ||
+        (ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(BRARB)) == 0))) {
+        void *m = mmap(NULL, sizeof(BRARB), PROT_READ | PROT_WRITE,
+                       MAP_SHARED, fd, 0);
+        if (m != MAP_FAILED) {
+            a = m;
+            if (memcmp(a->magic, BRARB_MAGIC, sizeof(a->magic)) != 0 ||
+                a->version != BRARB_VERSION || a->size != sizeof(BRARB)) {
+                memset(a, 0, sizeof(BRARB));
+                a->version = BRARB_VERSION;
+                a->size = sizeof(BRARB);
+                memcpy(a->magic, BRARB_MAGIC, sizeof(a->magic));
+            }
+        }
+    }
+    flock(fd, LOCK_UN);
+    close(fd);
+    if (!a)
+        return 0;
+    __atomic_store_n(&a->slice_ns[side], brarb_slice_ns(side), __ATOMIC_RELAXED);
+    c->seg = a;
+    return 1;
+}
+
+/* t is later than then by more than limit (false if t is not later) */
+static inline int brarb_older(uint64_t then, uint64_t t, uint64_t limit)
+{
+    return t > then && t - then > limit;
+}
+
+/* The holder of a transfer in progress since before BRARB_STALE_MS has
+ * exited (EPERM: alive, only run by another user) */
+static inline int brarb_gone(BRARB *a, unsigned side, uint64_t now)
+{
+    if (!brarb_older(__atomic_load_n(&a->last_use_ns[side], __ATOMIC_RELAXED),
+                     now, BRARB_STALE_MS * 1000000ull))
+        return 0;
+    pid_t pid = (pid_t)__atomic_load_n(&a->pid[side], __ATOMIC_RELAXED);
+    return pid > 0 && kill(pid, 0) < 0 && errno == ESRCH;
+}
+
+/*
+ * Wait for this side's turn and mark a transfer in progress; every call
+ * must be followed by brarb_leave() once the transfer has returned.
+ * Returns the ns waited.
+ */
+static inline uint64_t brarb_enter(BRARB_CLIENT *c)
+{
+    BRARB *a = c->seg;
+    if (!a)
+        return 0;
+    const unsigned me = c->side, other = BRARB_SCAN + BRARB_PRINT - me;
+    const uint64_t t0 = brarb_now_ns();
+    int waited = 0;
+
+    for (;;) {
+        uint64_t now = brarb_now_ns();
+        uint64_t st = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+        unsigned holder = (unsigned)(st & BRARB_HOLDER);
+        int busy = (st & BRARB_BUSY) != 0;
+        if (holder == me) {
+            /* Slice used up with the other side waiting: pass the turn
+             * on rather than start another transfer (dated now, so this
+             * side does not see the waiter as idle and take it back) */
+            if (!busy &&
+                !brarb_older(__atomic_load_n(&a->waiting_ns[other], __ATOMIC_RELAXED),
+                             now, BRARB_IDLE_MS * 1000000ull) &&
+                brarb_older(st >> 3, now, __atomic_load_n(&a->slice_ns[me], __ATOMIC_RELAXED))) {
+                __atomic_store_n(&a->last_use_ns[other], now, __ATOMIC_RELAXED);
+                if (__atomic_compare_exchange_n(&a->state, &st, (now << 3) | other, 0,
+                                                __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                    __atomic_fetch_add(&a->handovers, 1, __ATOMIC_RELAXED);
+                continue;
+            }
+            if (__atomic_compare_exchange_n(&a->state, &st, st | BRARB_BUSY, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+                break;
+            continue;
+        }
+        if (holder == 0 || holder > BRARB_PRINT ||
+            (!busy &&
+             (brarb_older(__atomic_load_n(&a->last_use_ns[holder], __ATOMIC_RELAXED),
+                          now, BRARB_IDLE_MS * 1000000ull) ||
+              brarb_older(st >> 3, now,
+                          __atomic_load_n(&a->slice_ns[holder], __ATOMIC_RELAXED)))) ||
+            (busy && brarb_gone(a, holder, now))) {
+            /* before taking the turn, so the other side never sees a new
+             * holder with an old last use and takes the link straight back */
+            __atomic_store_n(&a->last_use_ns[me], now, __ATOMIC_RELAXED);
+            __atomic_store_n(&a->pid[me], (uint64_t)getpid(), __ATOMIC_RELAXED);
+            if (__atomic_compare_exchange_n(&a->state, &st, (now << 3) | BRARB_BUSY | me, 0,
+                                            __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+                if (holder)
+                    __atomic_fetch_add(&a->handovers, 1, __ATOMIC_RELAXED);
+                break;
+            }
+            continue;
+        }
+        waited = 1;
+        __atomic_store_n(&a->waiting_ns[me], now, __ATOMIC_RELAXED);
+        struct timespec ts = { 0, BRARB_POLL_US * 1000L };
+        nanosleep(&ts, NULL);
+    }
+    if (!waited)
+        return 0;
+    __atomic_store_n(&a->waiting_ns[me], 0, __ATOMIC_RELAXED);
+    uint64_t ns = brarb_now_ns() - t0;
+    c->waits++;
+    c->wait_ns += ns;
+    if (ns > c->max_wait_ns)
+        c->max_wait_ns = ns;
+    return ns;
+}
+
+/* End the transfer started by brarb_enter(), keeping the turn */
+static inline void brarb_leave(BRARB_CLIENT *c)
+{
+    BRARB *a = c->seg;
+    if (!a)
+        return;
+    __atomic_store_n(&a->last_use_ns[c->side], brarb_now_ns(), __ATOMIC_RELAXED);
+    uint64_t st = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+    while ((st & BRARB_HOLDER) == c->side && (st & BRARB_BUSY) &&
+           !__atomic_compare_exchange_n(&a->state, &st, st & ~BRARB_BUSY, 0,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+}
+
+/*
+ * For a side that keeps transfers posted across many requests, so that one
+ * transfer in progress can last as long as the device stays quiet: it
+ * should cancel them and brarb_leave() when this returns 1.  That is when
+ * it has lost the link, or when the other side is waiting and this side
+ * has used up its slice or moved nothing for BRARB_IDLE_MS (the last data
+ * is dated with brarb_used()).
+ */
+static inline int brarb_wanted(BRARB_CLIENT *c)
+{
+    BRARB *a = c->seg;
+    if (!a)
+        return 0;
+    const unsigned me = c->side, other = BRARB_SCAN + BRARB_PRINT - me;
+    uint64_t now = brarb_now_ns();
+    uint64_t st = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+    if ((st & BRARB_HOLDER) != me)
+        return 1;
+    if (brarb_older(__atomic_load_n(&a->waiting_ns[other], __ATOMIC_RELAXED),
+                    now, BRARB_IDLE_MS * 1000000ull))
+        return 0;
+    return brarb_older(st >> 3, now, __atomic_load_n(&a->slice_ns[me], __ATOMIC_RELAXED)) ||
+           brarb_older(__atomic_load_n(&a->last_use_ns[me], __ATOMIC_RELAXED),
+                       now, BRARB_IDLE_MS * 1000000ull);
+}
+
+/* Date this side's last data, inside a long transfer */
+static inline void brarb_used(BRARB_CLIENT *c)
+{
+    if (c->seg)
+        __atomic_store_n(&c->seg->last_use_ns[c->side], brarb_now_ns(), __ATOMIC_RELAXED);
+}
+
+/* After brarb_leave(), hand the turn straight to the other side if it is
+ * waiting (within its slice, this side's next brarb_enter() would just
+ * start another transfer) */
+static inline void brarb_pass(BRARB_CLIENT *c)
+{
+    BRARB *a = c->seg;
+    if (!a)
+        return;
+    const unsigned me = c->side, other = BRARB_SCAN + BRARB_PRINT - me;
+    uint64_t now = brarb_now_ns();
+    uint64_t st = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+    if ((st & (BRARB_HOLDER | BRARB_BUSY)) != me ||
+        brarb_older(__atomic_load_n(&a->waiting_ns[other], __ATOMIC_RELAXED),
+                    now, BRARB_IDLE_MS * 1000000ull))
+        return;
+    __atomic_store_n(&a->last_use_ns[other], now, __ATOMIC_RELAXED);
+    if (__atomic_compare_exchange_n(&a->state, &st, (now << 3) | other, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+        __atomic_fetch_add(&a->handovers, 1, __ATOMIC_RELAXED);
+}
+
+/* Give the link up at the end of a page or job, if this side still holds
+ * it and is not in a transfer */
+static inline void brarb_done(BRARB_CLIENT *c)
+{
+    BRARB *a = c->seg;
+    if (!a)
+        return;
+    uint64_t st = __atomic_load_n(&a->state, __ATOMIC_ACQUIRE);
+    if ((st & (BRARB_HOLDER | BRARB_BUSY)) == c->side)
+        __atomic_compare_exchange_n(&a->state, &st, st & ~BRARB_HOLDER, 0,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_RELAXED);
+}
+
+#endif /* BROTHER_USB_ARB_H */
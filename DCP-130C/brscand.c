@@ -0,0 +1,948 @@
+/*
+ * brscand — resident scanner daemon for the DCP-130C
+ *
+ * Without it every scan pays for loading libsane-brother2 and the decode
+ * stubs, reading the ini files, probing USB and opening the device: saned
+ * forks a process per connection and the backend starts from nothing.
+ * brscand does all of that once at startup and keeps the handle open,
+ * then runs the scans that the "brscand" SANE backend (brscand_shim.c)
+ * forwards over a Unix socket.  The protocol is described in brscand.h.
+ *
+ * The handle is opened again at the next job when the device could not
+ * be opened at startup or a scan fails to start (scanner unplugged or
+ * switched off), so the daemon outlives the scanner.
+ *
+ * There is one scanner, so jobs from saned and AirSane clients queue
+ * here instead of racing for the USB interface.  A thread accepts
+ * connections and a short-lived thread per connection reads its request
+ * (so a client that is slow to send one holds up nobody else), while the
+ * main thread runs the queued jobs: shortest expected job
+ * first, by resolution x area x bits per pixel, so a 100 dpi preview does
+ * not wait behind a 600 dpi colour page.  A job that has been overtaken
+ * MAX_OVERTAKE times runs next whatever its size.  Waiting clients are
+ * sent their position; a job with the same settings as the one before
+ * runs without the options being restored and set again.
+ *
+ * Build, next to the stubs:
+ *   gcc -O2 -o brscand brscand.c -ldl -lpthread
+ *
+ * Usage:
+ *   brscand [-b backend.so] [-n name] [-d device] [-s socket]
+ *
+ * -n is the backend name used in its symbols (sane_<name>_open); plain
+ * sane_open is tried when they are missing.  -d defaults to the first
+ * device the backend lists.  BROTHER_DEBUG=1 logs a line per job.
+ *
+ * Copyright: 2026, written for the DCP-130C ARM port
+ */
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
+#include <strings.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include "brscand.h"
+
+#define DEFAULT_BACKEND "/usr/lib/sane/libsane-brother2.so.1"
+#define DEFAULT_NAME    "brother2"
+#define QUEUE_MAX       16      /* jobs waiting behind the running one */
+#define MAX_OVERTAKE    3       /* then a job runs next whatever its size */
+#define READERS_MAX     32      /* connections still sending their request */
+
+enum { JOB_OPTIONS, JOB_PARAMS, JOB_SCAN };
+
+typedef struct {
+    int   idx;
+    char *value;                /* as the client sent it */
+} JOB_SET;
+
+typedef struct JOB {
+    struct JOB     *next;
+    int             kind;
+    FILE           *in, *out;
+    JOB_SET        *sets;       /* by option index, one per option */
+    int             nsets;
+    double          cost;       /* expected bytes */
+    unsigned long   seq;
+    int             overtaken;
+    int             ahead;      /* position last reported, -1 if none */
+    struct timespec t_queued;
+} JOB;
+
+/* What job_cost() needs, read from the options when the device opens */
+typedef struct {
+    int       res, mode, geom[4];   /* option indices (tl-x ... br-y), 0 if absent */
+    int       res_fixed, geom_fixed;
+    double    def_res;
+    char      def_mode[64];
+    double    def_geom[4];
+} COST_MODEL;
+
+static struct {
+    SANE_Status (*init)(SANE_Int *, SANE_Auth_Callback);
+    SANE_Status (*get_devices)(const SANE_Device ***, SANE_Bool);
+    SANE_Status (*open)(SANE_String_Const, SANE_Handle *);
+    void (*close)(SANE_Handle);
+    const SANE_Option_Descriptor *(*get_option_descriptor)(SANE_Handle,
+                                                           SANE_Int);
+    SANE_Status (*control_option)(SANE_Handle, SANE_Int, SANE_Action,
+                                  void *, SANE_Int *);
+    SANE_Status (*get_parameters)(SANE_Handle, SANE_Parameters *);
+    SANE_Status (*start)(SANE_Handle);
+    SANE_Status (*read)(SANE_Handle, SANE_Byte *, SANE_Int, SANE_Int *);
+    void (*cancel)(SANE_Handle);
+    SANE_String_Const (*strstatus)(SANE_Status);   /* optional */
+} be;
+
+static int g_debug;
+static const char *g_name = DEFAULT_NAME;
+static const char *g_device;        /* NULL: first listed */
+static SANE_Handle g_h;
+static int g_nopt;
+static void **g_defaults;           /* per option, NULL if not restored */
+static SANE_Byte *g_buf;            /* BRSCAND_CHUNK, allocated once */
+static unsigned long g_jobs;
+static volatile sig_atomic_t g_stop;
+
+/* Shared by the accepting thread and the scanning (main) thread */
+static pthread_mutex_t g_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t  g_wake = PTHREAD_COND_INITIALIZER;
+static JOB *g_queue;
+static int g_queued, g_running;
+static int g_readers;               /* reading threads alive */
+static unsigned long g_seq;
+static char *g_options;             /* OPTIONS reply while the device is open */
+static size_t g_options_len;
+static COST_MODEL g_cost;
+
+/* Scanning thread only: the settings of the last job run */
+static JOB_SET *g_applied;
+static int g_napplied = -1;         /* -1: none since the device opened */
+
+static const char *debug_ts(void) {
+    static char buf[16];
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%03d",
+             tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (int)(ts.tv_nsec / 1000000));
+    return buf;
+}
+
+static double ms_since(const struct timespec *t0)
+{
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (t.tv_sec - t0->tv_sec) * 1e3 + (t.tv_nsec - t0->tv_nsec) / 1e6;
+}
+
+static const char *status_text(SANE_Status st)
+{
+    static char buf[32];
+    if (be.strstatus)
+        return be.strstatus(st);
+    snprintf(buf, sizeof(buf), "status %d", (int)st);
+    return buf;
+}
+
+static void *backend_sym(void *lib, const char *fn)
+{
+    char name[128];
+    snprintf(name, sizeof(name), "sane_%s_%s", g_name, fn);
+    void *p = dlsym(lib, name);
+    if (!p) {
+        snprintf(name, sizeof(name), "sane_%s", fn);
+        p = dlsym(lib, name);
+    }
+    return p;
+}
+
+static int backend_load(const char *path)
+{
+    void *lib = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!lib) {
+        fprintf(stderr, "brscand: %s\n", dlerror());
+        return 0;
+    }
+#define LOAD(f)                                                         \
+    if (!(*(void **)&be.f = backend_sym(lib, #f))) {                    \
+        fprintf(stderr, "brscand: %s: no sane_%s_%s\n", path, g_name, #f); \
+        return 0;                                                       \
+    }
+    LOAD(init) LOAD(get_devices) LOAD(open) LOAD(close)
+    LOAD(get_option_descriptor) LOAD(control_option) LOAD(get_parameters)
+    LOAD(start) LOAD(read) LOAD(cancel)
+#undef LOAD
+    *(void **)&be.strstatus = backend_sym(lib, "strstatus");
+    return 1;
+}
+
+static int settable(const SANE_Option_Descriptor *d)
+{
+    return brscand_has_value(d) && SANE_OPTION_IS_SETTABLE(d->cap);
+}
+
+static void sets_free(JOB_SET *sets, int n)
+{
+    for (int i = 0; i < n; i++)
+        free(sets[i].value);
+    free(sets);
+}
+
+static void device_close(void)
+{
+    if (!g_h)
+        return;
+    be.close(g_h);
+    g_h = NULL;
+    for (int i = 0; i < g_nopt; i++)
+        free(g_defaults[i]);
+    free(g_defaults);
+    g_defaults = NULL;
+    g_nopt = 0;
+    sets_free(g_applied, g_napplied);
+    g_applied = NULL;
+    g_napplied = -1;
+
+    pthread_mutex_lock(&g_lock);
+    free(g_options);
+    g_options = NULL;
+    memset(&g_cost, 0, sizeof(g_cost));
+    pthread_mutex_unlock(&g_lock);
+}
+
+static double word_value(SANE_Word w, int fixed)
+{
+    return fixed ? w / 65536.0 : (double)w;
+}
+
+/* Find the options that size a scan, with their defaults */
+static void cost_setup(COST_MODEL *c)
+{
+    static const char *const geom[4] = { "tl-x", "tl-y", "br-x", "br-y" };
+
+    memset(c, 0, sizeof(*c));
+    for (int i = 1; i < g_nopt; i++) {
+        const SANE_Option_Descriptor *d = be.get_option_descriptor(g_h, i);
+        if (!d || !d->name || !g_defaults[i])
+            continue;
+        const SANE_Word *w = g_defaults[i];
+        int fixed = d->type == SANE_TYPE_FIXED;
+        if (strcmp(d->name, "mode") == 0 && d->type == SANE_TYPE_STRING) {
+            c->mode = i;
+            snprintf(c->def_mode, sizeof(c->def_mode), "%.*s",
+                     (int)strnlen(g_defaults[i], (size_t)d->size),
+                     (const char *)g_defaults[i]);
+            continue;
+        }
+        if (d->type != SANE_TYPE_INT && !fixed)
+            continue;
+        if (strcmp(d->name, "resolution") == 0) {
+            c->res = i;
+            c->res_fixed = fixed;
+            c->def_res = word_value(w[0], fixed);
+        }
+        for (int k = 0; k < 4; k++) {
+            if (strcmp(d->name, geom[k]) == 0) {
+                c->geom[k] = i;
+                c->geom_fixed = fixed;
+                c->def_geom[k] = word_value(w[0], fixed);
+            }
+        }
+    }
+}
+
+static void send_options(FILE *out);
+
+/* Open the device and remember the option values it starts with */
+static int device_open(void)
+{
+    static char first[256];
+    const char *dev = g_device;
+
+    if (g_h)
+        return 1;
+    if (!dev) {
+        const SANE_Device **list = NULL;
+        if (be.get_devices(&list, SANE_TRUE) != SANE_STATUS_GOOD ||
+            !list || !list[0]) {
+            fprintf(stderr, "brscand: no scanner found\n");
+            return 0;
+        }
+        snprintf(first, sizeof(first), "%s", list[0]->name);
+        dev = first;
+    }
+    SANE_Status st = be.open(dev, &g_h);
+    if (st != SANE_STATUS_GOOD) {
+        fprintf(stderr, "brscand: cannot open %s: %s\n", dev, status_text(st));
+        g_h = NULL;
+        return 0;
+    }
+
+    SANE_Int n = 0;
+    if (be.control_option(g_h, 0, SANE_ACTION_GET_VALUE, &n, NULL) !=
+        SANE_STATUS_GOOD || n < 1)
+        n = 1;
+    g_nopt = n;
+    g_defaults = calloc((size_t)n, sizeof(*g_defaults));
+    for (int i = 1; i < n && g_defaults; i++) {
+        const SANE_Option_Descriptor *d = be.get_option_descriptor(g_h, i);
+        if (!settable(d) || !SANE_OPTION_IS_ACTIVE(d->cap))
+            continue;
+        void *v = calloc(1, (size_t)d->size);
+        if (v && be.control_option(g_h, i, SANE_ACTION_GET_VALUE, v, NULL) ==
+            SANE_STATUS_GOOD)
+            g_defaults[i] = v;
+        else
+            free(v);
+    }
+
+    /* what the accepting thread answers OPTIONS with, and sizes jobs by */
+    COST_MODEL c;
+    char *text = NULL;
+    size_t len = 0;
+    FILE *f = open_memstream(&text, &len);
+    if (f) {
+        send_options(f);
+        fclose(f);
+    }
+    cost_setup(&c);
+    pthread_mutex_lock(&g_lock);
+    free(g_options);
+    g_options = text;
+    g_options_len = len;
+    g_cost = c;
+    pthread_mutex_unlock(&g_lock);
+
+    if (g_debug)
+        fprintf(stderr, "%s [BRSCAND] opened %s, %d options\n",
+                debug_ts(), dev, g_nopt);
+    return 1;
+}
+
+static void restore_defaults(void)
+{
+    for (int i = 1; i < g_nopt; i++) {
+        if (!g_defaults || !g_defaults[i])
+            continue;
+        const SANE_Option_Descriptor *d = be.get_option_descriptor(g_h, i);
+        if (!settable(d) || !SANE_OPTION_IS_ACTIVE(d->cap))
+            continue;
+        /* the backend may write back to the buffer it is given */
+        void *v = malloc((size_t)d->size);
+        if (!v)
+            continue;
+        memcpy(v, g_defaults[i], (size_t)d->size);
+        be.control_option(g_h, i, SANE_ACTION_SET_VALUE, v, NULL);
+        free(v);
+    }
+}
+
+static void send_options(FILE *out)
+{
+    fprintf(out, "COUNT %d\n", g_nopt);
+    for (int i = 0; i < g_nopt; i++) {
+        const SANE_Option_Descriptor *d = be.get_option_descriptor(g_h, i);
+        if (!d) {
+            fprintf(out, "OPT %d %d 0 0 0 0\nEND\n", i, SANE_TYPE_GROUP);
+            continue;
+        }
+        fprintf(out, "OPT %d %d %d %d %d %d\n", i, d->type, d->unit, d->size,
+                d->cap, d->constraint_type);
+        brscand_put_text(out, "NAME", d->name);
+        brscand_put_text(out, "TITLE", d->title);
+        brscand_put_text(out, "DESC", d->desc);
+        if (d->constraint_type == SANE_CONSTRAINT_RANGE && d->constraint.range) {
+            fprintf(out, "RANGE %d %d %d\n", d->constraint.range->min,
+                    d->constraint.range->max, d->constraint.range->quant);
+        } else if (d->constraint_type == SANE_CONSTRAINT_WORD_LIST &&
+                   d->constraint.word_list) {
+            const SANE_Word *w = d->constraint.word_list;
+            fprintf(out, "WORDS %d", w[0]);
+            for (int k = 1; k <= w[0]; k++)
+                fprintf(out, " %d", w[k]);
+            putc('\n', out);
+        } else if (d->constraint_type == SANE_CONSTRAINT_STRING_LIST &&
+                   d->constraint.string_list) {
+            for (const SANE_String_Const *s = d->constraint.string_list; *s; s++)
+                brscand_put_text(out, "STRING", *s);
+        }
+        if (brscand_has_value(d) && SANE_OPTION_IS_ACTIVE(d->cap)) {
+            void *v = calloc(1, (size_t)d->size);
+            if (v && be.control_option(g_h, i, SANE_ACTION_GET_VALUE, v, NULL)
+                == SANE_STATUS_GOOD) {
+                fputs("VAL ", out);
+                brscand_put_value(out, d, v);
+                putc('\n', out);
+            }
+            free(v);
+        }
+        fputs("END\n", out);
+    }
+}
+
+static void job_free(JOB *j)
+{
+    fclose(j->out);
+    fclose(j->in);
+    sets_free(j->sets, j->nsets);
+    free(j);
+}
+
+/* Keep the sets sorted by index, the last one for an option winning */
+static int job_add_set(JOB *j, int idx, const char *value)
+{
+    int i = 0;
+    while (i < j->nsets && j->sets[i].idx < idx)
+        i++;
+    char *v = strndup(value, strcspn(value, "\r\n"));
+    if (!v)
+        return 0;
+    if (i < j->nsets && j->sets[i].idx == idx) {
+        free(j->sets[i].value);
+        j->sets[i].value = v;
+        return 1;
+    }
+    JOB_SET *sets = realloc(j->sets, (size_t)(j->nsets + 1) * sizeof(*sets));
+    if (!sets) {
+        free(v);
+        return 0;
+    }
+    memmove(&sets[i + 1], &sets[i], (size_t)(j->nsets - i) * sizeof(*sets));
+    sets[i].idx = idx;
+    sets[i].value = v;
+    j->sets = sets;
+    j->nsets++;
+    return 1;
+}
+
+/* Read one request, up to GO for PARAMS and SCAN; NULL if it is not one */
+static JOB *read_job(int fd)
+{
+    char line[BRSCAND_LINE];
+    int fd2 = dup(fd);
+    JOB *j = calloc(1, sizeof(*j));
+
+    if (!j || fd2 < 0) {
+        free(j);
+        close(fd);
+        if (fd2 >= 0)
+            close(fd2);
+        return NULL;
+    }
+    if (!(j->in = fdopen(fd, "r"))) {
+        close(fd);
+        close(fd2);
+        free(j);
+        return NULL;
+    }
+    if (!(j->out = fdopen(fd2, "w"))) {
+        close(fd2);
+        fclose(j->in);
+        free(j);
+        return NULL;
+    }
+    j->ahead = -1;
+    clock_gettime(CLOCK_MONOTONIC, &j->t_queued);
+
+    if (!fgets(line, sizeof(line), j->in))
+        goto bad;
+    if (strncmp(line, "OPTIONS", 7) == 0) {
+        j->kind = JOB_OPTIONS;
+        return j;
+    }
+    if (strncmp(line, "PARAMS", 6) == 0)
+        j->kind = JOB_PARAMS;
+    else if (strncmp(line, "SCAN", 4) == 0)
+        j->kind = JOB_SCAN;
+    else {
+        fprintf(j->out, "ERROR %d unknown request\n", SANE_STATUS_INVAL);
+        goto bad;
+    }
+    while (fgets(line, sizeof(line), j->in)) {
+        int idx, pos = 0;
+        if (strncmp(line, "GO", 2) == 0)
+            return j;
+        if (sscanf(line, "SET %d %n", &idx, &pos) == 1 && pos > 0 && idx > 0 &&
+            !job_add_set(j, idx, line + pos))
+            break;
+    }
+bad:
+    job_free(j);
+    return NULL;
+}
+
+static int contains_ci(const char *s, const char *word)
+{
+    size_t n = strlen(word);
+    for (; *s; s++)
+        if (strncasecmp(s, word, n) == 0)
+            return 1;
+    return 0;
+}
+
+/* First word of a value written by brscand_put_value() */
+static double set_number(const char *v, int fixed)
+{
+    char *end;
+    strtol(v, &end, 10);
+    return word_value((SANE_Word)strtol(end, NULL, 10), fixed);
+}
+
+/*
+ * Expected bytes of a scan, resolution x area x bits per pixel, from the
+ * job's settings over the defaults.  Call with g_lock held.  Options the
+ * backend does not have count as 300 dpi and an A4 page, so jobs that
+ * cannot be told apart keep their order.
+ */
+static double job_cost(const JOB *j)
+{
+    if (j->kind != JOB_SCAN)
+        return 0;
+    const COST_MODEL *c = &g_cost;
+    double res = c->def_res > 0 ? c->def_res : 300, g[4];
+    const char *mode = c->def_mode;
+    memcpy(g, c->def_geom, sizeof(g));
+    for (int i = 0; i < j->nsets; i++) {
+        const JOB_SET *s = &j->sets[i];
+        if (s->idx == c->res)
+            res = set_number(s->value, c->res_fixed);
+        else if (s->idx == c->mode)
+            mode = s->value;
+        for (int k = 0; k < 4; k++)
+            if (c->geom[k] && s->idx == c->geom[k])
+                g[k] = set_number(s->value, c->geom_fixed);
+    }
+    double w = g[2] - g[0], h = g[3] - g[1];
+    if (!c->geom[2] || w <= 0)
+        w = 215.9;
+    if (!c->geom[3] || h <= 0)
+        h = 297.0;
+    double bpp = contains_ci(mode, "color") ? 24 : contains_ci(mode, "gray") ? 8 : 1;
+    return res * res * (w / 25.4) * (h / 25.4) * bpp / 8;
+}
+
+/* Negative when a runs before b: overtaken too often, then size, then age */
+static int job_order(const JOB *a, const JOB *b)
+{
+    int fa = a->overtaken >= MAX_OVERTAKE, fb = b->overtaken >= MAX_OVERTAKE;
+    if (fa != fb)
+        return fb - fa;
+    if (!fa && a->cost != b->cost)
+        return a->cost < b->cost ? -1 : 1;
+    return a->seq < b->seq ? -1 : 1;
+}
+
+/* Tell waiting clients how many jobs are ahead of theirs; g_lock held */
+static void report_positions(void)
+{
+    for (JOB *j = g_queue; j; j = j->next) {
+        int ahead = g_running;
+        for (JOB *k = g_queue; k; k = k->next)
+            if (k != j && job_order(k, j) < 0)
+                ahead++;
+        if (ahead > 0 && ahead != j->ahead) {
+            fprintf(j->out, "QUEUED %d\n", ahead);
+            fflush(j->out);
+        }
+        j->ahead = ahead;
+    }
+}
+
+/* Take the next job off the queue; g_lock held */
+static JOB *queue_pop(void)
+{
+    JOB **best = &g_queue;
+    for (JOB **p = &g_queue; *p; p = &(*p)->next)
+        if (job_order(*p, *best) < 0)
+            best = p;
+    JOB *j = *best;
+    *best = j->next;
+    g_queued--;
+    for (JOB *k = g_queue; k; k = k->next)
+        if (k->seq < j->seq)
+            k->overtaken++;
+    return j;
+}
+
+/*
+ * Reading thread, one per connection: read the request and queue it for
+ * the scanning thread.  A client that stops talking is dropped after
+ * the receive timeout, and only its own thread waits for it.
+ */
+static void *read_loop(void *arg)
+{
+    int fd = (int)(intptr_t)arg;
+    struct timeval rtv = { 10, 0 }, wtv = { 60, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &rtv, sizeof(rtv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &wtv, sizeof(wtv));
+    JOB *j = read_job(fd);
+
+    pthread_mutex_lock(&g_lock);
+    g_readers--;
+    if (!j) {
+        pthread_mutex_unlock(&g_lock);
+        return NULL;
+    }
+    if (j->kind == JOB_OPTIONS && g_options) {
+        /* answered from the copy taken at open: no need to queue */
+        char *text = malloc(g_options_len);
+        size_t len = g_options_len;
+        if (text)
+            memcpy(text, g_options, len);
+        pthread_mutex_unlock(&g_lock);
+        if (text)
+            fwrite(text, 1, len, j->out);
+        free(text);
+        job_free(j);
+        return NULL;
+    }
+    if (g_stop || g_queued >= QUEUE_MAX) {
+        int stopping = g_stop;
+        pthread_mutex_unlock(&g_lock);
+        if (stopping)
+            fprintf(j->out, "ERROR %d scan daemon stopping\n", SANE_STATUS_CANCELLED);
+        else
+            fprintf(j->out, "ERROR %d scan queue full\n", SANE_STATUS_DEVICE_BUSY);
+        job_free(j);
+        return NULL;
+    }
+    j->seq = ++g_seq;
+    j->cost = job_cost(j);
+    j->next = g_queue;
+    g_queue = j;
+    g_queued++;
+    report_positions();
+    if (g_debug && (g_running || g_queued > 1))
+        fprintf(stderr, "%s [BRSCAND] queued %s %lu (%.0f KB expected), "
+                "%d job(s) ahead\n", debug_ts(),
+                j->kind == JOB_SCAN ? "scan" : "request", j->seq,
+                j->cost / 1024, j->ahead);
+    pthread_cond_signal(&g_wake);
+    pthread_mutex_unlock(&g_lock);
+    return NULL;
+}
+
+/* Accepting thread: hand each connection to a reading thread */
+static void *accept_loop(void *arg)
+{
+    int ls = *(int *)arg;
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, 256 * 1024);
+    for (;;) {
+        int fd = accept(ls, NULL, NULL);
+        if (fd < 0)
+            continue;
+        pthread_mutex_lock(&g_lock);
+        int busy = g_readers >= READERS_MAX;
+        if (!busy)
+            g_readers++;
+        pthread_mutex_unlock(&g_lock);
+
+        pthread_t tid;
+        if (!busy &&
+            pthread_create(&tid, &attr, read_loop, (void *)(intptr_t)fd) == 0)
+            continue;
+        if (!busy) {
+            pthread_mutex_lock(&g_lock);
+            g_readers--;
+            pthread_mutex_unlock(&g_lock);
+        }
+        /* too many clients still sending requests, or no thread for one */
+        struct timeval wtv = { 1, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &wtv, sizeof(wtv));
+        dprintf(fd, "ERROR %d too many connections\n", SANE_STATUS_DEVICE_BUSY);
+        close(fd);
+    }
+    return NULL;
+}
+
+static void apply_sets(const JOB *j)
+{
+    for (int i = 0; i < j->nsets; i++) {
+        int idx = j->sets[i].idx;
+        if (idx >= g_nopt)
+            continue;
+        const SANE_Option_Descriptor *d = be.get_option_descriptor(g_h, idx);
+        if (!settable(d))
+            continue;
+        void *v = malloc((size_t)d->size);
+        if (v && brscand_get_value(j->sets[i].value, d, v)) {
+            SANE_Status st = be.control_option(g_h, idx, SANE_ACTION_SET_VALUE,
+                                               v, NULL);
+            if (st != SANE_STATUS_GOOD && g_debug)
+                fprintf(stderr, "%s [BRSCAND] set %s: %s\n", debug_ts(),
+                        d->name ? d->name : "?", status_text(st));
+        }
+        free(v);
+    }
+}
+
+static int same_settings(const JOB *j)
+{
+    if (g_napplied != j->nsets)
+        return 0;
+    for (int i = 0; i < j->nsets; i++)
+        if (g_applied[i].idx != j->sets[i].idx ||
+            strcmp(g_applied[i].value, j->sets[i].value) != 0)
+            return 0;
+    return 1;
+}
+
+static void remember_settings(const JOB *j)
+{
+    sets_free(g_applied, g_napplied);
+    g_applied = calloc((size_t)j->nsets + 1, sizeof(*g_applied));
+    g_napplied = -1;
+    if (!g_applied)
+        return;
+    for (int i = 0; i < j->nsets; i++) {
+        g_applied[i].idx = j->sets[i].idx;
+        if (!(g_applied[i].value = strdup(j->sets[i].value))) {
+            sets_free(g_applied, i);
+            g_applied = NULL;
+            return;
+        }
+    }
+    g_napplied = j->nsets;
+}
+
+static void scan(FILE *out, const struct timespec *t0, double waited, int same)
+{
+    SANE_Status st = SANE_STATUS_GOOD;
+    unsigned long long bytes = 0;
+    double first_ms = -1;
+    int frames = 0, gone = 0;
+
+    for (;;) {
+        st = be.start(g_h);
+        if (st != SANE_STATUS_GOOD) {
+            fprintf(out, "ERROR %d %s\n", st, status_text(st));
+            break;
+        }
+        SANE_Parameters p;
+        memset(&p, 0, sizeof(p));
+        be.get_parameters(g_h, &p);
+        fprintf(out, "FRAME %d %d %d %d %d %d\n", p.format, p.last_frame,
+                p.bytes_per_line, p.pixels_per_line, p.lines, p.depth);
+        frames++;
+        for (;;) {
+            SANE_Int len = 0;
+            st = be.read(g_h, g_buf, BRSCAND_CHUNK, &len);
+            if (st != SANE_STATUS_GOOD)
+                break;
+            if (len <= 0)
+                continue;
+            if (first_ms < 0)
+                first_ms = ms_since(t0);
+            fprintf(out, "DATA %d\n", len);
+            fwrite(g_buf, 1, (size_t)len, out);
+            if (fflush(out) != 0) {
+                gone = 1;
+                break;
+            }
+            bytes += (unsigned long long)len;
+        }
+        if (gone)
+            break;
+        fprintf(out, "END %d\n", st);
+        if (fflush(out) != 0 || st != SANE_STATUS_EOF || p.last_frame)
+            break;
+    }
+    be.cancel(g_h);
+    /* a scan that did not start usually means the device went away */
+    if (frames == 0 && st != SANE_STATUS_DEVICE_BUSY)
+        device_close();
+
+    if (g_debug)
+        fprintf(stderr, "%s [BRSCAND] job %lu: %d frame(s), %llu bytes, "
+                "queued %.1f ms, first data after %.1f ms, %.1f ms in all%s "
+                "(%s)\n", debug_ts(), g_jobs, frames, bytes, waited,
+                first_ms < 0 ? 0 : first_ms, ms_since(t0),
+                same ? ", settings unchanged" : "",
+                gone ? "client went away" : status_text(st));
+}
+
+/* Scanning thread: run one job taken off the queue */
+static void run_job(JOB *j)
+{
+    struct timespec t_run;
+    double waited = ms_since(&j->t_queued);
+    char c;
+
+    clock_gettime(CLOCK_MONOTONIC, &t_run);
+    if (recv(fileno(j->in), &c, 1, MSG_PEEK | MSG_DONTWAIT) == 0) {
+        if (g_debug)
+            fprintf(stderr, "%s [BRSCAND] client left the queue after %.1f ms\n",
+                    debug_ts(), waited);
+        return;
+    }
+    g_jobs++;
+    if (!device_open()) {
+        fprintf(j->out, "ERROR %d scanner not available\n", SANE_STATUS_IO_ERROR);
+        return;
+    }
+    if (j->kind == JOB_OPTIONS) {
+        send_options(j->out);
+        return;
+    }
+    /* back-to-back jobs with the same settings skip restoring and setting */
+    int same = same_settings(j);
+    if (!same) {
+        restore_defaults();
+        apply_sets(j);
+        remember_settings(j);
+    }
+    if (j->kind == JOB_SCAN) {
+        scan(j->out, &t_run, waited, same);
+        return;
+    }
+    SANE_Parameters p;
+    SANE_Status st = be.get_parameters(g_h, &p);
+    if (st == SANE_STATUS_GOOD)
+        fprintf(j->out, "P %d %d %d %d %d %d\n", p.format, p.last_frame,
+                p.bytes_per_line, p.pixels_per_line, p.lines, p.depth);
+    else
+        fprintf(j->out, "ERROR %d %s\n", st, status_text(st));
+}
+
+static void on_signal(int sig)
+{
+    (void)sig;
+    g_stop = 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: brscand [-b backend.so] [-n name] [-d device] "
+            "[-s socket]\n");
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = DEFAULT_BACKEND, *path = getenv("BROTHER_SCAND_SOCKET");
+    int opt;
+
+    if (!path || !*path)
+        path = BRSCAND_SOCKET;
+    while ((opt = getopt(argc, argv, "b:n:d:s:")) != -1) {
+        switch (opt) {
+        case 'b': lib = optarg; break;
+        case 'n': g_name = optarg; break;
+        case 'd': g_device = optarg; break;
+        case 's': path = optarg; break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind != argc) {
+        usage();
+        return 2;
+    }
+    const char *env = getenv("BROTHER_DEBUG");
+    g_debug = env && strcmp(env, "1") == 0;
+
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sa.sun_path)) {
+        fprintf(stderr, "brscand: socket path too long: %s\n", path);
+        return 2;
+    }
+    strcpy(sa.sun_path, path);
+
+    g_buf = malloc(BRSCAND_CHUNK);
+    if (!g_buf || !backend_load(lib))
+        return 1;
+    SANE_Int version = 0;
+    SANE_Status st = be.init(&version, NULL);
+    if (st != SANE_STATUS_GOOD) {
+        fprintf(stderr, "brscand: backend init failed: %s\n", status_text(st));
+        return 1;
+    }
+    if (!device_open())
+        fprintf(stderr, "brscand: will try the scanner again at the next job\n");
+
+    int ls = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (ls < 0) {
+        perror("socket");
+        return 1;
+    }
+    unlink(path);
+    if (bind(ls, (struct sockaddr *)&sa, sizeof(sa)) != 0 ||
+        listen(ls, 8) != 0) {
+        fprintf(stderr, "brscand: cannot listen on %s: %s\n", path,
+                strerror(errno));
+        return 1;
+    }
+    /* saned and AirSane run as other users */
+    chmod(path, 0666);
+
+    struct sigaction sig;
+    memset(&sig, 0, sizeof(sig));
+    sig.sa_handler = on_signal;
+    sigaction(SIGTERM, &sig, NULL);
+    sigaction(SIGINT, &sig, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    /* signals go to the scanning thread, which checks g_stop */
+    sigset_t block, old;
+    pthread_t tid;
+    sigemptyset(&block);
+    sigaddset(&block, SIGTERM);
+    sigaddset(&block, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &block, &old);
+    if (pthread_create(&tid, NULL, accept_loop, &ls) != 0) {
+        fprintf(stderr, "brscand: cannot start the accepting thread\n");
+        return 1;
+    }
+    pthread_detach(tid);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    fprintf(stderr, "brscand: serving %s on %s\n", lib, path);
+
+    while (!g_stop) {
+        JOB *j = NULL;
+        pthread_mutex_lock(&g_lock);
+        while (!g_queue && !g_stop) {
+            struct timespec until;
+            clock_gettime(CLOCK_REALTIME, &until);
+            until.tv_sec++;
+            pthread_cond_timedwait(&g_wake, &g_lock, &until);
+        }
+        if (!g_stop) {
+            j = queue_pop();
+            g_running = 1;
+            report_positions();
+        }
+        pthread_mutex_unlock(&g_lock);
+        if (!j)
+            break;
+        run_job(j);
+        job_free(j);
+        pthread_mutex_lock(&g_lock);
+        g_running = 0;
+        pthread_mutex_unlock(&g_lock);
+    }
+
+    pthread_mutex_lock(&g_lock);
+    while (g_queue) {
+        JOB *j = g_queue;
+        g_queue = j->next;
+        fprintf(j->out, "ERROR %d scan daemon stopping\n", SANE_STATUS_CANCELLED);
+        job_free(j);
+    }
+    pthread_mutex_unlock(&g_lock);
+    device_close();
+    close(ls);
+    unlink(path);
+    return 0;
+}
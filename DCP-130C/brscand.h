@@ -0,0 +1,207 @@
+/*
+ * Resident scanner daemon (brscand.c) and its SANE shim (brscand_shim.c)
+ *
+ * brscand loads libsane-brother2 once, keeps the device handle open and
+ * runs scans for the shim, the "brscand" SANE backend that saned, AirSane
+ * and scanimage load instead of brother2.  Each request is one connection
+ * to BRSCAND_SOCKET (override with BROTHER_SCAND_SOCKET).  The scanner
+ * runs one job at a time; the daemon queues the others, shortest first.
+ *
+ * Requests and replies are text lines; scan data is sent in DATA chunks.
+ *
+ *   OPTIONS                   -> COUNT n, then per option:
+ *                                OPT idx type unit size cap constraint
+ *                                NAME/TITLE/DESC text
+ *                                RANGE min max quant | WORDS n w... |
+ *                                STRING s (one line per list entry)
+ *                                VAL value (defaults; readable options)
+ *                                END
+ *   PARAMS | SCAN, then any number of
+ *     SET idx value           (options the client changed), then
+ *     GO                      -> PARAMS: P format last lines... line
+ *                                SCAN, per frame:
+ *                                FRAME format last bpl ppl lines depth
+ *                                DATA n + n bytes ...
+ *                                END status
+ *                             -> either: ERROR status text
+ *
+ * While a PARAMS or SCAN job waits its turn, the reply is preceded by
+ * QUEUED n lines, n being the jobs ahead of it; sent when n changes.
+ *
+ * Values are written as the word count and words (BOOL, INT, FIXED) or
+ * the string itself (STRING).  Before applying SETs the daemon restores
+ * the defaults it read at startup, so one job never inherits another's
+ * settings.
+ *
+ * Both sides build without the SANE development headers: when
+ * <sane/sane.h> is missing, the SANE 1.0 declarations they use are
+ * repeated here.
+ *
+ * Copyright: 2026, written for the DCP-130C ARM port
+ */
+#ifndef BRSCAND_H
+#define BRSCAND_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BRSCAND_SOCKET  "/run/brscand/brscand.sock"
+#define BRSCAND_CHUNK   65536          /* largest DATA chunk */
+#define BRSCAND_LINE    4096           /* longest protocol line */
+
+#if defined(__has_include)
+#if __has_include(<sane/sane.h>)
+#include <sane/sane.h>
+#define BRSCAND_HAVE_SANE_H 1
+#endif
+#endif
+
+#ifndef BRSCAND_HAVE_SANE_H
+typedef int             SANE_Word;
+typedef SANE_Word       SANE_Bool;
+typedef SANE_Word       SANE_Int;
+typedef SANE_Word       SANE_Fixed;
+typedef unsigned char   SANE_Byte;
+typedef char            SANE_Char;
+typedef SANE_Char      *SANE_String;
+typedef const SANE_Char *SANE_String_Const;
+typedef void           *SANE_Handle;
+
+#define SANE_FALSE 0
+#define SANE_TRUE  1
+#define SANE_VERSION_CODE(major, minor, build) \
+    ((((SANE_Word)(major) & 0xff) << 24) | (((SANE_Word)(minor) & 0xff) << 16) | \
+     ((SANE_Word)(build) & 0xffff))
+
+typedef enum {
+    SANE_STATUS_GOOD = 0, SANE_STATUS_UNSUPPORTED, SANE_STATUS_CANCELLED,
+    SANE_STATUS_DEVICE_BUSY, SANE_STATUS_INVAL, SANE_STATUS_EOF,
+    SANE_STATUS_JAMMED, SANE_STATUS_NO_DOCS, SANE_STATUS_COVER_OPEN,
+    SANE_STATUS_IO_ERROR, SANE_STATUS_NO_MEM, SANE_STATUS_ACCESS_DENIED
+} SANE_Status;
+
+typedef enum {
+    SANE_TYPE_BOOL = 0, SANE_TYPE_INT, SANE_TYPE_FIXED, SANE_TYPE_STRING,
+    SANE_TYPE_BUTTON, SANE_TYPE_GROUP
+} SANE_Value_Type;
+
+typedef enum {
+    SANE_UNIT_NONE = 0, SANE_UNIT_PIXEL, SANE_UNIT_BIT, SANE_UNIT_MM,
+    SANE_UNIT_DPI, SANE_UNIT_PERCENT, SANE_UNIT_MICROSECOND
+} SANE_Unit;
+
+typedef struct {
+    SANE_String_Const name, vendor, model, type;
+} SANE_Device;
+
+#define SANE_CAP_SOFT_SELECT (1 << 0)
+#define SANE_CAP_INACTIVE    (1 << 5)
+#define SANE_OPTION_IS_ACTIVE(cap)   (((cap) & SANE_CAP_INACTIVE) == 0)
+#define SANE_OPTION_IS_SETTABLE(cap) (((cap) & SANE_CAP_SOFT_SELECT) != 0)
+
+#define SANE_INFO_INEXACT       (1 << 0)
+#define SANE_INFO_RELOAD_PARAMS (1 << 2)
+
+typedef enum {
+    SANE_CONSTRAINT_NONE = 0, SANE_CONSTRAINT_RANGE,
+    SANE_CONSTRAINT_WORD_LIST, SANE_CONSTRAINT_STRING_LIST
+} SANE_Constraint_Type;
+
+typedef struct {
+    SANE_Word min, max, quant;
+} SANE_Range;
+
+typedef struct {
+    SANE_String_Const    name, title, desc;
+    SANE_Value_Type      type;
+    SANE_Unit            unit;
+    SANE_Int             size;
+    SANE_Int             cap;
+    SANE_Constraint_Type constraint_type;
+    union {
+        const SANE_String_Const *string_list;
+        const SANE_Word         *word_list;
+        const SANE_Range        *range;
+    } constraint;
+} SANE_Option_Descriptor;
+
+typedef enum {
+    SANE_ACTION_GET_VALUE = 0, SANE_ACTION_SET_VALUE, SANE_ACTION_SET_AUTO
+} SANE_Action;
+
+typedef enum {
+    SANE_FRAME_GRAY = 0, SANE_FRAME_RGB, SANE_FRAME_RED, SANE_FRAME_GREEN,
+    SANE_FRAME_BLUE
+} SANE_Frame;
+
+typedef struct {
+    SANE_Frame format;
+    SANE_Bool  last_frame;
+    SANE_Int   bytes_per_line;
+    SANE_Int   pixels_per_line;
+    SANE_Int   lines;
+    SANE_Int   depth;
+} SANE_Parameters;
+
+typedef void (*SANE_Auth_Callback)(SANE_String_Const resource,
+                                   SANE_Char *username, SANE_Char *password);
+#endif /* !BRSCAND_HAVE_SANE_H */
+
+/* Options with a value that can be read (and sent) */
+static inline int brscand_has_value(const SANE_Option_Descriptor *d)
+{
+    return d && d->type != SANE_TYPE_BUTTON && d->type != SANE_TYPE_GROUP &&
+           d->size > 0;
+}
+
+/* Write text on one line: newlines become spaces */
+static inline void brscand_put_text(FILE *f, const char *key, const char *s)
+{
+    fprintf(f, "%s ", key);
+    for (; s && *s; s++)
+        putc(*s == '\n' || *s == '\r' ? ' ' : *s, f);
+    putc('\n', f);
+}
+
+/* Write the d->size bytes at v, as described above (no newline) */
+static inline void brscand_put_value(FILE *f, const SANE_Option_Descriptor *d,
+                                     const void *v)
+{
+    if (d->type == SANE_TYPE_STRING) {
+        fprintf(f, "%.*s", (int)strnlen((const char *)v, (size_t)d->size),
+                (const char *)v);
+        return;
+    }
+    int n = d->size / (int)sizeof(SANE_Word);
+    fprintf(f, "%d", n);
+    for (int i = 0; i < n; i++)
+        fprintf(f, " %d", ((const SANE_Word *)v)[i]);
+}
+
+/* Parse a value written by brscand_put_value() into d->size bytes at v */
+static inline int brscand_get_value(const char *s,
+                                    const SANE_Option_Descriptor *d, void *v)
+{
+    memset(v, 0, (size_t)d->size);
+    if (d->type == SANE_TYPE_STRING) {
+        size_t len = strcspn(s, "\r\n");
+        if (len >= (size_t)d->size)
+            len = (size_t)d->size - 1;
+        memcpy(v, s, len);
+        return 1;
+    }
+    char *end;
+    long n = strtol(s, &end, 10);
+    if (end == s || n < 0 || n > d->size / (long)sizeof(SANE_Word))
+        return 0;
+    for (long i = 0; i < n; i++) {
+        s = end;
+        ((SANE_Word *)v)[i] = (SANE_Word)strtol(s, &end, 10);
+        if (end == s)
+            return 0;
+    }
+    return 1;
+}
+
+#endif /* BRSCAND_H */
@@ -0,0 +1,561 @@
+/*
+ * brscand_shim — the "brscand" SANE backend
+ *
+ * Forwards scans to the resident daemon (brscand.c) instead of loading
+ * the Brother backend in every saned child.  Options are fetched from
+ * the daemon when the device is opened and kept here: values are checked
+ * against their constraints locally, and the ones the frontend changed
+ * are sent with each job.  While other jobs hold the scanner the daemon
+ * queues this one: sane_start() waits for its turn, and BROTHER_DEBUG=1
+ * logs the queue position as it changes.
+ *
+ * Build, next to the stubs:
+ *   gcc -shared -fPIC -O2 -o libsane-brscand.so.1 brscand_shim.c
+ *
+ * Listed in /etc/sane.d/dll.conf as "brscand".  BROTHER_SCAND_SOCKET
+ * overrides the socket (BRSCAND_SOCKET in brscand.h).
+ *
+ * Copyright: 2026, written for the DCP-130C ARM port
+ */
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "brscand.h"
+
+#define SHIM_DEVICE "dcp130c"
+
+typedef struct {
+    SANE_Option_Descriptor d;
+    void       *value;          /* d.size bytes */
+    int         dirty;          /* changed by the frontend: send it */
+    SANE_Range  range;
+    SANE_Word  *words;
+    char      **strings;        /* NULL terminated */
+} SHIM_OPT;
+
+typedef struct {
+    int             nopt;
+    SHIM_OPT       *opt;
+    FILE           *in, *out;   /* job in progress */
+    SANE_Parameters p;
+    int             remaining;  /* bytes left in the current DATA chunk */
+    int             frame_done;
+} SHIM;
+
+static int g_debug;
+
+static const char *debug_ts(void) {
+    static char buf[16];
+    struct timespec ts;
+    struct tm tm;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    localtime_r(&ts.tv_sec, &tm);
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%03d",
+             tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (int)(ts.tv_nsec / 1000000));
+    return buf;
+}
+
+static const char *socket_path(void)
+{
+    const char *p = getenv("BROTHER_SCAND_SOCKET");
+    return p && *p ? p : BRSCAND_SOCKET;
+}
+
+static void job_close(SHIM *s)
+{
+    if (s->in)
+        fclose(s->in);
+    if (s->out)
+        fclose(s->out);
+    s->in = s->out = NULL;
+    s->remaining = 0;
+    s->frame_done = 0;
+}
+
+/* Connect and send the request line */
+static SANE_Status job_open(SHIM *s, const char *request)
+{
+    struct sockaddr_un sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sun_family = AF_UNIX;
+    snprintf(sa.sun_path, sizeof(sa.sun_path), "%s", socket_path());
+
+    job_close(s);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+        return SANE_STATUS_IO_ERROR;
+    if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) != 0) {
+        if (g_debug)
+            fprintf(stderr, "%s [BRSCAND] cannot reach the daemon at %s: %s\n",
+                    debug_ts(), sa.sun_path, strerror(errno));
+        close(fd);
+        return SANE_STATUS_IO_ERROR;
+    }
+    int fd2 = dup(fd);
+    s->in = fdopen(fd, "r");
+    s->out = fd2 >= 0 ? fdopen(fd2, "w") : NULL;
+    if (!s->in || !s->out) {
+        if (!s->in)
+            close(fd);
+        if (!s->out && fd2 >= 0)
+            close(fd2);
+        job_close(s);
+        return SANE_STATUS_NO_MEM;
+    }
+    fprintf(s->out, "%s\n", request);
+    return SANE_STATUS_GOOD;
+}
+
+/* Send the changed options and GO */
+static SANE_Status job_go(SHIM *s)
+{
+    for (int i = 1; i < s->nopt; i++) {
+        SHIM_OPT *o = &s->opt[i];
+        if (!o->dirty || !o->value)
+            continue;
+        fprintf(s->out, "SET %d ", i);
+        brscand_put_value(s->out, &o->d, o->value);
+        putc('\n', s->out);
+    }
+    fputs("GO\n", s->out);
+    return fflush(s->out) == 0 ? SANE_STATUS_GOOD : SANE_STATUS_IO_ERROR;
+}
+
+/* Next reply line; the daemon's queue positions are logged and skipped */
+static int read_line(SHIM *s, char *line, size_t size)
+{
+    int ahead;
+    do {
+        if (!s->in || !fgets(line, (int)size, s->in))
+            return 0;
+        line[strcspn(line, "\r\n")] = '\0';
+        if (sscanf(line, "QUEUED %d", &ahead) != 1)
+            return 1;
+        if (g_debug)
+            fprintf(stderr, "%s [BRSCAND] waiting for the scanner: %d job(s) "
+                    "ahead\n", debug_ts(), ahead);
+    } while (1);
+}
+
+/* "ERROR status text": the status, IO_ERROR for anything unexpected */
+static SANE_Status reply_error(const char *line)
+{
+    int st;
+    if (sscanf(line, "ERROR %d", &st) == 1 && st > 0)
+        return (SANE_Status)st;
+    return SANE_STATUS_IO_ERROR;
+}
+
+static int read_params(const char *line, const char *key, SANE_Parameters *p)
+{
+    int f, last;
+    char fmt[64];
+    snprintf(fmt, sizeof(fmt), "%s %%d %%d %%d %%d %%d %%d", key);
+    if (sscanf(line, fmt, &f, &last, &p->bytes_per_line, &p->pixels_per_line,
+               &p->lines, &p->depth) != 6)
+        return 0;
+    p->format = (SANE_Frame)f;
+    p->last_frame = last;
+    return 1;
+}
+
+static void free_options(SHIM *s)
+{
+    for (int i = 0; i < s->nopt; i++) {
+        SHIM_OPT *o = &s->opt[i];
+        free((void *)o->d.name);
+        free((void *)o->d.title);
+        free((void *)o->d.desc);
+        free(o->value);
+        free(o->words);
+        for (int k = 0; o->strings && o->strings[k]; k++)
+            free(o->strings[k]);
+        free(o->strings);
+    }
+    free(s->opt);
+    s->opt = NULL;
+    s->nopt = 0;
+}
+
+static SANE_Status fetch_options(SHIM *s)
+{
+    char line[BRSCAND_LINE] = "";
+    SANE_Status st = job_open(s, "OPTIONS");
+    if (st != SANE_STATUS_GOOD)
+        return st;
+    fflush(s->out);
+    if (!read_line(s, line, sizeof(line)) ||
+        sscanf(line, "COUNT %d", &s->nopt) != 1 || s->nopt < 1) {
+        st = strncmp(line, "ERROR", 5) == 0 ? reply_error(line)
+                                            : SANE_STATUS_IO_ERROR;
+        s->nopt = 0;
+        job_close(s);
+        return st;
+    }
+    s->opt = calloc((size_t)s->nopt, sizeof(*s->opt));
+    if (!s->opt) {
+        s->nopt = 0;
+        job_close(s);
+        return SANE_STATUS_NO_MEM;
+    }
+
+    SHIM_OPT *o = NULL;
+    int nstrings = 0;
+    st = SANE_STATUS_IO_ERROR;
+    while (read_line(s, line, sizeof(line))) {
+        int idx, type, unit, size, cap, ctype;
+        if (sscanf(line, "OPT %d %d %d %d %d %d", &idx, &type, &unit, &size,
+                   &cap, &ctype) == 6) {
+            if (idx < 0 || idx >= s->nopt || size < 0 || size > BRSCAND_LINE)
+                break;
+            o = &s->opt[idx];
+            o->d.type = (SANE_Value_Type)type;
+            o->d.unit = (SANE_Unit)unit;
+            o->d.size = size;
+            o->d.cap = cap;
+            o->d.constraint_type = (SANE_Constraint_Type)ctype;
+            o->value = calloc(1, (size_t)(size > 0 ? size : 1));
+            nstrings = 0;
+            continue;
+        }
+        if (!o)
+            break;
+        if (strncmp(line, "NAME ", 5) == 0) {
+            o->d.name = strdup(line + 5);
+        } else if (strncmp(line, "TITLE ", 6) == 0) {
+            o->d.title = strdup(line + 6);
+        } else if (strncmp(line, "DESC ", 5) == 0) {
+            o->d.desc = strdup(line + 5);
+        } else if (sscanf(line, "RANGE %d %d %d", &o->range.min,
+                          &o->range.max, &o->range.quant) == 3) {
+            o->d.constraint.range = &o->range;
+        } else if (strncmp(line, "WORDS ", 6) == 0) {
+            char *p = line + 6, *end;
+            long n = strtol(p, &end, 10);
+            if (n < 0 || n > BRSCAND_LINE)
+                break;
+            o->words = calloc((size_t)n + 1, sizeof(SANE_Word));
+            if (!o->words)
+                break;
+            o->words[0] = (SANE_Word)n;
+            for (long k = 1; k <= n; k++)
+                o->words[k] = (SANE_Word)strtol(end, &end, 10);
+            o->d.constraint.word_list = o->words;
+        } else if (strncmp(line, "STRING ", 7) == 0) {
+            char **l = realloc(o->strings, (size_t)(nstrings + 2) * sizeof(*l));
+            if (!l)
+                break;
+            o->strings = l;
+            l[nstrings++] = strdup(line + 7);
+            l[nstrings] = NULL;
+            o->d.constraint.string_list = (const SANE_String_Const *)l;
+        } else if (strncmp(line, "VAL ", 4) == 0) {
+            if (o->d.size > 0)
+                brscand_get_value(line + 4, &o->d, o->value);
+        } else if (strcmp(line, "END") == 0) {
+            if (o == &s->opt[s->nopt - 1]) {
+                st = SANE_STATUS_GOOD;
+                break;
+            }
+        }
+    }
+    job_close(s);
+    if (st != SANE_STATUS_GOOD)
+        free_options(s);
+    return st;
+}
+
+/* Fit the words at v to the option's constraint; 1 if any changed */
+static int constrain_words(const SHIM_OPT *o, SANE_Word *w, int n)
+{
+    int inexact = 0;
+    for (int i = 0; i < n; i++) {
+        SANE_Word v = w[i];
+        if (o->d.type == SANE_TYPE_BOOL) {
+            v = v ? SANE_TRUE : SANE_FALSE;
+        } else if (o->d.constraint_type == SANE_CONSTRAINT_RANGE) {
+            const SANE_Range *r = &o->range;
+            if (v < r->min)
+                v = r->min;
+            if (v > r->max)
+                v = r->max;
+            if (r->quant > 0)
+                v = r->min + (v - r->min + r->quant / 2) / r->quant * r->quant;
+            if (v > r->max)
+                v = r->max;
+        } else if (o->d.constraint_type == SANE_CONSTRAINT_WORD_LIST &&
+                   o->words && o->words[0] > 0) {
+            SANE_Word best = o->words[1];
+            for (int k = 1; k <= o->words[0]; k++) {
+                long long dk = (long long)o->words[k] - v;
+                long long db = (long long)best - v;
+                if ((dk < 0 ? -dk : dk) < (db < 0 ? -db : db))
+                    best = o->words[k];
+            }
+            v = best;
+        }
+        if (v != w[i]) {
+            w[i] = v;
+            inexact = 1;
+        }
+    }
+    return inexact;
+}
+
+SANE_Status sane_brscand_init(SANE_Int *version_code,
+                              SANE_Auth_Callback authorize)
+{
+    (void)authorize;
+    const char *env = getenv("BROTHER_DEBUG");
+    g_debug = env && strcmp(env, "1") == 0;
+    if (version_code)
+        *version_code = SANE_VERSION_CODE(1, 0, 0);
+    return SANE_STATUS_GOOD;
+}
+
+void sane_brscand_exit(void)
+{
+}
+
+SANE_Status sane_brscand_get_devices(const SANE_Device ***device_list,
+                                     SANE_Bool local_only)
+{
+    static const SANE_Device dev = {
+        SHIM_DEVICE, "Brother", "DCP-130C", "flatbed scanner"
+    };
+    static const SANE_Device *list[] = { &dev, NULL };
+    (void)local_only;
+    *device_list = list;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status sane_brscand_open(SANE_String_Const name, SANE_Handle *h)
+{
+    if (name && *name && strcmp(name, SHIM_DEVICE) != 0)
+        return SANE_STATUS_INVAL;
+    SHIM *s = calloc(1, sizeof(*s));
+    if (!s)
+        return SANE_STATUS_NO_MEM;
+    SANE_Status st = fetch_options(s);
+    if (st != SANE_STATUS_GOOD) {
+        free(s);
+        return st;
+    }
+    *h = s;
+    return SANE_STATUS_GOOD;
+}
+
+void sane_brscand_close(SANE_Handle h)
+{
+    SHIM *s = h;
+    job_close(s);
+    free_options(s);
+    free(s);
+}
+
+const SANE_Option_Descriptor *sane_brscand_get_option_descriptor(SANE_Handle h,
+                                                                 SANE_Int n)
+{
+    SHIM *s = h;
+    if (n < 0 || n >= s->nopt)
+        return NULL;
+    return &s->opt[n].d;
+}
+
+SANE_Status sane_brscand_control_option(SANE_Handle h, SANE_Int n,
+                                        SANE_Action action, void *v,
+                                        SANE_Int *info)
+{
+    SHIM *s = h;
+    if (info)
+        *info = 0;
+    if (n < 0 || n >= s->nopt)
+        return SANE_STATUS_INVAL;
+    SHIM_OPT *o = &s->opt[n];
+    if (!brscand_has_value(&o->d) || !SANE_OPTION_IS_ACTIVE(o->d.cap))
+        return SANE_STATUS_INVAL;
+
+    if (action == SANE_ACTION_GET_VALUE) {
+        memcpy(v, o->value, (size_t)o->d.size);
+        return SANE_STATUS_GOOD;
+    }
+    if (action != SANE_ACTION_SET_VALUE)
+        return SANE_STATUS_UNSUPPORTED;
+    if (s->in)
+        return SANE_STATUS_DEVICE_BUSY;
+    if (n == 0 || !SANE_OPTION_IS_SETTABLE(o->d.cap))
+        return SANE_STATUS_INVAL;
+
+    if (o->d.type == SANE_TYPE_STRING) {
+        const char *str = v;
+        if (o->strings) {
+            int k = 0;
+            while (o->strings[k] && strcmp(o->strings[k], str) != 0)
+                k++;
+            if (!o->strings[k])
+                return SANE_STATUS_INVAL;
+        }
+        memset(o->value, 0, (size_t)o->d.size);
+        strncpy(o->value, str, (size_t)o->d.size - 1);
+    } else {
+        int nw = o->d.size / (int)sizeof(SANE_Word);
+        memcpy(o->value, v, (size_t)nw * sizeof(SANE_Word));
+        if (constrain_words(o, o->value, nw)) {
+            memcpy(v, o->value, (size_t)nw * sizeof(SANE_Word));
+            if (info)
+                *info |= SANE_INFO_INEXACT;
+        }
+    }
+    o->dirty = 1;
+    if (info)
+        *info |= SANE_INFO_RELOAD_PARAMS;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status sane_brscand_get_parameters(SANE_Handle h, SANE_Parameters *p)
+{
+    SHIM *s = h;
+    char line[BRSCAND_LINE];
+    if (s->in) {
+        *p = s->p;
+        return SANE_STATUS_GOOD;
+    }
+    SANE_Status st = job_open(s, "PARAMS");
+    if (st == SANE_STATUS_GOOD)
+        st = job_go(s);
+    if (st == SANE_STATUS_GOOD) {
+        if (!read_line(s, line, sizeof(line)))
+            st = SANE_STATUS_IO_ERROR;
+        else if (!read_params(line, "P", p))
+            st = reply_error(line);
+    }
+    job_close(s);
+    return st;
+}
+
+SANE_Status sane_brscand_start(SANE_Handle h)
+{
+    SHIM *s = h;
+    char line[BRSCAND_LINE] = "";
+    SANE_Status st;
+
+    if (s->in && s->frame_done && !s->p.last_frame) {
+        /* next frame of the same job */
+        s->frame_done = 0;
+    } else {
+        st = job_open(s, "SCAN");
+        if (st == SANE_STATUS_GOOD)
+            st = job_go(s);
+        if (st != SANE_STATUS_GOOD) {
+            job_close(s);
+            return st;
+        }
+    }
+    if (!read_line(s, line, sizeof(line)) ||
+        !read_params(line, "FRAME", &s->p)) {
+        st = reply_error(line);
+        job_close(s);
+        return st;
+    }
+    s->remaining = 0;
+    return SANE_STATUS_GOOD;
+}
+
+SANE_Status sane_brscand_read(SANE_Handle h, SANE_Byte *buf, SANE_Int max,
+                              SANE_Int *len)
+{
+    SHIM *s = h;
+    char line[BRSCAND_LINE];
+    *len = 0;
+    if (!s->in)
+        return SANE_STATUS_CANCELLED;
+    if (s->frame_done)
+        return SANE_STATUS_EOF;
+    while (s->remaining == 0) {
+        int n, st;
+        if (!read_line(s, line, sizeof(line))) {
+            job_close(s);
+            return SANE_STATUS_IO_ERROR;
+        }
+        if (sscanf(line, "DATA %d", &n) == 1 && n > 0 && n <= BRSCAND_CHUNK) {
+            s->remaining = n;
+        } else if (sscanf(line, "END %d", &st) == 1) {
+            s->frame_done = 1;
+            if (st != SANE_STATUS_EOF || s->p.last_frame)
+                job_close(s);
+            return (SANE_Status)st == SANE_STATUS_GOOD ? SANE_STATUS_EOF
+                                                       : (SANE_Status)st;
+        } else {
+            job_close(s);
+            return SANE_STATUS_IO_ERROR;
+        }
+    }
+    int n = max < s->remaining ? max : s->remaining;
+    if (n <= 0)
+        return SANE_STATUS_GOOD;
+    if (fread(buf, 1, (size_t)n, s->in) != (size_t)n) {
+        job_close(s);
+        return SANE_STATUS_IO_ERROR;
+    }
+    s->remaining -= n;
+    *len = n;
+    return SANE_STATUS_GOOD;
+}
+
+void sane_brscand_cancel(SANE_Handle h)
+{
+    /* closing the connection makes the daemon cancel the scan */
+    job_close(h);
+}
+
+SANE_Status sane_brscand_set_io_mode(SANE_Handle h, SANE_Bool non_blocking)
+{
+    (void)h;
+    return non_blocking ? SANE_STATUS_UNSUPPORTED : SANE_STATUS_GOOD;
+}
+
+SANE_Status sane_brscand_get_select_fd(SANE_Handle h, SANE_Int *fd)
+{
+    (void)h;
+    (void)fd;
+    return SANE_STATUS_UNSUPPORTED;
+}
+
+SANE_String_Const sane_brscand_strstatus(SANE_Status st)
+{
+    static const char *const text[] = {
+        "Success", "Operation not supported", "Operation was cancelled",
+        "Device busy", "Invalid argument", "End of file reached",
+        "Document feeder jammed", "Document feeder out of documents",
+        "Scanner cover is open", "Error during device I/O", "Out of memory",
+        "Access to resource has been denied"
+    };
+    if ((unsigned)st < sizeof(text) / sizeof(text[0]))
+        return text[st];
+    return "Unknown SANE status code";
+}
+
+/* Plain sane_* names too, for frontends that load the backend directly */
+#define ALIAS(f) __attribute__((alias("sane_brscand_" #f)))
+SANE_Status sane_init(SANE_Int *, SANE_Auth_Callback) ALIAS(init);
+void sane_exit(void) ALIAS(exit);
+SANE_Status sane_get_devices(const SANE_Device ***, SANE_Bool)
+    ALIAS(get_devices);
+SANE_Status sane_open(SANE_String_Const, SANE_Handle *) ALIAS(open);
+void sane_close(SANE_Handle) ALIAS(close);
+const SANE_Option_Descriptor *sane_get_option_descriptor(SANE_Handle, SANE_Int)
+    ALIAS(get_option_descriptor);
+SANE_Status sane_control_option(SANE_Handle, SANE_Int, SANE_Action, void *,
+                                SANE_Int *) ALIAS(control_option);
+SANE_Status sane_get_parameters(SANE_Handle, SANE_Parameters *)
+    ALIAS(get_parameters);
+SANE_Status sane_start(SANE_Handle) ALIAS(start);
+SANE_Status sane_read(SANE_Handle, SANE_Byte *, SANE_Int, SANE_Int *)
+    ALIAS(read);
+void sane_cancel(SANE_Handle) ALIAS(cancel);
+SANE_Status sane_set_io_mode(SANE_Handle, SANE_Bool) ALIAS(set_io_mode);
+SANE_Status sane_get_select_fd(SANE_Handle, SANE_Int *) ALIAS(get_select_fd);
+SANE_String_Const sane_strstatus(SANE_Status) ALIAS(strstatus);
@@ -0,0 +1,479 @@
+/*
+ * scandec_bench — replay scan decoder traces at full CPU speed
+ *
+ * Times the decode path without the scanner: a trace captured with
+ * BROTHER_TRACE=<file> (format in scandec_trace.h) is loaded into memory
+ * and fed through ScanDecOpen/ScanDecWrite/ScanDecPageEnd/ScanDecClose
+ * as the backend called them, optionally followed by ColorMatching() on
+ * colour lines, as often as asked.  The best run is reported as lines/s
+ * and ns per input byte, with the allocations made while decoding and a
+ * hash of the output, so two builds of the decoder can be compared on
+ * the same data.  BROTHER_* settings (BROTHER_SIMD, BROTHER_BATCH_LINES,
+ * BROTHER_PIPELINE, BROTHER_BW_DITHER, ...) apply as in a real scan.
+ *
+ * Without a captured trace, -g writes a synthetic one: a text page of
+ * PackBits lines with white margins, in colour, True Gray or B&W at a
+ * given resolution.
+ *
+ * Build, next to the stubs:
+ *   gcc -O2 -o scandec_bench scandec_bench.c scandec_stubs.c \
+ *       brcolor_stubs.c -lpthread
+ *
+ * Usage:
+ *   scandec_bench [-n runs] [-l lutname] trace...
+ *   scandec_bench -g colour|gray|bw [-d dpi] [-p lines] out.trace
+ *
+ * Copyright: 2026, based on Brother brscan2-src-0.2.5-1 API
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "scandec_trace.h"
+
+typedef int            BOOL;
+typedef int            INT;
+typedef unsigned char  BYTE;
+typedef unsigned long  DWORD;
+typedef void          *HANDLE;
+typedef char          *LPSTR;
+
+typedef struct {
+    INT   nInResoX, nInResoY, nOutResoX, nOutResoY, nColorType;
+    DWORD dwInLinePixCnt;
+    INT   nOutDataKind;
+    BOOL  bLongBoundary;
+    DWORD dwOutLinePixCnt, dwOutLineByte, dwOutWriteMaxSize;
+} SCANDEC_OPEN;
+
+typedef struct {
+    INT   nInDataComp, nInDataKind;
+    BYTE *pLineData;
+    DWORD dwLineDataSize;
+    BYTE *pWriteBuff;
+    DWORD dwWriteBuffSize;
+    BOOL  bReverWrite;
+} SCANDEC_WRITE;
+
+#pragma pack(1)
+typedef struct {
+    int   nRgbLine, nPaperType, nMachineId;
+    LPSTR lpLutName;
+} CMATCH_INIT;
+#pragma pack()
+
+BOOL  ScanDecOpen(SCANDEC_OPEN *p);
+void  ScanDecSetTblHandle(HANDLE h1, HANDLE h2);
+BOOL  ScanDecPageStart(void);
+DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st);
+DWORD ScanDecPageEnd(SCANDEC_WRITE *w, INT *st);
+BOOL  ScanDecClose(void);
+BOOL  ColorMatchingInit(CMATCH_INIT d);
+void  ColorMatchingEnd(void);
+BOOL  ColorMatching(BYTE *d, long len, long cnt);
+
+#define SC_2BIT  (0x01 << 8)
+#define SC_8BIT  (0x02 << 8)
+#define SC_24BIT (0x04 << 8)
+#define SCIDC_WHITE 1
+#define SCIDC_PACK  3
+
+/* Allocation counting while decoding (also in the decode worker) */
+extern void *__libc_malloc(size_t);
+extern void *__libc_calloc(size_t, size_t);
+extern void *__libc_realloc(void *, size_t);
+static int g_counting = 0;
+static unsigned long g_allocs = 0;
+
+void *malloc(size_t n)
+{
+    if (g_counting) __atomic_fetch_add(&g_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_malloc(n);
+}
+
+void *calloc(size_t n, size_t size)
+{
+    if (g_counting) __atomic_fetch_add(&g_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_calloc(n, size);
+}
+
+void *realloc(void *p, size_t n)
+{
+    if (g_counting) __atomic_fetch_add(&g_allocs, 1, __ATOMIC_RELAXED);
+    return __libc_realloc(p, n);
+}
+
+static double now_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/* --- Replay --- */
+
+typedef struct {
+    BYTE  *data;
+    size_t size;
+    unsigned sessions, pages, writes;
+    unsigned long long bytes_in;        /* ScanDecWrite payload */
+    TRACE_OPEN_ARGS first;              /* of the first session */
+} TRACE;
+
+/* Load and check a whole trace; 0 with a message when it is unusable */
+static int load_trace(const char *path, TRACE *t)
+{
+    memset(t, 0, sizeof(*t));
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    t->data = size > 0 ? (BYTE *)malloc(size) : NULL;
+    if (!t->data || fread(t->data, size, 1, f) != 1) {
+        fprintf(stderr, "%s: cannot read\n", path);
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+    t->size = size;
+
+    const TRACE_HEADER *h = (const TRACE_HEADER *)t->data;
+    if (t->size < sizeof(*h) || memcmp(h->magic, TRACE_MAGIC, 8) ||
+        h->version != TRACE_VERSION) {
+        fprintf(stderr, "%s: not a version %d scan decoder trace\n",
+                path, TRACE_VERSION);
+        return 0;
+    }
+    size_t pos = sizeof(*h);
+    while (pos + sizeof(TRACE_RECORD) <= t->size) {
+        const TRACE_RECORD *r = (const TRACE_RECORD *)(t->data + pos);
+        if (r->size > t->size - pos - sizeof(*r))
+            break;
+        if (r->type == TRACE_OPEN) {
+            if (r->size != sizeof(TRACE_OPEN_ARGS))
+                break;
+            if (!t->sessions)
+                memcpy(&t->first, r + 1, sizeof(t->first));
+            t->sessions++;
+        } else if (r->type == TRACE_WRITE) {
+            t->writes++;
+            t->bytes_in += r->size;
+        } else if (r->type == TRACE_PAGE_END) {
+            t->pages++;
+        }
+        pos += sizeof(*r) + r->size;
+    }
+    if (pos != t->size)
+        fprintf(stderr, "%s: ignoring %zu bytes of truncated trace\n",
+                path, t->size - pos);
+    t->size = pos;
+    if (!t->sessions) {
+        fprintf(stderr, "%s: no session in trace\n", path);
+        return 0;
+    }
+    return 1;
+}
+
+typedef struct {
+    double ms, colour_ms;
+    unsigned long lines;
+    unsigned long allocs;
+    unsigned hash;                      /* FNV-1a of the output */
+} RUN;
+
+static void fnv1a(unsigned *h, const BYTE *p, size_t n)
+{
+    for (size_t i = 0; i < n; i++)
+        *h = (*h ^ p[i]) * 16777619u;
+}
+
+/* Handle the lines one ScanDecWrite/ScanDecPageEnd call returned */
+static void take_lines(RUN *run, BYTE *buf, DWORD bytes, INT lines,
+                       const SCANDEC_OPEN *op, int colour)
+{
+    if (lines <= 0 || !bytes)
+        return;
+    if (colour) {
+        double t0 = now_ms();
+        ColorMatching(buf, (long)op->dwOutLineByte, lines);
+        run->colour_ms += now_ms() - t0;
+    }
+    run->lines += lines;
+    fnv1a(&run->hash, buf, bytes);
+}
+
+static void replay(const TRACE *t, const char *lut, RUN *run)
+{
+    SCANDEC_OPEN op;
+    BYTE *buf = NULL;
+    int colour = 0;
+    INT st;
+
+    memset(run, 0, sizeof(*run));
+    run->hash = 2166136261u;
+    size_t pos = sizeof(TRACE_HEADER);
+    double t0 = now_ms();
+    while (pos < t->size) {
+        const TRACE_RECORD *r = (const TRACE_RECORD *)(t->data + pos);
+        BYTE *payload = (BYTE *)(r + 1);
+        pos += sizeof(*r) + r->size;
+
+        switch (r->type) {
+        case TRACE_OPEN: {
+            const TRACE_OPEN_ARGS *a = (const TRACE_OPEN_ARGS *)payload;
+            memset(&op, 0, sizeof(op));
+            op.nInResoX = a->nInResoX;
+            op.nInResoY = a->nInResoY;
+            op.nOutResoX = a->nOutResoX;
+            op.nOutResoY = a->nOutResoY;
+            op.nColorType = a->nColorType;
+            op.dwInLinePixCnt = a->dwInLinePixCnt;
+            op.nOutDataKind = a->nOutDataKind;
+            op.bLongBoundary = a->bLongBoundary;
+            if (!ScanDecOpen(&op))
+                break;
+            free(buf);
+            buf = (BYTE *)malloc(op.dwOutWriteMaxSize);
+            colour = lut && (op.nColorType & SC_24BIT);
+            if (colour) {
+                CMATCH_INIT ci = { (int)op.dwOutLinePixCnt, 1, 1, (LPSTR)lut };
+                ColorMatchingInit(ci);
+            }
+            break;
+        }
+        case TRACE_TABLES:
+            ScanDecSetTblHandle(r->a ? payload : NULL,
+                                r->b ? payload + 256 : NULL);
+            break;
+        case TRACE_PAGE_START:
+            ScanDecPageStart();
+            break;
+        case TRACE_WRITE:
+        case TRACE_PAGE_END: {
+            if (!buf)
+                break;
+            SCANDEC_WRITE w = { r->a, r->b, payload, r->size, buf,
+                                op.dwOutWriteMaxSize, 0 };
+            g_counting = 1;
+            DWORD n = r->type == TRACE_WRITE ? ScanDecWrite(&w, &st)
+                                             : ScanDecPageEnd(&w, &st);
+            g_counting = 0;
+            take_lines(run, buf, n, st, &op, colour);
+            break;
+        }
+        case TRACE_CLOSE:
+            ScanDecClose();
+            if (colour)
+                ColorMatchingEnd();
+            colour = 0;
+            free(buf);
+            buf = NULL;
+            break;
+        }
+    }
+    run->ms = now_ms() - t0;
+    run->allocs = g_allocs;
+    g_allocs = 0;
+    if (buf) {
+        ScanDecClose();
+        free(buf);
+    }
+}
+
+static const char *mode_name(int colortype)
+{
+    return colortype & SC_24BIT ? "24-bit RGB" :
+           colortype & SC_8BIT  ? "8-bit gray" : "1-bit B&W";
+}
+
+static int bench(const char *path, int runs, const char *lut)
+{
+    TRACE t;
+    if (!load_trace(path, &t)) {
+        free(t.data);
+        return 0;
+    }
+    RUN best, run;
+    replay(&t, lut, &best);
+    for (int i = 1; i < runs; i++) {
+        replay(&t, lut, &run);
+        if (run.hash != best.hash)
+            fprintf(stderr, "%s: run %d produced different output\n", path, i + 1);
+        if (run.ms < best.ms)
+            best = run;
+    }
+    printf("%s: %u session%s, %u page%s, %u writes, %.1f MB in\n", path,
+           t.sessions, t.sessions == 1 ? "" : "s",
+           t.pages, t.pages == 1 ? "" : "s", t.writes, t.bytes_in / 1048576.0);
+    printf("  %s, %u px, %dx%d -> %dx%d dpi\n", mode_name(t.first.nColorType),
+           t.first.dwInLinePixCnt, t.first.nInResoX, t.first.nInResoY,
+           t.first.nOutResoX, t.first.nOutResoY);
+    printf("  best of %d: %.2f ms, %lu lines, %.0f lines/s, %.2f ns/byte, "
+           "%lu allocations while decoding, output %08x\n",
+           runs, best.ms, best.lines,
+           best.ms > 0 ? best.lines * 1000.0 / best.ms : 0,
+           t.bytes_in ? best.ms * 1e6 / t.bytes_in : 0,
+           best.allocs, best.hash);
+    if (lut)
+        printf("  colour matching: %.2f ms of that\n", best.colour_ms);
+    free(t.data);
+    return 1;
+}
+
+/* --- Synthetic traces --- */
+
+static unsigned g_rnd = 1;
+
+static unsigned rnd(void)
+{
+    g_rnd = g_rnd * 1103515245 + 12345;
+    return g_rnd >> 8;
+}
+
+/* PackBits-encode px bytes of src into dst */
+static DWORD pack_line(const BYTE *src, DWORD px, BYTE *dst)
+{
+    DWORD i = 0, n = 0;
+    while (i < px) {
+        DWORD r = 1;
+        while (i + r < px && r < 128 && src[i + r] == src[i])
+            r++;
+        if (r >= 2) {
+            dst[n++] = (BYTE)(1 - (int)r);
+            dst[n++] = src[i];
+            i += r;
+            continue;
+        }
+        DWORD l = 1;
+        while (i + l < px && l < 128 &&
+               !(i + l + 1 < px && src[i + l] == src[i + l + 1]))
+            l++;
+        dst[n++] = (BYTE)(l - 1);
+        memcpy(dst + n, src + i, l);
+        n += l;
+        i += l;
+    }
+    return n;
+}
+
+static void put_rec(FILE *f, unsigned type, int a, int b, const void *p,
+                    unsigned size)
+{
+    TRACE_RECORD r = { type, size, a, b };
+    fwrite(&r, sizeof(r), 1, f);
+    if (size)
+        fwrite(p, size, 1, f);
+}
+
+/*
+ * A letter page: 1/2 inch white margins, then text rows of a 1/6 inch
+ * pitch with 1/10 inch tall strokes on light, slightly noisy paper.
+ * Blank lines are sent as SCIDC_WHITE, like the scanner does.
+ */
+static int make_trace(const char *path, const char *kind, int dpi, int lines)
+{
+    int colortype = !strcmp(kind, "colour") ? SC_24BIT | 0x02 :
+                    !strcmp(kind, "gray")   ? SC_8BIT :
+                    !strcmp(kind, "bw")     ? SC_2BIT | 0x01 : 0;
+    if (!colortype || dpi < 50 || dpi > 1200) {
+        fprintf(stderr, "-g takes colour, gray or bw, -d 50..1200\n");
+        return 0;
+    }
+    DWORD px = (DWORD)dpi * 85 / 10;
+    if (lines <= 0)
+        lines = dpi * 11;
+    int planes = colortype & SC_24BIT ? 3 : 1;
+    int margin = dpi / 2, pitch = dpi / 6, stroke = dpi / 10;
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        perror(path);
+        return 0;
+    }
+    TRACE_HEADER h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, TRACE_MAGIC, 8);
+    h.version = TRACE_VERSION;
+    fwrite(&h, sizeof(h), 1, f);
+    TRACE_OPEN_ARGS a = { dpi, dpi, dpi, dpi, colortype, (unsigned)px, 1, 0 };
+    put_rec(f, TRACE_OPEN, 0, 0, &a, sizeof(a));
+    put_rec(f, TRACE_PAGE_START, 0, 0, NULL, 0);
+
+    BYTE *line = (BYTE *)malloc(px), *comp = (BYTE *)malloc(px * 2 + 16);
+    for (int y = 0; y < lines; y++) {
+        int text = y >= margin && y < lines - margin && (y - margin) % pitch < stroke;
+        for (int c = 0; c < planes; c++) {
+            int kind_in = planes == 3 ? 2 + c : 1;
+            if (!text) {
+                put_rec(f, TRACE_WRITE, SCIDC_WHITE, kind_in, NULL, 0);
+                continue;
+            }
+            for (DWORD x = 0; x < px; x++)
+                line[x] = (BYTE)(0xF0 + rnd() % 12);
+            for (DWORD x = margin; x + margin < px; ) {
+                DWORD word = 10 + rnd() % (dpi / 3), gap = dpi / 25 + 1;
+                for (DWORD k = 0; k < word && x + k + margin < px; k++)
+                    if (rnd() % 3)
+                        line[x + k] = (BYTE)(0x20 + rnd() % 48 + 12 * c);
+                x += word + gap;
+            }
+            DWORD n = pack_line(line, px, comp);
+            put_rec(f, TRACE_WRITE, SCIDC_PACK, kind_in, comp, (unsigned)n);
+        }
+    }
+    put_rec(f, TRACE_PAGE_END, 0, 0, NULL, 0);
+    put_rec(f, TRACE_CLOSE, 0, 0, NULL, 0);
+    free(line);
+    free(comp);
+    if (fclose(f) != 0) {
+        perror(path);
+        return 0;
+    }
+    printf("%s: %s, %lu px x %d lines at %d dpi\n", path, mode_name(colortype),
+           (unsigned long)px, lines, dpi);
+    return 1;
+}
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: scandec_bench [-n runs] [-l lutname] trace...\n"
+            "       scandec_bench -g colour|gray|bw [-d dpi] [-p lines] out.trace\n");
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 5, dpi = 300, lines = 0, opt;
+    const char *lut = NULL, *gen = NULL;
+
+    while ((opt = getopt(argc, argv, "n:l:g:d:p:")) != -1) {
+        switch (opt) {
+        case 'n': runs = atoi(optarg); break;
+        case 'l': lut = optarg; break;
+        case 'g': gen = optarg; break;
+        case 'd': dpi = atoi(optarg); break;
+        case 'p': lines = atoi(optarg); break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind >= argc || runs < 1) {
+        usage();
+        return 2;
+    }
+    if (gen)
+        return make_trace(argv[optind], gen, dpi, lines) ? 0 : 1;
+    if (getenv("BROTHER_TRACE")) {
+        fprintf(stderr, "unset BROTHER_TRACE: the replay would be captured\n");
+        return 2;
+    }
+
+    int ok = 1;
+    for (int i = optind; i < argc; i++)
+        ok &= bench(argv[i], runs, lut);
+    return ok ? 0 : 1;
+}
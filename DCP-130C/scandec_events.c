@@ -0,0 +1,207 @@
+/*
+ * scandec_events — print a scan decoder event dump
+ *
+ * Reads the ring that scandec_stubs.c writes to BROTHER_EVENTS=<file> at
+ * ScanDecClose(), on SIGUSR2 or on a crash (format in scandec_events.h)
+ * and prints each event with its time since the first one, followed by
+ * a summary: write gaps, per-line decode time and time in each call.
+ * -s prints only the summary.
+ *
+ * Build, next to the stubs:
+ *   gcc -O2 -o scandec_events scandec_events.c
+ *
+ * Usage:
+ *   scandec_events [-s] dump
+ *
+ * Copyright: 2026, based on Brother brscan2-src-0.2.5-1 API
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "scandec_events.h"
+
+/* Running count, mean and maximum of one quantity */
+typedef struct {
+    unsigned long n;
+    double        sum, max;
+} STAT;
+
+static void stat_add(STAT *s, double v)
+{
+    s->n++;
+    s->sum += v;
+    if (v > s->max)
+        s->max = v;
+}
+
+static double stat_mean(const STAT *s)
+{
+    return s->n ? s->sum / s->n : 0;
+}
+
+static const char *comp_name(unsigned comp)
+{
+    switch (comp) {
+    case 1:  return "white";
+    case 2:  return "noncomp";
+    case 3:  return "pack";
+    default: return "unknown";
+    }
+}
+
+static const char *kind_name(unsigned kind)
+{
+    switch (kind) {
+    case 2:  return " red";
+    case 3:  return " green";
+    case 4:  return " blue";
+    default: return "";
+    }
+}
+
+static const char *lines_word(unsigned n)
+{
+    return n == 1 ? "line" : "lines";
+}
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: scandec_events [-s] dump\n");
+}
+
+int main(int argc, char **argv)
+{
+    int summary_only = 0, opt;
+
+    while ((opt = getopt(argc, argv, "s")) != -1) {
+        switch (opt) {
+        case 's': summary_only = 1; break;
+        default: usage(); return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage();
+        return 2;
+    }
+    const char *path = argv[optind];
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        perror(path);
+        return 1;
+    }
+    EV_HEADER h;
+    if (fread(&h, sizeof(h), 1, f) != 1 ||
+        memcmp(h.magic, EV_MAGIC, sizeof(h.magic)) != 0 ||
+        h.version != EV_VERSION || h.entry_size != sizeof(EV_ENTRY)) {
+        fprintf(stderr, "%s: not a version %d scan decoder event dump\n",
+                path, EV_VERSION);
+        fclose(f);
+        return 1;
+    }
+    EV_ENTRY *ev = h.count ? malloc((size_t)h.count * sizeof(EV_ENTRY)) : NULL;
+    if (h.count && !ev) {
+        fprintf(stderr, "%s: no memory for %u events\n", path, h.count);
+        fclose(f);
+        return 1;
+    }
+    size_t n = h.count ? fread(ev, sizeof(EV_ENTRY), h.count, f) : 0;
+    fclose(f);
+    if (n < h.count)
+        fprintf(stderr, "%s: dump ends after %zu of %u events\n",
+                path, n, h.count);
+
+    printf("%s: %zu events", path, n);
+    if (h.first)
+        printf(" (%llu older ones overwritten)", (unsigned long long)h.first);
+    printf(", ring of %u\n", h.capacity);
+    if (!n) {
+        free(ev);
+        return 0;
+    }
+    uint64_t t0 = ev[0].ts;
+    time_t start = (time_t)((h.real_base + (t0 - h.mono_base)) / 1000000000u);
+    struct tm tm;
+    localtime_r(&start, &tm);
+    printf("  first event at %04d-%02d-%02d %02d:%02d:%02d\n",
+           tm.tm_year + 1900, tm.tm_mon + 1, tm.tm_mday,
+           tm.tm_hour, tm.tm_min, tm.tm_sec);
+
+    STAT gap = {0, 0, 0}, decode = {0, 0, 0}, call = {0, 0, 0};
+    unsigned long writes = 0, returned = 0, long_gaps = 0, pages = 0;
+    unsigned long sessions = 0;
+    uint64_t last_write = 0;
+    for (size_t i = 0; i < n; i++) {
+        const EV_ENTRY *e = &ev[i];
+        double ms = (double)(e->ts - t0) / 1e6;
+        if (!summary_only)
+            printf("%12.3f ms  ", ms);
+        switch (e->type) {
+        case EV_OPEN:
+            sessions++;
+            last_write = 0;
+            if (!summary_only)
+                printf("open      colour type 0x%04x, %u px\n", e->a, e->b);
+            break;
+        case EV_PAGE_START:
+            if (!summary_only)
+                printf("page %u start\n", e->b);
+            break;
+        case EV_WRITE:
+            writes++;
+            if (last_write)
+                stat_add(&gap, (double)(e->ts - last_write) / 1e6);
+            last_write = e->ts;
+            if (!summary_only)
+                printf("write     %s%s, %u bytes\n", comp_name(e->a >> 8),
+                       kind_name(e->a & 0xFF), e->b);
+            break;
+        case EV_GAP:
+            long_gaps++;
+            if (!summary_only)
+                printf("gap       %.1f ms since the previous write\n",
+                       e->b / 1000.0);
+            break;
+        case EV_DECODE:
+            if (e->a)
+                stat_add(&decode, e->b / 1000.0);
+            if (!summary_only)
+                printf("decode    %u %s, %.1f us\n", e->a, lines_word(e->a),
+                       e->b / 1000.0);
+            break;
+        case EV_RETURN:
+            returned += e->a;
+            stat_add(&call, e->b / 1000.0);
+            if (!summary_only)
+                printf("return    %u %s, %.1f us\n", e->a, lines_word(e->a),
+                       e->b / 1000.0);
+            break;
+        case EV_PAGE_END:
+            pages++;
+            if (!summary_only)
+                printf("page %u end\n", e->b);
+            break;
+        case EV_CLOSE:
+            if (!summary_only)
+                printf("close\n");
+            break;
+        default:
+            if (!summary_only)
+                printf("event %u (%u, %u)\n", e->type, e->a, e->b);
+            break;
+        }
+    }
+
+    printf("summary: %lu session(s), %lu page(s), %lu writes, "
+           "%lu lines returned over %.1f ms\n", sessions, pages, writes,
+           returned, (double)(ev[n - 1].ts - t0) / 1e6);
+    printf("  write gap:  mean %.3f ms, max %.1f ms, %lu over %d ms\n",
+           stat_mean(&gap), gap.max, long_gaps, EV_GAP_US / 1000);
+    printf("  decode:     %lu lines, mean %.1f us, max %.1f us\n",
+           decode.n, stat_mean(&decode), decode.max);
+    printf("  call:       %lu calls, mean %.1f us, max %.1f us\n",
+           call.n, stat_mean(&call), call.max);
+    free(ev);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Scan decoder event dumps: written by scandec_stubs.c from its event
+ * ring when BROTHER_EVENTS names a file, printed by scandec_events.c.
+ *
+ * A dump is an EV_HEADER followed by count EV_ENTRY records, oldest
+ * first, native-endian.  first is the sequence number of the oldest
+ * entry: events before it were overwritten when the ring wrapped.
+ * Timestamps are CLOCK_MONOTONIC nanoseconds; mono_base/real_base were
+ * read together when the ring was set up, for conversion to wall-clock
+ * time.  Per event type:
+ *
+ *   type            a                        b
+ *   EV_OPEN         nColorType               dwInLinePixCnt
+ *   EV_PAGE_START   -                        page number (from 1)
+ *   EV_WRITE        nInDataComp << 8 | Kind  dwLineDataSize
+ *   EV_GAP          -                        us since the previous write
+ *   EV_DECODE       output lines completed   ns decoding one scanner line
+ *   EV_RETURN       lines returned           ns in the call
+ *   EV_PAGE_END     -                        page number
+ *   EV_CLOSE        -                        -
+ *
+ * EV_GAP is only recorded for gaps over EV_GAP_US.  EV_RETURN follows
+ * each ScanDecWrite() and ScanDecPageEnd(); with BROTHER_PIPELINE=1 the
+ * decode worker records EV_DECODE, so it may come after the EV_RETURN
+ * of its write.
+ */
+#ifndef SCANDEC_EVENTS_H
+#define SCANDEC_EVENTS_H
+
+#include <stdint.h>
+
+#define EV_MAGIC   "BRSCEVT1"
+#define EV_VERSION 1
+#define EV_GAP_US  100000
+
+typedef struct {
+    char     magic[8];
+    uint32_t version;
+    uint32_t entry_size;        /* sizeof(EV_ENTRY) */
+    uint32_t capacity;          /* ring slots */
+    uint32_t count;             /* entries that follow */
+    uint64_t first;             /* sequence number of the first entry */
+    uint64_t mono_base;         /* CLOCK_MONOTONIC ns ... */
+    uint64_t real_base;         /* ... and CLOCK_REALTIME ns, same instant */
+} EV_HEADER;
+
+enum {
+    EV_OPEN = 1,
+    EV_PAGE_START,
+    EV_WRITE,
+    EV_GAP,
+    EV_DECODE,
+    EV_RETURN,
+    EV_PAGE_END,
+    EV_CLOSE
+};
+
+typedef struct {
+    uint64_t ts;                /* CLOCK_MONOTONIC ns */
+    uint16_t type;
+    uint16_t a;                 /* see above */
+    uint32_t b;
+} EV_ENTRY;
+
+#endif /* SCANDEC_EVENTS_H */
@@ -11,25 +11,83 @@
  * Output format must match what SANE expects (set by brother2.c
  * sane_get_parameters):
  *   SC_2BIT  modes (BW/ED): 1-bit packed, (pixels+7)/8 bytes/line
+ *                           (threshold, Bayer or error-diffused)
  *   SC_8BIT  modes (TG/256): 8-bit gray, pixels bytes/line
  *   SC_24BIT modes (FUL):    24-bit RGB, pixels*3 bytes/line
  *
+ * When nOutResoX/Y differ from nInResoX/Y, lines are resampled to the
+ * output resolution on the way through (see "Resolution scaling").
+ * BROTHER_ENCODE=1 also streams each page as JPEG or G4 (see
+ * "Compressed output"); build with -DHAVE_LIBJPEG -ljpeg for JPEG.
+ *
+ * PackBits decoding and RGB plane interleaving have NEON paths (ARMv7
+ * with NEON, and all AArch64) selected at load time, with portable scalar
+ * fallbacks.  Set BROTHER_SIMD=0 to force the scalar kernels (e.g. to
+ * compare decode_ms).
+ *
+ * ScanDecCtxOpen() and the other ScanDecCtx*() calls run independent
+ * decode sessions side by side behind a handle; the original ScanDec*()
+ * calls drive a default session (see "Sessions").
+ *
+ * BROTHER_TRACE=<file> records every call for replay by scandec_bench.
+ * BROTHER_EVENTS=<file> keeps a binary ring of timed events, dumped at
+ * close or on SIGUSR2 and printed by scandec_events (see "Event ring").
+ *
  * Debug diagnostics: set BROTHER_DEBUG=1 to enable timing and statistics
  * output on stderr.  Useful for diagnosing CPU usage and scanning pauses.
+ * The same statistics are collected, without output, while a
+ * brother_exporter segment exists (see brother_stats.h).
  *
  * Copyright: 2026, based on Brother brscan2-src-0.2.5-1 API
  */
 #include <string.h>
 #include <stdlib.h>
 #include <signal.h>
+#include <errno.h>
 #include <unistd.h>
 #include <stdio.h>
 #include <time.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "scandec_trace.h"
+#include "scandec_events.h"
+#include "brother_stats.h"
+#ifdef HAVE_LIBJPEG
+#include <setjmp.h>
+#include <jpeglib.h>
+#include <jerror.h>
+#endif
+
+/*
+ * NEON support.  On AArch64 Advanced SIMD is mandatory.  On 32-bit ARM the
+ * library is normally built for the distro baseline (Raspbian: ARMv6+VFP,
+ * no NEON), so the NEON functions are compiled with a per-function target
+ * attribute and only called after checking HWCAP_NEON at runtime.
+ * GCC >= 8 lets arm_neon.h be included without -mfpu=neon for this.
+ */
+#if defined(__aarch64__)
+#include <arm_neon.h>
+#define SCANDEC_HAVE_NEON 1
+#define SCANDEC_NEON_FN
+#elif defined(__arm__) && defined(__ARM_FP) && (__GNUC__ >= 8)
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#ifndef HWCAP_NEON
+#define HWCAP_NEON (1 << 12)
+#endif
+#define SCANDEC_HAVE_NEON 1
+#define SCANDEC_NEON_FN __attribute__((target("fpu=neon")))
+#endif
+
+static int ev_dump(void);
 
 /* SIGSEGV handler: write crash info to stderr before dying */
 static void scandec_segfault_handler(int sig) {
     const char msg[] = "\n[SCANDEC] FATAL: Segmentation fault (SIGSEGV) in scan backend!\n";
     write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    ev_dump();
     struct sigaction sa;
     sa.sa_handler = SIG_DFL;
     sigemptyset(&sa.sa_mask);
@@ -40,6 +98,9 @@ static void scandec_segfault_handler(int sig) {
 
 /* Debug diagnostics — enabled by BROTHER_DEBUG=1 environment variable */
 static int g_debug = 0;
+static BRSTATS *g_brstats = NULL;
+/* Serialises what sessions share: event and stats setup, event dumps */
+static pthread_mutex_t g_setup_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static double timespec_ms(struct timespec *ts) {
     return ts->tv_sec * 1000.0 + ts->tv_nsec / 1e6;
@@ -50,23 +111,135 @@ static double elapsed_ms(struct timespec *start, struct timespec *end) {
 }
 
 /*
- * Format current wall-clock time as "HH:MM:SS.mmm" into a static buffer.
- * Returns pointer to the static buffer (not thread-safe, fine for debug).
+ * Format current wall-clock time as "HH:MM:SS.mmm" into a per-thread
+ * buffer and return it.  localtime_r() is only called when the second
+ * changes.
  */
 static const char *debug_ts(void) {
-    static char buf[16];
+    static __thread char buf[16];
+    static __thread time_t last_sec = -1;
+    static __thread struct tm tm;
     struct timespec ts;
     clock_gettime(CLOCK_REALTIME, &ts);
-    struct tm tm;
-    localtime_r(&ts.tv_sec, &tm);
+    if (ts.tv_sec != last_sec) {
+        localtime_r(&ts.tv_sec, &tm);
+        last_sec = ts.tv_sec;
+    }
     snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%03d",
              tm.tm_hour, tm.tm_min, tm.tm_sec,
              (int)(ts.tv_nsec / 1000000));
     return buf;
 }
 
+/*
+ * Latency histograms for the session summary, log-linear in the style of
+ * HdrHistogram.  Values are nanoseconds.  Below HIST_SUB each value has
+ * its own bucket; above it every power of two is split into HIST_SUB
+ * buckets, so a bucket is at most 1/16 of its value wide (about 6%).
+ * Adding a sample is a count-leading-zeros and an increment into a fixed
+ * array, with no allocation.  HIST_POWERS powers of two reach 18 minutes.
+ */
+#define HIST_SUB_BITS 4
+#define HIST_SUB      (1u << HIST_SUB_BITS)
+#define HIST_POWERS   40
+#define HIST_BUCKETS  ((HIST_POWERS - HIST_SUB_BITS + 1) * HIST_SUB)
+
+typedef struct {
+    unsigned count[HIST_BUCKETS];
+    unsigned long n;
+    uint64_t sum, max;
+} LAT_HIST;
+
+static inline void hist_add(LAT_HIST *h, uint64_t v)
+{
+    unsigned i;
+    if (v >= (1ull << HIST_POWERS))
+        v = (1ull << HIST_POWERS) - 1;
+    if (v < HIST_SUB) {
+        i = (unsigned)v;
+    } else {
+        unsigned e = 63 - (unsigned)__builtin_clzll(v) - HIST_SUB_BITS;
+        i = (e + 1) * HIST_SUB + (unsigned)(v >> e) - HIST_SUB;
+    }
+    h->count[i]++;
+    h->n++;
+    h->sum += v;
+    if (v > h->max)
+        h->max = v;
+}
+
+/* Lowest and highest value counted in bucket i */
+static uint64_t hist_low(unsigned i)
+{
+    if (i < HIST_SUB)
+        return i;
+    unsigned e = i / HIST_SUB - 1;
+    return (uint64_t)(i % HIST_SUB + HIST_SUB) << e;
+}
+
+static uint64_t hist_high(unsigned i)
+{
+    return i < HIST_SUB ? i : hist_low(i) + (1ull << (i / HIST_SUB - 1)) - 1;
+}
+
+/*
+ * Smallest value that pct percent of the samples do not exceed, to
+ * bucket precision: the top of the bucket holding that rank, capped at
+ * the largest sample.
+ */
+static uint64_t hist_percentile(const LAT_HIST *h, double pct)
+{
+    if (!h->n)
+        return 0;
+    double want = pct / 100.0 * (double)h->n;
+    unsigned long rank = (unsigned long)want;
+    if (rank < want || rank == 0)
+        rank++;
+    unsigned long seen = 0;
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        seen += h->count[i];
+        if (seen >= rank)
+            return hist_high(i) < h->max ? hist_high(i) : h->max;
+    }
+    return h->max;
+}
+
+/* One summary line: percentiles of h in units of unit_ns */
+static void hist_print(const char *label, const LAT_HIST *h,
+                       double unit_ns, const char *unit, const char *what)
+{
+    fprintf(stderr,
+            "[SCANDEC]   %-14s p50 %.3f  p90 %.3f  p99 %.3f  p99.9 %.3f  "
+            "max %.3f %s (%lu %s)\n", label,
+            hist_percentile(h, 50) / unit_ns, hist_percentile(h, 90) / unit_ns,
+            hist_percentile(h, 99) / unit_ns, hist_percentile(h, 99.9) / unit_ns,
+            h->max / unit_ns, unit, h->n, what);
+}
+
+/* h as a JSON object: count, max and percentiles in ns, then the
+ * non-empty buckets as [low, high, count] */
+static void hist_json(FILE *f, const char *name, const LAT_HIST *h)
+{
+    fprintf(f, "\"%s\": {\"count\": %lu, \"max\": %llu, \"p50\": %llu, "
+            "\"p90\": %llu, \"p99\": %llu, \"p999\": %llu, \"buckets\": [",
+            name, h->n, (unsigned long long)h->max,
+            (unsigned long long)hist_percentile(h, 50),
+            (unsigned long long)hist_percentile(h, 90),
+            (unsigned long long)hist_percentile(h, 99),
+            (unsigned long long)hist_percentile(h, 99.9));
+    const char *sep = "";
+    for (unsigned i = 0; i < HIST_BUCKETS; i++) {
+        if (!h->count[i])
+            continue;
+        fprintf(f, "%s[%llu, %llu, %u]", sep, (unsigned long long)hist_low(i),
+                (unsigned long long)hist_high(i), h->count[i]);
+        sep = ", ";
+    }
+    fprintf(f, "]}");
+}
+
 /* Scan statistics for debug reporting */
-static struct {
+typedef struct {
     unsigned long lines_total;
     unsigned long lines_white;
     unsigned long lines_noncomp;
@@ -75,37 +248,33 @@ static struct {
     unsigned long bytes_in;
     unsigned long bytes_out;
     unsigned long rgb_planes;
-    double        decode_ms;     /* total time in decode_packbits */
+    unsigned long pages;
+    double        decode_ms;     /* total time in PackBits decode */
     double        convert_ms;    /* total time in gray8_to_1bit */
     double        write_ms;      /* total time in ScanDecWrite */
     struct timespec open_time;   /* when ScanDecOpen was called */
     struct timespec last_write;  /* timestamp of last ScanDecWrite */
-    struct timespec last_progress; /* timestamp of last progress report */
     double        max_gap_ms;    /* longest gap between writes */
     double        max_write_ms;  /* longest single ScanDecWrite call */
     double        first_data_ms; /* latency from Open to first Write (scanner warm-up) */
+    LAT_HIST      gap_hist;     /* gaps between writes, after the first */
+    LAT_HIST      line_hist;    /* write-to-line time, as write_ms */
     int           got_first;     /* flag: have we received first Write yet? */
     unsigned long gaps_over_100; /* gaps > 100 ms */
     unsigned long gaps_over_1s;  /* gaps > 1 second */
     unsigned long gaps_over_5s;  /* gaps > 5 seconds */
+    unsigned long batch_reads;  /* batched returns (BROTHER_BATCH_LINES) */
+    unsigned long batch_lines;  /* lines handed back in those returns */
+    unsigned long batch_dropped; /* lines still pending at close */
+    unsigned long pipe_lines;   /* lines returned by the decode worker */
+    unsigned      pipe_max_inflight; /* most jobs + lines queued at once */
+    double        pipe_wait_ms; /* caller time blocked on the worker */
+    unsigned long pipe_rejected; /* lines longer than a job slot */
+    double        scale_ms;     /* time resampling to the output resolution */
+    unsigned long scale_dropped; /* scaled lines never returned */
     const char   *mode_name;    /* scan mode for summary (e.g. "24-bit RGB") */
     int           mode_bpp;     /* bytes per pixel (3=color, 1=gray, 0=bw) */
-} g_stats;
-
-__attribute__((constructor))
-static void scandec_init(void) {
-    struct sigaction sa;
-    sa.sa_handler = scandec_segfault_handler;
-    sigemptyset(&sa.sa_mask);
-    sa.sa_flags = 0;
-    sigaction(SIGSEGV, &sa, NULL);
-
-    const char *env = getenv("BROTHER_DEBUG");
-    if (env && env[0] == '1') {
-        g_debug = 1;
-        fprintf(stderr, "%s [SCANDEC] debug diagnostics enabled (BROTHER_DEBUG=1)\n", debug_ts());
-    }
-}
+} SCANDEC_STATS;
 
 typedef int            BOOL;
 typedef int            INT;
@@ -125,6 +294,9 @@ typedef void          *HANDLE;
 #define SC_2BIT  (0x01 << 8)   /* 1-bit B&W output */
 #define SC_8BIT  (0x02 << 8)   /* 8-bit grayscale output */
 #define SC_24BIT (0x04 << 8)   /* 24-bit RGB output */
+#define SC_BW    (0x01 | SC_2BIT)  /* B&W, fixed threshold */
+#define SC_ED    (0x02 | SC_2BIT)  /* B&W, error diffusion */
+#define SC_DTH   (0x04 | SC_2BIT)  /* B&W, dither pattern */
 
 typedef struct {
     INT   nInResoX;
@@ -151,26 +323,334 @@ typedef struct {
     BOOL  bReverWrite;
 } SCANDEC_WRITE;
 
-static SCANDEC_OPEN g_open;
-static int g_bpp = 0;  /* bytes per pixel for the output format */
+/* Decode worker state, see pipe_worker() */
+typedef struct {
+    INT   nInDataComp;
+    INT   nInDataKind;
+    DWORD dwLineDataSize;
+    BYTE *pLineData;            /* job_cap bytes inside job_mem */
+    int   completes;            /* the last input of an output line */
+} PIPE_JOB;
+
+/*
+ * Per-session state.  Everything one decode session owns lives in a
+ * SCANDEC_CTX, so several sessions can run side by side, each on its own
+ * thread (see "Sessions").  Every function that touches a session takes
+ * it as sd: the ScanDecCtx*() entry points pass their handle, the decode
+ * worker its session, and the original ScanDec*() calls g_sd_default.
+ * Settings read from the environment, the SIMD kernels, the event ring
+ * and the stats segment stay process-wide.
+ */
+typedef struct {
+    DWORD dwLines;              /* output lines so far this page */
+    DWORD dwWhiteLines;         /* of which white */
+    DWORD dwWhiteRuns;          /* runs of consecutive white lines */
+    DWORD dwLongestRun;         /* longest run ... */
+    DWORD dwLongestRunStart;    /* ... and its first line */
+    DWORD dwTopMargin;          /* white lines before the first ink */
+    DWORD dwBottomMargin;       /* white lines after the last ink */
+    BOOL  bBlankPage;           /* no line carries real content */
+} SCANDEC_PAGE_INFO;
+
+typedef void (*SCANDEC_WHITE_RUN_CB)(DWORD dwFirstLine, DWORD dwLines,
+                                     void *pCtx);
+
+typedef BOOL (*SCANDEC_ENC_SINK)(const BYTE *pData, DWORD dwSize, void *pCtx);
+
+struct SCANDEC_CTX;
+typedef int (*LINE_FN)(struct SCANDEC_CTX *sd, const SCANDEC_WRITE *w,
+                       BYTE *dst, DWORD outLine, DWORD pixelsPerLine,
+                       struct timespec *t_start);
+typedef DWORD (*DECODE_FN)(struct SCANDEC_CTX *sd, const SCANDEC_WRITE *w,
+                           BYTE *dst, DWORD room, struct timespec *t_start);
+typedef void (*BW_FN)(struct SCANDEC_CTX *sd, const BYTE *gray, DWORD n,
+                      DWORD px, BYTE *packed);
+typedef DWORD (*INK_FN)(const BYTE *line, DWORD px);
+
+typedef struct SCANDEC_CTX {
+    unsigned      id;           /* 0 = default session, else handle number */
+    SCANDEC_OPEN  params;
+    int           bpp;          /* bytes per pixel for the output format */
+    /* statistics are collected: BROTHER_DEBUG=1, or a stats segment */
+    int           stats_on;
+    int           brstats_open; /* session counted in scan_active */
+    SCANDEC_STATS stats;
+
+    /* Colour planes, see "Color plane assembly" */
+    BYTE         *plane_buf;    /* R, G, B rows, then the white row */
+    BYTE         *white_row;
+    DWORD         plane_stride; /* bytes per plane, 64-aligned */
+    int           planes_kept;  /* input planes stay put until blue */
+    const BYTE   *plane_src[3]; /* R, G, B data for the line */
+    DWORD         plane_pixels;
+    int           have_red;
+    int           have_green;
+
+    /* Multi-line output, see "Multi-line output" */
+    DWORD         batch_max;    /* lines per return, 0 = off */
+    BYTE         *batch_buf;    /* caller's buffer holding the pending lines */
+    DWORD         batch_count;  /* lines pending there */
+    BYTE         *spill;        /* lines the caller had no room for yet */
+    DWORD         spill_max;
+    DWORD         spill_count;
+    int           page_done;    /* page ended, only the spill is left */
+
+    /* Decode worker, see pipe_worker() */
+    struct {
+        int             running;
+        int             stop;
+        pthread_t       thread;
+        pthread_mutex_t lock;
+        pthread_cond_t  cond;       /* job queued, job finished, or stop */
+        unsigned        max_lines;  /* in-flight bound + 1 (see "Pipelined decode") */
+        PIPE_JOB       *job;        /* job_slots slots */
+        unsigned        job_slots;  /* max_lines + 2, see pipe_start() */
+        BYTE           *job_mem;
+        DWORD           job_cap;
+        unsigned        job_head, job_count;
+        unsigned        owed;       /* queued or busy jobs that complete a line */
+        int             busy;       /* worker is decoding job[job_head - 1] */
+        BYTE           *out;        /* max_lines output lines */
+        unsigned        out_head, out_count;
+    } pipe;
+
+    /* Fused tone table, see ScanDecSetTblHandle() */
+    BYTE          tone[256];
+    int           tone_on;
+
+    /* 1-bit engine, see "Line-streaming B&W engines" */
+    int           bw_mode;
+    BW_FN         bw_fn;        /* g_bw_fns[bw_mode] */
+    BYTE         *bw_gray;      /* one decoded gray line */
+    int          *bw_err;       /* 3 error rows of px + 2*margin */
+    int          *bw_row[3];    /* current, next, next-but-one */
+    DWORD         bw_pixels;
+    unsigned      bw_line;      /* lines since page start */
+    int           bw_window;
+    BYTE         *bw_ring;      /* bw_window rows of gray */
+    unsigned     *bw_colsum;    /* per column: sum of ring rows */
+    unsigned     *bw_colsq;     /* ... and of their squares */
+
+    /* White runs and blank pages */
+    DWORD         line_ink;     /* ink in the last decoded line, or INK_UNCOUNTED */
+    INK_FN        ink_fn;       /* blank_line()'s count for the output format */
+    SCANDEC_PAGE_INFO page;
+    DWORD         run_start, run_len;
+    unsigned long long page_ink, page_px;
+    SCANDEC_WHITE_RUN_CB run_cb;
+    DWORD         run_cb_min;
+    void         *run_cb_ctx;
+
+    uint64_t      ev_last_write; /* time of the previous EV_WRITE */
+    uint32_t      ev_page;
+    FILE         *trace;        /* BROTHER_TRACE, see ctx_path() */
+
+    /* Compressed output */
+    struct {
+        int set;                            /* ScanDecSetEncoder() was called */
+        int on, quality;                    /* enabled, JPEG quality 1..100 */
+        SCANDEC_ENC_SINK sink;              /* API sink, else a file */
+        void *ctx;
+        int kind;                           /* ENC_* of the open page */
+        int failed;                         /* page given up on */
+        int fd;
+        unsigned page;                      /* number of the open page file */
+        DWORD px, lines;
+        BYTE *buf;                          /* compressed bytes not yet sunk */
+        size_t len, cap;
+        unsigned bits; int nbits;           /* G4 bit writer */
+        BYTE *ref, *cur;                    /* G4 lines, 1 = black */
+        BYTE *last;                         /* JPEG: last line, for padding */
+        unsigned long page_out;             /* bytes sunk for this page */
+        unsigned long pages, bytes_in, bytes_out;
+        double ms;
+    } enc;
+#ifdef HAVE_LIBJPEG
+    struct jpeg_compress_struct jpg;
+    struct {
+        struct jpeg_error_mgr pub;
+        jmp_buf jb;
+    } jpg_err;
+    struct jpeg_destination_mgr jpg_dest;
+#endif
+
+    /* Progressive delivery, see ctx_path() */
+    struct {
+        int fd;
+        BYTE *map;
+        size_t size;
+        struct PRV_HEADER *h;
+        int open;                           /* a page is being published */
+        unsigned page;
+        DWORD line;                         /* output line within the page */
+        unsigned *acc;                      /* preview sums, one per sample */
+        unsigned long bands;
+    } prv;
+
+    /* Resolution scaling */
+    struct {
+        int             on;
+        int             ch;               /* bytes per pixel: 1 gray, 3 RGB */
+        DWORD           in_px, out_px;
+        long long       in_y, out_y;      /* vertical resolutions, equal = copy */
+        DWORD           max_up;           /* most output lines per input line */
+        BYTE           *row;              /* decoded line, in_px + ntap pixels */
+        BYTE           *hrow[2];          /* scaled rows: current, previous */
+        BYTE           *line;             /* output line being emitted */
+        unsigned       *acc;              /* box sums of the pending output line */
+        unsigned        ntap;             /* taps per output pixel, 0 = copy */
+        DWORD          *tap_first;        /* first input pixel per output pixel */
+        unsigned short *tap_w;            /* ntap weights per output pixel */
+        unsigned long   in_lines;         /* this page */
+        unsigned long   out_lines;        /* this page, including dropped ones */
+    } scale;
+
+    const LINE_FN *line_fns;    /* line handlers, by nInDataComp */
+    DECODE_FN     decode;       /* decode_line() copy */
+    int           ready;        /* open: the above follow the settings */
+    /* ScanDecWrite() copy */
+    DWORD (*write)(struct SCANDEC_CTX *, SCANDEC_WRITE *, INT *);
+} SCANDEC_CTX;
+
+static SCANDEC_CTX g_sd_default;
+
+static void ctx_init(SCANDEC_CTX *c);
+
+/*
+ * The file a BROTHER_* setting names, for this session: the name itself
+ * for the default session, "<name>.<id>" for a handle, so sessions side
+ * by side do not write over each other's trace or preview.
+ */
+static const char *ctx_path(const SCANDEC_CTX *sd, const char *name,
+                            char *buf, size_t size)
+{
+    if (!sd->id)
+        return name;
+    snprintf(buf, size, "%s.%u", name, sd->id);
+    return buf;
+}
 
 /* Color plane assembly for 24-bit RGB mode.
  * The scanner sends separate R, G, B planes (nInDataKind 2,3,4).
  * We buffer each plane and only emit interleaved RGB when all three
- * planes for a line have been received. */
-static BYTE *g_red_plane = NULL;
-static BYTE *g_green_plane = NULL;
-static BYTE *g_blue_plane = NULL;
-static DWORD g_plane_pixels = 0;
-static int g_have_red = 0;
-static int g_have_green = 0;
+ * planes for a line have been received.
+ *
+ * A line is assembled in one cache-line aligned block, allocated by
+ * ScanDecOpen and kept until ScanDecClose, so the allocator is never
+ * touched while scanning.  It holds R, G and B rows at a 64-byte aligned
+ * stride; PackBits planes decode straight into their row.  Planes that
+ * need no decoding are not copied at all: white planes point at a shared
+ * all-0xFF row and a full uncompressed blue plane (the last one of a
+ * line) is interleaved directly from the caller's buffer.  Full
+ * uncompressed red and green planes are read where they lie only in the
+ * pipeline's job slots, which stay put until their blue plane arrives
+ * (planes_kept).  Callers may refill their buffer between calls (the
+ * backend reuses one USB read buffer for all three planes), so they are
+ * copied everywhere else. */
+#define PLANE_ALIGN 64
+
+/* Row for plane c (0=R, 1=G, 2=B) */
+static inline BYTE *plane_row(SCANDEC_CTX *sd, int c)
+{
+    return sd->plane_buf + (DWORD)c * sd->plane_stride;
+}
+
+static void free_planes(SCANDEC_CTX *sd)
+{
+    free(sd->plane_buf);
+    sd->plane_buf = NULL;
+    sd->white_row = NULL;
+    sd->plane_stride = 0;
+    sd->plane_pixels = 0;
+    sd->have_red = 0;
+    sd->have_green = 0;
+}
+
+/*
+ * Multi-line output (BROTHER_BATCH_LINES=N, N > 1).  Decoded lines are
+ * handed back up to N at a time, capped by dwOutWriteMaxSize and the
+ * caller's dwWriteBuffSize, with *st set to the number of lines
+ * returned.  Each line is decoded straight into pWriteBuff at the
+ * running offset and left there, pending, while calls return 0; the
+ * caller passes the same buffer until lines come back (pending lines
+ * are moved over if it does not).  Lines the caller's buffer has no
+ * room for wait in sd->spill and come back first on the following
+ * calls, so ScanDecPageEnd() drains what it cannot return over the
+ * ScanDecPageEnd() calls after it.  Default is one line per call, as the
+ * original library did.
+ */
+static int   g_batch_env = 1;         /* lines per return requested */
+static int   g_pipeline_env = 0;      /* BROTHER_PIPELINE=1 */
+
+/*
+ * 1-bit rendering engines.  SC_BW scans threshold, SC_ED scans use
+ * Floyd-Steinberg error diffusion and SC_DTH scans an 8x8 Bayer
+ * pattern; BROTHER_BW_DITHER=threshold|bayer|fs|jarvis|bradley|sauvola
+ * overrides the choice for every 1-bit mode, BROTHER_BW_THRESHOLD sets
+ * the fixed threshold level (default 128) and BROTHER_BW_WINDOW the
+ * adaptive window in pixels (default 1/4 inch).
+ */
+enum { BW_THRESHOLD, BW_BAYER, BW_FS, BW_JARVIS, BW_BRADLEY, BW_SAUVOLA };
+#define BW_ENGINES 6
+static const char *const g_bw_names[BW_ENGINES] = {
+    "threshold", "bayer", "fs", "jarvis", "bradley", "sauvola"
+};
+static int   g_bw_env = -1;           /* BROTHER_BW_DITHER, -1 = by mode */
+static int   g_bw_level = 128;        /* BROTHER_BW_THRESHOLD */
+static int   g_bw_window_env = 0;     /* BROTHER_BW_WINDOW, 0 = by dpi */
+
+/* Compressed output, see "Compressed output" */
+static int   g_enc_env = 0;           /* BROTHER_ENCODE=1 */
+static int   g_enc_quality_env = 0;   /* BROTHER_ENCODE_QUALITY, 0 = default */
+static const char *g_enc_out_env = NULL;  /* BROTHER_ENCODE_OUT */
+static unsigned g_enc_pages = 0;      /* page files started, all sessions */
+
+/* Trace capture, see "Trace capture" */
+static const char *g_trace_env = NULL;    /* BROTHER_TRACE */
+
+/* Event ring, see "Event ring" */
+static const char *g_ev_env = NULL;       /* BROTHER_EVENTS */
+static unsigned long g_ev_size_env = 0;   /* BROTHER_EVENTS_SIZE, 0 = default */
+
+/* Progressive delivery, see "Progressive delivery" */
+static const char *g_prv_env = NULL;  /* BROTHER_PREVIEW */
+static int   g_prv_band_env = 64;     /* BROTHER_PREVIEW_BAND */
+
+/* Latency histograms as JSON, see stats_json() */
+static const char *g_stats_json_env = NULL;  /* BROTHER_STATS_JSON */
+
+static int   pipe_start(SCANDEC_CTX *sd, const SCANDEC_OPEN *p);
+static void  pipe_stop(SCANDEC_CTX *sd);
+static void  pipe_wait_idle(SCANDEC_CTX *sd);
+static DWORD pipe_flush(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st);
+static void  select_line_handlers(SCANDEC_CTX *sd, int ready);
+
+/* Allocate the plane rows for lines of 'pixels' bytes per plane */
+static int alloc_planes(SCANDEC_CTX *sd, DWORD pixels)
+{
+    void *mem;
+    DWORD stride = (pixels + PLANE_ALIGN - 1) & ~(DWORD)(PLANE_ALIGN - 1);
+
+    free_planes(sd);
+    if (stride == 0)
+        stride = PLANE_ALIGN;
+    if (posix_memalign(&mem, PLANE_ALIGN, stride * 4) != 0)
+        return 0;
+    sd->plane_buf = (BYTE *)mem;
+    sd->plane_stride = stride;
+    sd->plane_pixels = pixels;
+    memset(sd->plane_buf, 0, stride * 3);
+    sd->white_row = sd->plane_buf + stride * 3;
+    memset(sd->white_row, 0xFF, stride);
+    return 1;
+}
 
 /*
  * PackBits decompression (TIFF/Apple standard)
  * Returns number of bytes written to output.
  */
-static DWORD decode_packbits(const BYTE *in, DWORD inLen,
-                              BYTE *out, DWORD outMax)
+static DWORD decode_packbits_scalar(const BYTE *in, DWORD inLen,
+                                    BYTE *out, DWORD outMax)
 {
     DWORD iP = 0, oP = 0;
     while (iP < inLen && oP < outMax) {
@@ -197,372 +677,3331 @@ static DWORD decode_packbits(const BYTE *in, DWORD inLen,
     return oP;
 }
 
+#ifdef SCANDEC_HAVE_NEON
 /*
- * Convert 8-bit grayscale data to 1-bit packed (for B&W modes).
- * Threshold: pixel >= 128 → white (1), else black (0).
- * MSB first within each byte.
+ * NEON PackBits decompression.
+ *
+ * Runs and literals on scanner data are short (typically 2-20 bytes), so
+ * the scalar decoder spends most of its time in memcpy/memset call
+ * overhead.  Here every run or literal is written as whole 16-byte
+ * vectors whenever both buffers have room: a literal may copy up to 15
+ * bytes beyond its end, and a run may fill up to 15 bytes beyond its end.
+ * Those bytes always lie ahead of oP, so the next control byte overwrites
+ * them.  Only bytes past the returned length can be left dirty — callers
+ * must treat [return value, outMax) as undefined, exactly as for a short
+ * input line with the scalar decoder.
  */
-static void gray8_to_1bit(const BYTE *gray, DWORD nPixels,
-                           BYTE *packed, DWORD packedSize)
+SCANDEC_NEON_FN
+static DWORD decode_packbits_neon(const BYTE *in, DWORD inLen,
+                                  BYTE *out, DWORD outMax)
 {
-    memset(packed, 0, packedSize);
-    for (DWORD i = 0; i < nPixels; i++) {
-        if (gray[i] >= 128) {
-            packed[i / 8] |= (0x80 >> (i % 8));
+    DWORD iP = 0, oP = 0;
+    while (iP < inLen && oP < outMax) {
+        signed char n = (signed char)in[iP++];
+        if (n >= 0) {
+            DWORD c = (DWORD)(n + 1);
+            DWORD span = (c + 15) & ~15UL;
+            if (iP + span <= inLen && oP + span <= outMax) {
+                for (DWORD k = 0; k < span; k += 16)
+                    vst1q_u8(out + oP + k, vld1q_u8(in + iP + k));
+            } else {
+                if (iP + c > inLen) c = inLen - iP;
+                if (oP + c > outMax) c = outMax - oP;
+                memcpy(out + oP, in + iP, c);
+            }
+            iP += c;
+            oP += c;
+        } else if (n != -128) {
+            DWORD c = (DWORD)(1 - n);
+            if (iP >= inLen) break;
+            BYTE v = in[iP++];
+            DWORD span = (c + 15) & ~15UL;
+            if (oP + span <= outMax) {
+                uint8x16_t vv = vdupq_n_u8(v);
+                for (DWORD k = 0; k < span; k += 16)
+                    vst1q_u8(out + oP + k, vv);
+            } else {
+                if (oP + c > outMax) c = outMax - oP;
+                memset(out + oP, v, c);
+            }
+            oP += c;
         }
     }
+    return oP;
 }
+#endif
 
-BOOL ScanDecOpen(SCANDEC_OPEN *p)
-{
-    if (!p) return FALSE;
-
-    /* Reset statistics */
-    memset(&g_stats, 0, sizeof(g_stats));
-    clock_gettime(CLOCK_MONOTONIC, &g_stats.open_time);
-    g_stats.last_write = g_stats.open_time;
-    g_stats.last_progress = g_stats.open_time;
-
-    p->dwOutLinePixCnt = p->dwInLinePixCnt;
+/*
+ * Ink for blank-page detection (blank_line()): pixels darker than
+ * BLANK_INK_LEVEL in any channel.  The interleave kernels count it as
+ * they write each colour pixel.
+ */
+#define BLANK_INK_LEVEL 128
+#define INK_UNCOUNTED   ((DWORD)-1)   /* line_ink: blank_line() counts */
 
-    /*
-     * Determine output bytes per line based on color type.
-     * Must match sane_get_parameters() in brother2.c:
-     *   SC_2BIT  → depth=1, bytes_per_line = (pixels+7)/8
-     *   SC_8BIT  → depth=8, bytes_per_line = pixels
-     *   SC_24BIT → depth=8, bytes_per_line = pixels*3
-     */
-    if (p->nColorType & SC_24BIT) {
-        g_bpp = 3;
-        p->dwOutLineByte = p->dwOutLinePixCnt * 3;
-    } else if (p->nColorType & SC_8BIT) {
-        g_bpp = 1;
-        p->dwOutLineByte = p->dwOutLinePixCnt;
-    } else {
-        g_bpp = 0;
-        p->dwOutLineByte = (p->dwOutLinePixCnt + 7) / 8;
+/*
+ * Planar to pixel-interleaved RGB: out[3i..3i+2] = r[i], g[i], b[i].
+ * Returns the number of ink pixels.
+ */
+static DWORD interleave_rgb_scalar(const BYTE *r, const BYTE *g,
+                                   const BYTE *b, BYTE *out, DWORD n)
+{
+    DWORD dark = 0;
+    for (DWORD i = 0; i < n; i++) {
+        out[0] = r[i];
+        out[1] = g[i];
+        out[2] = b[i];
+        /* | rather than || keeps the loop free of branches */
+        dark += (r[i] < BLANK_INK_LEVEL) | (g[i] < BLANK_INK_LEVEL) |
+                (b[i] < BLANK_INK_LEVEL);
+        out += 3;
     }
+    return dark;
+}
 
-    /* Store mode info for summary diagnostics */
-    g_stats.mode_bpp = g_bpp;
-    g_stats.mode_name = (g_bpp == 3) ? "24-bit RGB" :
-                        (g_bpp == 1) ? "8-bit gray" : "1-bit B&W";
-
-    if (p->bLongBoundary)
-        p->dwOutLineByte = (p->dwOutLineByte + 3) & ~3UL;
-
-    p->dwOutWriteMaxSize = p->dwOutLineByte * 16;
-
-    memcpy(&g_open, p, sizeof(*p));
-
-    /* Allocate plane buffers for 24-bit color mode */
-    free(g_red_plane);   g_red_plane = NULL;
-    free(g_green_plane); g_green_plane = NULL;
-    free(g_blue_plane);  g_blue_plane = NULL;
-    g_have_red = 0;
-    g_have_green = 0;
-    if (g_bpp == 3) {
-        g_plane_pixels = p->dwInLinePixCnt;
-        g_red_plane   = (BYTE *)calloc(g_plane_pixels, 1);
-        g_green_plane = (BYTE *)calloc(g_plane_pixels, 1);
-        g_blue_plane  = (BYTE *)calloc(g_plane_pixels, 1);
-        if (!g_red_plane || !g_green_plane || !g_blue_plane) {
-            free(g_red_plane);   g_red_plane = NULL;
-            free(g_green_plane); g_green_plane = NULL;
-            free(g_blue_plane);  g_blue_plane = NULL;
-            return FALSE;
-        }
+#ifdef SCANDEC_HAVE_NEON
+/* NEON interleave: one vst3q_u8 stores 16 RGB pixels (48 bytes); ink
+ * pixels are counted as 0/1 bytes summed into four 32-bit lanes */
+SCANDEC_NEON_FN
+static DWORD interleave_rgb_neon(const BYTE *r, const BYTE *g,
+                                 const BYTE *b, BYTE *out, DWORD n)
+{
+    const uint8x16_t level = vdupq_n_u8(BLANK_INK_LEVEL);
+    uint32x4_t dark = vdupq_n_u32(0);
+    DWORD i = 0;
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x3_t v;
+        v.val[0] = vld1q_u8(r + i);
+        v.val[1] = vld1q_u8(g + i);
+        v.val[2] = vld1q_u8(b + i);
+        vst3q_u8(out + i * 3, v);
+        uint8x16_t m = vorrq_u8(vorrq_u8(vcltq_u8(v.val[0], level),
+                                         vcltq_u8(v.val[1], level)),
+                                vcltq_u8(v.val[2], level));
+        dark = vpadalq_u16(dark, vpaddlq_u8(vshrq_n_u8(m, 7)));
     }
+    DWORD tail = interleave_rgb_scalar(r + i, g + i, b + i, out + i * 3, n - i);
+    return vgetq_lane_u32(dark, 0) + vgetq_lane_u32(dark, 1) +
+           vgetq_lane_u32(dark, 2) + vgetq_lane_u32(dark, 3) + tail;
+}
+#endif
 
-    if (g_debug) {
-        fprintf(stderr, "%s [SCANDEC] ScanDecOpen: %lux%lu px, reso %dx%d→%dx%d, "
-                "mode=%s, outLine=%lu bytes\n",
-                debug_ts(),
-                (unsigned long)p->dwInLinePixCnt,
-                (unsigned long)p->dwOutLinePixCnt,
-                p->nInResoX, p->nInResoY,
-                p->nOutResoX, p->nOutResoY,
-                g_stats.mode_name, (unsigned long)p->dwOutLineByte);
+/*
+ * Tone tables from ScanDecSetTblHandle(): h1 and h2 each point at a
+ * 256-entry BYTE table (gamma, brightness/contrast) or are NULL.  They
+ * are fused into sd->tone[v] = h2[h1[v]] when the handles are set, and the
+ * lookup is folded into the 8-bit decode paths below so every output
+ * byte is mapped once, while the line is still in cache.  An identity
+ * result leaves sd->tone_on clear and the plain kernels in use.
+ */
+/* PackBits decode with the tone lookup fused in: a repeat run costs
+ * one lookup, a literal one per byte */
+static DWORD decode_packbits_tone(const BYTE *tone, const BYTE *in, DWORD inLen,
+                                  BYTE *out, DWORD outMax)
+{
+    DWORD iP = 0, oP = 0;
+    while (iP < inLen && oP < outMax) {
+        signed char n = (signed char)in[iP++];
+        if (n >= 0) {
+            DWORD c = (DWORD)(n + 1);
+            if (iP + c > inLen) c = inLen - iP;
+            if (oP + c > outMax) c = outMax - oP;
+            for (DWORD k = 0; k < c; k++)
+                out[oP + k] = tone[in[iP + k]];
+            iP += c;
+            oP += c;
+        } else if (n != -128) {
+            DWORD c = (DWORD)(1 - n);
+            if (iP >= inLen) break;
+            BYTE v = tone[in[iP++]];
+            if (oP + c > outMax) c = outMax - oP;
+            memset(out + oP, v, c);
+            oP += c;
+        }
     }
-
-    return TRUE;
+    return oP;
 }
 
-void ScanDecSetTblHandle(HANDLE h1, HANDLE h2)
+/* Uncompressed copy through the tone table */
+static void copy_tone(const BYTE *tone, const BYTE *in, BYTE *out, DWORD n)
 {
-    (void)h1;
-    (void)h2;
+    for (DWORD i = 0; i < n; i++)
+        out[i] = tone[in[i]];
 }
 
-BOOL ScanDecPageStart(void)
+/* Interleave with the tone table applied to all three channels; ink is
+ * counted on the mapped values */
+static DWORD interleave_rgb_tone(const BYTE *tone, const BYTE *r, const BYTE *g,
+                                 const BYTE *b, BYTE *out, DWORD n)
 {
-    return TRUE;
+    DWORD dark = 0;
+    for (DWORD i = 0; i < n; i++) {
+        out[0] = tone[r[i]];
+        out[1] = tone[g[i]];
+        out[2] = tone[b[i]];
+        dark += (out[0] < BLANK_INK_LEVEL) | (out[1] < BLANK_INK_LEVEL) |
+                (out[2] < BLANK_INK_LEVEL);
+        out += 3;
+    }
+    return dark;
 }
 
-DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st)
-{
-    struct timespec t_start, t_end;
-    if (g_debug)
-        clock_gettime(CLOCK_MONOTONIC, &t_start);
+typedef DWORD (*PACKBITS_FN)(const BYTE *, DWORD, BYTE *, DWORD);
+typedef DWORD (*INTERLEAVE_FN)(const BYTE *, const BYTE *, const BYTE *,
+                               BYTE *, DWORD);
 
-    if (!w || !w->pLineData || !w->pWriteBuff) {
-        if (st) *st = -1;
-        return 0;
-    }
+/* Active SIMD kernels, chosen once by select_decoders() */
+static PACKBITS_FN   g_decode_packbits = decode_packbits_scalar;
+static INTERLEAVE_FN g_interleave_rgb  = interleave_rgb_scalar;
+static const char   *g_decode_name = "scalar";
 
-    DWORD outLine = g_open.dwOutLineByte;
-    if (outLine == 0 || outLine > w->dwWriteBuffSize) {
-        if (st) *st = 0;
-        return 0;
+/*
+ * Pick the fastest kernels this CPU supports.  BROTHER_SIMD=0 forces the
+ * scalar path so decode_ms can be compared on the same machine.
+ */
+static void select_decoders(void)
+{
+    const char *env = getenv("BROTHER_SIMD");
+    if (env && env[0] == '0')
+        return;
+#ifdef SCANDEC_HAVE_NEON
+#if defined(__aarch64__)
+    int have_neon = 1;
+#else
+    int have_neon = (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+    if (have_neon) {
+        g_decode_packbits = decode_packbits_neon;
+        g_interleave_rgb  = interleave_rgb_neon;
+        g_decode_name = "neon";
     }
+#endif
+}
 
-    if (g_debug) {
-        /* Track gap between consecutive writes (inter-call latency) */
-        double gap = elapsed_ms(&g_stats.last_write, &t_start);
-        if (gap > g_stats.max_gap_ms)
-            g_stats.max_gap_ms = gap;
-        /* Gap histogram: count long gaps for pattern analysis */
-        if (gap > 5000.0) g_stats.gaps_over_5s++;
-        else if (gap > 1000.0) g_stats.gaps_over_1s++;
-        else if (gap > 100.0) g_stats.gaps_over_100++;
-        /* First-data latency (scanner warm-up time) */
-        if (!g_stats.got_first) {
-            g_stats.first_data_ms = elapsed_ms(&g_stats.open_time, &t_start);
-            g_stats.got_first = 1;
-        }
-        g_stats.last_write = t_start;
-        g_stats.bytes_in += w->dwLineDataSize;
+/*
+ * Decode one PackBits line and zero whatever the input did not cover, so a
+ * short line yields the same output from every decoder.  With tone set,
+ * the tone table is applied on the way (colour planes leave that to the
+ * interleave).  Accumulates decode_ms with stats set.
+ */
+static inline __attribute__((always_inline))
+DWORD decode_packbits_line(SCANDEC_CTX *sd, const BYTE *in, DWORD inLen,
+                           BYTE *out, DWORD outMax, const int tone,
+                           const int stats)
+{
+    struct timespec t0, t1;
+    if (stats)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    DWORD n = tone
+            ? decode_packbits_tone(sd->tone, in, inLen, out, outMax)
+            : g_decode_packbits(in, inLen, out, outMax);
+    if (n < outMax)
+        memset(out + n, 0, outMax - n);
+    if (stats) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sd->stats.decode_ms += elapsed_ms(&t0, &t1);
     }
+    return n;
+}
 
-    /*
-     * 24-bit color mode: the scanner sends separate R, G, B planes
-     * (nInDataKind 2=Red, 3=Green, 4=Blue). Buffer each plane and
-     * only emit a pixel-interleaved RGB line when all three are received.
-     */
-    if (g_bpp == 3 && g_red_plane && g_green_plane && g_blue_plane
-        && w->nInDataKind >= 2 && w->nInDataKind <= 4)
-    {
-        if (g_debug) g_stats.rgb_planes++;
-
-        BYTE *planeBuf;
-        switch (w->nInDataKind) {
-        case 2:  planeBuf = g_red_plane;   g_have_red = 1;   break;
-        case 3:  planeBuf = g_green_plane; g_have_green = 1;  break;
-        default: planeBuf = g_blue_plane;                      break;
-        }
-
-        switch (w->nInDataComp) {
-        case SCIDC_WHITE:
-            if (g_debug) g_stats.lines_white++;
-            memset(planeBuf, 0xFF, g_plane_pixels);
-            break;
-        case SCIDC_NONCOMP: {
-            if (g_debug) g_stats.lines_noncomp++;
-            DWORD cpLen = w->dwLineDataSize;
-            if (cpLen > g_plane_pixels) cpLen = g_plane_pixels;
-            memcpy(planeBuf, w->pLineData, cpLen);
-            if (cpLen < g_plane_pixels)
-                memset(planeBuf + cpLen, 0, g_plane_pixels - cpLen);
-            break;
-        }
-        case SCIDC_PACK:
-            if (g_debug) g_stats.lines_pack++;
-            decode_packbits(w->pLineData, w->dwLineDataSize,
-                            planeBuf, g_plane_pixels);
-            break;
-        default: {
-            if (g_debug) g_stats.lines_unknown++;
-            DWORD cpLen = w->dwLineDataSize;
-            if (cpLen > g_plane_pixels) cpLen = g_plane_pixels;
-            memcpy(planeBuf, w->pLineData, cpLen);
-            break;
-        }
-        }
+__attribute__((constructor))
+static void scandec_init(void) {
+    ctx_init(&g_sd_default);
 
-        /* If this is not the Blue plane, or we're missing a plane, buffer only */
-        if (w->nInDataKind != 4 || !g_have_red || !g_have_green) {
-            if (st) *st = 0;
-            return 0;
-        }
+    struct sigaction sa;
+    sa.sa_handler = scandec_segfault_handler;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = 0;
+    sigaction(SIGSEGV, &sa, NULL);
 
-        /* All three planes received — interleave R,G,B into pixel RGB */
-        DWORD safe_pixels = g_plane_pixels;
-        if (safe_pixels > outLine / 3) safe_pixels = outLine / 3;
-        memset(w->pWriteBuff, 0, outLine);
-        for (DWORD i = 0; i < safe_pixels; i++) {
-            w->pWriteBuff[i * 3 + 0] = g_red_plane[i];
-            w->pWriteBuff[i * 3 + 1] = g_green_plane[i];
-            w->pWriteBuff[i * 3 + 2] = g_blue_plane[i];
-        }
-        g_have_red = 0;
-        g_have_green = 0;
-
-        if (g_debug) {
-            g_stats.lines_total++;
-            g_stats.bytes_out += outLine;
-            clock_gettime(CLOCK_MONOTONIC, &t_end);
-            double call_ms = elapsed_ms(&t_start, &t_end);
-            g_stats.write_ms += call_ms;
-            if (call_ms > g_stats.max_write_ms)
-                g_stats.max_write_ms = call_ms;
-            if ((g_stats.lines_total % 100) == 0) {
-                double total_ms = elapsed_ms(&g_stats.open_time, &t_end);
-                double interval_ms = elapsed_ms(&g_stats.last_progress, &t_end);
-                g_stats.last_progress = t_end;
-                fprintf(stderr, "%s [SCANDEC] progress: %lu lines, %.1f ms elapsed, "
-                        "last 100 in %.1f ms (%.1f ms/line), "
-                        "%.2f ms/line decode avg, max gap %.1f ms\n",
-                        debug_ts(),
-                        g_stats.lines_total, total_ms,
-                        interval_ms, interval_ms / 100.0,
-                        g_stats.write_ms / g_stats.lines_total,
-                        g_stats.max_gap_ms);
-            }
-        }
+    select_decoders();
 
-        if (st) *st = 1;
-        return outLine;
+    const char *env = getenv("BROTHER_DEBUG");
+    if (env && env[0] == '1') {
+        g_debug = 1;
+        fprintf(stderr, "%s [SCANDEC] debug diagnostics enabled (BROTHER_DEBUG=1), "
+                "PackBits decoder: %s\n", debug_ts(), g_decode_name);
     }
 
-    /*
-     * Grayscale / B&W path
-     */
-    memset(w->pWriteBuff, 0, outLine);
+    env = getenv("BROTHER_BATCH_LINES");
+    if (env && atoi(env) > 1) {
+        g_batch_env = atoi(env);
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] batched output: up to %d lines per "
+                    "ScanDecWrite (BROTHER_BATCH_LINES)\n",
+                    debug_ts(), g_batch_env);
+    }
+    env = getenv("BROTHER_PIPELINE");
+    if (env && strcmp(env, "1") == 0)
+        g_pipeline_env = 1;
 
-    /* Temporary buffer for decompressed 8-bit data (for B&W conversion) */
-    BYTE *rawBuf = NULL;
-    DWORD rawLen = 0;
-    DWORD pixelsPerLine = g_open.dwOutLinePixCnt;
+    env = getenv("BROTHER_BW_DITHER");
+    for (int i = 0; env && i < BW_ENGINES; i++)
+        if (strcmp(env, g_bw_names[i]) == 0)
+            g_bw_env = i;
+    env = getenv("BROTHER_BW_THRESHOLD");
+    if (env && *env && atoi(env) >= 1 && atoi(env) <= 255)
+        g_bw_level = atoi(env);
+    env = getenv("BROTHER_BW_WINDOW");
+    if (env && atoi(env) >= 3)
+        g_bw_window_env = atoi(env);
 
-    switch (w->nInDataComp) {
-    case SCIDC_WHITE:
-        if (g_debug) g_stats.lines_white++;
-        /* White line: fill output with white */
-        if (g_bpp == 0) {
-            /* 1-bit packed: white = all 1s = 0xFF */
-            memset(w->pWriteBuff, 0xFF, outLine);
-        } else {
-            /* 8-bit gray or 24-bit RGB: white = 0xFF */
-            memset(w->pWriteBuff, 0xFF, outLine);
+    env = getenv("BROTHER_ENCODE");
+    if (env && strcmp(env, "1") == 0)
+        g_enc_env = 1;
+    env = getenv("BROTHER_ENCODE_QUALITY");
+    if (env && atoi(env) >= 1 && atoi(env) <= 100)
+        g_enc_quality_env = atoi(env);
+    g_enc_out_env = getenv("BROTHER_ENCODE_OUT");
+    g_trace_env = getenv("BROTHER_TRACE");
+    g_ev_env = getenv("BROTHER_EVENTS");
+    g_stats_json_env = getenv("BROTHER_STATS_JSON");
+    env = getenv("BROTHER_EVENTS_SIZE");
+    if (env && atol(env) > 0)
+        g_ev_size_env = (unsigned long)atol(env);
+    g_prv_env = getenv("BROTHER_PREVIEW");
+    env = getenv("BROTHER_PREVIEW_BAND");
+    if (env && atoi(env) >= 1 && atoi(env) <= 4096)
+        g_prv_band_env = atoi(env);
+}
+
+/*
+ * 1-bit B&W output, fixed-threshold fast path (SC_BW with no tone table
+ * or other level).  Threshold: pixel >= 128 → white (1), else black (0),
+ * i.e. the output bit is simply the pixel's top bit.  MSB first within
+ * each byte; bits past the last pixel are 0.
+ */
+
+/* Pack 8 gray pixels into one output byte */
+static inline BYTE pack8_gray(const BYTE *g)
+{
+    return (BYTE)((g[0] & 0x80)        | ((g[1] & 0x80) >> 1) |
+                  ((g[2] & 0x80) >> 2) | ((g[3] & 0x80) >> 3) |
+                  ((g[4] & 0x80) >> 4) | ((g[5] & 0x80) >> 5) |
+                  ((g[6] & 0x80) >> 6) | ((g[7] & 0x80) >> 7));
+}
+
+/*
+ * Convert 8-bit grayscale data to 1-bit packed (for B&W modes).
+ * nPixels is the number of gray bytes available; the rest of the
+ * packedSize-byte output is filled with 0.
+ */
+static void gray8_to_1bit(const BYTE *gray, DWORD nPixels,
+                           BYTE *packed, DWORD packedSize)
+{
+    if (nPixels > packedSize * 8) nPixels = packedSize * 8;
+    DWORD whole = nPixels / 8;
+    for (DWORD i = 0; i < whole; i++)
+        packed[i] = pack8_gray(gray + i * 8);
+    DWORD oB = whole;
+    DWORD rest = nPixels & 7;
+    if (rest) {
+        BYTE b = 0;
+        for (DWORD k = 0; k < rest; k++)
+            b |= (BYTE)((gray[whole * 8 + k] & 0x80) >> k);
+        packed[oB++] = b;
+    }
+    if (oB < packedSize)
+        memset(packed + oB, 0, packedSize - oB);
+}
+
+/*
+ * Fused PackBits decode + threshold for B&W lines: PackBits runs go
+ * straight to packed 1-bit output with no intermediate gray line.  Bits
+ * are collected in a small accumulator; once it is byte-aligned, a repeat
+ * run becomes a single memset of 0x00/0xFF and a literal is packed eight
+ * pixels at a time.  Pixels the input does not cover decode as 0 (black),
+ * the same as a zero-filled gray line.  Returns the number of pixels
+ * decoded.
+ */
+static DWORD packbits_to_1bit(const BYTE *in, DWORD inLen, DWORD nPixels,
+                              BYTE *out, DWORD outBytes)
+{
+    DWORD iP = 0, px = 0, oB = 0;
+    unsigned acc = 0;   /* pending bits, LSB = newest */
+    int nb = 0;         /* number of pending bits (0..7) */
+
+    if (nPixels > outBytes * 8) nPixels = outBytes * 8;
+
+#define PUT_BIT(bit) do {                         \
+        acc = (acc << 1) | (bit);                 \
+        if (++nb == 8) {                          \
+            out[oB++] = (BYTE)acc;                \
+            acc = 0; nb = 0;                      \
+        }                                         \
+    } while (0)
+
+    while (iP < inLen && px < nPixels) {
+        signed char n = (signed char)in[iP++];
+        if (n >= 0) {
+            DWORD c = (DWORD)(n + 1);
+            if (iP + c > inLen) c = inLen - iP;
+            if (px + c > nPixels) c = nPixels - px;
+            const BYTE *g = in + iP;
+            iP += c;
+            px += c;
+            while (c && nb) { PUT_BIT(*g >> 7); g++; c--; }
+            for (; c >= 8; c -= 8, g += 8)
+                out[oB++] = pack8_gray(g);
+            while (c) { PUT_BIT(*g >> 7); g++; c--; }
+        } else if (n != -128) {
+            DWORD c = (DWORD)(1 - n);
+            if (iP >= inLen) break;
+            unsigned bit = in[iP++] >> 7;
+            if (px + c > nPixels) c = nPixels - px;
+            px += c;
+            while (c && nb) { PUT_BIT(bit); c--; }
+            if (c >= 8) {
+                memset(out + oB, bit ? 0xFF : 0x00, c / 8);
+                oB += c / 8;
+                c &= 7;
+            }
+            while (c) { PUT_BIT(bit); c--; }
+        }
+    }
+#undef PUT_BIT
+
+    if (nb)
+        out[oB++] = (BYTE)(acc << (8 - nb));
+    if (oB < outBytes)
+        memset(out + oB, 0, outBytes - oB);
+    return px;
+}
+
+/*
+ * Line-streaming B&W engines for everything the fused threshold above
+ * does not cover: another threshold level, a tone table, ordered
+ * dither and error diffusion.  The gray line is decoded into sd->bw_gray
+ * first.  Error diffusion keeps at most two rows of error ahead of the
+ * current one (Jarvis; Floyd-Steinberg needs one), in 1/48 units for
+ * both kernels, and runs serpentine to avoid directional worms.  All
+ * buffers are allocated by ScanDecOpen.
+ */
+#define BW_MARGIN 2                   /* error row padding on each side */
+
+/*
+ * Adaptive binarisation (bradley, sauvola).  The threshold for a pixel
+ * comes from the mean (and, for Sauvola, the deviation) of a window of
+ * sd->bw_window columns centred on it over the last sd->bw_window rows,
+ * the current one included, so output is never delayed.  The rows are
+ * kept in a ring and per-column sums are updated as a row enters and
+ * the oldest leaves; a running sum across the column totals makes each
+ * pixel O(1) regardless of the window size.
+ */
+#define BW_MAX_WINDOW   255
+#define BW_BRADLEY_PCT  15            /* black below mean - 15% */
+#define BW_SAUVOLA_K    0.1           /* low: faint text on dim paper */
+#define BW_SAUVOLA_R    128.0
+
+static const BYTE g_bayer8[8][8] = {
+    {  0, 32,  8, 40,  2, 34, 10, 42 },
+    { 48, 16, 56, 24, 50, 18, 58, 26 },
+    { 12, 44,  4, 36, 14, 46,  6, 38 },
+    { 60, 28, 52, 20, 62, 30, 54, 22 },
+    {  3, 35, 11, 43,  1, 33,  9, 41 },
+    { 51, 19, 59, 27, 49, 17, 57, 25 },
+    { 15, 47,  7, 39, 13, 45,  5, 37 },
+    { 63, 31, 55, 23, 61, 29, 53, 21 },
+};
+
+static void bw_free(SCANDEC_CTX *sd)
+{
+    free(sd->bw_gray);
+    free(sd->bw_err);
+    free(sd->bw_ring);
+    free(sd->bw_colsum);
+    free(sd->bw_colsq);
+    sd->bw_gray = NULL;
+    sd->bw_err = NULL;
+    sd->bw_ring = NULL;
+    sd->bw_colsum = NULL;
+    sd->bw_colsq = NULL;
+    sd->bw_pixels = 0;
+}
+
+/* Start of a page: no diffused error and Bayer row 0 */
+static void bw_reset(SCANDEC_CTX *sd)
+{
+    sd->bw_line = 0;
+    if (sd->bw_err)
+        memset(sd->bw_err, 0,
+               3 * (sd->bw_pixels + 2 * BW_MARGIN) * sizeof(*sd->bw_err));
+    if (sd->bw_colsum) {
+        memset(sd->bw_colsum, 0, sd->bw_pixels * sizeof(*sd->bw_colsum));
+        memset(sd->bw_colsq, 0, sd->bw_pixels * sizeof(*sd->bw_colsq));
+    }
+}
+
+static int bw_alloc(SCANDEC_CTX *sd, DWORD pixels)
+{
+    DWORD w = pixels + 2 * BW_MARGIN;
+    sd->bw_gray = (BYTE *)malloc(pixels ? pixels : 1);
+    sd->bw_err = (int *)calloc(3 * w, sizeof(*sd->bw_err));
+    if (!sd->bw_gray || !sd->bw_err) {
+        bw_free(sd);
+        return 0;
+    }
+    if (sd->bw_mode >= BW_BRADLEY) {
+        sd->bw_ring = (BYTE *)malloc((size_t)sd->bw_window * (pixels ? pixels : 1));
+        sd->bw_colsum = (unsigned *)calloc(pixels ? pixels : 1, sizeof(unsigned));
+        sd->bw_colsq = (unsigned *)calloc(pixels ? pixels : 1, sizeof(unsigned));
+        if (!sd->bw_ring || !sd->bw_colsum || !sd->bw_colsq) {
+            bw_free(sd);
+            return 0;
+        }
+    }
+    for (int r = 0; r < 3; r++)
+        sd->bw_row[r] = sd->bw_err + r * w + BW_MARGIN;
+    sd->bw_pixels = pixels;
+    return 1;
+}
+
+/* Rotate the error rows after a line: clear the one that was current */
+static void bw_next_row(SCANDEC_CTX *sd)
+{
+    int *done = sd->bw_row[0];
+    sd->bw_row[0] = sd->bw_row[1];
+    sd->bw_row[1] = sd->bw_row[2];
+    sd->bw_row[2] = done;
+    memset(done - BW_MARGIN, 0,
+           (sd->bw_pixels + 2 * BW_MARGIN) * sizeof(*done));
+    sd->bw_line++;
+}
+
+/*
+ * The engines below each render n gray pixels into px pixels of cleared
+ * packed output, gray[n..px) counting as black.  ScanDecOpen() picks one
+ * into sd->bw_fn; bw_render() does the clearing and the row bookkeeping.
+ */
+
+/* Plain threshold at BROTHER_BW_THRESHOLD */
+static void bw_threshold(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                         BYTE *packed)
+{
+    (void)sd; (void)px;
+    for (DWORD x = 0; x < n; x++)
+        if (gray[x] >= g_bw_level)
+            packed[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+}
+
+/* Ordered dither against the 8x8 Bayer matrix */
+static void bw_bayer(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                     BYTE *packed)
+{
+    (void)px;
+    const BYTE *t = g_bayer8[sd->bw_line & 7];
+    for (DWORD x = 0; x < n; x++)
+        if (gray[x] > t[x & 7] * 4 + 2)
+            packed[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+}
+
+/* Error diffusion, serpentine; jarvis picks Jarvis-Judice-Ninke over
+ * Floyd-Steinberg and is a constant in each copy */
+static inline __attribute__((always_inline))
+void bw_diffuse(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                BYTE *packed, const int jarvis)
+{
+    int *e0 = sd->bw_row[0], *e1 = sd->bw_row[1], *e2 = sd->bw_row[2];
+    int rev = sd->bw_line & 1;
+    int d = rev ? -1 : 1;
+    for (DWORD i = 0; i < px; i++) {
+        long x = rev ? (long)(px - 1 - i) : (long)i;
+        int g = (DWORD)x < n ? gray[x] : 0;
+        int v = g + e0[x] / 48;
+        int err;
+        if (v >= g_bw_level) {
+            packed[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+            err = v - 255;
+        } else {
+            err = v;
+        }
+        if (!jarvis) {
+            /* 7/16, 3/16, 5/16, 1/16 -> x48: 21, 9, 15, 3 */
+            e0[x + d] += err * 21;
+            e1[x - d] += err * 9;
+            e1[x]     += err * 15;
+            e1[x + d] += err * 3;
+        } else {
+            e0[x + d]     += err * 7;
+            e0[x + 2 * d] += err * 5;
+            e1[x - 2 * d] += err * 3;
+            e1[x - d]     += err * 5;
+            e1[x]         += err * 7;
+            e1[x + d]     += err * 5;
+            e1[x + 2 * d] += err * 3;
+            e2[x - 2 * d] += err * 1;
+            e2[x - d]     += err * 3;
+            e2[x]         += err * 5;
+            e2[x + d]     += err * 3;
+            e2[x + 2 * d] += err * 1;
+        }
+    }
+    /* Error pushed into the margins falls off the page */
+}
+
+static void bw_fs(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                  BYTE *packed)
+{
+    bw_diffuse(sd, gray, n, px, packed, 0);
+}
+
+static void bw_jarvis(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                      BYTE *packed)
+{
+    bw_diffuse(sd, gray, n, px, packed, 1);
+}
+
+/* Adaptive threshold over the window's mean (Bradley) or mean and
+ * deviation (Sauvola, with sauvola a constant in each copy) */
+static inline __attribute__((always_inline))
+void bw_adaptive(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                 BYTE *packed, const int sauvola)
+{
+    DWORD rows = (DWORD)sd->bw_window;
+    BYTE *row = sd->bw_ring + (size_t)(sd->bw_line % rows) * sd->bw_pixels;
+
+    /* Slide the column sums: the oldest row leaves, this one enters */
+    if (sd->bw_line >= rows) {
+        for (DWORD x = 0; x < px; x++) {
+            sd->bw_colsum[x] -= row[x];
+            sd->bw_colsq[x] -= (unsigned)row[x] * row[x];
+        }
+    }
+    memcpy(row, gray, n);
+    memset(row + n, 0, px - n);
+    for (DWORD x = 0; x < px; x++) {
+        sd->bw_colsum[x] += row[x];
+        sd->bw_colsq[x] += (unsigned)row[x] * row[x];
+    }
+    if (sd->bw_line + 1 < rows)
+        rows = sd->bw_line + 1;
+
+    long half = sd->bw_window / 2;
+    unsigned long long sum = 0, sq = 0;
+    for (long x = 0; x <= half && x < (long)px; x++) {
+        sum += sd->bw_colsum[x];
+        sq += sd->bw_colsq[x];
+    }
+    for (long x = 0; x < (long)px; x++) {
+        long lo = x - half < 0 ? 0 : x - half;
+        long hi = x + half >= (long)px ? (long)px - 1 : x + half;
+        unsigned long long cnt = (unsigned long long)(hi - lo + 1) * rows;
+        int white;
+        if (!sauvola) {
+            white = (unsigned long long)row[x] * cnt * 100 >
+                    sum * (100 - BW_BRADLEY_PCT);
+        } else {
+            /* g > m * (1 + k * (sd / R - 1)), squared to avoid sqrt() */
+            double m = (double)sum / cnt;
+            double var = (double)sq / cnt - m * m;
+            double d = row[x] - m * (1.0 - BW_SAUVOLA_K);
+            double c = m * BW_SAUVOLA_K / BW_SAUVOLA_R;
+            white = d > 0 && d * d > c * c * (var > 0 ? var : 0);
+        }
+        if (white)
+            packed[x >> 3] |= (BYTE)(0x80 >> (x & 7));
+        /* Move the column window one to the right */
+        if (x + half + 1 < (long)px) {
+            sum += sd->bw_colsum[x + half + 1];
+            sq += sd->bw_colsq[x + half + 1];
+        }
+        if (x - half >= 0) {
+            sum -= sd->bw_colsum[x - half];
+            sq -= sd->bw_colsq[x - half];
+        }
+    }
+}
+
+static void bw_bradley(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                       BYTE *packed)
+{
+    bw_adaptive(sd, gray, n, px, packed, 0);
+}
+
+static void bw_sauvola(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, DWORD px,
+                       BYTE *packed)
+{
+    bw_adaptive(sd, gray, n, px, packed, 1);
+}
+
+/* By engine, in BW_* order */
+static const BW_FN g_bw_fns[BW_ENGINES] = {
+    bw_threshold, bw_bayer, bw_fs, bw_jarvis, bw_bradley, bw_sauvola
+};
+
+/*
+ * Render n gray pixels (n <= sd->bw_pixels) to packedSize bytes of 1-bit
+ * output, white = 1, MSB first, padding 0.  Pixels past n count as
+ * black for threshold and dither, matching the zero-filled gray line.
+ */
+static void bw_render(SCANDEC_CTX *sd, const BYTE *gray, DWORD n, BYTE *packed,
+                      DWORD packedSize)
+{
+    DWORD px = sd->bw_pixels;
+    if (px > packedSize * 8) px = packedSize * 8;
+    if (n > px) n = px;
+    memset(packed, 0, packedSize);
+    sd->bw_fn(sd, gray, n, px, packed);
+    bw_next_row(sd);
+}
+
+/*
+ * Lines held over from earlier calls go to the front of the caller's
+ * buffer: spilled ones first, as many as fit, else the pending batch,
+ * moved over when the caller passes another buffer than last time.
+ * Returns the number of lines now at the start of w->pWriteBuff.
+ */
+static DWORD batch_take(SCANDEC_CTX *sd, SCANDEC_WRITE *w)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    DWORD room = w->dwWriteBuffSize / outLine;
+    DWORD n;
+    if (sd->spill_count) {
+        n = sd->spill_count < room ? sd->spill_count : room;
+        memcpy(w->pWriteBuff, sd->spill, n * outLine);
+        sd->spill_count -= n;
+        if (sd->spill_count)
+            memmove(sd->spill, sd->spill + n * outLine,
+                    sd->spill_count * outLine);
+        return n;
+    }
+    n = sd->batch_count;
+    sd->batch_count = 0;
+    if (n && sd->batch_buf != w->pWriteBuff) {
+        DWORD k = n < room ? n : room;
+        memmove(w->pWriteBuff, sd->batch_buf, k * outLine);
+        /* A smaller buffer: the rest waits with the spilled lines */
+        memcpy(sd->spill, sd->batch_buf + k * outLine, (n - k) * outLine);
+        sd->spill_count = n - k;
+        n = k;
+    }
+    return n;
+}
+
+/* Grow the spill to take more lines; 0 if out of memory */
+static int spill_reserve(SCANDEC_CTX *sd, DWORD more)
+{
+    if (sd->spill_count + more <= sd->spill_max)
+        return 1;
+    DWORD cap = sd->spill_max ? sd->spill_max : more;
+    while (cap < sd->spill_count + more)
+        cap *= 2;
+    BYTE *b = (BYTE *)realloc(sd->spill, (size_t)cap * sd->params.dwOutLineByte);
+    if (!b)
+        return 0;
+    sd->spill = b;
+    sd->spill_max = cap;
+    return 1;
+}
+
+/* Statistics for a batched return of n lines */
+static inline void batch_returned(SCANDEC_CTX *sd, DWORD n)
+{
+    if (sd->batch_max && sd->stats_on && n) {
+        sd->stats.batch_reads++;
+        sd->stats.batch_lines += n;
+    }
+}
+
+/* Page end after the page has been returned: only spilled lines left */
+static DWORD batch_drain(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    DWORD n = 0;
+    if ((sd->spill_count || sd->batch_count) && w && w->pWriteBuff &&
+        w->dwWriteBuffSize >= outLine)
+        n = batch_take(sd, w);
+    batch_returned(sd, n);
+    if (st) *st = (INT)n;
+    return n * outLine;
+}
+
+/*
+ * White-run tracking and blank-page detection over the output lines of
+ * a page.  A line is white when the scanner sent it as SCIDC_WHITE (or
+ * all three planes so) or when at most BLANK_LINE_INK_PERMILLE of its
+ * pixels are ink, i.e. darker than BLANK_INK_LEVEL (1-bit: black) --
+ * dust and paper texture do not break a run.  A page is blank when its
+ * ink in total stays under BLANK_PAGE_INK_PERMILLE.  Runs of at least
+ * the requested length are reported through the callback as soon as
+ * they end, and the page summary is available from ScanDecGetPageInfo().
+ */
+#define BLANK_LINE_INK_PERMILLE  2
+#define BLANK_PAGE_INK_PERMILLE  1
+
+static void blank_reset(SCANDEC_CTX *sd)
+{
+    memset(&sd->page, 0, sizeof(sd->page));
+    sd->run_start = sd->run_len = 0;
+    sd->page_ink = sd->page_px = 0;
+}
+
+/* A white run ended (or the page did) */
+static void blank_end_run(SCANDEC_CTX *sd)
+{
+    if (!sd->run_len)
+        return;
+    sd->page.dwWhiteRuns++;
+    if (sd->run_len > sd->page.dwLongestRun) {
+        sd->page.dwLongestRun = sd->run_len;
+        sd->page.dwLongestRunStart = sd->run_start;
+    }
+    if (sd->run_cb && sd->run_len >= sd->run_cb_min)
+        sd->run_cb(sd->run_start, sd->run_len, sd->run_cb_ctx);
+    sd->run_len = 0;
+}
+
+/* Set bits in a 64-bit word, without relying on a popcount instruction */
+static inline DWORD bits64(uint64_t v)
+{
+    v -= (v >> 1) & 0x5555555555555555ull;
+    v = (v & 0x3333333333333333ull) + ((v >> 2) & 0x3333333333333333ull);
+    v = (v + (v >> 4)) & 0x0F0F0F0F0F0F0F0Full;
+    return (DWORD)((v * 0x0101010101010101ull) >> 56);
+}
+
+/*
+ * Ink pixels in px pixels of an output line (bpp 0 = packed 1-bit).
+ * 1-bit and gray lines are counted 64 pixels or 8 pixels at a time,
+ * right after the decoder has written them: with the level at 128, ink
+ * bytes are the ones with the top bit clear, and the multiply sums the
+ * eight 0/1 bytes into the top one.  Counting inside the PackBits
+ * kernels instead costs more, as their literals are too short for
+ * anything but a byte loop.
+ */
+static DWORD ink_1bit(const BYTE *line, DWORD px)
+{
+    DWORD ink = 0, i = 0;
+    for (; i + 8 <= px / 8; i += 8) {
+        uint64_t v;
+        memcpy(&v, line + i, 8);
+        ink += 64 - bits64(v);
+    }
+    for (; i < px / 8; i++)
+        ink += 8 - __builtin_popcount(line[i]);
+    if (px & 7)
+        ink += (px & 7) -
+               __builtin_popcount(line[px / 8] >> (8 - (px & 7)));
+    return ink;
+}
+
+static DWORD ink_gray(const BYTE *line, DWORD px)
+{
+    DWORD ink = 0, i = 0;
+#if BLANK_INK_LEVEL == 128
+    for (; i + 8 <= px; i += 8) {
+        uint64_t v;
+        memcpy(&v, line + i, 8);
+        ink += (DWORD)((((~v >> 7) & 0x0101010101010101ull) *
+                        0x0101010101010101ull) >> 56);
+    }
+#endif
+    for (; i < px; i++)
+        ink += line[i] < BLANK_INK_LEVEL;
+    return ink;
+}
+
+static DWORD ink_rgb(const BYTE *line, DWORD px)
+{
+    DWORD ink = 0;
+    for (DWORD i = 0; i < px * 3; i += 3)
+        ink += (line[i] < BLANK_INK_LEVEL) | (line[i + 1] < BLANK_INK_LEVEL) |
+               (line[i + 2] < BLANK_INK_LEVEL);
+    return ink;
+}
+
+/* By output bytes per pixel (0: packed 1-bit), for sd->ink_fn */
+static const INK_FN g_ink_fns[4] = { ink_1bit, ink_gray, ink_gray, ink_rgb };
+
+/* Account one output line with ink pixels, counted here if INK_UNCOUNTED */
+static void blank_line(SCANDEC_CTX *sd, const BYTE *line, DWORD px, DWORD ink)
+{
+    if (ink == INK_UNCOUNTED)
+        ink = sd->ink_fn(line, px);
+    sd->page_px += px;
+    sd->page_ink += ink;
+    if ((unsigned long long)ink * 1000 <=
+        (unsigned long long)px * BLANK_LINE_INK_PERMILLE) {
+        if (!sd->run_len)
+            sd->run_start = sd->page.dwLines;
+        sd->run_len++;
+        sd->page.dwWhiteLines++;
+    } else {
+        if (sd->page.dwWhiteLines == sd->page.dwLines)
+            sd->page.dwTopMargin = sd->page.dwLines;
+        blank_end_run(sd);
+    }
+    sd->page.dwLines++;
+}
+
+/* Page complete: settle margins and the verdict */
+static void blank_finish(SCANDEC_CTX *sd)
+{
+    int inked = sd->page.dwWhiteLines != sd->page.dwLines;
+    sd->page.dwBottomMargin = inked ? sd->run_len : sd->page.dwLines;
+    if (!inked)
+        sd->page.dwTopMargin = sd->page.dwLines;
+    blank_end_run(sd);
+    sd->page.bBlankPage = sd->page.dwLines > 0 &&
+        sd->page_ink * 1000 <= sd->page_px * BLANK_PAGE_INK_PERMILLE;
+}
+
+/*
+ * Event ring.  With BROTHER_EVENTS=<file> each write, long gap, line
+ * decode and return is recorded as a 16-byte binary event with its
+ * CLOCK_MONOTONIC time (format in scandec_events.h).  Recording is a
+ * clock read and a few stores into a fixed ring: nothing is formatted or
+ * written while scanning, so it can stay on in production without
+ * shifting the gaps it measures.  The ring is dumped to the file at
+ * ScanDecClose(), on SIGUSR2 and on SIGSEGV, and keeps the last
+ * BROTHER_EVENTS_SIZE events (rounded up to a power of two) across
+ * sessions.  scandec_events prints dumps.
+ */
+#define EV_RING_DEFAULT 65536         /* events, 1 MB */
+#define EV_RING_MIN     256
+#define EV_RING_MAX     (16 * 1024 * 1024)
+
+static struct {
+    EV_ENTRY *ring;
+    uint32_t  mask;                   /* slots - 1 */
+    uint64_t  head;                   /* events recorded, atomic */
+    uint64_t  mono_base, real_base;
+} g_ev;
+
+static inline uint64_t ev_clock(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* Record one event; callers check g_ev.ring.  Safe from any thread. */
+static inline void ev_put(uint64_t ts, unsigned type, unsigned long a,
+                          uint64_t b)
+{
+    uint64_t i = __atomic_fetch_add(&g_ev.head, 1, __ATOMIC_RELAXED);
+    EV_ENTRY *e = &g_ev.ring[i & g_ev.mask];
+    e->ts = ts;
+    e->type = (uint16_t)type;
+    e->a = a > 0xFFFF ? 0xFFFF : (uint16_t)a;
+    e->b = b > 0xFFFFFFFFu ? 0xFFFFFFFFu : (uint32_t)b;
+}
+
+static int ev_write_all(int fd, const void *p, size_t n)
+{
+    const char *c = p;
+    while (n) {
+        ssize_t k = write(fd, c, n);
+        if (k < 0 && errno == EINTR)
+            continue;
+        if (k <= 0)
+            return 0;
+        c += k;
+        n -= (size_t)k;
+    }
+    return 1;
+}
+
+/*
+ * Write the ring to BROTHER_EVENTS, oldest event first.  Only
+ * async-signal-safe calls, so the signal handlers can use it; a dump
+ * taken mid-scan may end in a partly written event.
+ */
+static int ev_dump(void)
+{
+    if (!g_ev.ring)
+        return 0;
+    uint64_t head = __atomic_load_n(&g_ev.head, __ATOMIC_ACQUIRE);
+    uint64_t slots = (uint64_t)g_ev.mask + 1;
+    uint64_t first = head > slots ? head - slots : 0;
+    EV_HEADER h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, EV_MAGIC, sizeof(h.magic));
+    h.version = EV_VERSION;
+    h.entry_size = sizeof(EV_ENTRY);
+    h.capacity = (uint32_t)slots;
+    h.count = (uint32_t)(head - first);
+    h.first = first;
+    h.mono_base = g_ev.mono_base;
+    h.real_base = g_ev.real_base;
+
+    int fd = open(g_ev_env, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+        return 0;
+    size_t at = (size_t)(first & g_ev.mask);
+    size_t n = h.count, run = n < slots - at ? n : slots - at;
+    int ok = ev_write_all(fd, &h, sizeof(h)) &&
+             ev_write_all(fd, g_ev.ring + at, run * sizeof(EV_ENTRY)) &&
+             ev_write_all(fd, g_ev.ring, (n - run) * sizeof(EV_ENTRY));
+    close(fd);
+    return ok;
+}
+
+static void ev_signal(int sig)
+{
+    int saved = errno;
+    (void)sig;
+    ev_dump();
+    errno = saved;
+}
+
+/* Allocate the ring at the first ScanDecOpen() */
+static void ev_setup(void)
+{
+    if (g_ev.ring || !g_ev_env || !*g_ev_env)
+        return;
+    unsigned long want = g_ev_size_env ? g_ev_size_env : EV_RING_DEFAULT;
+    uint32_t slots = EV_RING_MIN;
+    while (slots < want && slots < EV_RING_MAX)
+        slots <<= 1;
+    g_ev.ring = calloc(slots, sizeof(EV_ENTRY));
+    if (!g_ev.ring) {
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] events: no memory for %u events\n",
+                    debug_ts(), slots);
+        return;
+    }
+    g_ev.mask = slots - 1;
+    struct timespec rt;
+    clock_gettime(CLOCK_REALTIME, &rt);
+    g_ev.mono_base = ev_clock();
+    g_ev.real_base = (uint64_t)rt.tv_sec * 1000000000u + (uint64_t)rt.tv_nsec;
+
+    /* Leave SIGUSR2 alone if the host process handles it */
+    struct sigaction sa, old;
+    if (sigaction(SIGUSR2, NULL, &old) == 0 && old.sa_handler == SIG_DFL) {
+        sa.sa_handler = ev_signal;
+        sigemptyset(&sa.sa_mask);
+        sa.sa_flags = SA_RESTART;
+        sigaction(SIGUSR2, &sa, NULL);
+    }
+    if (g_debug)
+        fprintf(stderr, "%s [SCANDEC] events: recording the last %u events, "
+                "dumped to %s at close or on SIGUSR2\n",
+                debug_ts(), slots, g_ev_env);
+}
+
+/*
+ * Trace capture.  With BROTHER_TRACE=<file> every call the backend makes
+ * is appended to a trace (format in scandec_trace.h): the open
+ * parameters, tone tables, page boundaries and the raw line data of each
+ * ScanDecWrite() with its nInDataComp/nInDataKind.  scandec_bench
+ * replays traces at full CPU speed, so decoder changes can be timed
+ * without the scanner and its USB waits.  Records go through a large
+ * stdio buffer; a write error stops the capture, not the scan.
+ */
+#define TRACE_BUFSIZE (256 * 1024)
+
+static void trace_rec(SCANDEC_CTX *sd, unsigned type, int a, int b,
+                      const void *data, DWORD size)
+{
+    if (!sd->trace)
+        return;
+    TRACE_RECORD r = { type, (unsigned)size, a, b };
+    if (fwrite(&r, sizeof(r), 1, sd->trace) != 1 ||
+        (size && fwrite(data, size, 1, sd->trace) != 1)) {
+        char buf[320];
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] trace: write to %s failed, "
+                    "capture stopped\n", debug_ts(),
+                    ctx_path(sd, g_trace_env, buf, sizeof(buf)));
+        fclose(sd->trace);
+        sd->trace = NULL;
+    }
+}
+
+/* Start a session record at ScanDecOpen() */
+static void trace_open(SCANDEC_CTX *sd, const SCANDEC_OPEN *p)
+{
+    if (!g_trace_env || !*g_trace_env)
+        return;
+    char buf[320];
+    const char *path = ctx_path(sd, g_trace_env, buf, sizeof(buf));
+    if (!sd->trace) {
+        sd->trace = fopen(path, "ab");
+        if (!sd->trace) {
+            if (g_debug)
+                fprintf(stderr, "%s [SCANDEC] trace: cannot open %s\n",
+                        debug_ts(), path);
+            return;
+        }
+        setvbuf(sd->trace, NULL, _IOFBF, TRACE_BUFSIZE);
+        if (ftell(sd->trace) == 0) {
+            TRACE_HEADER h;
+            memset(&h, 0, sizeof(h));
+            memcpy(h.magic, TRACE_MAGIC, sizeof(h.magic));
+            h.version = TRACE_VERSION;
+            fwrite(&h, sizeof(h), 1, sd->trace);
+        }
+    }
+    TRACE_OPEN_ARGS a = {
+        p->nInResoX, p->nInResoY, p->nOutResoX, p->nOutResoY, p->nColorType,
+        (unsigned)p->dwInLinePixCnt, p->nOutDataKind, p->bLongBoundary
+    };
+    trace_rec(sd, TRACE_OPEN, 0, 0, &a, sizeof(a));
+    if (g_debug && sd->trace)
+        fprintf(stderr, "%s [SCANDEC] trace: capturing to %s\n",
+                debug_ts(), path);
+}
+
+static void trace_close(SCANDEC_CTX *sd)
+{
+    if (!sd->trace)
+        return;
+    trace_rec(sd, TRACE_CLOSE, 0, 0, NULL, 0);
+    if (sd->trace)
+        fclose(sd->trace);
+    sd->trace = NULL;
+}
+
+/*
+ * Compressed output.  With BROTHER_ENCODE=1, or a ScanDecSetEncoder()
+ * call, every output line is also fed in order to an encoder.  Gray and
+ * colour scans get baseline JPEG (libjpeg-turbo, built in with
+ * -DHAVE_LIBJPEG -ljpeg) and 1-bit scans get CCITT T.6 (G4).  The stream
+ * goes to the sink given to ScanDecSetEncoder(), or to the file
+ * BROTHER_ENCODE_OUT names ("%d" = page number, default
+ * /tmp/brscan-page%d.jpg or .g4).  A frontend or network server can
+ * forward it as is, without copying the raster again.
+ *
+ * G4 is raw MMR ending in EOFB, as PDF's /CCITTFaxDecode takes it with
+ * /K -1.  It is written while the page is scanned.  JPEG needs the page
+ * height in its header, and that is only known at ScanDecPageEnd().  So
+ * the compressed stream (never the raster) is kept in memory, and the
+ * SOF height is patched in before the stream is written.
+ */
+#define ENC_NONE  0
+#define ENC_JPEG  1
+#define ENC_G4    2
+#define ENC_CHUNK 4096                  /* G4 bytes per sink write */
+#define ENC_DEFAULT_QUALITY 85
+
+/* Hand compressed bytes to the sink or the page file */
+static void enc_sink(SCANDEC_CTX *sd, const BYTE *p, size_t n)
+{
+    if (sd->enc.failed || !n)
+        return;
+    sd->enc.bytes_out += n;
+    sd->enc.page_out += n;
+    if (sd->enc.sink) {
+        if (!sd->enc.sink(p, (DWORD)n, sd->enc.ctx))
+            sd->enc.failed = 1;
+        return;
+    }
+    while (n) {
+        ssize_t k = write(sd->enc.fd, p, n);
+        if (k <= 0) {
+            sd->enc.failed = 1;
+            return;
+        }
+        p += k;
+        n -= (size_t)k;
+    }
+}
+
+/* Page file from BROTHER_ENCODE_OUT, with "%d" replaced by the page */
+static int enc_open_file(SCANDEC_CTX *sd, const char *ext)
+{
+    char tmpl[256], path[320];
+    if (g_enc_out_env && *g_enc_out_env)
+        snprintf(tmpl, sizeof(tmpl), "%s", g_enc_out_env);
+    else
+        snprintf(tmpl, sizeof(tmpl), "/tmp/brscan-page%%d.%s", ext);
+    char *pct = strstr(tmpl, "%d");
+    if (pct) {
+        *pct = '\0';
+        snprintf(path, sizeof(path), "%s%u%s", tmpl, sd->enc.page, pct + 2);
+    } else {
+        snprintf(path, sizeof(path), "%s", tmpl);
+    }
+    sd->enc.fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (sd->enc.fd < 0 && g_debug)
+        fprintf(stderr, "%s [SCANDEC] encoder: cannot create %s\n",
+                debug_ts(), path);
+    return sd->enc.fd >= 0;
+}
+
+/* --- CCITT T.6 (G4) --- */
+
+typedef struct { unsigned short code; unsigned char len; } G4_CODE;
+
+/* White runs 0..63 */
+static const G4_CODE g4_white_term[64] = {
+    {0x035,  8}, {0x007,  6}, {0x007,  4}, {0x008,  4}, {0x00b,  4}, {0x00c,  4},
+    {0x00e,  4}, {0x00f,  4}, {0x013,  5}, {0x014,  5}, {0x007,  5}, {0x008,  5},
+    {0x008,  6}, {0x003,  6}, {0x034,  6}, {0x035,  6}, {0x02a,  6}, {0x02b,  6},
+    {0x027,  7}, {0x00c,  7}, {0x008,  7}, {0x017,  7}, {0x003,  7}, {0x004,  7},
+    {0x028,  7}, {0x02b,  7}, {0x013,  7}, {0x024,  7}, {0x018,  7}, {0x002,  8},
+    {0x003,  8}, {0x01a,  8}, {0x01b,  8}, {0x012,  8}, {0x013,  8}, {0x014,  8},
+    {0x015,  8}, {0x016,  8}, {0x017,  8}, {0x028,  8}, {0x029,  8}, {0x02a,  8},
+    {0x02b,  8}, {0x02c,  8}, {0x02d,  8}, {0x004,  8}, {0x005,  8}, {0x00a,  8},
+    {0x00b,  8}, {0x052,  8}, {0x053,  8}, {0x054,  8}, {0x055,  8}, {0x024,  8},
+    {0x025,  8}, {0x058,  8}, {0x059,  8}, {0x05a,  8}, {0x05b,  8}, {0x04a,  8},
+    {0x04b,  8}, {0x032,  8}, {0x033,  8}, {0x034,  8},
+};
+/* White runs 64..1728, step 64 */
+static const G4_CODE g4_white_makeup[27] = {
+    {0x01b,  5}, {0x012,  5}, {0x017,  6}, {0x037,  7}, {0x036,  8}, {0x037,  8},
+    {0x064,  8}, {0x065,  8}, {0x068,  8}, {0x067,  8}, {0x0cc,  9}, {0x0cd,  9},
+    {0x0d2,  9}, {0x0d3,  9}, {0x0d4,  9}, {0x0d5,  9}, {0x0d6,  9}, {0x0d7,  9},
+    {0x0d8,  9}, {0x0d9,  9}, {0x0da,  9}, {0x0db,  9}, {0x098,  9}, {0x099,  9},
+    {0x09a,  9}, {0x018,  6}, {0x09b,  9},
+};
+/* Black runs 0..63 */
+static const G4_CODE g4_black_term[64] = {
+    {0x037, 10}, {0x002,  3}, {0x003,  2}, {0x002,  2}, {0x003,  3}, {0x003,  4},
+    {0x002,  4}, {0x003,  5}, {0x005,  6}, {0x004,  6}, {0x004,  7}, {0x005,  7},
+    {0x007,  7}, {0x004,  8}, {0x007,  8}, {0x018,  9}, {0x017, 10}, {0x018, 10},
+    {0x008, 10}, {0x067, 11}, {0x068, 11}, {0x06c, 11}, {0x037, 11}, {0x028, 11},
+    {0x017, 11}, {0x018, 11}, {0x0ca, 12}, {0x0cb, 12}, {0x0cc, 12}, {0x0cd, 12},
+    {0x068, 12}, {0x069, 12}, {0x06a, 12}, {0x06b, 12}, {0x0d2, 12}, {0x0d3, 12},
+    {0x0d4, 12}, {0x0d5, 12}, {0x0d6, 12}, {0x0d7, 12}, {0x06c, 12}, {0x06d, 12},
+    {0x0da, 12}, {0x0db, 12}, {0x054, 12}, {0x055, 12}, {0x056, 12}, {0x057, 12},
+    {0x064, 12}, {0x065, 12}, {0x052, 12}, {0x053, 12}, {0x024, 12}, {0x037, 12},
+    {0x038, 12}, {0x027, 12}, {0x028, 12}, {0x058, 12}, {0x059, 12}, {0x02b, 12},
+    {0x02c, 12}, {0x05a, 12}, {0x066, 12}, {0x067, 12},
+};
+/* Black runs 64..1728, step 64 */
+static const G4_CODE g4_black_makeup[27] = {
+    {0x00f, 10}, {0x0c8, 12}, {0x0c9, 12}, {0x05b, 12}, {0x033, 12}, {0x034, 12},
+    {0x035, 12}, {0x06c, 13}, {0x06d, 13}, {0x04a, 13}, {0x04b, 13}, {0x04c, 13},
+    {0x04d, 13}, {0x072, 13}, {0x073, 13}, {0x074, 13}, {0x075, 13}, {0x076, 13},
+    {0x077, 13}, {0x052, 13}, {0x053, 13}, {0x054, 13}, {0x055, 13}, {0x05a, 13},
+    {0x05b, 13}, {0x064, 13}, {0x065, 13},
+};
+/* Either colour, 1792..2560, step 64 */
+static const G4_CODE g4_ext_makeup[13] = {
+    {0x008, 11}, {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12}, {0x014, 12},
+    {0x015, 12}, {0x016, 12}, {0x017, 12}, {0x01c, 12}, {0x01d, 12}, {0x01e, 12},
+    {0x01f, 12},
+};
+
+/* Vertical mode codes for a1 - b1 = -3..3 */
+static const G4_CODE g4_vert[7] = {
+    {0x02, 7}, {0x02, 6}, {0x02, 3}, {0x01, 1}, {0x03, 3}, {0x03, 6}, {0x03, 7},
+};
+#define G4_PASS   0x1, 4
+#define G4_HORIZ  0x1, 3
+#define G4_EOL    0x1, 12
+
+static void g4_put(SCANDEC_CTX *sd, unsigned code, int len)
+{
+    sd->enc.bits = (sd->enc.bits << len) | code;
+    sd->enc.nbits += len;
+    while (sd->enc.nbits >= 8) {
+        sd->enc.nbits -= 8;
+        sd->enc.buf[sd->enc.len++] = (BYTE)(sd->enc.bits >> sd->enc.nbits);
+        if (sd->enc.len == sd->enc.cap) {
+            enc_sink(sd, sd->enc.buf, sd->enc.len);
+            sd->enc.len = 0;
+        }
+    }
+}
+
+/* One run of a colour: make-up codes, then a terminating code */
+static void g4_span(SCANDEC_CTX *sd, DWORD span, const G4_CODE *term,
+                    const G4_CODE *makeup)
+{
+    while (span >= 2624) {
+        g4_put(sd, g4_ext_makeup[12].code, g4_ext_makeup[12].len);
+        span -= 2560;
+    }
+    if (span >= 64) {
+        DWORD m = span / 64;
+        const G4_CODE *c = m <= 27 ? &makeup[m - 1] : &g4_ext_makeup[m - 28];
+        g4_put(sd, c->code, c->len);
+        span -= m * 64;
+    }
+    g4_put(sd, term[span].code, term[span].len);
+}
+
+static inline int g4_pixel(const BYTE *l, DWORD i)
+{
+    return l[i >> 3] >> (7 - (i & 7)) & 1;
+}
+
+/* First pixel in [bs, be) that is not colour, or be */
+static DWORD g4_find(const BYTE *l, DWORD bs, DWORD be, int colour)
+{
+    BYTE same = colour ? 0xFF : 0x00;
+    while (bs < be && (bs & 7)) {
+        if (g4_pixel(l, bs) != colour)
+            return bs;
+        bs++;
+    }
+    while (bs + 8 <= be && l[bs >> 3] == same)
+        bs += 8;
+    while (bs < be && g4_pixel(l, bs) == colour)
+        bs++;
+    return bs;
+}
+
+static inline DWORD g4_find2(const BYTE *l, DWORD bs, DWORD be, int colour)
+{
+    return bs < be ? g4_find(l, bs, be, colour) : be;
+}
+
+/* Code sd->enc.cur against the reference line sd->enc.ref (T.4 2-D coding) */
+static void g4_row(SCANDEC_CTX *sd)
+{
+    const BYTE *bp = sd->enc.cur, *rp = sd->enc.ref;
+    DWORD bits = sd->enc.px;
+    DWORD a0 = 0;
+    DWORD a1 = g4_pixel(bp, 0) ? 0 : g4_find(bp, 0, bits, 0);
+    DWORD b1 = g4_pixel(rp, 0) ? 0 : g4_find(rp, 0, bits, 0);
+    for (;;) {
+        DWORD b2 = g4_find2(rp, b1, bits, b1 < bits && g4_pixel(rp, b1));
+        if (b2 >= a1) {
+            long d = (long)b1 - (long)a1;
+            if (d < -3 || d > 3) {
+                /* Horizontal: a0a1 and a1a2 as runs */
+                DWORD a2 = g4_find2(bp, a1, bits, a1 < bits && g4_pixel(bp, a1));
+                g4_put(sd, G4_HORIZ);
+                if (a0 + a1 == 0 || !g4_pixel(bp, a0)) {
+                    g4_span(sd, a1 - a0, g4_white_term, g4_white_makeup);
+                    g4_span(sd, a2 - a1, g4_black_term, g4_black_makeup);
+                } else {
+                    g4_span(sd, a1 - a0, g4_black_term, g4_black_makeup);
+                    g4_span(sd, a2 - a1, g4_white_term, g4_white_makeup);
+                }
+                a0 = a2;
+            } else {
+                g4_put(sd, g4_vert[3 - d].code, g4_vert[3 - d].len);
+                a0 = a1;
+            }
+        } else {
+            g4_put(sd, G4_PASS);
+            a0 = b2;
+        }
+        if (a0 >= bits)
+            break;
+        int c = g4_pixel(bp, a0);
+        a1 = g4_find(bp, a0, bits, c);
+        b1 = g4_find(rp, a0, bits, !c);
+        b1 = g4_find2(rp, b1, bits, c);
+    }
+}
+
+/* --- JPEG (libjpeg-turbo) --- */
+
+#ifdef HAVE_LIBJPEG
+/* Grow the output buffer to take more bytes */
+static int enc_reserve(SCANDEC_CTX *sd, size_t more)
+{
+    if (sd->enc.len + more <= sd->enc.cap)
+        return 1;
+    size_t cap = sd->enc.cap ? sd->enc.cap : ENC_CHUNK;
+    while (cap < sd->enc.len + more)
+        cap *= 2;
+    BYTE *b = (BYTE *)realloc(sd->enc.buf, cap);
+    if (!b)
+        return 0;
+    sd->enc.buf = b;
+    sd->enc.cap = cap;
+    return 1;
+}
+
+/* The session a libjpeg callback is for, see jpg_begin() */
+#define JPG_CTX(cinfo) ((SCANDEC_CTX *)(cinfo)->client_data)
+
+static void jpg_error_exit(j_common_ptr cinfo)
+{
+    if (g_debug) {
+        char msg[JMSG_LENGTH_MAX];
+        (*cinfo->err->format_message)(cinfo, msg);
+        fprintf(stderr, "%s [SCANDEC] encoder: libjpeg: %s\n", debug_ts(), msg);
+    }
+    longjmp(JPG_CTX(cinfo)->jpg_err.jb, 1);
+}
+
+/* The destination is sd->enc.buf, grown as libjpeg fills it */
+static void jpg_init_dest(j_compress_ptr cinfo)
+{
+    SCANDEC_CTX *sd = JPG_CTX(cinfo);
+    if (!enc_reserve(sd, ENC_CHUNK))
+        ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+    sd->jpg_dest.next_output_byte = sd->enc.buf + sd->enc.len;
+    sd->jpg_dest.free_in_buffer = sd->enc.cap - sd->enc.len;
+}
+
+static boolean jpg_empty_dest(j_compress_ptr cinfo)
+{
+    SCANDEC_CTX *sd = JPG_CTX(cinfo);
+    sd->enc.len = sd->enc.cap;
+    jpg_init_dest(cinfo);
+    return TRUE;
+}
+
+static void jpg_term_dest(j_compress_ptr cinfo)
+{
+    SCANDEC_CTX *sd = JPG_CTX(cinfo);
+    sd->enc.len = sd->enc.cap - sd->jpg_dest.free_in_buffer;
+}
+
+static int jpg_begin(SCANDEC_CTX *sd, int components)
+{
+    sd->jpg.err = jpeg_std_error(&sd->jpg_err.pub);
+    sd->jpg_err.pub.error_exit = jpg_error_exit;
+    sd->jpg.client_data = sd;           /* kept by jpeg_create_compress() */
+    if (setjmp(sd->jpg_err.jb)) {
+        jpeg_destroy_compress(&sd->jpg);
+        return 0;
+    }
+    jpeg_create_compress(&sd->jpg);
+    sd->jpg_dest.init_destination = jpg_init_dest;
+    sd->jpg_dest.empty_output_buffer = jpg_empty_dest;
+    sd->jpg_dest.term_destination = jpg_term_dest;
+    sd->jpg.dest = &sd->jpg_dest;
+    sd->jpg.image_width = sd->enc.px;
+    /* Placeholder until the page ends; see jpg_end() */
+    sd->jpg.image_height = JPEG_MAX_DIMENSION;
+    sd->jpg.input_components = components;
+    sd->jpg.in_color_space = components == 3 ? JCS_RGB : JCS_GRAYSCALE;
+    jpeg_set_defaults(&sd->jpg);
+    jpeg_set_quality(&sd->jpg, sd->enc.quality, TRUE);
+    if (sd->params.nOutResoX > 0 && sd->params.nOutResoY > 0) {
+        sd->jpg.density_unit = 1;
+        sd->jpg.X_density = (UINT16)sd->params.nOutResoX;
+        sd->jpg.Y_density = (UINT16)sd->params.nOutResoY;
+    }
+    jpeg_start_compress(&sd->jpg, TRUE);
+    return 1;
+}
+
+static int jpg_line(SCANDEC_CTX *sd, const BYTE *line, DWORD size)
+{
+    if (setjmp(sd->jpg_err.jb)) {
+        jpeg_destroy_compress(&sd->jpg);
+        return 0;
+    }
+    memcpy(sd->enc.last, line, size);
+    JSAMPROW row = sd->enc.last;
+    jpeg_write_scanlines(&sd->jpg, &row, 1);
+    return 1;
+}
+
+/*
+ * Finish at the real height.  Repeating the last line to whole iMCU rows
+ * lets every row be compressed, then image_height can be lowered to what
+ * was written and jpeg_finish_compress() closes the stream normally.
+ * The SOF still says JPEG_MAX_DIMENSION and is set to the page height.
+ */
+static int jpg_end(SCANDEC_CTX *sd)
+{
+    if (setjmp(sd->jpg_err.jb)) {
+        jpeg_destroy_compress(&sd->jpg);
+        return 0;
+    }
+    DWORD imcu = (DWORD)sd->jpg.max_v_samp_factor * DCTSIZE;
+    JSAMPROW row = sd->enc.last;
+    while (sd->jpg.next_scanline % imcu)
+        jpeg_write_scanlines(&sd->jpg, &row, 1);
+    sd->jpg.image_height = sd->jpg.next_scanline;
+    jpeg_finish_compress(&sd->jpg);
+    jpeg_destroy_compress(&sd->jpg);
+
+    for (size_t i = 2; i + 9 <= sd->enc.len && sd->enc.buf[i] == 0xFF; ) {
+        BYTE m = sd->enc.buf[i + 1];
+        if (m >= 0xC0 && m <= 0xC2) {
+            sd->enc.buf[i + 5] = (BYTE)(sd->enc.lines >> 8);
+            sd->enc.buf[i + 6] = (BYTE)sd->enc.lines;
+            break;
+        }
+        if (m == 0xDA)
+            break;
+        i += 2 + ((size_t)sd->enc.buf[i + 2] << 8 | sd->enc.buf[i + 3]);
+    }
+    return 1;
+}
+#endif
+
+/* --- Page control --- */
+
+static void enc_free(SCANDEC_CTX *sd)
+{
+    free(sd->enc.buf);
+    free(sd->enc.ref);
+    free(sd->enc.cur);
+    free(sd->enc.last);
+    sd->enc.buf = sd->enc.ref = sd->enc.cur = sd->enc.last = NULL;
+    sd->enc.len = sd->enc.cap = 0;
+    if (sd->enc.fd >= 0)
+        close(sd->enc.fd);
+    sd->enc.fd = -1;
+    sd->enc.kind = ENC_NONE;
+}
+
+/* Start a page on its first line; 0 when this scan is not encoded */
+static int enc_begin(SCANDEC_CTX *sd)
+{
+    DWORD px = sd->params.dwOutLinePixCnt;
+    int kind = sd->bpp == 0 ? ENC_G4 : ENC_JPEG;
+#ifndef HAVE_LIBJPEG
+    if (kind == ENC_JPEG) {
+        if (g_debug && !sd->enc.failed)
+            fprintf(stderr, "%s [SCANDEC] encoder: JPEG not built in "
+                    "(HAVE_LIBJPEG), %s page not encoded\n",
+                    debug_ts(), sd->stats.mode_name);
+        sd->enc.failed = 1;
+        return 0;
+    }
+#endif
+    sd->enc.page = __atomic_add_fetch(&g_enc_pages, 1, __ATOMIC_RELAXED);
+    sd->enc.px = px;
+    sd->enc.lines = 0;
+    sd->enc.len = 0;
+    sd->enc.bits = 0;
+    sd->enc.nbits = 0;
+    sd->enc.failed = 0;
+    sd->enc.page_out = 0;
+    if (!sd->enc.sink && !enc_open_file(sd, kind == ENC_G4 ? "g4" : "jpg")) {
+        sd->enc.failed = 1;
+        return 0;
+    }
+    sd->enc.kind = kind;
+    if (kind == ENC_G4) {
+        sd->enc.cap = ENC_CHUNK;
+        sd->enc.buf = (BYTE *)malloc(ENC_CHUNK);
+        sd->enc.ref = (BYTE *)calloc(1, (px + 7) / 8);
+        sd->enc.cur = (BYTE *)malloc((px + 7) / 8);
+        if (!sd->enc.buf || !sd->enc.ref || !sd->enc.cur)
+            goto fail;
+        return 1;
+    }
+#ifdef HAVE_LIBJPEG
+    sd->enc.last = (BYTE *)malloc(px * sd->bpp);
+    if (sd->enc.last && jpg_begin(sd, sd->bpp))
+        return 1;
+#endif
+fail:
+    enc_free(sd);
+    sd->enc.failed = 1;
+    return 0;
+}
+
+/* Feed one output line (outLine bytes, packed 1 = white in 1-bit) */
+static void enc_line(SCANDEC_CTX *sd, const BYTE *line)
+{
+    if (!sd->enc.on || sd->enc.failed)
+        return;
+    if (sd->enc.kind == ENC_NONE && !enc_begin(sd))
+        return;
+    struct timespec t0, t1;
+    if (g_debug)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    if (sd->enc.kind == ENC_G4) {
+        DWORD n = (sd->enc.px + 7) / 8;
+        for (DWORD i = 0; i < n; i++)
+            sd->enc.cur[i] = (BYTE)~line[i];
+        g4_row(sd);
+        BYTE *t = sd->enc.ref;
+        sd->enc.ref = sd->enc.cur;
+        sd->enc.cur = t;
+        sd->enc.bytes_in += n;
+    } else {
+#ifdef HAVE_LIBJPEG
+        if (!jpg_line(sd, line, sd->enc.px * sd->bpp)) {
+            enc_free(sd);
+            sd->enc.failed = 1;
+            return;
+        }
+        sd->enc.bytes_in += sd->enc.px * sd->bpp;
+#endif
+    }
+    sd->enc.lines++;
+    if (g_debug) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sd->enc.ms += elapsed_ms(&t0, &t1);
+    }
+}
+
+/* Page end: close the stream and hand over what is left */
+static void enc_end(SCANDEC_CTX *sd)
+{
+    if (sd->enc.kind == ENC_G4) {
+        g4_put(sd, G4_EOL);
+        g4_put(sd, G4_EOL);
+        if (sd->enc.nbits)
+            g4_put(sd, 0, 8 - sd->enc.nbits);
+        enc_sink(sd, sd->enc.buf, sd->enc.len);
+    }
+#ifdef HAVE_LIBJPEG
+    else if (sd->enc.kind == ENC_JPEG) {
+        if (jpg_end(sd))
+            enc_sink(sd, sd->enc.buf, sd->enc.len);
+        else
+            sd->enc.failed = 1;
+    }
+#endif
+    if (sd->enc.kind != ENC_NONE) {
+        sd->enc.pages++;
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] encoder: page %u, %s %lux%lu, "
+                    "%lu bytes%s\n", debug_ts(), sd->enc.page,
+                    sd->enc.kind == ENC_G4 ? "G4" : "JPEG",
+                    (unsigned long)sd->enc.px, (unsigned long)sd->enc.lines,
+                    sd->enc.page_out,
+                    sd->enc.failed ? ", sink failed" : "");
+    }
+    enc_free(sd);
+    sd->enc.failed = 0;
+}
+
+/*
+ * Progressive delivery.  With BROTHER_PREVIEW=<file> (normally under
+ * /dev/shm) the output lines of each page are also published while it
+ * is scanned, so a web frontend can draw the image as it arrives
+ * instead of waiting a minute for the whole page.  The file is mapped
+ * shared and holds a ring of line bands plus a 1/8-scale preview
+ * (8x8 box average, 8-bit gray or RGB; 1-bit scans give a gray
+ * preview).  Layout, all native-endian:
+ *
+ *   PRV_HEADER                  geometry and progress counters
+ *   PRV_BAND[bands] + lines     band k of a page in slot k % bands,
+ *                               band_lines output lines each
+ *   preview rows                preview_width * channels bytes each
+ *
+ * generation is odd while ScanDecOpen() lays the file out again, and
+ * readers re-read the geometry when it changes.  A band is complete
+ * once lines_done covers it.  Its slot's seq is odd while it is being
+ * refilled, so a reader copies the band and then checks that seq and
+ * first_line have not changed.  preview_rows counts the finished
+ * preview rows, and page_done is set at ScanDecPageEnd().
+ */
+#define PRV_MAGIC        "BRPRVW01"
+#define PRV_VERSION      1
+#define PRV_BANDS        8
+#define PRV_SCALE        8
+#define PRV_MAX_ROWS     2048           /* preview rows kept per page */
+
+typedef struct PRV_HEADER {
+    char     magic[8];
+    unsigned version;
+    unsigned generation;
+    unsigned page;                      /* pages started by the writer */
+    unsigned page_done;
+    unsigned lines_done;                /* lines in completed bands */
+    unsigned preview_rows;
+    unsigned width, line_bytes, bpp;    /* output lines (bpp 0 = 1-bit) */
+    unsigned reso_x, reso_y;
+    unsigned band_lines, bands, band_offset, band_stride;
+    unsigned preview_width, preview_channels, preview_offset;
+    unsigned preview_max_rows;
+    unsigned reserved[11];
+} PRV_HEADER;
+
+typedef struct {
+    unsigned seq;
+    unsigned first_line;
+    unsigned lines;
+    unsigned reserved;
+} PRV_BAND;
+
+static inline void prv_publish(unsigned *p, unsigned v)
+{
+    __atomic_store_n(p, v, __ATOMIC_RELEASE);
+}
+
+static PRV_BAND *prv_band(SCANDEC_CTX *sd, unsigned k)
+{
+    return (PRV_BAND *)(sd->prv.map + sd->prv.h->band_offset +
+                        (size_t)(k % sd->prv.h->bands) * sd->prv.h->band_stride);
+}
+
+static void prv_free(SCANDEC_CTX *sd)
+{
+    if (sd->prv.map)
+        munmap(sd->prv.map, sd->prv.size);
+    if (sd->prv.fd >= 0)
+        close(sd->prv.fd);
+    free(sd->prv.acc);
+    sd->prv.map = NULL;
+    sd->prv.h = NULL;
+    sd->prv.acc = NULL;
+    sd->prv.fd = -1;
+    sd->prv.open = 0;
+}
+
+/* Lay the file out for this scan's lines; not fatal when it fails */
+static void prv_setup(SCANDEC_CTX *sd, const SCANDEC_OPEN *p)
+{
+    prv_free(sd);
+    if (!g_prv_env || !*g_prv_env || !p->dwOutLineByte)
+        return;
+    char buf[320];
+    const char *path = ctx_path(sd, g_prv_env, buf, sizeof(buf));
+    unsigned band = (unsigned)g_prv_band_env;
+    unsigned ch = sd->bpp == 3 ? 3 : 1;
+    unsigned pw = (unsigned)(p->dwOutLinePixCnt + PRV_SCALE - 1) / PRV_SCALE;
+    size_t stride = (sizeof(PRV_BAND) + (size_t)band * p->dwOutLineByte + 7) & ~(size_t)7;
+    size_t size = sizeof(PRV_HEADER) + PRV_BANDS * stride +
+                  (size_t)pw * ch * PRV_MAX_ROWS;
+
+    sd->prv.fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    struct stat st;
+    if (sd->prv.fd < 0 || fstat(sd->prv.fd, &st) != 0 ||
+        ((size_t)st.st_size < size && ftruncate(sd->prv.fd, size) != 0)) {
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] preview: cannot use %s\n",
+                    debug_ts(), path);
+        prv_free(sd);
+        return;
+    }
+    /* Never shrink: readers may still have the old size mapped */
+    if ((size_t)st.st_size > size)
+        size = st.st_size;
+    sd->prv.map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                       sd->prv.fd, 0);
+    sd->prv.acc = (unsigned *)calloc((size_t)pw * ch, sizeof(unsigned));
+    if (sd->prv.map == MAP_FAILED || !sd->prv.acc) {
+        sd->prv.map = NULL;
+        prv_free(sd);
+        return;
+    }
+    sd->prv.size = size;
+    sd->prv.h = (PRV_HEADER *)sd->prv.map;
+
+    PRV_HEADER *h = sd->prv.h;
+    unsigned gen = memcmp(h->magic, PRV_MAGIC, 8) ? 0 : h->generation;
+    prv_publish(&h->generation, gen | 1);
+    memcpy(h->magic, PRV_MAGIC, 8);
+    h->version = PRV_VERSION;
+    h->page = sd->prv.page;
+    h->page_done = 0;
+    h->lines_done = 0;
+    h->preview_rows = 0;
+    h->width = (unsigned)p->dwOutLinePixCnt;
+    h->line_bytes = (unsigned)p->dwOutLineByte;
+    h->bpp = (unsigned)sd->bpp;
+    h->reso_x = (unsigned)p->nOutResoX;
+    h->reso_y = (unsigned)p->nOutResoY;
+    h->band_lines = band;
+    h->bands = PRV_BANDS;
+    h->band_offset = sizeof(PRV_HEADER);
+    h->band_stride = (unsigned)stride;
+    h->preview_width = pw;
+    h->preview_channels = ch;
+    h->preview_offset = (unsigned)(sizeof(PRV_HEADER) + PRV_BANDS * stride);
+    h->preview_max_rows = PRV_MAX_ROWS;
+    memset(sd->prv.map + sizeof(PRV_HEADER), 0, PRV_BANDS * stride);
+    prv_publish(&h->generation, (gen | 1) + 1);
+    if (g_debug)
+        fprintf(stderr, "%s [SCANDEC] preview: %s, %u bands of %u lines, "
+                "1/%d preview %ux%u\n", debug_ts(), path, PRV_BANDS,
+                band, PRV_SCALE, pw, ch);
+}
+
+/* Finish preview row r from the sums of rows lines */
+static void prv_row(SCANDEC_CTX *sd, unsigned r, unsigned rows)
+{
+    PRV_HEADER *h = sd->prv.h;
+    unsigned pw = h->preview_width, ch = h->preview_channels;
+    if (r < PRV_MAX_ROWS) {
+        BYTE *o = sd->prv.map + h->preview_offset + (size_t)r * pw * ch;
+        for (unsigned x = 0; x < pw; x++) {
+            unsigned cols = h->width - x * PRV_SCALE;
+            unsigned n = (cols < PRV_SCALE ? cols : PRV_SCALE) * rows;
+            for (unsigned c = 0; c < ch; c++)
+                o[x * ch + c] = (BYTE)((sd->prv.acc[x * ch + c] + n / 2) / n);
+        }
+        prv_publish(&h->preview_rows, r + 1);
+    }
+    memset(sd->prv.acc, 0, (size_t)pw * ch * sizeof(unsigned));
+}
+
+/* Close the band holding line n - 1 after its last line */
+static void prv_close_band(SCANDEC_CTX *sd, DWORD n)
+{
+    unsigned band = sd->prv.h->band_lines;
+    unsigned first = (unsigned)((n - 1) / band * band);
+    PRV_BAND *b = prv_band(sd, (unsigned)((n - 1) / band));
+    b->first_line = first;
+    b->lines = (unsigned)n - first;
+    prv_publish(&b->seq, b->seq + 1);
+    prv_publish(&sd->prv.h->lines_done, (unsigned)n);
+    sd->prv.bands++;
+}
+
+/* Publish one output line (outLine bytes, packed 1 = white in 1-bit) */
+static void prv_line(SCANDEC_CTX *sd, const BYTE *line)
+{
+    if (!sd->prv.h)
+        return;
+    PRV_HEADER *h = sd->prv.h;
+    if (!sd->prv.open) {
+        sd->prv.open = 1;
+        sd->prv.line = 0;
+        prv_publish(&h->lines_done, 0);
+        prv_publish(&h->preview_rows, 0);
+        prv_publish(&h->page_done, 0);
+        prv_publish(&h->page, ++sd->prv.page);
+    }
+    DWORD y = sd->prv.line++;
+    unsigned band = h->band_lines;
+    PRV_BAND *b = prv_band(sd, (unsigned)(y / band));
+    if (y % band == 0)
+        prv_publish(&b->seq, b->seq + 1);   /* odd: being refilled */
+    memcpy((BYTE *)(b + 1) + (size_t)(y % band) * h->line_bytes, line,
+           h->line_bytes);
+    if ((y + 1) % band == 0)
+        prv_close_band(sd, y + 1);
+
+    unsigned *acc = sd->prv.acc;
+    if (h->bpp == 0) {
+        for (unsigned x = 0; x < h->width; x++)
+            acc[x / PRV_SCALE] += (line[x >> 3] >> (7 - (x & 7)) & 1) * 255;
+    } else if (h->bpp == 1) {
+        for (unsigned x = 0; x < h->width; x++)
+            acc[x / PRV_SCALE] += line[x];
+    } else {
+        for (unsigned x = 0; x < h->width; x++)
+            for (unsigned c = 0; c < 3; c++)
+                acc[x / PRV_SCALE * 3 + c] += line[x * 3 + c];
+    }
+    if ((y + 1) % PRV_SCALE == 0)
+        prv_row(sd, (unsigned)(y / PRV_SCALE), PRV_SCALE);
+}
+
+/* Page end: publish the partial band and preview row, then page_done */
+static void prv_end(SCANDEC_CTX *sd)
+{
+    if (!sd->prv.h || !sd->prv.open)
+        return;
+    DWORD n = sd->prv.line;
+    if (n % sd->prv.h->band_lines)
+        prv_close_band(sd, n);
+    if (n % PRV_SCALE)
+        prv_row(sd, (unsigned)(n / PRV_SCALE), (unsigned)(n % PRV_SCALE));
+    prv_publish(&sd->prv.h->page_done, 1);
+    sd->prv.open = 0;
+}
+
+/* An output line is complete: feed the encoder and the preview */
+static void out_line(SCANDEC_CTX *sd, const BYTE *line)
+{
+    enc_line(sd, line);
+    prv_line(sd, line);
+}
+
+/*
+ * Resolution scaling.  When nOutResoX/Y differ from nInResoX/Y, lines
+ * are decoded to 8 bits at the input resolution into sd->scale.row (1-bit
+ * modes as gray, rendered after scaling) and resampled on the way out.
+ * Horizontally each output pixel has precomputed taps; vertically the
+ * stream keeps only the running box sums, or the previous and current
+ * rows, so each input line yields its output lines straight away.  A box
+ * filter averages everything an output pixel covers when shrinking;
+ * enlarging interpolates bilinearly between pixel centres.
+ */
+#define SCALE_ONE    4096             /* tap weights sum to this */
+#define SCALE_MAX_UP 16               /* per axis, = dwOutWriteMaxSize lines */
+
+static void scale_free(SCANDEC_CTX *sd)
+{
+    free(sd->scale.row);
+    free(sd->scale.hrow[0]);
+    free(sd->scale.hrow[1]);
+    free(sd->scale.line);
+    free(sd->scale.acc);
+    free(sd->scale.tap_first);
+    free(sd->scale.tap_w);
+    memset(&sd->scale, 0, sizeof(sd->scale));
+    sd->scale.max_up = 1;
+}
+
+static void scale_reset(SCANDEC_CTX *sd)
+{
+    sd->scale.in_lines = 0;
+    sd->scale.out_lines = 0;
+    if (sd->scale.acc)
+        memset(sd->scale.acc, 0, sd->scale.out_px * sd->scale.ch * sizeof(unsigned));
+}
+
+/* Horizontal taps: box over the covered span, or bilinear */
+static void scale_build_taps(SCANDEC_CTX *sd, DWORD in, DWORD out)
+{
+    for (DWORD x = 0; x < out; x++) {
+        unsigned short *wt = sd->scale.tap_w + x * sd->scale.ntap;
+        if (out < in) {
+            /* Input pixel i spans [i*out, (i+1)*out), output x spans
+             * [x*in, (x+1)*in) */
+            unsigned long long lo = (unsigned long long)x * in, hi = lo + in;
+            DWORD i = (DWORD)(lo / out);
+            unsigned sum = 0, k = 0;
+            sd->scale.tap_first[x] = i;
+            for (; (unsigned long long)i * out < hi && k < sd->scale.ntap; i++, k++) {
+                unsigned long long a = (unsigned long long)i * out, b = a + out;
+                if (a < lo) a = lo;
+                if (b > hi) b = hi;
+                wt[k] = (unsigned short)((b - a) * SCALE_ONE / in);
+                sum += wt[k];
+            }
+            wt[k - 1] += SCALE_ONE - sum;
+        } else {
+            /* Centre of x in input pixels, in 1/(2*out) steps */
+            long long num = (2LL * x + 1) * in - out;
+            if (num < 0) num = 0;
+            DWORD i = (DWORD)(num / (2LL * out));
+            unsigned f = (unsigned)(num % (2LL * out) * SCALE_ONE / (2LL * out));
+            if (i >= in - 1) {
+                i = in - 1;
+                f = 0;
+            }
+            sd->scale.tap_first[x] = i;
+            wt[0] = (unsigned short)(SCALE_ONE - f);
+            wt[1] = (unsigned short)f;
+        }
+    }
+}
+
+/* Set up scaling for the session just opened; 0 on allocation failure */
+static int scale_setup(SCANDEC_CTX *sd, const SCANDEC_OPEN *p)
+{
+    scale_free(sd);
+    DWORD in = p->dwInLinePixCnt, out = p->dwOutLinePixCnt;
+    int sx = in != out;
+    int sy = p->nInResoY > 0 && p->nOutResoY > 0 &&
+             p->nOutResoY != p->nInResoY &&
+             p->nOutResoY <= p->nInResoY * SCALE_MAX_UP;
+    if (!sx && !sy)
+        return 1;
+
+    int ch = sd->bpp == 3 ? 3 : 1;
+    sd->scale.ch = ch;
+    sd->scale.in_px = in;
+    sd->scale.out_px = out;
+    sd->scale.in_y = sy ? p->nInResoY : 1;
+    sd->scale.out_y = sy ? p->nOutResoY : 1;
+    sd->scale.max_up = (DWORD)((sd->scale.out_y + sd->scale.in_y - 1) / sd->scale.in_y);
+    if (sx)
+        sd->scale.ntap = out < in ? (in + out - 1) / out + 1 : 2;
+
+    /* Taps may reach ntap pixels past the last one, with weight 0 */
+    sd->scale.row = (BYTE *)calloc(((size_t)in + sd->scale.ntap) * ch, 1);
+    sd->scale.hrow[0] = (BYTE *)calloc((size_t)out * ch, 1);
+    sd->scale.hrow[1] = (BYTE *)calloc((size_t)out * ch, 1);
+    sd->scale.line = (BYTE *)malloc((size_t)out * ch);
+    sd->scale.acc = (unsigned *)calloc((size_t)out * ch, sizeof(unsigned));
+    if (sx) {
+        sd->scale.tap_first = (DWORD *)malloc(out * sizeof(DWORD));
+        sd->scale.tap_w = (unsigned short *)calloc((size_t)out * sd->scale.ntap,
+                                                   sizeof(unsigned short));
+    }
+    if (!sd->scale.row || !sd->scale.hrow[0] || !sd->scale.hrow[1] ||
+        !sd->scale.line || !sd->scale.acc ||
+        (sx && (!sd->scale.tap_first || !sd->scale.tap_w))) {
+        scale_free(sd);
+        return 0;
+    }
+    if (sx)
+        scale_build_taps(sd, in, out);
+    sd->scale.on = 1;
+    return 1;
+}
+
+/*
+ * n lines are at the start of pWriteBuff.  Unbatched, they are returned
+ * now; batched, they stay pending until the batch is full, the caller's
+ * buffer cannot take another input line's output, or lines have spilled.
+ */
+static DWORD finish_line(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st, DWORD n)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    if (sd->batch_max) {
+        if (n < sd->batch_max && !sd->spill_count &&
+            n + sd->scale.max_up <= w->dwWriteBuffSize / outLine) {
+            sd->batch_buf = w->pWriteBuff;
+            sd->batch_count = n;
+            if (st) *st = 0;
+            return 0;
+        }
+        batch_returned(sd, n);
+    }
+    if (st) *st = (INT)n;
+    return n * outLine;
+}
+
+/* Free what an open session holds (ScanDecClose(), a failed open) */
+static void ctx_release(SCANDEC_CTX *sd)
+{
+    pipe_stop(sd);
+    select_line_handlers(sd, 0);
+    free_planes(sd);
+    bw_free(sd);
+    scale_free(sd);
+    prv_free(sd);
+    free(sd->spill);
+    sd->spill = NULL;
+    sd->spill_max = 0;
+    sd->spill_count = 0;
+    sd->batch_max = 0;
+    sd->batch_count = 0;
+}
+
+/* ScanDecOpen() on sd; a failed open leaves nothing allocated or counted */
+static BOOL ctx_open(SCANDEC_CTX *sd, SCANDEC_OPEN *p)
+{
+    if (!p) return FALSE;
+    trace_open(sd, p);
+    pthread_mutex_lock(&g_setup_lock);
+    ev_setup();
+    g_brstats = brstats_attach();
+    pthread_mutex_unlock(&g_setup_lock);
+    if (g_ev.ring) {
+        ev_put(ev_clock(), EV_OPEN, (unsigned)p->nColorType, p->dwInLinePixCnt);
+        sd->ev_page = 0;
+        sd->ev_last_write = 0;
+    }
+
+    /* Reset statistics */
+    memset(&sd->stats, 0, sizeof(sd->stats));
+    clock_gettime(CLOCK_MONOTONIC, &sd->stats.open_time);
+    sd->stats.last_write = sd->stats.open_time;
+    sd->stats_on = g_debug || g_brstats;
+    select_line_handlers(sd, 0);
+    if (g_brstats && !sd->brstats_open) {
+        BRSTATS_ADD(g_brstats, scan_active, 1);
+        sd->brstats_open = 1;
+    }
+
+    p->dwOutLinePixCnt = p->dwInLinePixCnt;
+    if (p->nInResoX > 0 && p->nOutResoX > 0 && p->nOutResoX != p->nInResoX &&
+        p->nOutResoX <= p->nInResoX * SCALE_MAX_UP) {
+        p->dwOutLinePixCnt = (DWORD)((unsigned long long)p->dwInLinePixCnt *
+                                     p->nOutResoX / p->nInResoX);
+        if (p->dwOutLinePixCnt == 0)
+            p->dwOutLinePixCnt = 1;
+    }
+
+    /*
+     * Determine output bytes per line based on color type.
+     * Must match sane_get_parameters() in brother2.c:
+     *   SC_2BIT  → depth=1, bytes_per_line = (pixels+7)/8
+     *   SC_8BIT  → depth=8, bytes_per_line = pixels
+     *   SC_24BIT → depth=8, bytes_per_line = pixels*3
+     */
+    if (p->nColorType & SC_24BIT) {
+        sd->bpp = 3;
+        p->dwOutLineByte = p->dwOutLinePixCnt * 3;
+    } else if (p->nColorType & SC_8BIT) {
+        sd->bpp = 1;
+        p->dwOutLineByte = p->dwOutLinePixCnt;
+    } else {
+        sd->bpp = 0;
+        p->dwOutLineByte = (p->dwOutLinePixCnt + 7) / 8;
+    }
+
+    /* Store mode info for summary diagnostics */
+    sd->stats.mode_bpp = sd->bpp;
+    sd->stats.mode_name = (sd->bpp == 3) ? "24-bit RGB" :
+                          (sd->bpp == 1) ? "8-bit gray" : "1-bit B&W";
+
+    if (p->bLongBoundary)
+        p->dwOutLineByte = (p->dwOutLineByte + 3) & ~3UL;
+
+    p->dwOutWriteMaxSize = p->dwOutLineByte * 16;
+
+    memcpy(&sd->params, p, sizeof(*p));
+
+    /* Allocate the plane rows for 24-bit color mode */
+    free_planes(sd);
+    if (sd->bpp == 3 && !alloc_planes(sd, p->dwInLinePixCnt))
+        goto fail;
+
+    /* 1-bit engine and its gray line / error rows */
+    bw_free(sd);
+    if (sd->bpp == 0) {
+        int kind = p->nColorType & 0xFF;
+        sd->bw_mode = g_bw_env >= 0 ? g_bw_env :
+                      kind == (SC_ED & 0xFF)  ? BW_FS :
+                      kind == (SC_DTH & 0xFF) ? BW_BAYER : BW_THRESHOLD;
+        sd->bw_fn = g_bw_fns[sd->bw_mode];
+        /* Adaptive window: 1/4 inch at the output resolution */
+        sd->bw_window = g_bw_window_env ? g_bw_window_env
+                                        : (p->nOutResoX > 0 ? p->nOutResoX / 4 : 75);
+        if (sd->bw_window < 3) sd->bw_window = 3;
+        if (sd->bw_window > BW_MAX_WINDOW) sd->bw_window = BW_MAX_WINDOW;
+        sd->bw_window |= 1;
+        if (!bw_alloc(sd, p->dwOutLinePixCnt))
+            goto fail;
+        bw_reset(sd);
+    }
+
+    if (!scale_setup(sd, p))
+        goto fail;
+    blank_reset(sd);
+    prv_setup(sd, p);
+    if (!sd->enc.set) {
+        sd->enc.on = g_enc_env;
+        sd->enc.quality = g_enc_quality_env ? g_enc_quality_env
+                                            : ENC_DEFAULT_QUALITY;
+    }
+
+    /* Batched output, at most dwOutWriteMaxSize */
+    free(sd->spill);
+    sd->spill = NULL;
+    sd->spill_max = 0;
+    sd->spill_count = 0;
+    sd->batch_max = 0;
+    sd->batch_count = 0;
+    sd->page_done = 0;
+    pipe_stop(sd);
+    if (g_pipeline_env && sd->scale.on) {
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] decode pipeline not used with "
+                    "scaling, decoding inline\n", debug_ts());
+    } else if (g_pipeline_env && p->dwOutLineByte > 0 && !pipe_start(sd, p)) {
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] decode pipeline unavailable, "
+                    "decoding inline\n", debug_ts());
+    }
+    sd->planes_kept = sd->pipe.running;
+    if (g_batch_env > 1 && p->dwOutLineByte > 0 && !sd->pipe.running) {
+        sd->batch_max = p->dwOutWriteMaxSize / p->dwOutLineByte;
+        if (sd->batch_max > (DWORD)g_batch_env)
+            sd->batch_max = g_batch_env;
+        if (sd->batch_max < 2)
+            sd->batch_max = 0;
+    }
+    /* The spill starts at a batch less one line and a whole scaled-up
+     * input line, and grows while the caller's buffer falls behind */
+    if (sd->batch_max || sd->scale.max_up > 1) {
+        sd->spill_max = (sd->batch_max ? sd->batch_max - 1 : 0) + sd->scale.max_up;
+        sd->spill = (BYTE *)malloc(sd->spill_max * p->dwOutLineByte);
+        if (!sd->spill)
+            goto fail;
+    }
+
+    select_line_handlers(sd, 1);
+
+    if (g_debug) {
+        fprintf(stderr, "%s [SCANDEC] ScanDecOpen: %lux%lu px, reso %dx%d→%dx%d, "
+                "mode=%s, outLine=%lu bytes\n",
+                debug_ts(),
+                (unsigned long)p->dwInLinePixCnt,
+                (unsigned long)p->dwOutLinePixCnt,
+                p->nInResoX, p->nInResoY,
+                p->nOutResoX, p->nOutResoY,
+                sd->stats.mode_name, (unsigned long)p->dwOutLineByte);
+        if (sd->scale.on)
+            fprintf(stderr, "%s [SCANDEC] scaling: %lu -> %lu px (%s), "
+                    "%lld -> %lld dpi vertical (%s)\n", debug_ts(),
+                    (unsigned long)sd->scale.in_px, (unsigned long)sd->scale.out_px,
+                    !sd->scale.ntap ? "copy" :
+                    sd->scale.out_px < sd->scale.in_px ? "box" : "bilinear",
+                    sd->scale.in_y, sd->scale.out_y,
+                    sd->scale.in_y == sd->scale.out_y ? "copy" :
+                    sd->scale.out_y < sd->scale.in_y ? "box" : "bilinear");
+        if (sd->bpp == 0)
+            fprintf(stderr, "%s [SCANDEC] B&W rendering: %s, %s %d%s\n",
+                    debug_ts(), g_bw_names[sd->bw_mode],
+                    sd->bw_mode >= BW_BRADLEY ? "window" : "level",
+                    sd->bw_mode >= BW_BRADLEY ? sd->bw_window : g_bw_level,
+                    g_bw_env >= 0 ? " (BROTHER_BW_DITHER)" : "");
+    }
+
+    return TRUE;
+
+fail:
+    ctx_release(sd);
+    if (sd->brstats_open) {
+        __atomic_fetch_sub(&g_brstats->scan_active, 1, __ATOMIC_RELAXED);
+        sd->brstats_open = 0;
+    }
+    trace_close(sd);
+    return FALSE;
+}
+
+BOOL ScanDecOpen(SCANDEC_OPEN *p)
+{
+    return ctx_open(&g_sd_default, p);
+}
+
+static void ctx_set_tables(SCANDEC_CTX *sd, HANDLE h1, HANDLE h2)
+{
+    const BYTE *t1 = (const BYTE *)h1, *t2 = (const BYTE *)h2;
+
+    if (sd->trace) {
+        BYTE both[512];
+        memset(both, 0, sizeof(both));
+        if (t1) memcpy(both, t1, 256);
+        if (t2) memcpy(both + 256, t2, 256);
+        trace_rec(sd, TRACE_TABLES, t1 != NULL, t2 != NULL, both, sizeof(both));
+    }
+
+    /* The decode worker reads sd->tone */
+    if (sd->pipe.running)
+        pipe_wait_idle(sd);
+
+    int identity = 1;
+    for (int v = 0; v < 256; v++) {
+        BYTE o = t1 ? t1[v] : (BYTE)v;
+        if (t2)
+            o = t2[o];
+        sd->tone[v] = o;
+        if (o != v)
+            identity = 0;
+    }
+    sd->tone_on = !identity;
+    select_line_handlers(sd, sd->ready);
+
+    if (g_debug) {
+        fprintf(stderr, "%s [SCANDEC] ScanDecSetTblHandle: h1=%s h2=%s, %s\n",
+                debug_ts(), t1 ? "table" : "NULL", t2 ? "table" : "NULL",
+                sd->tone_on ? "fused tone LUT applied while decoding"
+                            : "identity, skipped");
+    }
+}
+
+void ScanDecSetTblHandle(HANDLE h1, HANDLE h2)
+{
+    ctx_set_tables(&g_sd_default, h1, h2);
+}
+
+static BOOL ctx_page_start(SCANDEC_CTX *sd)
+{
+    trace_rec(sd, TRACE_PAGE_START, 0, 0, NULL, 0);
+    if (g_ev.ring)
+        ev_put(ev_clock(), EV_PAGE_START, 0, ++sd->ev_page);
+    if (sd->pipe.running)
+        pipe_wait_idle(sd);
+    bw_reset(sd);
+    scale_reset(sd);
+    blank_reset(sd);
+    sd->page_done = 0;
+    return TRUE;
+}
+
+BOOL ScanDecPageStart(void)
+{
+    return ctx_page_start(&g_sd_default);
+}
+
+/*
+ * Per-line decoding, specialised.  The colour mode (with the fused 1-bit
+ * threshold as a mode of its own), whether a tone table is active and
+ * whether statistics are kept are fixed for the session, and each line's
+ * compression picks one of four handlers, so line_decode() below is
+ * stamped out once per mode x tone x statistics x compression with all
+ * four as constants.  select_line_handlers() points sd->line_fns at the
+ * row for the session, and again when ScanDecSetTblHandle() changes the
+ * tone, and line_handler() indexes that row by nInDataComp.  With
+ * statistics off the counters and clock reads are not compiled into the
+ * handlers at all.
+ *
+ * Each handler decodes one scanner line into dst: outLine bytes holding
+ * pixelsPerLine pixels (packed 1-bit in LINE_BW).  Without scaling that
+ * is the output line itself; with scaling it is an 8-bit line at the
+ * input resolution.  Returns 1 once dst holds a complete line, 0 while
+ * colour planes are still being collected.  t_start is when decoding of
+ * this line began (write_ms statistics).
+ */
+enum { LINE_BW_FAST, LINE_BW, LINE_BYTES, LINE_PLANES, LINE_MODES };
+
+#define LINE_INLINE static inline __attribute__((always_inline))
+
+/* Statistics for a completed line */
+static void line_done(SCANDEC_CTX *sd, DWORD outLine, struct timespec *t_start)
+{
+    struct timespec t_end;
+    sd->stats.lines_total++;
+    sd->stats.bytes_out += outLine;
+    clock_gettime(CLOCK_MONOTONIC, &t_end);
+    double call_ms = elapsed_ms(t_start, &t_end);
+    sd->stats.write_ms += call_ms;
+    if (call_ms > sd->stats.max_write_ms)
+        sd->stats.max_write_ms = call_ms;
+    hist_add(&sd->stats.line_hist, (uint64_t)(call_ms * 1e6));
+}
+
+/*
+ * 24-bit color mode: the scanner sends separate R, G, B planes
+ * (nInDataKind 2=Red, 3=Green, 4=Blue). Buffer each plane and
+ * only emit a pixel-interleaved RGB line when all three are received.
+ */
+LINE_INLINE int line_planes(SCANDEC_CTX *sd, const SCANDEC_WRITE *w, BYTE *dst,
+                            DWORD outLine, struct timespec *t_start,
+                            const int tone, const int comp, const int stats)
+{
+    if (stats) sd->stats.rgb_planes++;
+
+    int plane = w->nInDataKind - 2;
+    BYTE *planeBuf = plane_row(sd, plane);
+    sd->plane_src[plane] = planeBuf;
+    if (plane == 0) sd->have_red = 1;
+    else if (plane == 1) sd->have_green = 1;
+
+    if (comp == SCIDC_WHITE) {
+        if (stats) sd->stats.lines_white++;
+        sd->plane_src[plane] = sd->white_row;
+    } else if (comp == SCIDC_NONCOMP) {
+        if (stats) sd->stats.lines_noncomp++;
+        DWORD cpLen = w->dwLineDataSize;
+        if (cpLen > sd->plane_pixels) cpLen = sd->plane_pixels;
+        /* Blue completes the line, so the caller's buffer is still
+         * valid when we interleave — use it in place, and red and
+         * green too where they are kept until then. */
+        if (cpLen == sd->plane_pixels && (plane == 2 || sd->planes_kept)) {
+            sd->plane_src[plane] = w->pLineData;
+        } else {
+            memcpy(planeBuf, w->pLineData, cpLen);
+            if (cpLen < sd->plane_pixels)
+                memset(planeBuf + cpLen, 0, sd->plane_pixels - cpLen);
+        }
+    } else if (comp == SCIDC_PACK) {
+        if (stats) sd->stats.lines_pack++;
+        decode_packbits_line(sd, w->pLineData, w->dwLineDataSize,
+                             planeBuf, sd->plane_pixels, 0, stats);
+    } else {
+        if (stats) sd->stats.lines_unknown++;
+        DWORD cpLen = w->dwLineDataSize;
+        if (cpLen > sd->plane_pixels) cpLen = sd->plane_pixels;
+        memcpy(planeBuf, w->pLineData, cpLen);
+        /* A short plane must not show an older line */
+        if (cpLen < sd->plane_pixels)
+            memset(planeBuf + cpLen, 0, sd->plane_pixels - cpLen);
+    }
+
+    /* If this is not the Blue plane, or we're missing a plane, buffer only */
+    if (w->nInDataKind != 4 || !sd->have_red || !sd->have_green)
+        return 0;
+
+    /* All three planes received — interleave R,G,B into pixel RGB.
+     * Only the padding past the last pixel (bLongBoundary) needs
+     * clearing; the planes cover everything before it. */
+    DWORD safe_pixels = sd->plane_pixels;
+    if (safe_pixels > outLine / 3) safe_pixels = outLine / 3;
+    DWORD dark = tone
+        ? interleave_rgb_tone(sd->tone, sd->plane_src[0], sd->plane_src[1],
+                              sd->plane_src[2], dst, safe_pixels)
+        : g_interleave_rgb(sd->plane_src[0], sd->plane_src[1],
+                           sd->plane_src[2], dst, safe_pixels);
+    sd->line_ink = (!tone || sd->tone[0xFF] >= BLANK_INK_LEVEL) &&
+                   sd->plane_src[0] == sd->white_row &&
+                   sd->plane_src[1] == sd->white_row &&
+                   sd->plane_src[2] == sd->white_row ? 0 : dark;
+    if (safe_pixels * 3 < outLine)
+        memset(dst + safe_pixels * 3, 0, outLine - safe_pixels * 3);
+    sd->have_red = 0;
+    sd->have_green = 0;
+
+    if (stats)
+        line_done(sd, outLine, t_start);
+    return 1;
+}
+
+/*
+ * Grayscale / B&W path (bw: packed 1-bit output; bw_fast: the 1-bit
+ * lines the fused 128 threshold produces directly, without tone).  Every
+ * case below fills all outLine bytes (data plus zero padding), so the
+ * line is not cleared up front.
+ */
+LINE_INLINE int line_flat(SCANDEC_CTX *sd, const SCANDEC_WRITE *w, BYTE *dst,
+                          DWORD outLine, DWORD pixelsPerLine,
+                          struct timespec *t_start, const int bw,
+                          const int bw_fast, const int tone, const int comp,
+                          const int stats)
+{
+    sd->line_ink = INK_UNCOUNTED;
+
+    if (comp == SCIDC_WHITE) {
+        if (stats) sd->stats.lines_white++;
+        /* White line: fill output with white */
+        if (bw && !bw_fast) {
+            /* Rendered like any other gray line, keeping dither phase
+             * and diffused error in step */
+            memset(sd->bw_gray, tone ? sd->tone[0xFF] : 0xFF, sd->bw_pixels);
+            bw_render(sd, sd->bw_gray, sd->bw_pixels, dst, outLine);
+        } else {
+            /* One fill: 1-bit all 1s, 8-bit 0xFF through the tone */
+            memset(dst, !bw && tone ? sd->tone[0xFF] : 0xFF, outLine);
+            if (bw || !tone || sd->tone[0xFF] >= BLANK_INK_LEVEL)
+                sd->line_ink = 0;
+        }
+    } else if (comp == SCIDC_NONCOMP) {
+        if (stats) sd->stats.lines_noncomp++;
+        if (bw) {
+            /* B&W: input is 8-bit gray, convert to 1-bit packed */
+            DWORD avail = w->dwLineDataSize;
+            if (avail > pixelsPerLine) avail = pixelsPerLine;
+            if (bw_fast) {
+                gray8_to_1bit(w->pLineData, avail, dst, outLine);
+            } else if (tone) {
+                copy_tone(sd->tone, w->pLineData, sd->bw_gray, avail);
+                bw_render(sd, sd->bw_gray, avail, dst, outLine);
+            } else {
+                bw_render(sd, w->pLineData, avail, dst, outLine);
+            }
+        } else {
+            /* Direct copy for grayscale/color */
+            DWORD rawLen = w->dwLineDataSize;
+            if (rawLen > outLine) rawLen = outLine;
+            if (tone)
+                copy_tone(sd->tone, w->pLineData, dst, rawLen);
+            else
+                memcpy(dst, w->pLineData, rawLen);
+            if (rawLen < outLine)
+                memset(dst + rawLen, 0, outLine - rawLen);
+        }
+    } else if (comp == SCIDC_PACK) {
+        if (stats) sd->stats.lines_pack++;
+        if (bw && !bw_fast) {
+            /* B&W: decode to gray, then threshold / dither */
+            decode_packbits_line(sd, w->pLineData, w->dwLineDataSize,
+                                 sd->bw_gray, sd->bw_pixels, tone, stats);
+            bw_render(sd, sd->bw_gray, sd->bw_pixels, dst, outLine);
+        } else if (bw) {
+            /* B&W: decode runs straight into packed 1-bit output */
+            struct timespec t0, t1;
+            if (stats)
+                clock_gettime(CLOCK_MONOTONIC, &t0);
+            packbits_to_1bit(w->pLineData, w->dwLineDataSize,
+                             pixelsPerLine, dst, outLine);
+            if (stats) {
+                clock_gettime(CLOCK_MONOTONIC, &t1);
+                sd->stats.decode_ms += elapsed_ms(&t0, &t1);
+            }
+        } else {
+            /* Decompress directly to output */
+            decode_packbits_line(sd, w->pLineData, w->dwLineDataSize,
+                                 dst, outLine, tone, stats);
+        }
+    } else {
+        if (stats) sd->stats.lines_unknown++;
+        /* Unknown compression: try direct copy */
+        DWORD rawLen = w->dwLineDataSize;
+        if (rawLen > outLine) rawLen = outLine;
+        if (tone && !bw)
+            copy_tone(sd->tone, w->pLineData, dst, rawLen);
+        else
+            memcpy(dst, w->pLineData, rawLen);
+        if (rawLen < outLine)
+            memset(dst + rawLen, 0, outLine - rawLen);
+    }
+
+    if (stats)
+        line_done(sd, outLine, t_start);
+    return 1;
+}
+
+/* The body every handler is generated from; mode, tone, comp and stats
+ * are constants in each copy */
+LINE_INLINE int line_decode(SCANDEC_CTX *sd, const SCANDEC_WRITE *w, BYTE *dst,
+                            DWORD outLine, DWORD pixelsPerLine,
+                            struct timespec *t_start, const int mode,
+                            const int tone, const int comp, const int stats)
+{
+    /* Colour planes; a line of any other kind is taken as interleaved */
+    if (mode == LINE_PLANES && w->nInDataKind >= 2 && w->nInDataKind <= 4)
+        return line_planes(sd, w, dst, outLine, t_start, tone, comp, stats);
+    return line_flat(sd, w, dst, outLine, pixelsPerLine, t_start,
+                     mode == LINE_BW || mode == LINE_BW_FAST,
+                     mode == LINE_BW_FAST, tone, comp, stats);
+}
+
+#define LINE_HANDLER(name, mode, tone, comp, stats)                        \
+    static int name(SCANDEC_CTX *sd, const SCANDEC_WRITE *w, BYTE *dst,    \
+                    DWORD outLine, DWORD pixelsPerLine,                    \
+                    struct timespec *t_start)                              \
+    {                                                                      \
+        return line_decode(sd, w, dst, outLine, pixelsPerLine, t_start,    \
+                           mode, tone, comp, stats);                       \
+    }
+
+/* One handler per compression, in nInDataComp order (0: unknown) */
+#define LINE_HANDLERS(tag, mode, tone, stats)                              \
+    LINE_HANDLER(line_##tag##_other,   mode, tone, 0, stats)               \
+    LINE_HANDLER(line_##tag##_white,   mode, tone, SCIDC_WHITE, stats)     \
+    LINE_HANDLER(line_##tag##_noncomp, mode, tone, SCIDC_NONCOMP, stats)   \
+    LINE_HANDLER(line_##tag##_pack,    mode, tone, SCIDC_PACK, stats)
+#define LINE_ROW(tag) { line_##tag##_other, line_##tag##_white,             \
+                        line_##tag##_noncomp, line_##tag##_pack }
+/* Without and with statistics */
+#define LINE_ROWS(tag) { LINE_ROW(tag), LINE_ROW(tag##_stats) }
+
+LINE_HANDLERS(bwfast, LINE_BW_FAST, 0, 0)
+LINE_HANDLERS(bwfast_stats, LINE_BW_FAST, 0, 1)
+LINE_HANDLERS(bw, LINE_BW, 0, 0)
+LINE_HANDLERS(bw_stats, LINE_BW, 0, 1)
+LINE_HANDLERS(bw_tone, LINE_BW, 1, 0)
+LINE_HANDLERS(bw_tone_stats, LINE_BW, 1, 1)
+LINE_HANDLERS(bytes, LINE_BYTES, 0, 0)
+LINE_HANDLERS(bytes_stats, LINE_BYTES, 0, 1)
+LINE_HANDLERS(bytes_tone, LINE_BYTES, 1, 0)
+LINE_HANDLERS(bytes_tone_stats, LINE_BYTES, 1, 1)
+LINE_HANDLERS(planes, LINE_PLANES, 0, 0)
+LINE_HANDLERS(planes_stats, LINE_PLANES, 0, 1)
+LINE_HANDLERS(planes_tone, LINE_PLANES, 1, 0)
+LINE_HANDLERS(planes_tone_stats, LINE_PLANES, 1, 1)
+
+/* By mode, tone, statistics and compression.  The fused threshold has no
+ * tone variant (a tone table selects LINE_BW); its slot repeats that row */
+static const LINE_FN g_line_table[LINE_MODES][2][2][SCIDC_PACK + 1] = {
+    [LINE_BW_FAST] = { LINE_ROWS(bwfast), LINE_ROWS(bw_tone) },
+    [LINE_BW]      = { LINE_ROWS(bw),     LINE_ROWS(bw_tone) },
+    [LINE_BYTES]   = { LINE_ROWS(bytes),  LINE_ROWS(bytes_tone) },
+    [LINE_PLANES]  = { LINE_ROWS(planes), LINE_ROWS(planes_tone) },
+};
+
+static inline LINE_FN line_handler(SCANDEC_CTX *sd, const SCANDEC_WRITE *w)
+{
+    unsigned comp = (unsigned)w->nInDataComp;
+    return sd->line_fns[comp <= SCIDC_PACK ? comp : 0];
+}
+
+/* Horizontal pass: sd->scale.row -> dst at the output width */
+static void scale_h(SCANDEC_CTX *sd, const BYTE *in, BYTE *dst)
+{
+    int ch = sd->scale.ch;
+    if (!sd->scale.ntap) {
+        memcpy(dst, in, sd->scale.out_px * ch);
+        return;
+    }
+    for (DWORD x = 0; x < sd->scale.out_px; x++) {
+        const unsigned short *wt = sd->scale.tap_w + x * sd->scale.ntap;
+        const BYTE *src = in + sd->scale.tap_first[x] * ch;
+        for (int c = 0; c < ch; c++) {
+            unsigned v = SCALE_ONE / 2;
+            for (unsigned k = 0; k < sd->scale.ntap; k++)
+                v += wt[k] * src[k * ch + c];
+            dst[x * ch + c] = (BYTE)(v / SCALE_ONE);
         }
-        rawLen = outLine;
-        break;
+    }
+}
 
-    case SCIDC_NONCOMP:
-        if (g_debug) g_stats.lines_noncomp++;
-        if (g_bpp == 0) {
-            /* B&W: input is 8-bit gray, convert to 1-bit packed */
-            gray8_to_1bit(w->pLineData, pixelsPerLine,
-                         w->pWriteBuff, outLine);
-        } else {
-            /* Direct copy for grayscale/color */
-            rawLen = w->dwLineDataSize;
-            if (rawLen > outLine) rawLen = outLine;
-            memcpy(w->pWriteBuff, w->pLineData, rawLen);
-        }
-        rawLen = outLine;
-        break;
-
-    case SCIDC_PACK:
-        if (g_debug) g_stats.lines_pack++;
-        if (g_bpp == 0) {
-            /* B&W: decompress to temp buffer, then convert to 1-bit */
-            rawBuf = (BYTE *)malloc(pixelsPerLine);
-            if (rawBuf) {
-                DWORD decompressed = decode_packbits(w->pLineData,
-                    w->dwLineDataSize, rawBuf, pixelsPerLine);
-                (void)decompressed;
-                gray8_to_1bit(rawBuf, pixelsPerLine,
-                             w->pWriteBuff, outLine);
-                free(rawBuf);
+/*
+ * Deliver one scaled 8-bit line as output line n of dst (room lines),
+ * rendered to 1-bit for B&W modes, and to the encoder and preview with
+ * out set.  Returns 1 if it was written; the callers pass the spill when
+ * the caller's buffer is short, so a line is lost only if the spill
+ * could not grow.
+ */
+LINE_INLINE DWORD scale_emit(SCANDEC_CTX *sd, const BYTE *line, BYTE *dst,
+                             DWORD room, DWORD n, const int out)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    sd->scale.out_lines++;
+    if (n >= room) {
+        if (sd->stats_on) sd->stats.scale_dropped++;
+        return 0;
+    }
+    BYTE *o = dst + n * outLine;
+    blank_line(sd, line, sd->scale.out_px, INK_UNCOUNTED);
+    if (sd->bpp == 0) {
+        bw_render(sd, line, sd->scale.out_px, o, outLine);
+    } else {
+        DWORD b = sd->scale.out_px * sd->scale.ch;
+        if (b > outLine) b = outLine;
+        memcpy(o, line, b);
+        if (b < outLine)
+            memset(o + b, 0, outLine - b);
+    }
+    if (out)
+        out_line(sd, o);
+    return 1;
+}
+
+/* Vertical pass for the line in sd->scale.row; returns lines written */
+LINE_INLINE DWORD scale_line(SCANDEC_CTX *sd, BYTE *dst, DWORD room,
+                             const int out)
+{
+    DWORD size = sd->scale.out_px * sd->scale.ch, n = 0;
+    BYTE *prev = sd->scale.hrow[0], *cur = sd->scale.hrow[1];
+    sd->scale.hrow[0] = cur;
+    sd->scale.hrow[1] = prev;
+    scale_h(sd, sd->scale.row, cur);
+
+    long long i = (long long)sd->scale.in_lines++;
+    long long in_y = sd->scale.in_y, out_y = sd->scale.out_y;
+    if (in_y == out_y) {
+        n += scale_emit(sd, cur, dst, room, n, out);
+    } else if (out_y < in_y) {
+        /* Input line i spans [i*out_y, (i+1)*out_y), output line j
+         * spans [j*in_y, (j+1)*in_y) */
+        long long lo = i * out_y, hi = lo + out_y;
+        for (;;) {
+            long long jlo = (long long)sd->scale.out_lines * in_y;
+            long long jhi = jlo + in_y;
+            long long a = lo > jlo ? lo : jlo, b = hi < jhi ? hi : jhi;
+            if (b > a)
+                for (DWORD k = 0; k < size; k++)
+                    sd->scale.acc[k] += (unsigned)(b - a) * cur[k];
+            if (jhi > hi)
+                break;
+            for (DWORD k = 0; k < size; k++) {
+                sd->scale.line[k] = (BYTE)((sd->scale.acc[k] + in_y / 2) / in_y);
+                sd->scale.acc[k] = 0;
             }
-        } else {
-            /* Decompress directly to output */
-            decode_packbits(w->pLineData, w->dwLineDataSize,
-                          w->pWriteBuff, outLine);
+            n += scale_emit(sd, sd->scale.line, dst, room, n, out);
         }
-        rawLen = outLine;
-        break;
+    } else {
+        /* Every output line whose centre lies at or above this row */
+        for (;;) {
+            long long num = (2LL * sd->scale.out_lines + 1) * in_y - out_y;
+            if (num < 0) num = 0;
+            if (num > 2 * out_y * i)
+                break;
+            unsigned f = (unsigned)(num % (2 * out_y) * 256 / (2 * out_y));
+            const BYTE *a = num / (2 * out_y) < i ? prev : cur;
+            for (DWORD k = 0; k < size; k++)
+                sd->scale.line[k] = (BYTE)((a[k] * (256 - f) + cur[k] * f + 128) >> 8);
+            n += scale_emit(sd, sd->scale.line, dst, room, n, out);
+        }
+    }
+    return n;
+}
 
-    default:
-        if (g_debug) g_stats.lines_unknown++;
-        /* Unknown compression: try direct copy */
-        rawLen = w->dwLineDataSize;
-        if (rawLen > outLine) rawLen = outLine;
-        memcpy(w->pWriteBuff, w->pLineData, rawLen);
-        rawLen = outLine;
-        break;
+/*
+ * Page end: when enlarging, the output lines below the centre of the
+ * last input row are still owed; they repeat that row.
+ */
+static DWORD scale_flush(SCANDEC_CTX *sd, BYTE *dst, DWORD room)
+{
+    DWORD n = 0;
+    if (!sd->scale.on || sd->scale.out_y <= sd->scale.in_y || !sd->scale.in_lines)
+        return 0;
+    unsigned long total = (unsigned long)
+        (sd->scale.in_lines * sd->scale.out_y / sd->scale.in_y);
+    int out = sd->enc.on || sd->prv.h;
+    while (sd->scale.out_lines < total)
+        n += scale_emit(sd, sd->scale.hrow[0], dst, room, n, out);
+    return n;
+}
+
+/*
+ * Decode one scanner line into dst, which has room for room output
+ * lines.  Returns the number of output lines written: 0 or 1 at the
+ * native resolution, 0..max_up when scaling.  Whether the session
+ * scales, has an encoder or preview to feed (out) and keeps statistics
+ * are constants in each copy; select_line_handlers() picks one into
+ * sd->decode.
+ */
+LINE_INLINE DWORD decode_line(SCANDEC_CTX *sd, const SCANDEC_WRITE *w,
+                              BYTE *dst, DWORD room, struct timespec *t_start,
+                              const int scaled, const int out, const int stats)
+{
+    if (!scaled) {
+        if (!line_handler(sd, w)(sd, w, dst, sd->params.dwOutLineByte,
+                                 sd->params.dwOutLinePixCnt, t_start))
+            return 0;
+        blank_line(sd, dst, sd->params.dwOutLinePixCnt, sd->line_ink);
+        if (out)
+            out_line(sd, dst);
+        return 1;
     }
+    if (!line_handler(sd, w)(sd, w, sd->scale.row,
+                             sd->scale.in_px * sd->scale.ch,
+                             sd->scale.in_px, t_start))
+        return 0;
 
-    if (g_debug) {
-        g_stats.lines_total++;
-        g_stats.bytes_out += outLine;
-        clock_gettime(CLOCK_MONOTONIC, &t_end);
-        double call_ms = elapsed_ms(&t_start, &t_end);
-        g_stats.write_ms += call_ms;
-        if (call_ms > g_stats.max_write_ms)
-            g_stats.max_write_ms = call_ms;
-        if ((g_stats.lines_total % 100) == 0) {
-            double total_ms = elapsed_ms(&g_stats.open_time, &t_end);
-            double interval_ms = elapsed_ms(&g_stats.last_progress, &t_end);
-            g_stats.last_progress = t_end;
-            fprintf(stderr, "%s [SCANDEC] progress: %lu lines, %.1f ms elapsed, "
-                    "last 100 in %.1f ms (%.1f ms/line), "
-                    "%.2f ms/line decode avg, max gap %.1f ms\n",
-                    debug_ts(),
-                    g_stats.lines_total, total_ms,
-                    interval_ms, interval_ms / 100.0,
-                    g_stats.write_ms / g_stats.lines_total,
-                    g_stats.max_gap_ms);
-        }
-    }
-
-    if (st) *st = 1;
-    return outLine;
+    struct timespec t0, t1;
+    if (stats)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    DWORD n = scale_line(sd, dst, room, out);
+    if (stats) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sd->stats.scale_ms += elapsed_ms(&t0, &t1);
+    }
+    return n;
 }
 
-DWORD ScanDecPageEnd(SCANDEC_WRITE *w, INT *st)
+#define DECODE_FN_DEF(name, scaled, out, stats)                            \
+    static DWORD name(SCANDEC_CTX *sd, const SCANDEC_WRITE *w, BYTE *dst,  \
+                      DWORD room, struct timespec *t_start)                \
+    {                                                                      \
+        return decode_line(sd, w, dst, room, t_start, scaled, out, stats); \
+    }
+
+DECODE_FN_DEF(decode_native,           0, 0, 0)
+DECODE_FN_DEF(decode_native_stats,     0, 0, 1)
+DECODE_FN_DEF(decode_native_out,       0, 1, 0)
+DECODE_FN_DEF(decode_native_out_stats, 0, 1, 1)
+DECODE_FN_DEF(decode_scaled,           1, 0, 0)
+DECODE_FN_DEF(decode_scaled_stats,     1, 0, 1)
+DECODE_FN_DEF(decode_scaled_out,       1, 1, 0)
+DECODE_FN_DEF(decode_scaled_out_stats, 1, 1, 1)
+
+/* By scaling, output and statistics */
+static const DECODE_FN g_decode_table[2][2][2] = {
+    { { decode_native, decode_native_stats },
+      { decode_native_out, decode_native_out_stats } },
+    { { decode_scaled, decode_scaled_stats },
+      { decode_scaled_out, decode_scaled_out_stats } },
+};
+
+/*
+ * Pipelined decode (BROTHER_PIPELINE=1).  ScanDecWrite() copies the
+ * scanner line into a bounded job queue and returns with the lines the
+ * worker thread has finished since the last call, one line behind the
+ * input (see pipe_submit()), so the backend's next USB read overlaps
+ * with decoding and colour-plane assembly on another core.
+ *
+ * At most max_lines - 1 jobs and finished lines are in flight before a
+ * caller must wait (one more may be queued when the caller's buffer is
+ * already full), so ScanDecPageEnd() can wait for the worker to go idle
+ * and return everything left in a single dwOutWriteMaxSize-sized call.
+ * The worker owns decode_line() and the decode statistics; the caller
+ * thread only touches the gap/bytes_in counters.
+ */
+static void *pipe_worker(void *arg)
+{
+    SCANDEC_CTX *sd = (SCANDEC_CTX *)arg;
+    DWORD outLine = sd->params.dwOutLineByte;
+
+    pthread_mutex_lock(&sd->pipe.lock);
+    for (;;) {
+        while (!sd->pipe.stop && sd->pipe.job_count == 0)
+            pthread_cond_wait(&sd->pipe.cond, &sd->pipe.lock);
+        if (sd->pipe.job_count == 0)
+            break;
+        PIPE_JOB *j = &sd->pipe.job[sd->pipe.job_head];
+        BYTE *dst = sd->pipe.out +
+            ((sd->pipe.out_head + sd->pipe.out_count) % sd->pipe.max_lines) * outLine;
+        sd->pipe.job_head = (sd->pipe.job_head + 1) % sd->pipe.job_slots;
+        sd->pipe.job_count--;
+        sd->pipe.busy = 1;
+        pthread_mutex_unlock(&sd->pipe.lock);
+
+        /* The slot stays ours until busy is cleared */
+        struct timespec t0;
+        if (sd->stats_on)
+            clock_gettime(CLOCK_MONOTONIC, &t0);
+        SCANDEC_WRITE jw;
+        memset(&jw, 0, sizeof(jw));
+        jw.nInDataComp = j->nInDataComp;
+        jw.nInDataKind = j->nInDataKind;
+        jw.pLineData = j->pLineData;
+        jw.dwLineDataSize = j->dwLineDataSize;
+        jw.pWriteBuff = dst;
+        jw.dwWriteBuffSize = outLine;
+        uint64_t e0 = g_ev.ring ? ev_clock() : 0;
+        int produced = sd->decode(sd, &jw, dst, 1, &t0) != 0;
+        if (g_ev.ring) {
+            uint64_t e1 = ev_clock();
+            ev_put(e1, EV_DECODE, (unsigned)produced, e1 - e0);
+        }
+
+        pthread_mutex_lock(&sd->pipe.lock);
+        if (produced)
+            sd->pipe.out_count++;
+        if (j->completes)
+            sd->pipe.owed--;
+        sd->pipe.busy = 0;
+        pthread_cond_broadcast(&sd->pipe.cond);
+    }
+    pthread_mutex_unlock(&sd->pipe.lock);
+    return NULL;
+}
+
+static void pipe_stop(SCANDEC_CTX *sd)
+{
+    if (sd->pipe.running) {
+        pthread_mutex_lock(&sd->pipe.lock);
+        sd->pipe.stop = 1;
+        pthread_cond_broadcast(&sd->pipe.cond);
+        pthread_mutex_unlock(&sd->pipe.lock);
+        pthread_join(sd->pipe.thread, NULL);
+        pthread_cond_destroy(&sd->pipe.cond);
+        pthread_mutex_destroy(&sd->pipe.lock);
+        sd->stats.batch_dropped += sd->pipe.out_count;
+    }
+    free(sd->pipe.job);
+    free(sd->pipe.job_mem);
+    free(sd->pipe.out);
+    memset(&sd->pipe, 0, sizeof(sd->pipe));
+}
+
+/* Start the worker for the session just opened with p; 0 on failure */
+static int pipe_start(SCANDEC_CTX *sd, const SCANDEC_OPEN *p)
+{
+    sd->pipe.max_lines = p->dwOutWriteMaxSize / p->dwOutLineByte;
+    if (sd->pipe.max_lines < 2)
+        return 0;
+    /* The longest line the decoders read from (a plane or input line of
+     * dwInLinePixCnt, a raw line of dwOutLineByte) PackBits-coded with a
+     * literal per byte, and room for padding; pipe_submit() rejects
+     * longer ones rather than decode part of them */
+    DWORD longest = p->dwInLinePixCnt > p->dwOutLineByte ? p->dwInLinePixCnt
+                                                         : p->dwOutLineByte;
+    sd->pipe.job_cap = longest * 2 + 256;
+    /* Two slots past the bound keep the red and green jobs of the line
+     * being decoded in place while later jobs are queued, so their
+     * planes are read from the slots (planes_kept) */
+    sd->pipe.job_slots = sd->pipe.max_lines + 2;
+    sd->pipe.job = (PIPE_JOB *)calloc(sd->pipe.job_slots, sizeof(PIPE_JOB));
+    sd->pipe.job_mem = (BYTE *)malloc(sd->pipe.job_slots * sd->pipe.job_cap);
+    sd->pipe.out = (BYTE *)malloc(sd->pipe.max_lines * p->dwOutLineByte);
+    if (!sd->pipe.job || !sd->pipe.job_mem || !sd->pipe.out) {
+        pipe_stop(sd);
+        return 0;
+    }
+    for (unsigned i = 0; i < sd->pipe.job_slots; i++)
+        sd->pipe.job[i].pLineData = sd->pipe.job_mem + i * sd->pipe.job_cap;
+    pthread_mutex_init(&sd->pipe.lock, NULL);
+    pthread_cond_init(&sd->pipe.cond, NULL);
+    if (pthread_create(&sd->pipe.thread, NULL, pipe_worker, sd) != 0) {
+        pthread_cond_destroy(&sd->pipe.cond);
+        pthread_mutex_destroy(&sd->pipe.lock);
+        pipe_stop(sd);
+        return 0;
+    }
+    sd->pipe.running = 1;
+    return 1;
+}
+
+/*
+ * Move up to *room finished lines into dst (called with the lock held;
+ * the copied slots are not reused until out_head moves past them).  With
+ * hold set, the newest line stays behind while no later line is owed.
+ */
+static DWORD pipe_collect(SCANDEC_CTX *sd, BYTE **dst, DWORD *room, int hold)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    DWORD n = 0;
+    while (sd->pipe.out_count > (sd->pipe.owed ? 0u : (unsigned)hold) && *room) {
+        memcpy(*dst, sd->pipe.out + sd->pipe.out_head * outLine, outLine);
+        sd->pipe.out_head = (sd->pipe.out_head + 1) % sd->pipe.max_lines;
+        sd->pipe.out_count--;
+        *dst += outLine;
+        (*room)--;
+        n++;
+    }
+    return n;
+}
+
+/*
+ * Queue one scanner line.  Lines come back one call behind the input:
+ * the newest decoded line is held until the next line that completes an
+ * output line (any but a red or green plane) is queued, and that call
+ * returns it, waiting for the worker if need be, while the worker
+ * decodes the new line during the caller's next read.  Only the first
+ * line of a page (or one after an input line that produced none) returns
+ * 0 lines; ScanDecPageEnd() returns the last.
+ */
+static DWORD pipe_submit(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    BYTE *dst = w->pWriteBuff;
+    DWORD room = w->dwWriteBuffSize / outLine;
+    DWORD lines = 0;
+    struct timespec t0, t1;
+
+    if (w->dwLineDataSize > sd->pipe.job_cap) {
+        if (sd->stats_on)
+            sd->stats.pipe_rejected++;
+        if (st) *st = -1;
+        return 0;
+    }
+    int completes = !(sd->bpp == 3 && sd->plane_buf) || w->nInDataKind == 4;
+
+    pthread_mutex_lock(&sd->pipe.lock);
+    lines += pipe_collect(sd, &dst, &room, 1);
+    /* Wait for the pipeline to drain below its bound, returning lines as
+     * they finish.  With no room left one extra job is allowed (we have
+     * returned at least one line, so the bound still holds overall). */
+    if (sd->stats_on)
+        clock_gettime(CLOCK_MONOTONIC, &t0);
+    while (sd->pipe.job_count + sd->pipe.busy + sd->pipe.out_count
+               >= sd->pipe.max_lines - 1 && room) {
+        pthread_cond_wait(&sd->pipe.cond, &sd->pipe.lock);
+        lines += pipe_collect(sd, &dst, &room, 1);
+    }
+
+    PIPE_JOB *j = &sd->pipe.job[(sd->pipe.job_head + sd->pipe.job_count)
+                              % sd->pipe.job_slots];
+    j->nInDataComp = w->nInDataComp;
+    j->nInDataKind = w->nInDataKind;
+    j->dwLineDataSize = w->dwLineDataSize;
+    j->completes = completes;
+    memcpy(j->pLineData, w->pLineData, j->dwLineDataSize);
+    sd->pipe.job_count++;
+    sd->pipe.owed += completes;
+    unsigned inflight = sd->pipe.job_count + sd->pipe.busy + sd->pipe.out_count;
+    pthread_cond_broadcast(&sd->pipe.cond);
+
+    /* The held line, or the one before this still being decoded */
+    lines += pipe_collect(sd, &dst, &room, 1);
+    while (completes && !lines && room && sd->pipe.owed > 1) {
+        pthread_cond_wait(&sd->pipe.cond, &sd->pipe.lock);
+        lines += pipe_collect(sd, &dst, &room, 1);
+    }
+    pthread_mutex_unlock(&sd->pipe.lock);
+    if (sd->stats_on) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        sd->stats.pipe_wait_ms += elapsed_ms(&t0, &t1);
+    }
+
+    if (sd->stats_on) {
+        if (inflight > sd->stats.pipe_max_inflight)
+            sd->stats.pipe_max_inflight = inflight;
+        sd->stats.pipe_lines += lines;
+    }
+    if (st) *st = (INT)lines;
+    return lines * outLine;
+}
+
+/* Block until the worker has decoded every queued job */
+static void pipe_wait_idle(SCANDEC_CTX *sd)
+{
+    pthread_mutex_lock(&sd->pipe.lock);
+    while (sd->pipe.job_count || sd->pipe.busy)
+        pthread_cond_wait(&sd->pipe.cond, &sd->pipe.lock);
+    pthread_mutex_unlock(&sd->pipe.lock);
+}
+
+/* Page end: return what the worker has left, once it is idle */
+static DWORD pipe_flush(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    DWORD outLine = sd->params.dwOutLineByte;
+    DWORD lines = 0;
+
+    pipe_wait_idle(sd);
+    pthread_mutex_lock(&sd->pipe.lock);
+    if (w && w->pWriteBuff) {
+        BYTE *dst = w->pWriteBuff;
+        DWORD room = w->dwWriteBuffSize / outLine;
+        lines = pipe_collect(sd, &dst, &room, 0);
+    }
+    pthread_mutex_unlock(&sd->pipe.lock);
+
+    if (sd->stats_on)
+        sd->stats.pipe_lines += lines;
+    if (st) *st = (INT)lines;
+    return lines * outLine;
+}
+
+/* Record EV_RETURN for a call that began at t0 and returns bytes */
+static inline DWORD ev_return(SCANDEC_CTX *sd, uint64_t t0, DWORD bytes,
+                               const int instr)
+{
+    if (instr && g_ev.ring) {
+        uint64_t t = ev_clock();
+        ev_put(t, EV_RETURN,
+               sd->params.dwOutLineByte ? bytes / sd->params.dwOutLineByte : 0,
+               t - t0);
+    }
+    return bytes;
+}
+
+/*
+ * ScanDecWrite() body.  With instr clear (no statistics, trace or event
+ * ring this session) none of the instrumentation is compiled in; the two
+ * copies are write_plain() and write_instr(), and ScanDecOpen() picks one.
+ */
+static inline __attribute__((always_inline))
+DWORD write_line(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st, const int instr)
+{
+    struct timespec t_start;
+    const int stats = instr && sd->stats_on;
+    if (stats)
+        clock_gettime(CLOCK_MONOTONIC, &t_start);
+
+    if (!w || !w->pLineData || !w->pWriteBuff) {
+        if (st) *st = -1;
+        return 0;
+    }
+    if (instr)
+        trace_rec(sd, TRACE_WRITE, w->nInDataComp, w->nInDataKind, w->pLineData,
+                  w->dwLineDataSize);
+    uint64_t ev_t0 = 0;
+    if (instr && g_ev.ring) {
+        ev_t0 = ev_clock();
+        if (sd->ev_last_write && ev_t0 - sd->ev_last_write > EV_GAP_US * 1000ull)
+            ev_put(ev_t0, EV_GAP, 0, (ev_t0 - sd->ev_last_write) / 1000);
+        sd->ev_last_write = ev_t0;
+        ev_put(ev_t0, EV_WRITE,
+               (unsigned)(w->nInDataComp & 0xFF) << 8 | (w->nInDataKind & 0xFF),
+               w->dwLineDataSize);
+    }
+
+    DWORD outLine = sd->params.dwOutLineByte;
+    if (outLine == 0 || outLine > w->dwWriteBuffSize) {
+        if (st) *st = 0;
+        return ev_return(sd, ev_t0, 0, instr);
+    }
+
+    if (stats) {
+        /* Track gap between consecutive writes (inter-call latency) */
+        double gap = elapsed_ms(&sd->stats.last_write, &t_start);
+        if (gap > sd->stats.max_gap_ms)
+            sd->stats.max_gap_ms = gap;
+        /* Gap histogram: count long gaps for pattern analysis */
+        if (gap > 5000.0) sd->stats.gaps_over_5s++;
+        else if (gap > 1000.0) sd->stats.gaps_over_1s++;
+        else if (gap > 100.0) sd->stats.gaps_over_100++;
+        /* The first gap is the warm-up, reported on its own */
+        if (sd->stats.got_first)
+            hist_add(&sd->stats.gap_hist, (uint64_t)(gap * 1e6));
+        /* First-data latency (scanner warm-up time) */
+        if (!sd->stats.got_first) {
+            sd->stats.first_data_ms = elapsed_ms(&sd->stats.open_time, &t_start);
+            sd->stats.got_first = 1;
+        }
+        sd->stats.last_write = t_start;
+        sd->stats.bytes_in += w->dwLineDataSize;
+    }
+
+    if (sd->pipe.running)
+        return ev_return(sd, ev_t0, pipe_submit(sd, w, st), instr);
+
+    /* This line's output goes after the lines held over, or to the
+     * spill when the caller's buffer has no room left for it */
+    sd->page_done = 0;
+    DWORD have = sd->batch_count || sd->spill_count ? batch_take(sd, w) : 0;
+    DWORD room = w->dwWriteBuffSize / outLine - have;
+    BYTE *dst = w->pWriteBuff + have * outLine;
+    int spilled = sd->spill && room < sd->scale.max_up;
+    if (spilled) {
+        spill_reserve(sd, sd->scale.max_up);
+        dst = sd->spill + sd->spill_count * outLine;
+        room = sd->spill_max - sd->spill_count;
+    }
+    DWORD n = sd->decode(sd, w, dst, room, &t_start);
+    if (instr && g_ev.ring) {
+        uint64_t t = ev_clock();
+        ev_put(t, EV_DECODE, n, t - ev_t0);
+    }
+    if (spilled) {
+        sd->spill_count += n;
+        n = 0;
+    }
+    if (!(n += have)) {
+        if (st) *st = 0;
+        return ev_return(sd, ev_t0, 0, instr);
+    }
+    return ev_return(sd, ev_t0, finish_line(sd, w, st, n), instr);
+}
+
+static DWORD write_plain(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    return write_line(sd, w, st, 0);
+}
+
+static DWORD write_instr(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    return write_line(sd, w, st, 1);
+}
+
+DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st)
 {
+    return g_sd_default.write(&g_sd_default, w, st);
+}
+
+/*
+ * Line handlers, decode_line() and ScanDecWrite() copies and the ink
+ * count for the session just opened, and again whenever
+ * ScanDecSetTblHandle() or ScanDecSetEncoder() change what they were
+ * chosen for (with the decode worker idle).  Until it is ready (ready
+ * clear, or a failed open) the generic ones, which need none of the
+ * session's buffers.
+ */
+static void select_line_handlers(SCANDEC_CTX *sd, int ready)
+{
+    int tone = sd->tone_on != 0;
+    sd->ready = ready;
+    if (!ready) {
+        sd->line_fns = g_line_table[LINE_BYTES][tone][1];
+        sd->decode = g_decode_table[0][1][1];
+        sd->ink_fn = ink_gray;
+        sd->write = write_instr;
+        return;
+    }
+    int bpp = sd->scale.on ? sd->scale.ch : sd->bpp;
+    int mode = bpp == 3 && sd->plane_buf ? LINE_PLANES :
+               bpp != 0 ? LINE_BYTES :
+               sd->bw_mode == BW_THRESHOLD && g_bw_level == 128 && !tone
+                   ? LINE_BW_FAST : LINE_BW;
+    int out = sd->enc.on || sd->prv.h;
+    sd->line_fns = g_line_table[mode][tone][sd->stats_on != 0];
+    sd->decode = g_decode_table[sd->scale.on != 0][out][sd->stats_on != 0];
+    sd->ink_fn = g_ink_fns[bpp];
+    sd->write = sd->stats_on || sd->trace || g_ev.ring ? write_instr
+                                                       : write_plain;
+}
+
+/* A session with nothing open; the non-zero defaults */
+static void ctx_init(SCANDEC_CTX *c)
+{
+    memset(c, 0, sizeof(*c));
+    c->bw_mode = BW_THRESHOLD;
+    c->bw_fn = bw_threshold;
+    c->run_cb_min = 1;
+    c->enc.fd = -1;
+    c->prv.fd = -1;
+    c->line_fns = g_line_table[LINE_BYTES][0][1];
+    c->decode = g_decode_table[0][1][1];
+    c->ink_fn = ink_gray;
+    c->write = write_instr;
+}
+
+static DWORD page_end(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    if (sd->stats_on)
+        sd->stats.pages++;
+    /* The worker updates the line statistics too */
+    if (sd->pipe.running)
+        pipe_wait_idle(sd);
     if (g_debug) {
         struct timespec now;
         clock_gettime(CLOCK_MONOTONIC, &now);
-        double total_ms = elapsed_ms(&g_stats.open_time, &now);
+        double total_ms = elapsed_ms(&sd->stats.open_time, &now);
         fprintf(stderr, "%s [SCANDEC] ScanDecPageEnd: %lu lines in %.1f ms "
                 "(%.1f lines/sec)\n",
                 debug_ts(),
-                g_stats.lines_total, total_ms,
-                g_stats.lines_total ? g_stats.lines_total / (total_ms / 1000.0) : 0);
+                sd->stats.lines_total, total_ms,
+                sd->stats.lines_total ? sd->stats.lines_total / (total_ms / 1000.0) : 0);
     }
-    (void)w;
-    if (st) *st = 0;
-    return 0;
+    /* Lines held over come back first, then the lines still owed by an
+     * enlarging scale go after them (or to the spill), so the page
+     * summary below covers them */
+    DWORD outLine = sd->params.dwOutLineByte;
+    int out = !sd->pipe.running && w && w->pWriteBuff && outLine &&
+              w->dwWriteBuffSize >= outLine;
+    DWORD have = out ? batch_take(sd, w) : 0, tail = 0;
+    if (sd->scale.on) {
+        DWORD room = out ? w->dwWriteBuffSize / outLine - have : 0;
+        if (sd->spill && (sd->spill_count || room < sd->scale.max_up)) {
+            spill_reserve(sd, sd->scale.max_up);
+            sd->spill_count += scale_flush(sd, sd->spill + sd->spill_count * outLine,
+                                           sd->spill_max - sd->spill_count);
+        } else if (out)
+            tail = scale_flush(sd, w->pWriteBuff + have * outLine, room);
+    }
+    blank_finish(sd);
+    enc_end(sd);
+    prv_end(sd);
+    if (g_debug)
+        fprintf(stderr, "%s [SCANDEC] page: %lu lines, %lu white in %lu runs "
+                "(longest %lu from line %lu), margins top %lu bottom %lu, "
+                "blank page: %s\n", debug_ts(),
+                (unsigned long)sd->page.dwLines, (unsigned long)sd->page.dwWhiteLines,
+                (unsigned long)sd->page.dwWhiteRuns,
+                (unsigned long)sd->page.dwLongestRun,
+                (unsigned long)sd->page.dwLongestRunStart,
+                (unsigned long)sd->page.dwTopMargin,
+                (unsigned long)sd->page.dwBottomMargin,
+                sd->page.bBlankPage ? "yes" : "no");
+
+    /* Hand back lines still in the decode pipeline, or the page's last
+     * lines; spilled ones follow on the next ScanDecPageEnd() calls */
+    if (sd->pipe.running)
+        return pipe_flush(sd, w, st);
+    sd->page_done = 1;
+    DWORD n = have + tail;
+    batch_returned(sd, n);
+    if (st) *st = (INT)n;
+    return n * outLine;
 }
 
-BOOL ScanDecClose(void)
+static DWORD ctx_page_end(SCANDEC_CTX *sd, SCANDEC_WRITE *w, INT *st)
+{
+    trace_rec(sd, TRACE_PAGE_END, 0, 0, NULL, 0);
+    if (!g_ev.ring)
+        return sd->page_done ? batch_drain(sd, w, st) : page_end(sd, w, st);
+    uint64_t t0 = ev_clock();
+    ev_put(t0, EV_PAGE_END, 0, sd->ev_page);
+    return ev_return(sd, t0, sd->page_done ? batch_drain(sd, w, st)
+                                           : page_end(sd, w, st), 1);
+}
+
+DWORD ScanDecPageEnd(SCANDEC_WRITE *w, INT *st)
+{
+    return ctx_page_end(&g_sd_default, w, st);
+}
+
+/*
+ * White runs and blank-page verdict for the current page; complete once
+ * ScanDecPageEnd() has returned.  Not part of Brother's API: frontends
+ * or a patched backend look these up with dlsym().
+ */
+static BOOL ctx_page_info(SCANDEC_CTX *sd, SCANDEC_PAGE_INFO *info)
+{
+    if (!info)
+        return FALSE;
+    if (sd->pipe.running)
+        pipe_wait_idle(sd);
+    memcpy(info, &sd->page, sizeof(*info));
+    return TRUE;
+}
+
+BOOL ScanDecGetPageInfo(SCANDEC_PAGE_INFO *info)
+{
+    return ctx_page_info(&g_sd_default, info);
+}
+
+/*
+ * Call cb(first line, line count, ctx) for every white run of at least
+ * dwMinLines lines as it ends.  It runs on the decoding thread (the
+ * worker with BROTHER_PIPELINE=1); NULL turns reporting off.
+ */
+static void ctx_white_run_cb(SCANDEC_CTX *sd, SCANDEC_WHITE_RUN_CB cb,
+                             DWORD dwMinLines, void *pCtx)
+{
+    if (sd->pipe.running)
+        pipe_wait_idle(sd);
+    sd->run_cb = cb;
+    sd->run_cb_min = dwMinLines ? dwMinLines : 1;
+    sd->run_cb_ctx = pCtx;
+}
+
+void ScanDecSetWhiteRunCallback(SCANDEC_WHITE_RUN_CB cb, DWORD dwMinLines,
+                                void *pCtx)
+{
+    ctx_white_run_cb(&g_sd_default, cb, dwMinLines, pCtx);
+}
+
+/*
+ * Encode every page (JPEG for gray and colour, G4 for 1-bit) and pass
+ * the stream to pfnSink(data, size, ctx) in pieces as it is produced;
+ * a FALSE return drops the rest of the page.  With pfnSink NULL pages go
+ * to BROTHER_ENCODE_OUT files.  nQuality is the JPEG quality, 0 for the
+ * default.  A page being encoded is finished with the old settings.
+ */
+static BOOL ctx_set_encoder(SCANDEC_CTX *sd, BOOL bEnable, INT nQuality,
+                            SCANDEC_ENC_SINK pfnSink, void *pCtx)
+{
+    if (nQuality < 0 || nQuality > 100)
+        return FALSE;
+    if (sd->pipe.running)
+        pipe_wait_idle(sd);
+    if (sd->enc.kind != ENC_NONE)
+        enc_end(sd);
+    sd->enc.set = 1;
+    sd->enc.on = bEnable;
+    sd->enc.quality = nQuality ? nQuality : ENC_DEFAULT_QUALITY;
+    sd->enc.sink = pfnSink;
+    sd->enc.ctx = pCtx;
+    if (sd->ready)
+        select_line_handlers(sd, 1);
+    return TRUE;
+}
+
+BOOL ScanDecSetEncoder(BOOL bEnable, INT nQuality, SCANDEC_ENC_SINK pfnSink,
+                       void *pCtx)
+{
+    return ctx_set_encoder(&g_sd_default, bEnable, nQuality, pfnSink, pCtx);
+}
+
+/*
+ * Append this session's histograms to BROTHER_STATS_JSON as one JSON
+ * object per line, with the settings that shape them, so runs with
+ * different queue depths or pipelining can be compared offline.
+ */
+static void stats_json(SCANDEC_CTX *sd, int piped)
+{
+    if (!g_stats_json_env || !*g_stats_json_env)
+        return;
+    FILE *f = fopen(g_stats_json_env, "a");
+    if (!f) {
+        fprintf(stderr, "%s [SCANDEC] stats: cannot append to %s\n",
+                debug_ts(), g_stats_json_env);
+        return;
+    }
+    fprintf(f, "{\"mode\": \"%s\", \"color_type\": %d, \"pixels\": %lu, "
+            "\"lines\": %lu, \"decoder\": \"%s\", \"pipeline\": %d, "
+            "\"batch_lines\": %lu, ",
+            sd->stats.mode_name ? sd->stats.mode_name : "unknown",
+            sd->params.nColorType, (unsigned long)sd->params.dwOutLinePixCnt,
+            sd->stats.lines_total, g_decode_name, piped,
+            sd->batch_max ? (unsigned long)sd->batch_max : 1ul);
+    hist_json(f, "gap_ns", &sd->stats.gap_hist);
+    fprintf(f, ", ");
+    hist_json(f, "line_ns", &sd->stats.line_hist);
+    fprintf(f, "}\n");
+    fclose(f);
+}
+
+/* Add h to an exporter histogram with upper bounds le[0..nle-1] */
+static void stats_publish_hist(uint64_t *bucket, const uint64_t *le, int nle,
+                               const LAT_HIST *h)
 {
+    for (unsigned i = 0, b = 0; i < HIST_BUCKETS; i++) {
+        while ((int)b < nle && hist_high(i) > le[b])
+            b++;
+        if (h->count[i])
+            __atomic_fetch_add(&bucket[b], (uint64_t)h->count[i],
+                               __ATOMIC_RELAXED);
+    }
+}
+
+/* Add this session's statistics to the exporter segment */
+static void stats_publish(SCANDEC_CTX *sd)
+{
+    BRSTATS *s = g_brstats;
+    if (!s || !sd->brstats_open)
+        return;
+    sd->brstats_open = 0;
+    BRSTATS_ADD(s, scan_sessions, 1);
+    BRSTATS_ADD(s, scan_pages, sd->stats.pages);
+    BRSTATS_ADD(s, scan_lines, sd->stats.lines_total);
+    BRSTATS_ADD(s, scan_in_white, sd->stats.lines_white);
+    BRSTATS_ADD(s, scan_in_noncomp, sd->stats.lines_noncomp);
+    BRSTATS_ADD(s, scan_in_pack, sd->stats.lines_pack);
+    BRSTATS_ADD(s, scan_in_unknown, sd->stats.lines_unknown);
+    BRSTATS_ADD(s, scan_bytes_in, sd->stats.bytes_in);
+    BRSTATS_ADD(s, scan_bytes_out, sd->stats.bytes_out);
+    BRSTATS_ADD(s, scan_decode_ns, sd->stats.write_ms * 1e6);
+    BRSTATS_ADD(s, scan_packbits_ns, sd->stats.decode_ms * 1e6);
+    BRSTATS_SET(s, scan_max_gap_ns, sd->stats.gap_hist.max);
+    BRSTATS_ADD(s, scan_gap_count, sd->stats.gap_hist.n);
+    BRSTATS_ADD(s, scan_gap_sum_ns, sd->stats.gap_hist.sum);
+    stats_publish_hist(s->scan_gap_bucket, brstats_gap_le,
+                       BRSTATS_GAP_BUCKETS, &sd->stats.gap_hist);
+    BRSTATS_ADD(s, scan_line_count, sd->stats.line_hist.n);
+    BRSTATS_ADD(s, scan_line_sum_ns, sd->stats.line_hist.sum);
+    stats_publish_hist(s->scan_line_bucket, brstats_line_le,
+                       BRSTATS_LINE_BUCKETS, &sd->stats.line_hist);
+    __atomic_fetch_sub(&s->scan_active, 1, __ATOMIC_RELAXED);
+}
+
+static BOOL ctx_close(SCANDEC_CTX *sd)
+{
+    int piped = sd->pipe.running;
+    sd->stats.batch_dropped = sd->batch_count + sd->spill_count;
+    if (!sd->batch_max)
+        sd->stats.scale_dropped += sd->spill_count;
+    pipe_stop(sd);
+    /* A page the backend never ended is closed here */
+    if (sd->enc.kind != ENC_NONE)
+        enc_end(sd);
+    prv_end(sd);
+    trace_close(sd);
+    stats_publish(sd);
+    if (g_ev.ring) {
+        ev_put(ev_clock(), EV_CLOSE, 0, 0);
+        /* one session's close at a time rewrites the file */
+        pthread_mutex_lock(&g_setup_lock);
+        int dumped = ev_dump();
+        pthread_mutex_unlock(&g_setup_lock);
+        unsigned long long recorded = __atomic_load_n(&g_ev.head, __ATOMIC_RELAXED);
+        if (g_debug)
+            fprintf(stderr, "%s [SCANDEC] events: %llu recorded, %s %s\n",
+                    debug_ts(), recorded,
+                    dumped ? "dumped to" : "cannot write", g_ev_env);
+    }
     if (g_debug) {
         struct timespec now;
         clock_gettime(CLOCK_MONOTONIC, &now);
-        double total_ms = elapsed_ms(&g_stats.open_time, &now);
-        double throughput = g_stats.bytes_out ?
-            (g_stats.bytes_out / 1024.0) / (total_ms / 1000.0) : 0;
-        double backend_ms = total_ms - g_stats.write_ms;
-        double tail_ms = g_stats.got_first
-            ? elapsed_ms(&g_stats.last_write, &now) : 0;
-        double scan_ms = g_stats.got_first
-            ? total_ms - g_stats.first_data_ms - tail_ms : 0;
-        double scan_rate = (g_stats.lines_total && scan_ms > 0)
-            ? scan_ms / g_stats.lines_total : 0;
+        double total_ms = elapsed_ms(&sd->stats.open_time, &now);
+        double throughput = sd->stats.bytes_out ?
+            (sd->stats.bytes_out / 1024.0) / (total_ms / 1000.0) : 0;
+        double backend_ms = total_ms - sd->stats.write_ms;
+        double tail_ms = sd->stats.got_first
+            ? elapsed_ms(&sd->stats.last_write, &now) : 0;
+        double scan_ms = sd->stats.got_first
+            ? total_ms - sd->stats.first_data_ms - tail_ms : 0;
+        double scan_rate = (sd->stats.lines_total && scan_ms > 0)
+            ? scan_ms / sd->stats.lines_total : 0;
         /* Estimate minimum transfer time based on data size and USB bandwidth */
-        double min_xfer_sec = g_stats.bytes_out > 0
-            ? g_stats.bytes_out / (70.0 * 1024.0) : 0;  /* ~70 KB/s Full-Speed */
+        double min_xfer_sec = sd->stats.bytes_out > 0
+            ? sd->stats.bytes_out / (70.0 * 1024.0) : 0;  /* ~70 KB/s Full-Speed */
         /* Compression ratio: bytes_in is what the scanner sent (compressed),
          * bytes_out is the decompressed raster output */
-        double compress_ratio = (g_stats.bytes_in > 0 && g_stats.bytes_out > 0)
-            ? (double)g_stats.bytes_out / g_stats.bytes_in : 1.0;
+        double compress_ratio = (sd->stats.bytes_in > 0 && sd->stats.bytes_out > 0)
+            ? (double)sd->stats.bytes_out / sd->stats.bytes_in : 1.0;
         /* Estimate transfer time using actual wire bytes, not output bytes */
-        double min_xfer_wire_sec = g_stats.bytes_in > 0
-            ? g_stats.bytes_in / (70.0 * 1024.0) : 0;
+        double min_xfer_wire_sec = sd->stats.bytes_in > 0
+            ? sd->stats.bytes_in / (70.0 * 1024.0) : 0;
         fprintf(stderr,
                 "%s [SCANDEC] === scan session summary (%s mode) ===\n"
                 "[SCANDEC]   total time:    %.1f ms (%.1f sec)\n"
@@ -571,6 +4010,7 @@ BOOL ScanDecClose(void)
                 "[SCANDEC]   data in/out:   %lu / %lu bytes (%.1f MB)\n"
                 "[SCANDEC]   compression:   %.1fx ratio (scanner sent %lu bytes for %lu bytes output)\n"
                 "[SCANDEC]   decode time:   %.1f ms total (%.3f ms/line avg)\n"
+                "[SCANDEC]   PackBits:      %.1f ms for %lu lines (%.1f us/line, %s decoder)\n"
                 "[SCANDEC]   backend time:  %.1f ms (%.1f%% — USB I/O + protocol)\n"
                 "[SCANDEC]   max write:     %.3f ms (single call)\n"
                 "[SCANDEC]   max gap:       %.1f ms (between writes — I/O or backend wait)\n"
@@ -581,38 +4021,80 @@ BOOL ScanDecClose(void)
                 "[SCANDEC]   throughput:    %.1f KB/s (output), %.1f KB/s (USB wire)\n"
                 "[SCANDEC]   min USB xfer:  %.1f sec for %.1f MB at ~70 KB/s Full-Speed\n",
                 debug_ts(),
-                g_stats.mode_name ? g_stats.mode_name : "unknown",
+                sd->stats.mode_name ? sd->stats.mode_name : "unknown",
                 total_ms, total_ms / 1000.0,
-                g_stats.lines_total,
-                g_stats.lines_white, g_stats.lines_noncomp,
-                g_stats.lines_pack, g_stats.lines_unknown,
-                g_stats.rgb_planes,
-                g_stats.bytes_in, g_stats.bytes_out,
-                g_stats.bytes_out / (1024.0 * 1024.0),
-                compress_ratio, g_stats.bytes_in, g_stats.bytes_out,
-                g_stats.write_ms,
-                g_stats.lines_total ? g_stats.write_ms / g_stats.lines_total : 0,
+                sd->stats.lines_total,
+                sd->stats.lines_white, sd->stats.lines_noncomp,
+                sd->stats.lines_pack, sd->stats.lines_unknown,
+                sd->stats.rgb_planes,
+                sd->stats.bytes_in, sd->stats.bytes_out,
+                sd->stats.bytes_out / (1024.0 * 1024.0),
+                compress_ratio, sd->stats.bytes_in, sd->stats.bytes_out,
+                sd->stats.write_ms,
+                sd->stats.lines_total ? sd->stats.write_ms / sd->stats.lines_total : 0,
+                sd->stats.decode_ms, sd->stats.lines_pack,
+                sd->stats.lines_pack ? sd->stats.decode_ms * 1000.0 / sd->stats.lines_pack : 0,
+                g_decode_name,
                 backend_ms,
                 total_ms > 0 ? (backend_ms / total_ms) * 100.0 : 0,
-                g_stats.max_write_ms,
-                g_stats.max_gap_ms,
-                g_stats.gaps_over_100, g_stats.gaps_over_1s,
-                g_stats.gaps_over_5s,
-                g_stats.first_data_ms,
+                sd->stats.max_write_ms,
+                sd->stats.max_gap_ms,
+                sd->stats.gaps_over_100, sd->stats.gaps_over_1s,
+                sd->stats.gaps_over_5s,
+                sd->stats.first_data_ms,
                 tail_ms,
                 scan_rate,
                 scan_rate > 0 ? 1000.0 / scan_rate : 0,
                 throughput,
-                g_stats.bytes_in ? (g_stats.bytes_in / 1024.0) / (total_ms / 1000.0) : 0,
+                sd->stats.bytes_in ? (sd->stats.bytes_in / 1024.0) / (total_ms / 1000.0) : 0,
                 min_xfer_sec,
-                g_stats.bytes_out / (1024.0 * 1024.0));
+                sd->stats.bytes_out / (1024.0 * 1024.0));
+        hist_print("gap dist:", &sd->stats.gap_hist, 1e6, "ms", "gaps");
+        hist_print("line dist:", &sd->stats.line_hist, 1e3, "us", "lines");
+        if (sd->batch_max)
+            fprintf(stderr,
+                "[SCANDEC]   batching:      %lu lines in %lu returns "
+                "(%.1f lines/return, max %lu), %lu dropped\n",
+                sd->stats.batch_lines, sd->stats.batch_reads,
+                sd->stats.batch_reads ? (double)sd->stats.batch_lines / sd->stats.batch_reads : 0,
+                sd->batch_max, sd->stats.batch_dropped);
+        if (sd->scale.on)
+            fprintf(stderr,
+                "[SCANDEC]   scaling:       %lu -> %lu px, %lld -> %lld dpi "
+                "vertical, %.1f ms, %lu lines never returned\n",
+                (unsigned long)sd->scale.in_px, (unsigned long)sd->scale.out_px,
+                sd->scale.in_y, sd->scale.out_y, sd->stats.scale_ms,
+                sd->stats.scale_dropped);
+        if (sd->prv.h) {
+            char buf[320];
+            fprintf(stderr,
+                "[SCANDEC]   preview:       %lu bands of %u lines, %u pages "
+                "published to %s\n",
+                sd->prv.bands, sd->prv.h->band_lines, sd->prv.page,
+                ctx_path(sd, g_prv_env, buf, sizeof(buf)));
+        }
+        if (sd->enc.pages)
+            fprintf(stderr,
+                "[SCANDEC]   encoder:       %lu pages, %lu -> %lu bytes "
+                "(%.1fx), %.1f ms\n",
+                sd->enc.pages, sd->enc.bytes_in, sd->enc.bytes_out,
+                sd->enc.bytes_out ? (double)sd->enc.bytes_in / sd->enc.bytes_out : 0,
+                sd->enc.ms);
+        if (piped)
+            fprintf(stderr,
+                "[SCANDEC]   pipeline:      %lu lines via worker, %.1f ms "
+                "waiting on it, max %u in flight, %lu dropped, "
+                "%lu too long\n",
+                sd->stats.pipe_lines, sd->stats.pipe_wait_ms,
+                sd->stats.pipe_max_inflight, sd->stats.batch_dropped,
+                sd->stats.pipe_rejected);
         /* Human-readable diagnosis */
         double decode_pct = total_ms > 0
-            ? (g_stats.write_ms / total_ms) * 100.0 : 0;
+            ? (sd->stats.write_ms / total_ms) * 100.0 : 0;
         /* Compression analysis */
-        if (g_stats.lines_pack > 0 || g_stats.lines_white > 0) {
-            unsigned long compressed_lines = g_stats.lines_pack + g_stats.lines_white;
-            unsigned long total_lines = compressed_lines + g_stats.lines_noncomp + g_stats.lines_unknown;
+        if (sd->stats.lines_pack > 0 || sd->stats.lines_white > 0) {
+            unsigned long compressed_lines = sd->stats.lines_pack + sd->stats.lines_white;
+            unsigned long total_lines = compressed_lines + sd->stats.lines_noncomp + sd->stats.lines_unknown;
             double pct_compressed = total_lines > 0
                 ? (compressed_lines * 100.0) / total_lines : 0;
             fprintf(stderr,
@@ -623,14 +4105,14 @@ BOOL ScanDecClose(void)
                 "[SCANDEC]   sent uncompressed (1.0x) despite the same C=RLENGTH compression request.\n"
                 "[SCANDEC]   This is a firmware-level decision encoded in the per-line header byte.\n",
                 pct_compressed,
-                g_stats.mode_name ? g_stats.mode_name : "this",
-                g_stats.lines_pack, g_stats.lines_white, g_stats.lines_noncomp,
-                g_stats.mode_name ? g_stats.mode_name : "this",
+                sd->stats.mode_name ? sd->stats.mode_name : "this",
+                sd->stats.lines_pack, sd->stats.lines_white, sd->stats.lines_noncomp,
+                sd->stats.mode_name ? sd->stats.mode_name : "this",
                 compress_ratio,
-                g_stats.bytes_in / (1024.0 * 1024.0),
-                g_stats.bytes_out / (1024.0 * 1024.0));
-        } else if (g_stats.lines_noncomp > 0) {
-            const char *mode = g_stats.mode_name ? g_stats.mode_name : "this";
+                sd->stats.bytes_in / (1024.0 * 1024.0),
+                sd->stats.bytes_out / (1024.0 * 1024.0));
+        } else if (sd->stats.lines_noncomp > 0) {
+            const char *mode = sd->stats.mode_name ? sd->stats.mode_name : "this";
             fprintf(stderr,
                 "[SCANDEC] compression: scanner sent ALL data uncompressed in %s mode.\n"
                 "[SCANDEC]   Compression ratio: %.1fx — no compression benefit for this scan.\n"
@@ -642,15 +4124,15 @@ BOOL ScanDecClose(void)
                 "[SCANDEC]   The scanner firmware decides per-line via the line header byte (bits[1:0]).\n"
                 "[SCANDEC]   For color planes (R/G/B), the firmware always clears the compression bits.\n"
                 "[SCANDEC]   Confirmed: True Gray achieves 3.9x compression with the same C=RLENGTH request.\n",
-                mode, compress_ratio, mode, g_stats.bytes_in);
+                mode, compress_ratio, mode, sd->stats.bytes_in);
             /* Suggest testing other modes when color is uncompressed */
-            if (g_stats.mode_bpp == 3)
+            if (sd->stats.mode_bpp == 3)
                 fprintf(stderr,
                     "[SCANDEC] next step: try 'True Gray' mode to test if the scanner compresses grayscale data:\n"
                     "[SCANDEC]   sudo BROTHER_DEBUG=1 scanimage -d 'brother2:bus1;dev1' --mode 'True Gray' --resolution=150 --format=pnm > gray_test.pnm\n"
                     "[SCANDEC]   Grayscale transfers 3x less data (1 plane vs 3) — ~30 sec vs ~88 sec.\n");
         }
-        if (decode_pct < 1.0 && g_stats.lines_total > 0) {
+        if (decode_pct < 1.0 && sd->stats.lines_total > 0) {
             fprintf(stderr,
                 "[SCANDEC] diagnosis: scan is USB-bandwidth limited "
                 "(decode < 1%% of time). %.1f KB/s is normal for Full-Speed USB.\n",
@@ -667,7 +4149,7 @@ BOOL ScanDecClose(void)
                     "[SCANDEC]   completes. The DCP-130C buffers scan data internally and continues\n"
                     "[SCANDEC]   transmitting over USB after the head returns home. %.1f MB of data\n"
                     "[SCANDEC]   requires at least %.0f seconds to transfer at Full-Speed USB.\n",
-                    g_stats.bytes_out / (1024.0 * 1024.0), min_xfer_sec);
+                    sd->stats.bytes_out / (1024.0 * 1024.0), min_xfer_sec);
             }
             fprintf(stderr,
                 "[SCANDEC] windows: the original Windows driver had the same USB bandwidth limit.\n"
@@ -675,22 +4157,111 @@ BOOL ScanDecClose(void)
                 "[SCANDEC]   bar during transfer (making the wait feel shorter) or used a different\n"
                 "[SCANDEC]   scan resolution/mode by default. The physical USB transfer speed is\n"
                 "[SCANDEC]   identical — 12 Mbit/s Full-Speed is a hardware constant.\n");
-        } else if (g_stats.lines_total > 0) {
+        } else if (sd->stats.lines_total > 0) {
             fprintf(stderr,
                 "[SCANDEC] diagnosis: decode uses %.1f%% of scan time "
                 "(%.3f ms/line). Check CPU load if scan is slow.\n",
                 decode_pct,
-                g_stats.write_ms / g_stats.lines_total);
+                sd->stats.write_ms / sd->stats.lines_total);
         }
+        stats_json(sd, piped);
     }
 
-    memset(&g_open, 0, sizeof(g_open));
-    g_bpp = 0;
-    free(g_red_plane);   g_red_plane = NULL;
-    free(g_green_plane); g_green_plane = NULL;
-    free(g_blue_plane);  g_blue_plane = NULL;
-    g_plane_pixels = 0;
-    g_have_red = 0;
-    g_have_green = 0;
+    memset(&sd->params, 0, sizeof(sd->params));
+    sd->bpp = 0;
+    ctx_release(sd);
     return TRUE;
 }
+
+BOOL ScanDecClose(void)
+{
+    return ctx_close(&g_sd_default);
+}
+
+/*
+ * Sessions.  ScanDecCtxOpen() opens a decode session of its own and
+ * returns its handle, or NULL if the open fails.  Every ScanDecCtx*()
+ * call takes the handle and behaves as the ScanDec*() call of the same
+ * name does on the default session, which the original API keeps using.
+ * Sessions share nothing but process-wide settings, so one process can
+ * decode several streams at once (two scanners, or a preview and a full
+ * resolution scan), one thread per session; a session must not be used
+ * from two threads at the same time.  Handle n traces to
+ * BROTHER_TRACE.<n> and publishes to BROTHER_PREVIEW.<n> (ctx_path()).
+ * The event ring and the exporter's counters take every session's
+ * events and totals.
+ */
+typedef SCANDEC_CTX *SCANDEC_HANDLE;
+
+static unsigned g_sessions;             /* handles opened, for their ids */
+
+SCANDEC_HANDLE ScanDecCtxOpen(SCANDEC_OPEN *p)
+{
+    SCANDEC_CTX *c = (SCANDEC_CTX *)malloc(sizeof(*c));
+    if (!c)
+        return NULL;
+    ctx_init(c);
+    c->id = __atomic_add_fetch(&g_sessions, 1, __ATOMIC_RELAXED);
+    if (!ctx_open(c, p)) {
+        free(c);
+        return NULL;
+    }
+    return c;
+}
+
+BOOL ScanDecCtxClose(SCANDEC_HANDLE c)
+{
+    if (!c)
+        return FALSE;
+    BOOL ok = ctx_close(c);
+    enc_free(c);
+    free(c);
+    return ok;
+}
+
+void ScanDecCtxSetTblHandle(SCANDEC_HANDLE c, HANDLE h1, HANDLE h2)
+{
+    if (c)
+        ctx_set_tables(c, h1, h2);
+}
+
+BOOL ScanDecCtxPageStart(SCANDEC_HANDLE c)
+{
+    return c ? ctx_page_start(c) : FALSE;
+}
+
+DWORD ScanDecCtxWrite(SCANDEC_HANDLE c, SCANDEC_WRITE *w, INT *st)
+{
+    if (!c) {
+        if (st) *st = -1;
+        return 0;
+    }
+    return c->write(c, w, st);
+}
+
+DWORD ScanDecCtxPageEnd(SCANDEC_HANDLE c, SCANDEC_WRITE *w, INT *st)
+{
+    if (!c) {
+        if (st) *st = -1;
+        return 0;
+    }
+    return ctx_page_end(c, w, st);
+}
+
+BOOL ScanDecCtxGetPageInfo(SCANDEC_HANDLE c, SCANDEC_PAGE_INFO *info)
+{
+    return c ? ctx_page_info(c, info) : FALSE;
+}
+
+void ScanDecCtxSetWhiteRunCallback(SCANDEC_HANDLE c, SCANDEC_WHITE_RUN_CB cb,
+                                   DWORD dwMinLines, void *pCtx)
+{
+    if (c)
+        ctx_white_run_cb(c, cb, dwMinLines, pCtx);
+}
+
+BOOL ScanDecCtxSetEncoder(SCANDEC_HANDLE c, BOOL bEnable, INT nQuality,
+                          SCANDEC_ENC_SINK pfnSink, void *pCtx)
+{
+    return c ? ctx_set_encoder(c, bEnable, nQuality, pfnSink, pCtx) : FALSE;
+}
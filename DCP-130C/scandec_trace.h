@@ -0,0 +1,53 @@
+/*
+ * Scan decoder trace files: written by scandec_stubs.c when BROTHER_TRACE
+ * names a file, replayed by scandec_bench.c.
+ *
+ * A trace is a TRACE_HEADER followed by records, native-endian.  Each
+ * session the backend runs is appended (TRACE_OPEN ... TRACE_CLOSE), so
+ * one file can hold several scans.  A TRACE_RECORD is followed by size
+ * payload bytes:
+ *
+ *   TRACE_OPEN        TRACE_OPEN_ARGS, the caller's SCANDEC_OPEN inputs
+ *   TRACE_TABLES      256-byte h1 then h2 table of ScanDecSetTblHandle;
+ *                     a, b = 1 when that handle was non-NULL
+ *   TRACE_PAGE_START  -
+ *   TRACE_WRITE       the line data; a = nInDataComp, b = nInDataKind
+ *   TRACE_PAGE_END    -
+ *   TRACE_CLOSE       -
+ */
+#ifndef SCANDEC_TRACE_H
+#define SCANDEC_TRACE_H
+
+#define TRACE_MAGIC   "BRSCTRC1"
+#define TRACE_VERSION 1
+
+typedef struct {
+    char     magic[8];
+    unsigned version;
+    unsigned reserved;
+} TRACE_HEADER;
+
+enum {
+    TRACE_OPEN = 1,
+    TRACE_TABLES,
+    TRACE_PAGE_START,
+    TRACE_WRITE,
+    TRACE_PAGE_END,
+    TRACE_CLOSE
+};
+
+typedef struct {
+    unsigned type;
+    unsigned size;              /* payload bytes that follow */
+    int      a, b;              /* see above */
+} TRACE_RECORD;
+
+typedef struct {
+    int      nInResoX, nInResoY, nOutResoX, nOutResoY;
+    int      nColorType;
+    unsigned dwInLinePixCnt;
+    int      nOutDataKind;
+    int      bLongBoundary;
+} TRACE_OPEN_ARGS;
+
+#endif /* SCANDEC_TRACE_H */
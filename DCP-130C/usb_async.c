@@ -0,0 +1,807 @@
+/*
+ * Event-driven USB bulk reads — linked into libsane-brother2.so
+ *
+ * The stock ReadDeviceData() polls usb_bulk_read() until the scanner has
+ * data.  install_scanner.sh patches it to sleep 2 ms after every empty
+ * read and to declare end of scan after STALL_THRESHOLD empty reads in a
+ * row, which still costs a wakeup every 2 ms and up to 400 ms of tail
+ * latency once the scanner goes quiet.
+ *
+ * With BROTHER_USB_ASYNC=1, bulk-IN reads are served from a queue of
+ * libusb-1.0 transfers kept posted on the scanner's endpoint instead:
+ *   - brusb_bulk_read() blocks in libusb_handle_events until the oldest
+ *     transfer completes, so an idle scanner costs no CPU at all
+ *   - end of scan is time based: once data has started, no data for
+ *     BROTHER_USB_STALL_MS (default 400 ms, the old 200 x 2 ms budget)
+ *     makes brusb_stalled() report a stall to the patched ReadDeviceData
+ *   - BROTHER_USB_QUEUE_DEPTH (default 4, max 16) transfers of 16 KB are
+ *     in flight at once, and each is re-posted as soon as its data has
+ *     been handed out, so the host controller always has a buffer to
+ *     fill while the backend decodes and returns to SANE.  Bulk transfers
+ *     on one endpoint complete in submission order, so the queue is a
+ *     plain ring: from the head, completed slots, then posted ones, then
+ *     free ones.
+ *   - with BROTHER_USB_THREAD=1 as well, a dedicated reader thread runs
+ *     the libusb event loop and copies completed transfers into a
+ *     single-producer/single-consumer byte ring (BROTHER_USB_RING_KB,
+ *     default 1024).  brusb_bulk_read() only pops from the ring, so USB
+ *     intake keeps going while saned or AirSane is slow to take data.
+ *     The ring indices are C11 atomics; an eventfd wakes the reader of
+ *     an empty ring, and a full ring holds transfers back (ring full
+ *     events and the high-water mark are in the debug stats).
+ *
+ * libusb-1.0 is attached to the device the backend already opened through
+ * libusb-0.1: the usbfs file descriptor for the same bus/device is looked
+ * up in /proc/self/fd and passed to libusb_wrap_sys_device(), so the
+ * interface claimed by the backend stays valid on that descriptor.  If
+ * any step fails, reads fall back to plain usb_bulk_read().
+ *
+ * Built without HAVE_LIBUSB1 (no libusb-1.0 headers), every call is a
+ * straight pass-through.  With BROTHER_DEBUG=1, transfer and wait
+ * statistics are printed when the device is closed.
+ *
+ * The link is shared with printing (brother_usb_arb.h).  A polled read
+ * is one transfer: it waits for the scan side's turn and ends the
+ * transfer when usb_bulk_read() returns.  In async mode, transfers are
+ * only posted while the scan side holds the link, and the whole queue
+ * counts as one transfer.  Whoever runs the event loop (brusb_bulk_read()
+ * or the reader thread) takes the turn before posting, and checks every
+ * BRUSB_ARB_CHECK_MS while it waits whether the print side wants the link
+ * (brarb_wanted()).  If so, it cancels what is posted, keeps any data
+ * that has arrived, and hands the turn over.  With nothing left posted
+ * (ring full, data not yet handed out) the transfer ends as well.  In
+ * direct mode nobody looks between two reads of the backend, so a print
+ * job waits at most for the next read to start.  brusb_link_done()
+ * cancels the queue and gives the turn up at the end of each page and
+ * when the device is closed.
+ */
+#define BRUSB_NO_REDIRECT
+#include "usb_async.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <limits.h>
+#include <time.h>
+#include <usb.h>
+#include "brother_stats.h"
+#include "brother_usb_arb.h"
+
+#ifdef HAVE_LIBUSB1
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+#endif
+
+#define BRUSB_DEFAULT_STALL_MS 400
+#define BRUSB_XFER_SIZE        (16 * 1024)
+#define BRUSB_DEFAULT_DEPTH    4
+#define BRUSB_MAX_DEPTH        16
+#define BRUSB_DEFAULT_RING_KB  1024
+#define BRUSB_ARB_CHECK_MS     10     /* ask brarb_wanted() this often */
+
+static int g_cfg_read = 0;
+static int g_async_env = 0;   /* BROTHER_USB_ASYNC=1 */
+static int g_debug = 0;
+static int g_stall_ms = BRUSB_DEFAULT_STALL_MS;
+static int g_depth = BRUSB_DEFAULT_DEPTH;
+static int g_thread_env = 0;  /* BROTHER_USB_THREAD=1 */
+static int g_ring_kb = BRUSB_DEFAULT_RING_KB;
+static int g_arb_open = 0;
+static BRARB_CLIENT g_arb;    /* turns on the link shared with printing */
+
+/* One polled read: one transfer on the shared link */
+static int polled_read(struct usb_dev_handle *dev, int ep, char *bytes,
+                       int size, int timeout) {
+    brarb_enter(&g_arb);
+    int n = usb_bulk_read(dev, ep, bytes, size, timeout);
+    brarb_leave(&g_arb);
+    return n;
+}
+
+static void read_config(void) {
+    if (g_cfg_read)
+        return;
+    g_cfg_read = 1;
+    const char *e = getenv("BROTHER_USB_ASYNC");
+    g_async_env = (e && e[0] == '1');
+    e = getenv("BROTHER_DEBUG");
+    g_debug = (e && strcmp(e, "1") == 0);
+    e = getenv("BROTHER_USB_STALL_MS");
+    if (e && atoi(e) > 0)
+        g_stall_ms = atoi(e);
+    e = getenv("BROTHER_USB_QUEUE_DEPTH");
+    if (e && atoi(e) > 0)
+        g_depth = atoi(e) > BRUSB_MAX_DEPTH ? BRUSB_MAX_DEPTH : atoi(e);
+    e = getenv("BROTHER_USB_THREAD");
+    g_thread_env = (e && e[0] == '1');
+    e = getenv("BROTHER_USB_RING_KB");
+    if (e && atoi(e) >= 64)
+        g_ring_kb = atoi(e);
+}
+
+int brusb_stall_ms(void) {
+    read_config();
+    return g_stall_ms;
+}
+
+/*
+ * Format current wall-clock time as "HH:MM:SS.mmm" into a static buffer.
+ */
+static const char *debug_ts(void) {
+    static char buf[16];
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    struct tm tm;
+    localtime_r(&ts.tv_sec, &tm);
+    snprintf(buf, sizeof(buf), "%02d:%02d:%02d.%03d",
+             tm.tm_hour, tm.tm_min, tm.tm_sec,
+             (int)(ts.tv_nsec / 1000000));
+    return buf;
+}
+
+#ifdef HAVE_LIBUSB1
+
+static double now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+/* One queued bulk-IN transfer */
+struct ua_slot {
+    struct libusb_transfer *xfer;
+    unsigned char          *buf;
+    int                     posted;  /* submitted, callback not yet run */
+    int                     done;    /* completed, data not yet handed out */
+};
+
+/* Async read state, attached to one libusb-0.1 handle at a time */
+static struct {
+    usb_dev_handle         *dev;     /* backend handle we are attached to */
+    int                     ep;      /* bulk-IN endpoint address */
+    int                     failed;  /* attach/transfer failed: pass through */
+    libusb_context         *ctx;
+    libusb_device_handle   *h;
+    struct ua_slot          slot[BRUSB_MAX_DEPTH];
+    unsigned char          *bufs;    /* depth x BRUSB_XFER_SIZE */
+    int                     depth;
+    int                     head;    /* oldest posted/completed slot */
+    int                     inflight;
+    int                     avail;   /* head's bytes not yet handed out */
+    int                     off;
+    int                     had_data;
+    int                     stalled;
+    int                     rx_seen;  /* a transfer has returned data */
+    double                  last_data_ms;
+    BRARB_CLIENT           *arb;     /* of the thread running the event loop */
+    int                     holding; /* in a transfer: may post */
+    /* Debug statistics */
+    unsigned long           reads;
+    unsigned long           xfers;
+    unsigned long           bytes;
+    unsigned long           empty_returns;
+    unsigned long           bus_idle;    /* completions that left nothing posted */
+    unsigned long           yields;      /* queue cancelled for printing */
+    double                  wait_ms;
+    double                  max_wait_ms;
+} g_ua;
+
+static void LIBUSB_CALL xfer_done(struct libusb_transfer *t) {
+    struct ua_slot *sl = (struct ua_slot *)t->user_data;
+    sl->posted = 0;
+    /* A cancelled transfer keeps what it received; an empty one is free */
+    sl->done = !(t->status == LIBUSB_TRANSFER_CANCELLED && t->actual_length == 0);
+    g_ua.inflight--;
+    if (t->actual_length > 0)
+        brarb_used(g_ua.arb);
+    /* Nothing left for the host controller to fill once the scanner has
+     * started sending: the wire goes idle until we re-post */
+    if (t->status == LIBUSB_TRANSFER_COMPLETED && t->actual_length > 0)
+        g_ua.rx_seen = 1;
+    if (g_ua.inflight == 0 && g_ua.rx_seen &&
+        t->status == LIBUSB_TRANSFER_COMPLETED)
+        g_ua.bus_idle++;
+}
+
+/*
+ * Reader-thread ring.  wr is only advanced by the reader thread and rd only
+ * by the thread calling brusb_bulk_read(); both count bytes since attach,
+ * so the fill level is wr - rd and the ring size is a power of two.
+ */
+static struct {
+    unsigned char   *buf;
+    size_t           size;
+    _Atomic size_t   wr;
+    _Atomic size_t   rd;
+    atomic_int       error;       /* transfer failed: consumer falls back */
+    atomic_int       stop;
+    atomic_int       held;        /* waiting for the link: no stall yet */
+    BRARB_CLIENT     arb;         /* the thread's own turns */
+    int              efd;         /* eventfd: data was added */
+    int              running;
+    pthread_t        thread;
+    /* Debug statistics (reader thread only, read after join) */
+    size_t           high_water;
+    unsigned long    full_events;
+    int              was_full;
+} g_ring = { .efd = -1 };
+
+/*
+ * Find the descriptor libusb-0.1 opened for this device, e.g.
+ * /dev/bus/usb/001/005 (or /proc/bus/usb/... on old kernels).
+ */
+static int find_usbfs_fd(usb_dev_handle *dev) {
+    struct usb_device *ud = usb_device(dev);
+    if (!ud || !ud->bus)
+        return -1;
+
+    char want_dev[64], want_proc[64];
+    snprintf(want_dev, sizeof(want_dev), "/dev/bus/usb/%s/%s",
+             ud->bus->dirname, ud->filename);
+    snprintf(want_proc, sizeof(want_proc), "/proc/bus/usb/%s/%s",
+             ud->bus->dirname, ud->filename);
+
+    DIR *d = opendir("/proc/self/fd");
+    if (!d)
+        return -1;
+    int fd = -1;
+    struct dirent *ent;
+    while ((ent = readdir(d)) != NULL) {
+        if (ent->d_name[0] == '.')
+            continue;
+        char link[64], target[PATH_MAX];
+        snprintf(link, sizeof(link), "/proc/self/fd/%s", ent->d_name);
+        ssize_t n = readlink(link, target, sizeof(target) - 1);
+        if (n <= 0)
+            continue;
+        target[n] = '\0';
+        if (strcmp(target, want_dev) == 0 || strcmp(target, want_proc) == 0) {
+            fd = atoi(ent->d_name);
+            break;
+        }
+    }
+    closedir(d);
+    return fd;
+}
+
+static void print_stats(const char *why) {
+    if (!g_debug || !g_ua.reads)
+        return;
+    fprintf(stderr, "%s [BROTHER2] usb async (%s): %lu reads, %lu transfers, "
+            "%lu bytes, %lu empty returns, wait %.1f ms total (max %.1f ms), "
+            "queue depth %d, bus idle %lu times, stall timeout %d ms, "
+            "link handed to printing %lu times\n",
+            debug_ts(), why, g_ua.reads, g_ua.xfers, g_ua.bytes,
+            g_ua.empty_returns, g_ua.wait_ms, g_ua.max_wait_ms,
+            g_ua.depth, g_ua.bus_idle, g_stall_ms, g_ua.yields);
+    if (g_ring.buf)
+        fprintf(stderr, "%s [BROTHER2] usb reader thread: ring %zu KB, "
+                "high-water %zu KB (%.0f%%), ring full %lu times\n",
+                debug_ts(), g_ring.size / 1024, g_ring.high_water / 1024,
+                100.0 * g_ring.high_water / g_ring.size, g_ring.full_events);
+}
+
+static void stop_reader_thread(void) {
+    if (g_ring.running) {
+        atomic_store(&g_ring.stop, 1);
+        pthread_join(g_ring.thread, NULL);
+        g_ring.running = 0;
+        /* The thread's link waits are the process's as well */
+        g_arb.waits += g_ring.arb.waits;
+        g_arb.wait_ns += g_ring.arb.wait_ns;
+        if (g_ring.arb.max_wait_ns > g_arb.max_wait_ns)
+            g_arb.max_wait_ns = g_ring.arb.max_wait_ns;
+    }
+    if (g_ring.efd >= 0)
+        close(g_ring.efd);
+    free(g_ring.buf);
+    memset(&g_ring, 0, sizeof(g_ring));
+    g_ring.efd = -1;
+}
+
+/*
+ * Cancel every posted transfer and wait for the callbacks.  Newest first,
+ * so the host controller never moves on to a later transfer of a ring
+ * whose older one came back empty.
+ */
+static void cancel_posted(void) {
+    for (int k = g_ua.depth - 1; k >= 0; k--) {
+        struct ua_slot *sl = &g_ua.slot[(g_ua.head + k) % g_ua.depth];
+        if (sl->posted)
+            libusb_cancel_transfer(sl->xfer);
+    }
+    while (g_ua.inflight > 0) {
+        struct timeval tv = { 1, 0 };
+        int before = g_ua.inflight;
+        if (libusb_handle_events_timeout_completed(g_ua.ctx, &tv, NULL) != 0 ||
+            g_ua.inflight == before)
+            break;
+    }
+}
+
+/* Wait for the scan side's turn before posting; returns the ns waited */
+static uint64_t link_take(void) {
+    uint64_t ns = brarb_enter(g_ua.arb);
+    brarb_used(g_ua.arb);
+    g_ua.holding = 1;
+    return ns;
+}
+
+/* Nothing is posted any more: end the transfer, keeping the turn */
+static void link_release(void) {
+    if (!g_ua.holding)
+        return;
+    brarb_leave(g_ua.arb);
+    g_ua.holding = 0;
+}
+
+/* The print side wants the link: stop moving data and hand it over */
+static void link_yield(void) {
+    if (!g_ua.holding)
+        return;
+    cancel_posted();
+    link_release();
+    brarb_pass(g_ua.arb);
+    g_ua.yields++;
+}
+
+static void detach(void) {
+    int i;
+    /* The reader thread owns the event loop: stop it before cancelling */
+    stop_reader_thread();
+    cancel_posted();
+    link_release();
+    /* A transfer still posted here belongs to a dead device; leak its
+     * memory rather than free what the kernel may still write to. */
+    if (g_ua.inflight == 0) {
+        for (i = 0; i < g_ua.depth; i++)
+            if (g_ua.slot[i].xfer)
+                libusb_free_transfer(g_ua.slot[i].xfer);
+        free(g_ua.bufs);
+    }
+    /* Does not close the fd: it still belongs to libusb-0.1 */
+    if (g_ua.h)
+        libusb_close(g_ua.h);
+    if (g_ua.ctx)
+        libusb_exit(g_ua.ctx);
+    memset(&g_ua, 0, sizeof(g_ua));
+}
+
+static int submit(struct ua_slot *sl) {
+    libusb_fill_bulk_transfer(sl->xfer, g_ua.h, (unsigned char)g_ua.ep,
+                              sl->buf, BRUSB_XFER_SIZE, xfer_done, sl, 0);
+    sl->done = 0;
+    if (libusb_submit_transfer(sl->xfer) != 0)
+        return -1;
+    sl->posted = 1;
+    g_ua.inflight++;
+    g_ua.xfers++;
+    return 0;
+}
+
+/* Post every free slot, oldest first; only while holding the link */
+static int post_free(void) {
+    for (int k = 0; k < g_ua.depth; k++) {
+        struct ua_slot *sl = &g_ua.slot[(g_ua.head + k) % g_ua.depth];
+        if (!sl->posted && !sl->done && submit(sl) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int slot_free(void) {
+    for (int i = 0; i < g_ua.depth; i++)
+        if (!g_ua.slot[i].posted && !g_ua.slot[i].done)
+            return 1;
+    return 0;
+}
+
+/* Wake the consumer; a failed write means the eventfd is already set */
+static void ring_signal(void) {
+    uint64_t one = 1;
+    ssize_t r = write(g_ring.efd, &one, sizeof(one));
+    (void)r;
+}
+
+/*
+ * Reader thread: move completed transfers, oldest first, into the ring and
+ * free their slots for posting again.  A transfer that does not fit stays
+ * completed until the consumer frees space, which also stops it being
+ * re-posted.
+ */
+static int ring_push_completed(void) {
+    for (;;) {
+        struct ua_slot *sl = &g_ua.slot[g_ua.head];
+        if (!sl->done)
+            return 0;
+        if (sl->xfer->status != LIBUSB_TRANSFER_COMPLETED &&
+            sl->xfer->status != LIBUSB_TRANSFER_CANCELLED) {
+            atomic_store(&g_ring.error, 1);
+            return -1;
+        }
+        size_t n = (size_t)sl->xfer->actual_length;
+        size_t wr = atomic_load_explicit(&g_ring.wr, memory_order_relaxed);
+        size_t rd = atomic_load_explicit(&g_ring.rd, memory_order_acquire);
+        if (g_ring.size - (wr - rd) < n) {
+            if (!g_ring.was_full)
+                g_ring.full_events++;
+            g_ring.was_full = 1;
+            return 1;
+        }
+        g_ring.was_full = 0;
+        size_t pos = wr & (g_ring.size - 1);
+        size_t first = n < g_ring.size - pos ? n : g_ring.size - pos;
+        memcpy(g_ring.buf + pos, sl->buf, first);
+        memcpy(g_ring.buf, sl->buf + first, n - first);
+        atomic_store_explicit(&g_ring.wr, wr + n, memory_order_release);
+        if (wr + n - rd > g_ring.high_water)
+            g_ring.high_water = wr + n - rd;
+        if (n)
+            ring_signal();
+        sl->done = 0;
+        g_ua.head = (g_ua.head + 1) % g_ua.depth;
+    }
+}
+
+static void *reader_thread(void *arg) {
+    int full = 0;
+    (void)arg;
+    while (!atomic_load(&g_ring.stop)) {
+        /* Take the link only with a buffer to post */
+        if (!g_ua.holding && slot_free()) {
+            atomic_store(&g_ring.held, 1);
+            link_take();
+            atomic_store(&g_ring.held, 0);
+        }
+        if (g_ua.holding && post_free() < 0) {
+            atomic_store(&g_ring.error, 1);
+            break;
+        }
+        /* Short naps while the ring is full, so space is noticed quickly,
+         * and while sharing the link, so a waiting printer is */
+        struct timeval tv = { 0, full ? 1000 :
+                              g_ua.arb->seg ? BRUSB_ARB_CHECK_MS * 1000 : 100000 };
+        int rc = libusb_handle_events_timeout_completed(g_ua.ctx, &tv, NULL);
+        if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED) {
+            atomic_store(&g_ring.error, 1);
+            break;
+        }
+        full = ring_push_completed();
+        if (full < 0)
+            break;
+        if (g_ua.holding && brarb_wanted(g_ua.arb))
+            link_yield();
+        else if (g_ua.inflight == 0)
+            link_release();
+    }
+    cancel_posted();
+    link_release();
+    /* Wake a consumer waiting on an empty ring */
+    ring_signal();
+    return NULL;
+}
+
+static int start_reader_thread(void) {
+    size_t size = 64 * 1024;
+    while (size < (size_t)g_ring_kb * 1024)
+        size <<= 1;
+    g_ring.buf = (unsigned char *)malloc(size);
+    g_ring.efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!g_ring.buf || g_ring.efd < 0)
+        return 0;
+    g_ring.size = size;
+    brarb_open(&g_ring.arb, BRARB_SCAN);
+    g_ua.arb = &g_ring.arb;
+    if (pthread_create(&g_ring.thread, NULL, reader_thread, NULL) != 0)
+        return 0;
+    g_ring.running = 1;
+    return 1;
+}
+
+static int attach(usb_dev_handle *dev, int ep) {
+    int fd = find_usbfs_fd(dev);
+    if (fd < 0)
+        return 0;
+    if (libusb_init(&g_ua.ctx) != 0) {
+        g_ua.ctx = NULL;
+        return 0;
+    }
+    if (libusb_wrap_sys_device(g_ua.ctx, (intptr_t)fd, &g_ua.h) != 0) {
+        g_ua.h = NULL;
+        return 0;
+    }
+    g_ua.depth = g_depth;
+    g_ua.bufs = (unsigned char *)malloc((size_t)g_depth * BRUSB_XFER_SIZE);
+    if (!g_ua.bufs)
+        return 0;
+    for (int i = 0; i < g_depth; i++) {
+        g_ua.slot[i].xfer = libusb_alloc_transfer(0);
+        g_ua.slot[i].buf = g_ua.bufs + (size_t)i * BRUSB_XFER_SIZE;
+        if (!g_ua.slot[i].xfer)
+            return 0;
+    }
+    g_ua.dev = dev;
+    g_ua.ep = ep;
+    g_ua.arb = &g_arb;
+    if (g_thread_env && !start_reader_thread())
+        return 0;
+    if (g_debug)
+        fprintf(stderr, "%s [BROTHER2] usb async: attached to fd %d, "
+                "endpoint 0x%02x, %d x %d KB transfers%s\n",
+                debug_ts(), fd, ep, g_depth, BRUSB_XFER_SIZE / 1024,
+                g_ring.running ? ", reader thread" : "");
+    return 1;
+}
+
+/* Returns 1 if reads for (dev, ep) should use the async path */
+static int async_ready(usb_dev_handle *dev, int ep) {
+    read_config();
+    if (!g_async_env || !(ep & USB_ENDPOINT_IN))
+        return 0;
+    if (g_ua.dev == dev && g_ua.ep == ep)
+        return !g_ua.failed;
+    if (g_ua.dev == dev && g_ua.failed)
+        return 0;
+    /* New device or endpoint: start over */
+    detach();
+    if (!attach(dev, ep)) {
+        detach();
+        g_ua.dev = dev;
+        g_ua.ep = ep;
+        g_ua.failed = 1;
+        if (g_debug)
+            fprintf(stderr, "%s [BROTHER2] usb async: cannot attach, "
+                    "using polled usb_bulk_read\n", debug_ts());
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Wait until the head transfer completes with data or *deadline_ms
+ * (monotonic) passes.  Time spent waiting for the link moves the deadline
+ * on: the scanner has not gone quiet while printing had the link.
+ * Returns 1 on data, 0 on timeout, -1 on error.
+ */
+static int wait_for_data(double *deadline_ms) {
+    for (;;) {
+        struct ua_slot *sl = &g_ua.slot[g_ua.head];
+        while (!sl->done) {
+            if (!g_ua.holding)
+                *deadline_ms += link_take() / 1e6;
+            if (post_free() < 0)
+                return -1;
+            double left = *deadline_ms - now_ms();
+            if (left <= 0)
+                return 0;
+            if (g_ua.arb->seg && left > BRUSB_ARB_CHECK_MS)
+                left = BRUSB_ARB_CHECK_MS;
+            struct timeval tv;
+            tv.tv_sec = (long)(left / 1000.0);
+            tv.tv_usec = (long)((left - tv.tv_sec * 1000.0) * 1000.0);
+            int rc = libusb_handle_events_timeout_completed(g_ua.ctx, &tv,
+                                                            &sl->done);
+            if (rc < 0 && rc != LIBUSB_ERROR_INTERRUPTED)
+                return -1;
+            if (!sl->done && brarb_wanted(g_ua.arb))
+                link_yield();
+        }
+        if (sl->xfer->status != LIBUSB_TRANSFER_COMPLETED &&
+            sl->xfer->status != LIBUSB_TRANSFER_CANCELLED)
+            return -1;
+        if (sl->xfer->actual_length > 0) {
+            g_ua.avail = sl->xfer->actual_length;
+            g_ua.off = 0;
+            return 1;
+        }
+        /* Zero-length packet: post it again at the back, try the next */
+        sl->done = 0;
+        g_ua.head = (g_ua.head + 1) % g_ua.depth;
+        if (g_ua.holding && post_free() < 0)
+            return -1;
+    }
+}
+
+/* Direct mode: hand out data from the head transfer of the queue */
+static int queue_read(char *bytes, int size, double deadline_ms) {
+    if (g_ua.holding && brarb_wanted(g_ua.arb))
+        link_yield();
+    if (g_ua.avail == 0) {
+        int rc = wait_for_data(&deadline_ms);
+        if (rc <= 0)
+            return rc;
+    }
+    struct ua_slot *sl = &g_ua.slot[g_ua.head];
+    int n = g_ua.avail < size ? g_ua.avail : size;
+    memcpy(bytes, sl->buf + g_ua.off, n);
+    g_ua.off += n;
+    g_ua.avail -= n;
+    /* Slot drained: re-post it at the back of the queue while the turn
+     * lasts */
+    if (g_ua.avail == 0) {
+        sl->done = 0;
+        g_ua.head = (g_ua.head + 1) % g_ua.depth;
+        if (g_ua.holding && brarb_wanted(g_ua.arb))
+            link_yield();
+        else if (g_ua.holding && post_free() < 0) {
+            /* Polled from the next read on: nothing may stay posted */
+            g_ua.failed = 1;
+            cancel_posted();
+        }
+    }
+    if (g_ua.inflight == 0)
+        link_release();
+    return n;
+}
+
+/* Reader-thread mode: pop up to size bytes from the ring */
+static int ring_read(char *bytes, int size, double deadline_ms) {
+    double last = now_ms();
+    for (;;) {
+        size_t rd = atomic_load_explicit(&g_ring.rd, memory_order_relaxed);
+        size_t wr = atomic_load_explicit(&g_ring.wr, memory_order_acquire);
+        if (wr != rd) {
+            size_t n = wr - rd < (size_t)size ? wr - rd : (size_t)size;
+            size_t pos = rd & (g_ring.size - 1);
+            size_t first = n < g_ring.size - pos ? n : g_ring.size - pos;
+            memcpy(bytes, g_ring.buf + pos, first);
+            memcpy(bytes + first, g_ring.buf, n - first);
+            atomic_store_explicit(&g_ring.rd, rd + n, memory_order_release);
+            return (int)n;
+        }
+        if (atomic_load(&g_ring.error))
+            return -1;
+        /* The stall clock stops while the thread waits for the link */
+        double t = now_ms();
+        if (atomic_load(&g_ring.held))
+            deadline_ms += t - last;
+        last = t;
+        double left = deadline_ms - t;
+        if (left <= 0)
+            return 0;
+        if (g_ring.arb.seg && left > BRUSB_ARB_CHECK_MS)
+            left = BRUSB_ARB_CHECK_MS;
+        struct pollfd pfd = { g_ring.efd, POLLIN, 0 };
+        if (poll(&pfd, 1, (int)left + 1) > 0) {
+            uint64_t v;
+            ssize_t r = read(g_ring.efd, &v, sizeof(v));
+            (void)r;
+        }
+    }
+}
+
+static int bulk_read(struct usb_dev_handle *dev, int ep, char *bytes,
+                     int size, int timeout) {
+    if (!async_ready(dev, ep))
+        return polled_read(dev, ep, bytes, size, timeout);
+
+    g_ua.reads++;
+    /* Before data starts (scanner warm-up) honour the caller's timeout;
+     * once it has, wait out the stall timeout. */
+    double start = now_ms();
+    double deadline = g_ua.had_data
+        ? g_ua.last_data_ms + g_stall_ms
+        : start + (timeout > 0 ? timeout : g_stall_ms);
+    int n = g_ring.running ? ring_read(bytes, size, deadline)
+                           : queue_read(bytes, size, deadline);
+    double now = now_ms();
+    g_ua.wait_ms += now - start;
+    if (now - start > g_ua.max_wait_ms)
+        g_ua.max_wait_ms = now - start;
+
+    if (n < 0) {
+        if (g_debug)
+            fprintf(stderr, "%s [BROTHER2] usb async: transfer failed, "
+                    "falling back to polled usb_bulk_read\n", debug_ts());
+        print_stats("failed");
+        detach();
+        g_ua.dev = dev;
+        g_ua.ep = ep;
+        g_ua.failed = 1;
+        return polled_read(dev, ep, bytes, size, timeout);
+    }
+    if (n == 0) {
+        g_ua.empty_returns++;
+        if (g_ua.had_data) {
+            /* Quiet for the whole stall timeout: end of data.  Wait for
+             * the caller's timeout again before the next page. */
+            g_ua.stalled = 1;
+            g_ua.had_data = 0;
+        }
+        return 0;
+    }
+    g_ua.bytes += n;
+    g_ua.had_data = 1;
+    g_ua.last_data_ms = now;
+    return n;
+}
+
+static void close_async(struct usb_dev_handle *dev) {
+    if (g_ua.dev == dev) {
+        print_stats("close");
+        detach();
+    }
+}
+
+/* End of page: nothing stays posted (the reader thread hands the link
+ * over by itself once printing waits) */
+static void async_link_done(void) {
+    if (!g_ring.running && g_ua.holding) {
+        cancel_posted();
+        link_release();
+    }
+}
+
+int brusb_async_active(void) {
+    return g_ua.dev != NULL && !g_ua.failed;
+}
+
+int brusb_stalled(void) {
+    int s = g_ua.stalled;
+    g_ua.stalled = 0;
+    return s;
+}
+
+#else /* !HAVE_LIBUSB1 */
+
+static int bulk_read(struct usb_dev_handle *dev, int ep, char *bytes,
+                     int size, int timeout) {
+    return polled_read(dev, ep, bytes, size, timeout);
+}
+
+static void close_async(struct usb_dev_handle *dev) {
+    (void)dev;
+}
+
+static void async_link_done(void) {
+}
+
+int brusb_async_active(void) {
+    return 0;
+}
+
+int brusb_stalled(void) {
+    return 0;
+}
+
+#endif /* HAVE_LIBUSB1 */
+
+int brusb_bulk_read(struct usb_dev_handle *dev, int ep, char *bytes,
+                    int size, int timeout) {
+    read_config();
+    if (!g_arb_open) {
+        g_arb_open = 1;
+        brarb_open(&g_arb, BRARB_SCAN);
+    }
+    return bulk_read(dev, ep, bytes, size, timeout);
+}
+
+void brusb_link_done(void) {
+    async_link_done();
+    brarb_done(&g_arb);
+    if (!g_arb.waits)
+        return;
+    if (g_debug)
+        fprintf(stderr, "%s [BROTHER2] USB link shared with printing: %lu reads "
+                "waited, %.1f ms in all (longest %.1f ms)\n", debug_ts(),
+                (unsigned long)g_arb.waits, g_arb.wait_ns / 1e6,
+                g_arb.max_wait_ns / 1e6);
+    BRSTATS *st = brstats_attach();
+    if (st) {
+        BRSTATS_ADD(st, arb_scan_waits, g_arb.waits);
+        BRSTATS_ADD(st, arb_scan_wait_ns, g_arb.wait_ns);
+    }
+    g_arb.waits = g_arb.wait_ns = g_arb.max_wait_ns = 0;
+}
+
+int brusb_close(struct usb_dev_handle *dev) {
+    close_async(dev);
+    brusb_link_done();
+    return usb_close(dev);
+}
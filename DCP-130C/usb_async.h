@@ -0,0 +1,36 @@
+/*
+ * Event-driven USB bulk reads for the brother2 backend (usb_async.c).
+ *
+ * install_scanner.sh includes this header into brother_devaccs.c right
+ * after brother_mfccmd.h, so every usb_bulk_read()/usb_close() in the
+ * backend (which brother2.c builds as one translation unit) goes through
+ * the brusb_* wrappers.  With BROTHER_USB_ASYNC unset they are plain
+ * pass-throughs to libusb-0.1, apart from taking turns with printing on
+ * the shared link.
+ */
+#ifndef BRUSB_ASYNC_H
+#define BRUSB_ASYNC_H
+
+struct usb_dev_handle;
+
+int brusb_bulk_read(struct usb_dev_handle *dev, int ep, char *bytes,
+                    int size, int timeout);
+int brusb_close(struct usb_dev_handle *dev);
+
+/* 1 while reads are served by libusb-1.0 async transfers */
+int brusb_async_active(void);
+/* 1 (once) when no data has arrived for the stall timeout after a scan
+ * started sending; the caller should treat it as end of data */
+int brusb_stalled(void);
+/* Stall timeout in ms (BROTHER_USB_STALL_MS, default 400) */
+int brusb_stall_ms(void);
+/* End of a page: give the shared link up to printing (brother_usb_arb.h)
+ * and publish this page's waits for it */
+void brusb_link_done(void);
+
+#ifndef BRUSB_NO_REDIRECT
+#define usb_bulk_read brusb_bulk_read
+#define usb_close     brusb_close
+#endif
+
+#endif /* BRUSB_ASYNC_H */
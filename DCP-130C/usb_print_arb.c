@@ -0,0 +1,118 @@
+/*
+ * Print side of the USB link arbitration — libbrusbarb.so
+ *
+ * Print data reaches the DCP-130C through CUPS's own usb backend, which
+ * writes it with libusb_bulk_transfer().  install_printer.sh installs a
+ * "brusb" backend that runs the usb backend with this library in
+ * LD_PRELOAD, so every bulk-OUT transfer the backend makes takes the
+ * print side's turn on the link shared with scanning (brother_usb_arb.h)
+ * and ends it when the transfer returns, whatever it returns.  Bulk-IN
+ * transfers (the backchannel's status reads) pass straight through.
+ *
+ * The backend writes with no timeout, so a single write can block for as
+ * long as the printer is busy moving paper.  Writes are therefore split
+ * in time: each piece is given the print side's slice as its timeout,
+ * and a piece that times out part way (libusb reports how much went out)
+ * ends the transfer, so a waiting scan can take its turn, before the rest
+ * is written.  The caller's own timeout, if any, still bounds the whole
+ * write.
+ *
+ * If the backend is killed in the middle of a write (a cancelled job),
+ * the turn is recovered by the scan side from the dead holder's pid.  At
+ * exit the turn is given up, and with BROTHER_DEBUG=1 the waits are
+ * logged as CUPS "DEBUG:" messages; they also go to brother_exporter's
+ * segment when it exists (brother_stats.h).
+ *
+ * No libusb-1.0 headers are needed: the one entry point is declared here
+ * and the real one is found with dlsym(RTLD_NEXT).
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "brother_stats.h"
+#include "brother_usb_arb.h"
+
+/* From libusb.h */
+#define LIBUSB_ENDPOINT_IN      0x80
+#define LIBUSB_ERROR_TIMEOUT    (-7)
+#define LIBUSB_ERROR_NOT_FOUND  (-5)
+
+typedef struct libusb_device_handle libusb_device_handle;
+typedef int (*bulk_transfer_fn)(libusb_device_handle *, unsigned char,
+                                unsigned char *, int, int *, unsigned int);
+
+static bulk_transfer_fn g_real;
+static pthread_once_t g_once = PTHREAD_ONCE_INIT;
+static BRARB_CLIENT g_arb;
+static int g_debug;
+static unsigned long g_writes, g_pieces;
+
+static void init(void)
+{
+    g_real = (bulk_transfer_fn)dlsym(RTLD_NEXT, "libusb_bulk_transfer");
+    const char *e = getenv("BROTHER_DEBUG");
+    g_debug = e && strcmp(e, "1") == 0;
+    brarb_open(&g_arb, BRARB_PRINT);
+}
+
+int libusb_bulk_transfer(libusb_device_handle *h, unsigned char ep,
+                         unsigned char *data, int length, int *transferred,
+                         unsigned int timeout)
+{
+    pthread_once(&g_once, init);
+    if (!g_real)
+        return LIBUSB_ERROR_NOT_FOUND;
+    if (!g_arb.seg || (ep & LIBUSB_ENDPOINT_IN))
+        return g_real(h, ep, data, length, transferred, timeout);
+
+    const uint64_t slice_ms =
+        __atomic_load_n(&g_arb.seg->slice_ns[BRARB_PRINT], __ATOMIC_RELAXED) / 1000000ull;
+    const uint64_t end = brarb_now_ns() + (uint64_t)timeout * 1000000ull;
+    int done = 0, r;
+    g_writes++;
+    for (;;) {
+        unsigned int piece = slice_ms ? (unsigned int)slice_ms : 1;
+        if (timeout) {
+            uint64_t now = brarb_now_ns();
+            uint64_t left_ms = now < end ? (end - now + 999999) / 1000000ull : 0;
+            if (left_ms == 0) {
+                r = LIBUSB_ERROR_TIMEOUT;
+                break;
+            }
+            if (left_ms < piece)
+                piece = (unsigned int)left_ms;
+        }
+        int n = 0;
+        brarb_enter(&g_arb);
+        r = g_real(h, ep, data + done, length - done, &n, piece);
+        brarb_leave(&g_arb);
+        g_pieces++;
+        done += n;
+        if (r != LIBUSB_ERROR_TIMEOUT || done >= length)
+            break;
+    }
+    if (r == LIBUSB_ERROR_TIMEOUT && done >= length)
+        r = 0;
+    if (transferred)
+        *transferred = done;
+    return r;
+}
+
+__attribute__((destructor))
+static void fini(void)
+{
+    if (!g_arb.seg)
+        return;
+    brarb_done(&g_arb);
+    BRSTATS *seg = brstats_attach();
+    if (seg) {
+        BRSTATS_ADD(seg, arb_print_waits, g_arb.waits);
+        BRSTATS_ADD(seg, arb_print_wait_ns, g_arb.wait_ns);
+    }
+    if (g_debug && g_writes)
+        fprintf(stderr, "DEBUG: [BRUSBARB] %lu USB writes in %lu pieces, %lu "
+                "waited for scanning, %.1f ms in all (longest %.1f ms)\n",
+                g_writes, g_pieces, (unsigned long)g_arb.waits,
+                g_arb.wait_ns / 1e6, g_arb.max_wait_ns / 1e6);
+}
@@ -45,6 +45,14 @@ log_debug() {
 PRINTER_NAME="Brother_DCP_130C"
 TMP_DIR="/tmp/brother_dcp130c_install"
 PRINTER_SHARED=false
+SCRIPT_DIR="$(cd "$(dirname "${BASH_SOURCE[0]}")" && pwd)"
+
+# CUPS backend that takes turns with scanning on the shared USB link
+# (DCP-130C/usb_print_arb.c).  Set to 1 by install_usb_arbitration().
+USB_ARB_OK=0
+USB_ARB_LIB="/usr/lib/libbrusbarb.so"
+USB_ARB_BACKEND="/usr/lib/cups/backend/brusb"
+CUPS_USB_BACKEND="/usr/lib/cups/backend/usb"
 
 # Patch lpadmin calls in a script file by commenting them out.
 # This prevents Brother's cupswrapper scripts from auto-creating printers.
@@ -287,6 +295,7 @@ install_dependencies() {
         ghostscript
         psutils
         a2ps
+        gcc
     )
 
 
@@ -857,6 +866,53 @@ esac\
     log_info "Drivers installed successfully."
 }
 
+# Build the print side of the USB link arbitration (DCP-130C/usb_print_arb.c)
+# and install the "brusb" CUPS backend that runs CUPS's usb backend with it
+# preloaded, so print data written to the DCP-130C takes turns with scan
+# reads.  Sets USB_ARB_OK=1 on success so configure_printer() uses a
+# brusb:// URI; on failure the queue keeps the plain usb backend.
+install_usb_arbitration() {
+    local src="$SCRIPT_DIR/DCP-130C/usb_print_arb.c"
+    if [[ ! -f "$src" ]]; then
+        log_warn "Source file not found: $src"
+        return 1
+    fi
+    if [[ ! -x "$CUPS_USB_BACKEND" ]]; then
+        log_warn "CUPS usb backend not found: $CUPS_USB_BACKEND"
+        return 1
+    fi
+    if ! command -v gcc &>/dev/null; then
+        log_warn "gcc not found — cannot compile the USB link arbitration"
+        return 1
+    fi
+    local build_out
+    build_out=$(mktemp)
+    if ! gcc -shared -fPIC -O2 -Wall -o "$build_out" "$src" -ldl -lpthread; then
+        log_warn "Failed to compile usb_print_arb.c"
+        rm -f "$build_out"
+        return 1
+    fi
+    sudo install -m 644 "$build_out" "$USB_ARB_LIB"
+    rm -f "$build_out"
+
+    # Mode 0700: CUPS runs it as root, like the usb backend it wraps.
+    # Without arguments (device discovery) it reports nothing, so printers
+    # are still listed once, by the usb backend.
+    sudo tee "$USB_ARB_BACKEND" > /dev/null << BRUSB_EOF
+#!/bin/sh
+# Brother DCP-130C: CUPS usb backend, with its bulk writes taking turns
+# with scanning on the shared USB link (installed by install_printer.sh)
+[ \$# -eq 0 ] && exit 0
+DEVICE_URI="usb:\${DEVICE_URI#brusb:}"
+LD_PRELOAD="$USB_ARB_LIB\${LD_PRELOAD:+:\$LD_PRELOAD}"
+export DEVICE_URI LD_PRELOAD
+exec "$CUPS_USB_BACKEND" "\$@"
+BRUSB_EOF
+    sudo chmod 700 "$USB_ARB_BACKEND"
+    USB_ARB_OK=1
+    log_info "Installed USB link arbitration backend: $USB_ARB_BACKEND"
+}
+
 # Detect printer USB connection
 detect_printer() {
     log_info "Detecting Brother DCP-130C printer..."
@@ -896,6 +952,11 @@ configure_printer() {
         log_warn "Could not auto-detect printer URI. Using default USB URI."
         PRINTER_URI="usb://Brother/DCP-130C"
     fi
+
+    # Send jobs through the brusb backend so they take turns with scanning
+    if [[ $USB_ARB_OK -eq 1 && "$PRINTER_URI" == usb:* ]]; then
+        PRINTER_URI="brusb:${PRINTER_URI#usb:}"
+    fi
     
     log_info "Printer URI: $PRINTER_URI"
     
@@ -1270,6 +1331,7 @@ main() {
     extract_and_modify_drivers
     repackage_drivers
     install_drivers
+    install_usb_arbitration || log_warn "Print jobs will not take turns with scanning on the USB link."
     detect_printer
     configure_printer
     test_print
@@ -48,6 +48,9 @@ SCANNER_NAME="Brother_DCP_130C"
 TMP_DIR="/tmp/brother_dcp130c_scanner_install"
 SCANNER_SHARED=false
 AIRSANE_INSTALLED=false
+# BROTHER_SCAN_DAEMON=1 routes scans through the resident brscand daemon
+SCAN_DAEMON="${BROTHER_SCAN_DAEMON:-0}"
+SCAN_DAEMON_INSTALLED=false
 
 # AirSane eSCL/AirScan server — exposes SANE scanners to Windows, macOS, iOS, Android
 AIRSANE_VERSION="0.4.9"
@@ -314,6 +317,27 @@ AVAHI_EOF
     install_airsane || log_warn "AirSane installation failed. Windows/macOS/iOS will not discover the scanner automatically."
 }
 
+# Ensure the saned user (which AirSane and brscand run as) can access the
+# Brother USB scanner.  The sane-utils package creates the saned user; we
+# add it to the scanner group and create a udev rule granting the scanner
+# group access to the device.
+install_scanner_udev_rule() {
+    if id saned &>/dev/null; then
+        sudo usermod -a -G scanner saned 2>/dev/null || true
+        sudo usermod -a -G lp saned 2>/dev/null || true
+    fi
+
+    local udev_rule="/etc/udev/rules.d/60-brother-scanner.rules"
+    if [[ ! -f "$udev_rule" ]]; then
+        sudo tee "$udev_rule" > /dev/null << 'UDEV_EOF'
+# Brother DCP-130C scanner — allow scanner group access for saned/AirSane
+ATTRS{idVendor}=="04f9", ATTRS{idProduct}=="01a8", MODE="0660", GROUP="scanner", ENV{libsane_matched}="yes"
+UDEV_EOF
+        sudo udevadm control --reload-rules 2>/dev/null || true
+        sudo udevadm trigger 2>/dev/null || true
+    fi
+}
+
 # Build and install AirSane — an eSCL/AirScan server that wraps SANE scanners.
 # AirSane advertises via Avahi using _uscan._tcp (eSCL), making the scanner
 # discoverable by Windows 10/11, macOS, iOS, and Android out of the box.
@@ -377,24 +401,7 @@ install_airsane() {
     fi
     cd "$TMP_DIR"
 
-    # Ensure the saned user (which AirSane runs as) can access the Brother USB scanner.
-    # The sane-utils package creates the saned user; we add it to the scanner group
-    # and create a udev rule granting the scanner group access to the device.
-    if id saned &>/dev/null; then
-        sudo usermod -a -G scanner saned 2>/dev/null || true
-        sudo usermod -a -G lp saned 2>/dev/null || true
-    fi
-
-    # Create udev rule so the Brother scanner is accessible by the scanner group
-    local udev_rule="/etc/udev/rules.d/60-brother-scanner.rules"
-    if [[ ! -f "$udev_rule" ]]; then
-        sudo tee "$udev_rule" > /dev/null << 'UDEV_EOF'
-# Brother DCP-130C scanner — allow scanner group access for saned/AirSane
-ATTRS{idVendor}=="04f9", ATTRS{idProduct}=="01a8", MODE="0660", GROUP="scanner", ENV{libsane_matched}="yes"
-UDEV_EOF
-        sudo udevadm control --reload-rules 2>/dev/null || true
-        sudo udevadm trigger 2>/dev/null || true
-    fi
+    install_scanner_udev_rule
 
     # Enable and start AirSane service
     sudo systemctl daemon-reload
@@ -427,7 +434,9 @@ install_dependencies() {
         gcc
         libsane-dev
         libusb-dev
+        libusb-1.0-0-dev
         libncurses-dev
+        libjpeg-dev
     )
 
 
@@ -749,12 +758,35 @@ compile_arm_backend() {
     #
     # Debug: When BROTHER_DEBUG=1 is set, counts total USB reads,
     # zero-byte reads, and total bytes, printing a summary at EOF.
+    #
+    # Event-driven reads: usb_async.h (DCP-130C/usb_async.c) redirects the
+    # backend's usb_bulk_read()/usb_close() to libusb-1.0 async transfers
+    # when BROTHER_USB_ASYNC=1. Reads then block until data arrives, so the
+    # usleep(2000) is skipped, and EOF is declared by time (brusb_stalled(),
+    # BROTHER_USB_STALL_MS) instead of by counting zero-byte reads.
+    #
+    # Exporter counters: the same read, zero-read, byte and stall counts
+    # are added to brother_exporter's segment when it exists
+    # (DCP-130C/brother_stats.h), whether or not BROTHER_DEBUG is set.
+    #
+    # Printing shares the USB link: brusb_bulk_read() takes the scan
+    # side's turn for each read (DCP-130C/brother_usb_arb.h), so print
+    # jobs' bulk writes are interleaved with the reads instead of the two
+    # stalling each other.  brusb_link_done() gives the turn up at EOF.
     local devaccs_c="$brscan_src/backend_src/brother_devaccs.c"
     if [[ -f "$devaccs_c" ]]; then
         # Ensure <time.h> is included (needed for timestamp in EOF message)
         if ! grep -q '#include <time.h>' "$devaccs_c"; then
             sed -i '/#include "brother_mfccmd.h"/a #include <time.h>' "$devaccs_c"
         fi
+        # Route bulk reads through the event-driven wrappers
+        if ! grep -q '#include "usb_async.h"' "$devaccs_c"; then
+            sed -i '/#include "brother_mfccmd.h"/a #include "usb_async.h"' "$devaccs_c"
+        fi
+        # Shared counters for brother_exporter
+        if ! grep -q '#include "brother_stats.h"' "$devaccs_c"; then
+            sed -i '/#include "brother_mfccmd.h"/a #include "brother_stats.h"' "$devaccs_c"
+        fi
 
         # Inject stall detection counters + debug variables before the
         # WriteLog at the start of ReadDeviceData.
@@ -769,28 +801,40 @@ compile_arm_backend() {
 \tstatic unsigned long _rdd_zero_reads = 0;\
 \tstatic unsigned long _rdd_total_bytes = 0;\
 \tstatic int _rdd_debug = -1;\
+\tstatic BRSTATS *_rdd_st = NULL;\
 \tif (_rdd_debug < 0) {\
 \t\tconst char *_e = getenv("BROTHER_DEBUG");\
 \t\t_rdd_debug = (_e && strcmp(_e, "1") == 0);\
+\t\t_rdd_st = brstats_attach();\
 \t}' "$devaccs_c"
 
         # After the ReadEnd WriteLog, add stall detection + CPU yield:
-        # - Count every USB read for debug stats
+        # - Count every USB read for debug stats (and the exporter)
         # - On data: reset streak, accumulate bytes
         # - On zero-byte: usleep(2000) to yield CPU, then check stall
-        # - On stall (200 consecutive zeros after data): force EOF
+        #   (no sleep with async reads: they already blocked)
+        # - On stall (200 consecutive zeros after data, or no data for
+        #   the stall timeout with async reads): force EOF
         sed -i '/WriteLog.*ReadDeviceData ReadEnd nResultSize/a\
 \t_rdd_reads++;\
+\tif (_rdd_st)\
+\t\tBRSTATS_ADD(_rdd_st, usb_reads, 1);\
 \tif (nResultSize > 0) {\
 \t\t_rdd_zero_streak = 0;\
 \t\t_rdd_had_data = 1;\
 \t\t_rdd_total_bytes += nResultSize;\
+\t\tif (_rdd_st)\
+\t\t\tBRSTATS_ADD(_rdd_st, usb_bytes, nResultSize);\
 \t} else {\
 \t\t_rdd_zero_reads++;\
-\t\tusleep(2000);\
+\t\tif (_rdd_st)\
+\t\t\tBRSTATS_ADD(_rdd_st, usb_zero_reads, 1);\
+\t\tif (!brusb_async_active())\
+\t\t\tusleep(2000);\
 \t\tif (_rdd_had_data) {\
 \t\t\t_rdd_zero_streak++;\
-\t\t\tif (_rdd_zero_streak >= STALL_THRESHOLD) {\
+\t\t\tif (brusb_async_active() ? brusb_stalled()\
+\t\t\t    : _rdd_zero_streak >= STALL_THRESHOLD) {\
 \t\t\t\tif (_rdd_debug) {\
 \t\t\t\t\tunsigned long _data_reads = _rdd_reads - _rdd_zero_reads;\
 \t\t\t\t\ttime_t _now = time(NULL);\
@@ -801,8 +845,11 @@ compile_arm_backend() {
 \t\t\t\t\t\t_tm.tm_hour, _tm.tm_min, _tm.tm_sec,\
 \t\t\t\t\t\t_rdd_reads, _rdd_zero_reads, _rdd_total_bytes,\
 \t\t\t\t\t\t_data_reads > 0 ? _rdd_total_bytes / _data_reads : 0,\
-\t\t\t\t\t\tSTALL_THRESHOLD * 2);\
+\t\t\t\t\t\tbrusb_async_active() ? brusb_stall_ms() : STALL_THRESHOLD * 2);\
 \t\t\t\t}\
+\t\t\t\tif (_rdd_st)\
+\t\t\t\t\tBRSTATS_ADD(_rdd_st, usb_stalls, 1);\
+\t\t\t\tbrusb_link_done();\
 \t\t\t\tnResultSize = -1;\
 \t\t\t\t_rdd_zero_streak = 0;\
 \t\t\t}\
@@ -865,6 +912,7 @@ a\
         "-I${brscan_src}" "-I${brscan_src}/include"
         "-I${brscan_src}/backend_src"
         "-I${brscan_src}/libbrscandec2" "-I${brscan_src}/libbrcolm2"
+        "-I${SCRIPT_DIR}/DCP-130C"
         -DHAVE_CONFIG_H -D_GNU_SOURCE
     )
     local -a backend_flags=(
@@ -905,8 +953,17 @@ a\
         log_warn "Source file not found: $stub_src"
         return 1
     fi
-    gcc -shared -fPIC -O2 -w -o "$build_dir/libbrscandec2.so.1.0.0" \
-        "$stub_src" || {
+    # JPEG output (BROTHER_ENCODE=1) needs libjpeg; G4 is built in
+    local jpeg_cflags=() jpeg_libs=()
+    if printf '#include <stdio.h>\n#include <jpeglib.h>\n' | gcc -E - &>/dev/null; then
+        jpeg_cflags=(-DHAVE_LIBJPEG)
+        jpeg_libs=(-ljpeg)
+    else
+        log_debug "jpeglib.h not found — scan decoder built without JPEG output"
+    fi
+    gcc -shared -fPIC -O2 -w "${jpeg_cflags[@]}" \
+        -o "$build_dir/libbrscandec2.so.1.0.0" \
+        "$stub_src" -lpthread "${jpeg_libs[@]}" || {
         log_warn "Failed to compile libbrscandec2 stub"
         return 1
     }
@@ -932,6 +989,23 @@ a\
         }
     fi
 
+    # Compile event-driven USB read wrappers (brother_devaccs.c calls them).
+    # Without libusb-1.0 headers they build as plain usb_bulk_read() calls.
+    local async_src="$SCRIPT_DIR/DCP-130C/usb_async.c"
+    local -a async_flags=()
+    local -a async_libs=()
+    if [[ -f /usr/include/libusb-1.0/libusb.h ]]; then
+        async_flags=(-DHAVE_LIBUSB1)
+        async_libs=(-lusb-1.0)
+    else
+        log_warn "libusb-1.0 headers not found (install libusb-1.0-0-dev); BROTHER_USB_ASYNC disabled"
+    fi
+    gcc -c "${common_flags[@]}" "${async_flags[@]}" \
+        -o "$build_dir/usb_async.o" "$async_src" || {
+        log_warn "Failed to compile usb_async.c"
+        return 1
+    }
+
     # Link the SANE backend shared library
     log_info "Linking native ARM SANE backend..."
     local -a link_objs=(
@@ -940,6 +1014,7 @@ a\
         "$build_dir/sanei_constrain_value.o"
         "$build_dir/sanei_init_debug.o"
         "$build_dir/sanei_config.o"
+        "$build_dir/usb_async.o"
     )
     # Include backend init stub if compiled
     if [[ -f "$build_dir/backend_init.o" ]]; then
@@ -948,7 +1023,7 @@ a\
     local link_output
     link_output=$(gcc -shared -fPIC -o "$build_dir/libsane-brother2.so.1.0.7" \
         "${link_objs[@]}" \
-        -lpthread -lusb -lm -ldl -lc \
+        -lpthread -lusb "${async_libs[@]}" -lm -ldl -lc \
         -Wl,-soname,libsane-brother2.so.1 2>&1) || true
     if [[ ! -f "$build_dir/libsane-brother2.so.1.0.7" ]]; then
         log_warn "Failed to link libsane-brother2.so"
@@ -990,6 +1065,30 @@ a\
     (cd /usr/lib && sudo ln -sf libbrcolm2.so.1.0.0 libbrcolm2.so.1 && \
      sudo ln -sf libbrcolm2.so.1.0.0 libbrcolm2.so)
 
+    # Colour LUTs for libbrcolm2 (.cube files, see brcolor_stubs.c), and
+    # the cache directory for the brtables.bin store built from them and
+    # backend_init.c's usbprobe.cache.  Backends map the store and use
+    # its tables in place, so only root and the scanner group (saned and
+    # users given scanner access) may write the directory; setgid keeps
+    # new files in the group.  Caches an older install left in a
+    # world-writable directory are dropped.
+    sudo install -d -m 755 /usr/local/Brother/sane/colorlut
+    getent group scanner > /dev/null || sudo groupadd --system scanner
+    if id saned &>/dev/null; then
+        sudo usermod -a -G scanner saned
+    fi
+    sudo install -d -m 2775 -o root -g scanner /var/cache/brother2
+    sudo rm -f /var/cache/brother2/brtables.bin /var/cache/brother2/usbprobe.cache
+
+    # backend_init.c caches its USB probe in /var/cache/brother2 between
+    # backend loads; drop it when a Brother device comes or goes so the
+    # next load probes sysfs again.
+    sudo tee /etc/udev/rules.d/61-brother-probe-cache.rules > /dev/null << 'UDEV_EOF'
+# Brother DCP-130C — invalidate the backend's cached USB probe on hotplug
+ACTION=="add|remove", SUBSYSTEM=="usb", ENV{DEVTYPE}=="usb_device", ENV{PRODUCT}=="4f9/*", RUN+="/bin/rm -f /var/cache/brother2/usbprobe.cache"
+UDEV_EOF
+    sudo udevadm control --reload-rules 2>/dev/null || true
+
     # Run ldconfig to update library cache
     sudo ldconfig 2>/dev/null || true
 
@@ -1020,6 +1119,117 @@ a\
     return 0
 }
 
+# Build and install brother_exporter (DCP-130C/brother_exporter.c).
+# It creates the shared counter segment (/dev/shm/brother-stats) that the
+# scan decoder, colour matching, the backend's USB reads and both sides
+# of the USB link arbitration add to, and serves it to Prometheus on
+# port 9632.  Without
+# the exporter running nothing is published, so a failure here only
+# loses the metrics.
+install_exporter() {
+    local src="$SCRIPT_DIR/DCP-130C/brother_exporter.c"
+    local out="$TMP_DIR/brother_exporter"
+    if [[ ! -f "$src" ]]; then
+        log_warn "Source file not found: $src"
+        return 1
+    fi
+    if ! gcc -O2 -Wall -o "$out" "$src"; then
+        log_warn "Failed to compile brother_exporter"
+        return 1
+    fi
+    sudo install -m 755 "$out" /usr/local/bin/brother_exporter
+
+    sudo tee /etc/systemd/system/brother-exporter.service > /dev/null << 'EXPORTER_EOF'
+[Unit]
+Description=Brother DCP-130C scanner and printer metrics for Prometheus
+After=network.target
+
+[Service]
+ExecStart=/usr/local/bin/brother_exporter -p 9632
+Restart=on-failure
+User=nobody
+
+[Install]
+WantedBy=multi-user.target
+EXPORTER_EOF
+    sudo systemctl daemon-reload
+    sudo systemctl enable brother-exporter 2>/dev/null || log_warn "Failed to enable brother-exporter"
+    sudo systemctl restart brother-exporter 2>/dev/null || log_warn "Failed to start brother-exporter"
+    log_info "brother_exporter installed (metrics on http://localhost:9632/metrics)."
+    return 0
+}
+
+# Build and install the resident scan daemon (DCP-130C/brscand.c) and the
+# "brscand" SANE backend that forwards to it (brscand_shim.c), then point
+# dll.conf at the shim.  brscand loads libsane-brother2 and opens the
+# scanner once, so saned, AirSane and scanimage no longer pay for the
+# backend load, ini parsing and device open on every scan.
+# Opt-in with BROTHER_SCAN_DAEMON=1; returns 1 (keeping brother2) on failure.
+install_scan_daemon() {
+    local src_dir="$SCRIPT_DIR/DCP-130C"
+    local f
+    for f in brscand.c brscand_shim.c brscand.h; do
+        if [[ ! -f "$src_dir/$f" ]]; then
+            log_warn "Source file not found: $src_dir/$f"
+            return 1
+        fi
+    done
+    if ! gcc -O2 -Wall -o "$TMP_DIR/brscand" "$src_dir/brscand.c" -ldl -lpthread; then
+        log_warn "Failed to compile brscand"
+        return 1
+    fi
+    if ! gcc -shared -fPIC -O2 -Wall -o "$TMP_DIR/libsane-brscand.so.1.0.0" \
+        -Wl,-soname,libsane-brscand.so.1 "$src_dir/brscand_shim.c"; then
+        log_warn "Failed to compile the brscand SANE backend"
+        return 1
+    fi
+    sudo install -m 755 "$TMP_DIR/brscand" /usr/local/bin/brscand
+    sudo install -m 644 "$TMP_DIR/libsane-brscand.so.1.0.0" /usr/lib/sane/
+    (cd /usr/lib/sane && sudo ln -sf libsane-brscand.so.1.0.0 libsane-brscand.so.1 && \
+     sudo ln -sf libsane-brscand.so.1.0.0 libsane-brscand.so)
+
+    # The daemon runs as saned with access to the USB device
+    install_scanner_udev_rule
+    local user=saned
+    if ! id saned &>/dev/null; then
+        log_warn "saned user not found; running brscand as root"
+        user=root
+    fi
+    sudo tee /etc/systemd/system/brscand.service > /dev/null << BRSCAND_EOF
+[Unit]
+Description=Brother DCP-130C resident scan daemon
+After=local-fs.target
+
+[Service]
+ExecStart=/usr/local/bin/brscand
+Restart=on-failure
+User=$user
+SupplementaryGroups=scanner lp
+RuntimeDirectory=brscand
+
+[Install]
+WantedBy=multi-user.target
+BRSCAND_EOF
+    sudo systemctl daemon-reload
+    sudo systemctl enable brscand 2>/dev/null || log_warn "Failed to enable brscand"
+    if ! sudo systemctl restart brscand 2>/dev/null; then
+        log_warn "Failed to start brscand"
+        return 1
+    fi
+
+    # Frontends use the shim; brother2 stays installed for the daemon only,
+    # as listing both would show the scanner twice
+    local dll_conf="/etc/sane.d/dll.conf"
+    if ! grep -q '^brscand$' "$dll_conf" 2>/dev/null; then
+        echo "brscand" | sudo tee -a "$dll_conf" > /dev/null
+    fi
+    sudo sed -i -e '/^#brother2  (served by brscand)$/d' \
+        -e 's/^brother2$/#brother2  (served by brscand)/' "$dll_conf"
+    SCAN_DAEMON_INSTALLED=true
+    log_info "brscand installed; scanimage -d brscand:dcp130c scans through it."
+    return 0
+}
+
 # Diagnose USB speed for Brother scanner.
 # Reads sysfs speed attribute to report negotiated link rate and
 # explains whether High-Speed (480 Mbit/s) is possible.
@@ -1378,13 +1588,34 @@ display_info() {
     log_info "  A 2 ms yield (usleep) is injected after zero-byte reads to reduce"
     log_info "  CPU usage. The CPU load does NOT affect scan speed — the bottleneck"
     log_info "  is the 12 Mbit/s USB link, not the host CPU."
+    log_info "  Set BROTHER_USB_ASYNC=1 to use event-driven libusb-1.0 reads instead:"
+    log_info "  no polling, and end of scan after BROTHER_USB_STALL_MS (400) ms idle."
+    log_info "  BROTHER_USB_QUEUE_DEPTH (default 4) sets how many 16 KB reads stay queued."
+    log_info "  BROTHER_USB_THREAD=1 adds a reader thread so slow clients never stall USB."
+    log_info "  BROTHER_PIPELINE=1 decodes lines on a second core while the next read runs."
     echo
     log_info "Tips for faster scans:"
     log_info "    - Use 'True Gray' mode (3x less data than color, ~30 sec vs ~88 sec)"
     log_info "      scanimage -d 'brother2:bus1;dev1' --mode 'True Gray' --resolution=150 --format=pnm > scan.pnm"
+    log_info "    - For documents, 'Black & White' or 'Gray[Error Diffusion]' is lighter still;"
+    log_info "      BROTHER_BW_DITHER=threshold|bayer|fs|jarvis picks how the gray is rendered,"
+    log_info "      and bradley|sauvola keeps faint text on yellowed pages"
     log_info "    - Use 150 DPI instead of 300 DPI (4x less data)"
+    log_info "    - BROTHER_ENCODE=1 also writes each page as JPEG (G4 for B&W) to"
+    log_info "      BROTHER_ENCODE_OUT (default /tmp/brscan-page%d.jpg), ready to forward"
+    log_info "    - BROTHER_PREVIEW=/dev/shm/brscan-preview shares bands and a 1/8 preview"
+    log_info "      while the page scans, for frontends that draw it as it arrives"
     log_info "    - Ensure usblp is unbound: echo '<intf>' | sudo tee /sys/bus/usb/drivers/usblp/unbind"
     log_info "  For debug diagnostics, scan with: sudo BROTHER_DEBUG=1 scanimage ..."
+    log_info "  Running totals (scans, USB reads, write gaps, prints) for Prometheus:"
+    log_info "    curl http://localhost:9632/metrics   (brother-exporter.service)"
+    if [[ "$SCAN_DAEMON_INSTALLED" == true ]]; then
+        log_info "  Scans go through brscand (brscand.service), which keeps the backend"
+        log_info "  loaded and the scanner open: use -d brscand:dcp130c with scanimage."
+    else
+        log_info "  BROTHER_SCAN_DAEMON=1 installs brscand, a resident scan daemon that"
+        log_info "  saves the backend load and device open at the start of every scan."
+    fi
     echo
     log_info "If the scanner is not detected, try:"
     log_info "  1. Disconnect and reconnect the USB cable"
@@ -1442,9 +1673,13 @@ main() {
         exit 1
     fi
     log_info "Using native ARM SANE backend (direct USB access)."
+    install_exporter || log_warn "brother_exporter not installed; scanner metrics unavailable."
 
     detect_scanner
     configure_scanner
+    if [[ "$SCAN_DAEMON" == "1" ]]; then
+        install_scan_daemon || log_warn "brscand not installed; scans load the brother2 backend directly."
+    fi
     setup_scanner_sharing
     test_scan
     cleanup
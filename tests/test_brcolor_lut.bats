@@ -0,0 +1,203 @@
+#!/usr/bin/env bats
+# Tests for 3D LUT colour matching in brcolor_stubs.c: .cube lookup by
+# lpLutName/nPaperType, tetrahedral interpolation accuracy, pass-through
+# without a LUT, and the mmap'd table store.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    gcc -shared -fPIC -O2 -w \
+        -o "$TEST_TMPDIR/libbrcolm_test.so" \
+        "$PROJECT_ROOT/DCP-130C/brcolor_stubs.c" || skip "gcc unavailable"
+    mkdir -p "$TEST_TMPDIR/lut" "$TEST_TMPDIR/cache"
+    export BROTHER_LUT_DIR="$TEST_TMPDIR/lut"
+    export BROTHER_LUT_CACHE="$TEST_TMPDIR/cache"
+    build_colm_driver
+}
+
+teardown() {
+    teardown_test_tmpdir
+}
+
+# write_cube <file> <size> <awk expressions for r g b of inputs r g b in 0..1>
+write_cube() {
+    local file="$1" size="$2" expr="$3"
+    awk -v n="$size" 'BEGIN {
+        print "TITLE \"test\""; print "LUT_3D_SIZE " n
+        for (bi = 0; bi < n; bi++) for (gi = 0; gi < n; gi++) for (ri = 0; ri < n; ri++) {
+            r = ri / (n - 1); g = gi / (n - 1); b = bi / (n - 1)
+            '"$expr"'
+            printf "%.6f %.6f %.6f\n", R, G, B
+        }
+    }' > "$file"
+}
+
+# Driver: colm_test <lutname> <paper> <mode>
+#   mode "id": prints max |out - in| over a test image
+#   mode "inv": max |out - (255 - in)|
+#   mode "mix": max error against R=(r+g)/2, G=g, B=255-b
+#   mode "sq18": max error against r^2 at the 18-node grid points
+build_colm_driver() {
+    cat > "$TEST_TMPDIR/colm_test.c" << 'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+typedef int BOOL; typedef unsigned char BYTE; typedef char *LPSTR;
+#pragma pack(1)
+typedef struct { int nRgbLine, nPaperType, nMachineId; LPSTR lpLutName; } CMATCH_INIT;
+#pragma pack()
+extern BOOL ColorMatchingInit(CMATCH_INIT d);
+extern void ColorMatchingEnd(void);
+extern BOOL ColorMatching(BYTE *d, long len, long cnt);
+int main(int argc, char **argv) {
+    enum { W = 300, H = 64 };
+    static BYTE in[W * H * 3], out[W * H * 3];
+    unsigned s = 7;
+    for (int i = 0; i < W * H * 3; i++) { s = s * 1103515245 + 12345; in[i] = s >> 16; }
+    /* Every level on every channel appears at least once */
+    for (int v = 0; v < 256; v++) in[v * 3] = in[v * 3 + 1] = in[v * 3 + 2] = v;
+    if (!strcmp(argv[3], "sq18"))
+        for (int i = 0; i < W * H * 3; i++) in[i] = (in[i] % 18) * 15;
+    memcpy(out, in, sizeof(in));
+    CMATCH_INIT ci = {W, atoi(argv[2]), 1, argv[1]};
+    ColorMatchingInit(ci);
+    ColorMatching(out, W * 3, H);
+    ColorMatchingEnd();
+    int worst = 0;
+    for (int i = 0; i < W * H * 3; i += 3) {
+        for (int c = 0; c < 3; c++) {
+            int want = in[i + c];
+            if (!strcmp(argv[3], "inv")) want = 255 - in[i + c];
+            if (!strcmp(argv[3], "mix"))
+                want = c == 0 ? (in[i] + in[i + 1] + 1) / 2 : c == 1 ? in[i + 1] : 255 - in[i + 2];
+            if (!strcmp(argv[3], "sq18") && c == 0) want = (in[i] * in[i] + 127) / 255;
+            int e = abs(out[i + c] - want);
+            if (e > worst) worst = e;
+        }
+    }
+    printf("%d\n", worst);
+    return 0;
+}
+CEOF
+    gcc -O1 -o "$TEST_TMPDIR/colm_test" "$TEST_TMPDIR/colm_test.c" \
+        "$TEST_TMPDIR/libbrcolm_test.so" -Wl,-rpath,"$TEST_TMPDIR"
+}
+
+@test "brcolor LUT: without a LUT the data is passed through unchanged" {
+    run "$TEST_TMPDIR/colm_test" /usr/local/Brother/sane/none.dat 1 id
+    [[ "$output" == "0" ]]
+}
+
+@test "brcolor LUT: identity cube leaves pixels unchanged" {
+    write_cube "$TEST_TMPDIR/lut/ident.cube" 17 'R = r; G = g; B = b'
+    run "$TEST_TMPDIR/colm_test" /usr/local/Brother/sane/ident.dat 1 id
+    [[ "$output" == "0" ]]
+}
+
+@test "brcolor LUT: inverting cube inverts every level" {
+    write_cube "$TEST_TMPDIR/lut/inv.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    run "$TEST_TMPDIR/colm_test" inv 0 inv
+    [[ "$output" -le 1 ]]
+}
+
+@test "brcolor LUT: tetrahedral interpolation is exact for channel mixing" {
+    # Any affine map is reproduced exactly between nodes
+    write_cube "$TEST_TMPDIR/lut/mix.cube" 5 'R = (r + g) / 2; G = g; B = 1 - b'
+    run "$TEST_TMPDIR/colm_test" mix 0 mix
+    [[ "$output" -le 1 ]]
+}
+
+@test "brcolor LUT: grid points of a non-linear cube are hit exactly" {
+    write_cube "$TEST_TMPDIR/lut/sq.cube" 18 'R = r * r; G = g; B = b'
+    run "$TEST_TMPDIR/colm_test" sq 0 sq18
+    [[ "$output" -le 1 ]]
+}
+
+@test "brcolor LUT: a per-paper cube is preferred over the generic one" {
+    write_cube "$TEST_TMPDIR/lut/scan.cube" 5 'R = r; G = g; B = b'
+    write_cube "$TEST_TMPDIR/lut/scan-2.cube" 5 'R = 1 - r; G = 1 - g; B = 1 - b'
+    run "$TEST_TMPDIR/colm_test" scan.dat 2 inv
+    [[ "$output" -le 1 ]]
+    run "$TEST_TMPDIR/colm_test" scan.dat 1 id
+    [[ "$output" == "0" ]]
+}
+
+@test "brcolor LUT: parsed table is stored and mapped until the source changes" {
+    write_cube "$TEST_TMPDIR/lut/c.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' c 0 inv 2>&1"
+    [[ "$output" == *"(parsed, brtables.bin refreshed)"* ]]
+    [[ -f "$TEST_TMPDIR/cache/brtables.bin" ]]
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' c 0 inv 2>&1"
+    [[ "$output" == *"(mapped from brtables.bin)"* ]]
+    [[ "${lines[${#lines[@]}-1]}" -le 1 ]]
+    # Any edit changes the source stamp: re-parse, which fails: pass-through
+    echo "garbage" > "$TEST_TMPDIR/lut/c.cube"
+    run "$TEST_TMPDIR/colm_test" c 0 id
+    [[ "$output" == "0" ]]
+}
+
+@test "brcolor LUT: one store file holds every LUT" {
+    write_cube "$TEST_TMPDIR/lut/inv.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    write_cube "$TEST_TMPDIR/lut/mix.cube" 5 'R = (r + g) / 2; G = g; B = 1 - b'
+    "$TEST_TMPDIR/colm_test" inv 0 inv
+    "$TEST_TMPDIR/colm_test" mix 0 mix
+    [[ "$(ls "$TEST_TMPDIR/cache")" == "brtables.bin" ]]
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' inv 0 inv 2>&1"
+    [[ "$output" == *"(mapped from brtables.bin)"* ]]
+    [[ "${lines[${#lines[@]}-1]}" -le 1 ]]
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' mix 0 mix 2>&1"
+    [[ "$output" == *"(mapped from brtables.bin)"* ]]
+    [[ "${lines[${#lines[@]}-1]}" -le 1 ]]
+}
+
+@test "brcolor LUT: a store with another version or a bad hash is rebuilt" {
+    write_cube "$TEST_TMPDIR/lut/inv.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    "$TEST_TMPDIR/colm_test" inv 0 inv
+    # Version field follows the 8-byte magic
+    printf '\x63' | dd of="$TEST_TMPDIR/cache/brtables.bin" bs=1 seek=8 conv=notrunc 2>/dev/null
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' inv 0 inv 2>&1"
+    [[ "$output" == *"(parsed, brtables.bin refreshed)"* ]]
+    [[ "${lines[${#lines[@]}-1]}" -le 1 ]]
+    # Flip a byte in the first directory entry's name
+    printf 'X' | dd of="$TEST_TMPDIR/cache/brtables.bin" bs=1 seek=32 conv=notrunc 2>/dev/null
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' inv 0 inv 2>&1"
+    [[ "$output" == *"(parsed, brtables.bin refreshed)"* ]]
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' inv 0 inv 2>&1"
+    [[ "$output" == *"(mapped from brtables.bin)"* ]]
+}
+
+@test "brcolor LUT: a cache directory everyone can write holds no store" {
+    write_cube "$TEST_TMPDIR/lut/inv.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    "$TEST_TMPDIR/colm_test" inv 0 inv
+    chmod 777 "$TEST_TMPDIR/cache"
+    # A store someone else could have put there is not mapped ...
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' inv 0 inv 2>&1"
+    [[ "$output" == *"is writable by everyone, not using brtables.bin"* ]]
+    [[ "$output" == *"grid (parsed)"* ]]
+    [[ "${lines[${#lines[@]}-1]}" -le 1 ]]
+    # ... nor rewritten
+    rm "$TEST_TMPDIR/cache/brtables.bin"
+    "$TEST_TMPDIR/colm_test" inv 0 inv
+    [[ -z "$(ls "$TEST_TMPDIR/cache")" ]]
+}
+
+@test "brcolor LUT: installer keeps the cache directory to root and the scanner group" {
+    grep -q 'install -d -m 2775 -o root -g scanner /var/cache/brother2' \
+        "$PROJECT_ROOT/install_scanner.sh"
+    run grep -c 'install -d -m 1\?777 /var/cache/brother2' "$PROJECT_ROOT/install_scanner.sh"
+    [[ "$output" == "0" ]]
+}
+
+@test "brcolor LUT: unwritable cache directory still applies the LUT" {
+    write_cube "$TEST_TMPDIR/lut/inv.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    BROTHER_LUT_CACHE="$TEST_TMPDIR/missing/dir" run "$TEST_TMPDIR/colm_test" inv 0 inv
+    [[ "$output" -le 1 ]]
+}
+
+@test "brcolor LUT: debug output names the LUT in use" {
+    write_cube "$TEST_TMPDIR/lut/inv.cube" 9 'R = 1 - r; G = 1 - g; B = 1 - b'
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/colm_test' inv 0 inv 2>&1"
+    [[ "$output" == *"[BRCOLOR] LUT $TEST_TMPDIR/lut/inv.cube: 9^3 grid"* ]]
+    [[ "$output" == *"ColorMatchingEnd"*"(3D LUT)"* ]]
+}
@@ -0,0 +1,117 @@
+#!/usr/bin/env bats
+# Tests for the shared pipeline counters (DCP-130C/brother_stats.h) and
+# brother_exporter.c: publishing only while the segment exists, scan and
+# colour matching totals from replayed sessions, the Prometheus output
+# over HTTP, and the counters patched into the backend's USB reads.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    gcc -O2 -w -o "$TEST_TMPDIR/scandec_bench" \
+        "$PROJECT_ROOT/DCP-130C/scandec_bench.c" \
+        "$PROJECT_ROOT/DCP-130C/scandec_stubs.c" \
+        "$PROJECT_ROOT/DCP-130C/brcolor_stubs.c" -lpthread || skip "gcc unavailable"
+    gcc -O2 -Wall -Werror -o "$TEST_TMPDIR/brother_exporter" \
+        "$PROJECT_ROOT/DCP-130C/brother_exporter.c"
+    export BROTHER_STATS_PATH="$TEST_TMPDIR/stats"
+}
+
+teardown() {
+    [[ -n "${EXPORTER_PID:-}" ]] && kill "$EXPORTER_PID" 2>/dev/null
+    teardown_test_tmpdir
+}
+
+# metric <name>: value of one sample in the exporter's output
+metric() {
+    "$TEST_TMPDIR/brother_exporter" -o | awk -v m="$1" '$1 == m { print $2 }'
+}
+
+@test "stats: nothing is published or created without the segment" {
+    "$TEST_TMPDIR/scandec_bench" -g gray -p 100 "$TEST_TMPDIR/g.trace"
+    run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/g.trace"
+    [[ "$status" -eq 0 ]]
+    [[ ! -e "$BROTHER_STATS_PATH" ]]
+}
+
+@test "stats: exporter creates the segment and counts replayed scans" {
+    run "$TEST_TMPDIR/brother_exporter" -o
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"brother_scan_sessions_total 0"* ]]
+    [[ "$(stat -c %a "$BROTHER_STATS_PATH")" == "666" ]]
+
+    "$TEST_TMPDIR/scandec_bench" -g gray "$TEST_TMPDIR/g.trace"
+    "$TEST_TMPDIR/scandec_bench" -n 2 "$TEST_TMPDIR/g.trace"
+    [[ "$(metric brother_scan_sessions_total)" == "2" ]]
+    [[ "$(metric brother_scan_pages_total)" == "2" ]]
+    [[ "$(metric brother_scan_lines_total)" == "6600" ]]
+    [[ "$(metric brother_scan_active)" == "0" ]]
+    [[ "$(metric 'brother_scan_input_lines_total{compression="pack"}')" -gt 0 ]]
+    [[ "$(metric brother_scan_input_bytes_total)" -gt 0 ]]
+}
+
+@test "stats: histogram buckets are cumulative and +Inf matches the count" {
+    "$TEST_TMPDIR/brother_exporter" -o > /dev/null
+    "$TEST_TMPDIR/scandec_bench" -g gray -p 500 "$TEST_TMPDIR/g.trace"
+    "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/g.trace"
+    "$TEST_TMPDIR/brother_exporter" -o > "$TEST_TMPDIR/metrics"
+    for h in brother_scan_write_gap_seconds brother_scan_line_seconds; do
+        run awk -v h="$h" '
+            index($1, h "_bucket{") == 1 { if ($2 < prev) bad = 1; prev = $2; inf = $2 }
+            $1 == h "_count" { count = $2 }
+            END { if (bad || inf != count || count == 0) exit 1 }' \
+            "$TEST_TMPDIR/metrics"
+        [[ "$status" -eq 0 ]]
+    done
+    [[ "$(metric brother_scan_line_seconds_count)" == "500" ]]
+}
+
+@test "stats: colour matching calls are counted per session" {
+    "$TEST_TMPDIR/brother_exporter" -o > /dev/null
+    "$TEST_TMPDIR/scandec_bench" -g colour -p 300 "$TEST_TMPDIR/c.trace"
+    "$TEST_TMPDIR/scandec_bench" -n 1 -l default "$TEST_TMPDIR/c.trace"
+    [[ "$(metric brother_colm_sessions_total)" == "1" ]]
+    [[ "$(metric brother_colm_calls_total)" == "300" ]]
+    [[ "$(metric brother_colm_bytes_total)" -gt 0 ]]
+}
+
+@test "stats: a segment of another layout is ignored, then reset by the exporter" {
+    head -c 64 /dev/zero > "$BROTHER_STATS_PATH"
+    "$TEST_TMPDIR/scandec_bench" -g gray -p 100 "$TEST_TMPDIR/g.trace"
+    "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/g.trace"
+    [[ "$(stat -c %s "$BROTHER_STATS_PATH")" == "64" ]]
+    [[ "$(metric brother_scan_sessions_total)" == "0" ]]
+    "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/g.trace"
+    [[ "$(metric brother_scan_sessions_total)" == "1" ]]
+}
+
+@test "stats: exporter serves /metrics over HTTP and 404 elsewhere" {
+    local port=$(( 20000 + RANDOM % 20000 ))
+    "$TEST_TMPDIR/brother_exporter" -b 127.0.0.1 -p "$port" 2> "$TEST_TMPDIR/exporter.log" &
+    EXPORTER_PID=$!
+    for _ in $(seq 50); do
+        grep -q serving "$TEST_TMPDIR/exporter.log" && break
+        sleep 0.1
+    done
+    exec 3<> "/dev/tcp/127.0.0.1/$port"
+    printf 'GET /metrics HTTP/1.1\r\nHost: localhost\r\n\r\n' >&3
+    run cat <&3
+    exec 3<&-
+    [[ "${lines[0]}" == *"200 OK"* ]]
+    [[ "$output" == *"text/plain; version=0.0.4"* ]]
+    [[ "$output" == *"# TYPE brother_usb_reads_total counter"* ]]
+    [[ "$output" == *'brother_scan_write_gap_seconds_bucket{le="+Inf"} 0'* ]]
+
+    exec 3<> "/dev/tcp/127.0.0.1/$port"
+    printf 'GET /other HTTP/1.0\r\n\r\n' >&3
+    run cat <&3
+    exec 3<&-
+    [[ "${lines[0]}" == *"404"* ]]
+}
+
+@test "stats: ReadDeviceData patch adds the USB counters" {
+    grep -q '#include "brother_stats.h"' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'BRSTATS_ADD(_rdd_st, usb_reads, 1)' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'BRSTATS_ADD(_rdd_st, usb_stalls, 1)' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'brother-exporter.service' "$PROJECT_ROOT/install_scanner.sh"
+}
@@ -0,0 +1,306 @@
+#!/usr/bin/env bats
+# Tests for the resident scan daemon (DCP-130C/brscand.c) and the
+# "brscand" SANE backend that forwards to it (DCP-130C/brscand_shim.c),
+# run against a fake backend: same data as a direct scan, one backend
+# open for many jobs, defaults restored between jobs, options kept to
+# their constraints, the job queue, and the installer wiring.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    local d="$PROJECT_ROOT/DCP-130C"
+    gcc -O2 -Wall -Werror -o "$TEST_TMPDIR/brscand" "$d/brscand.c" -ldl -lpthread ||
+        skip "gcc unavailable"
+    gcc -shared -fPIC -O2 -Wall -Werror -o "$TEST_TMPDIR/libsane-brscand.so.1" \
+        "$d/brscand_shim.c"
+
+    # A backend with a mode list, a resolution word list and a range;
+    # FAKE_DELAY_US slows its reads down
+    cat > "$TEST_TMPDIR/fake.c" << 'EOF'
+#include <unistd.h>
+#include "brscand.h"
+static SANE_String_Const modes[] = { "Gray", "Color", NULL };
+static const SANE_Word res_list[] = { 2, 100, 200 };
+static const SANE_Range tlx_range = { 0, 215 << 16, 0 };
+static SANE_Option_Descriptor opt[4];
+static char mode[16] = "Gray";
+static SANE_Word res = 100, tlx = 0, left;
+static const SANE_Device dev = { "fake0", "Fake", "Scanner", "flatbed" };
+static const SANE_Device *devs[] = { &dev, NULL };
+
+SANE_Status sane_fake_init(SANE_Int *v, SANE_Auth_Callback a)
+{
+    (void)a; *v = SANE_VERSION_CODE(1, 0, 0);
+    opt[0] = (SANE_Option_Descriptor){ "", "Number of options", "", SANE_TYPE_INT,
+        SANE_UNIT_NONE, 4, 4, SANE_CONSTRAINT_NONE, { 0 } };
+    opt[1] = (SANE_Option_Descriptor){ "mode", "Mode", "Scan mode", SANE_TYPE_STRING,
+        SANE_UNIT_NONE, 16, 5, SANE_CONSTRAINT_STRING_LIST, { .string_list = modes } };
+    opt[2] = (SANE_Option_Descriptor){ "resolution", "Resolution", "dpi",
+        SANE_TYPE_INT, SANE_UNIT_DPI, 4, 5, SANE_CONSTRAINT_WORD_LIST,
+        { .word_list = res_list } };
+    opt[3] = (SANE_Option_Descriptor){ "tl-x", "Left", "", SANE_TYPE_FIXED,
+        SANE_UNIT_MM, 4, 5, SANE_CONSTRAINT_RANGE, { .range = &tlx_range } };
+    return SANE_STATUS_GOOD;
+}
+SANE_Status sane_fake_get_devices(const SANE_Device ***l, SANE_Bool lo)
+{ (void)lo; *l = devs; return SANE_STATUS_GOOD; }
+SANE_Status sane_fake_open(SANE_String_Const n, SANE_Handle *h)
+{ fprintf(stderr, "fake: open %s\n", n); *h = opt; return SANE_STATUS_GOOD; }
+void sane_fake_close(SANE_Handle h) { (void)h; fprintf(stderr, "fake: close\n"); }
+const SANE_Option_Descriptor *sane_fake_get_option_descriptor(SANE_Handle h, SANE_Int n)
+{ (void)h; return n >= 0 && n < 4 ? &opt[n] : NULL; }
+SANE_Status sane_fake_control_option(SANE_Handle h, SANE_Int n, SANE_Action a,
+                                     void *v, SANE_Int *info)
+{
+    (void)h; if (info) *info = 0;
+    void *p = n == 0 ? NULL : n == 1 ? (void *)mode : n == 2 ? (void *)&res : (void *)&tlx;
+    if (a == SANE_ACTION_GET_VALUE) {
+        if (n == 0) *(SANE_Word *)v = 4; else memcpy(v, p, (size_t)opt[n].size);
+        return SANE_STATUS_GOOD;
+    }
+    if (n == 0) return SANE_STATUS_INVAL;
+    fprintf(stderr, "fake: set %d\n", n);
+    memcpy(p, v, (size_t)opt[n].size);
+    return SANE_STATUS_GOOD;
+}
+SANE_Status sane_fake_get_parameters(SANE_Handle h, SANE_Parameters *p)
+{
+    (void)h; int color = strcmp(mode, "Color") == 0;
+    p->format = color ? SANE_FRAME_RGB : SANE_FRAME_GRAY; p->last_frame = 1;
+    p->pixels_per_line = res + (tlx >> 16); p->lines = res / 2; p->depth = 8;
+    p->bytes_per_line = p->pixels_per_line * (color ? 3 : 1);
+    return SANE_STATUS_GOOD;
+}
+SANE_Status sane_fake_start(SANE_Handle h)
+{
+    SANE_Parameters p; sane_fake_get_parameters(h, &p);
+    fprintf(stderr, "fake: start mode=%s res=%d\n", mode, res);
+    left = p.bytes_per_line * p.lines;
+    return SANE_STATUS_GOOD;
+}
+SANE_Status sane_fake_read(SANE_Handle h, SANE_Byte *b, SANE_Int max, SANE_Int *len)
+{
+    (void)h; *len = 0; if (left == 0) return SANE_STATUS_EOF;
+    if (getenv("FAKE_DELAY_US")) usleep((useconds_t)atoi(getenv("FAKE_DELAY_US")));
+    int n = max < left ? max : left; if (n > 1000) n = 1000;
+    for (int i = 0; i < n; i++) b[i] = (SANE_Byte)((left - i) * 7 + res);
+    left -= n; *len = n; return SANE_STATUS_GOOD;
+}
+void sane_fake_cancel(SANE_Handle h) { (void)h; left = 0; }
+EOF
+    gcc -shared -fPIC -O2 -Wall -Werror -I"$d" -o "$TEST_TMPDIR/libfake.so" \
+        "$TEST_TMPDIR/fake.c"
+
+    # client <lib> <prefix> [name=value...]: set options, scan, print a summary
+    cat > "$TEST_TMPDIR/client.c" << 'EOF'
+#include <dlfcn.h>
+#include "brscand.h"
+#define F(t, n, ...) t (*n)(__VA_ARGS__) = (t (*)(__VA_ARGS__))sym(#n)
+static void *lib; static const char *pre;
+static void *sym(const char *n)
+{
+    char b[128]; snprintf(b, sizeof(b), "sane_%s_%s", pre, n);
+    void *p = dlsym(lib, b); if (!p) { fprintf(stderr, "no %s\n", b); exit(3); }
+    return p;
+}
+int main(int argc, char **argv)
+{
+    lib = dlopen(argv[1], RTLD_NOW); pre = argv[2];
+    if (!lib) { fprintf(stderr, "%s\n", dlerror()); return 3; }
+    F(SANE_Status, init, SANE_Int *, SANE_Auth_Callback);
+    F(SANE_Status, get_devices, const SANE_Device ***, SANE_Bool);
+    F(SANE_Status, open, SANE_String_Const, SANE_Handle *);
+    F(const SANE_Option_Descriptor *, get_option_descriptor, SANE_Handle, SANE_Int);
+    F(SANE_Status, control_option, SANE_Handle, SANE_Int, SANE_Action, void *, SANE_Int *);
+    F(SANE_Status, get_parameters, SANE_Handle, SANE_Parameters *);
+    F(SANE_Status, start, SANE_Handle);
+    F(SANE_Status, read, SANE_Handle, SANE_Byte *, SANE_Int, SANE_Int *);
+    F(void, cancel, SANE_Handle);
+    F(void, close, SANE_Handle);
+    SANE_Int v; const SANE_Device **devs; SANE_Handle h; SANE_Status st;
+    init(&v, NULL); get_devices(&devs, 1);
+    if ((st = open(devs[0]->name, &h)) != SANE_STATUS_GOOD) { printf("open: %d\n", st); return 1; }
+    for (int a = 3; a < argc; a++) {
+        char *eq = strchr(argv[a], '='); *eq++ = '\0';
+        for (int i = 1; get_option_descriptor(h, i); i++) {
+            const SANE_Option_Descriptor *d = get_option_descriptor(h, i);
+            if (strcmp(d->name, argv[a]) != 0) continue;
+            char buf[64] = ""; SANE_Int info = 0;
+            if (d->type == SANE_TYPE_STRING) strncpy(buf, eq, sizeof(buf) - 1);
+            else *(SANE_Word *)buf = atoi(eq) << (d->type == SANE_TYPE_FIXED ? 16 : 0);
+            st = control_option(h, i, SANE_ACTION_SET_VALUE, buf, &info);
+            printf("set %s: %d%s", argv[a], st, info & SANE_INFO_INEXACT ? " inexact" : "");
+            if (d->type != SANE_TYPE_STRING) printf(" %d", *(SANE_Word *)buf);
+            printf("\n");
+        }
+    }
+    SANE_Parameters p;
+    if ((st = start(h)) != SANE_STATUS_GOOD) { printf("start: %d\n", st); return 1; }
+    get_parameters(h, &p);
+    printf("params %d %d %d %d %d\n", p.format, p.bytes_per_line,
+           p.pixels_per_line, p.lines, p.depth);
+    static SANE_Byte buf[4096]; SANE_Int len; unsigned long long n = 0; unsigned h32 = 2166136261u;
+    while ((st = read(h, buf, sizeof(buf), &len)) == SANE_STATUS_GOOD)
+        for (int i = 0; i < len; i++, n++) h32 = (h32 ^ buf[i]) * 16777619u;
+    printf("read %llu bytes, hash %08x, status %d\n", n, h32, st);
+    cancel(h); close(h);
+    return 0;
+}
+EOF
+    gcc -O2 -Wall -Werror -I"$d" -o "$TEST_TMPDIR/client" "$TEST_TMPDIR/client.c" -ldl
+    export BROTHER_SCAND_SOCKET="$TEST_TMPDIR/brscand.sock"
+}
+
+teardown() {
+    [[ -n "${DAEMON_PID:-}" ]] && kill "$DAEMON_PID" 2>/dev/null
+    teardown_test_tmpdir
+}
+
+start_daemon() {
+    BROTHER_DEBUG=1 "$TEST_TMPDIR/brscand" -b "$TEST_TMPDIR/libfake.so" -n fake \
+        2> "$TEST_TMPDIR/daemon.log" &
+    DAEMON_PID=$!
+    for _ in $(seq 50); do
+        grep -q serving "$TEST_TMPDIR/daemon.log" && return 0
+        sleep 0.1
+    done
+    cat "$TEST_TMPDIR/daemon.log"
+    return 1
+}
+
+# wait_log <pattern>: wait for the daemon to log a line matching it
+wait_log() {
+    for _ in $(seq 100); do
+        grep -q "$1" "$TEST_TMPDIR/daemon.log" && return 0
+        sleep 0.05
+    done
+    return 1
+}
+
+direct() {
+    "$TEST_TMPDIR/client" "$TEST_TMPDIR/libfake.so" fake "$@" 2>/dev/null
+}
+
+shim() {
+    "$TEST_TMPDIR/client" "$TEST_TMPDIR/libsane-brscand.so.1" brscand "$@"
+}
+
+@test "brscand: scans through the daemon match a direct scan" {
+    start_daemon
+    run shim
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == "$(direct)" ]]
+    [[ "$output" == *"read 5000 bytes"*"status 5"* ]]
+
+    run shim mode=Color resolution=200 tl-x=10
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == "$(direct mode=Color resolution=200 tl-x=10)" ]]
+    [[ "$output" == *"params 1 630 210 100 8"* ]]
+}
+
+@test "brscand: backend opened once, defaults restored for each job" {
+    start_daemon
+    shim mode=Color > /dev/null
+    run shim
+    [[ "$output" == *"params 0 100 100 50 8"* ]]
+    shim resolution=200 > /dev/null
+    [[ "$(grep -c 'fake: open' "$TEST_TMPDIR/daemon.log")" == "1" ]]
+    [[ "$(grep 'fake: start' "$TEST_TMPDIR/daemon.log")" == \
+       "$(printf 'fake: start mode=Color res=100\nfake: start mode=Gray res=100\nfake: start mode=Gray res=200')" ]]
+    run grep -c '\[BRSCAND\] job .*first data after' "$TEST_TMPDIR/daemon.log"
+    [[ "$output" == "3" ]]
+}
+
+@test "brscand: shim keeps values to the backend's constraints" {
+    start_daemon
+    run shim resolution=150 tl-x=500 mode=Lineart
+    [[ "$output" == *"set resolution: 0 inexact 100"* ]]
+    [[ "$output" == *"set tl-x: 0 inexact $((215 << 16))"* ]]
+    [[ "$output" == *"set mode: 4"* ]]
+    [[ "$output" == *"params 0 315 315 50 8"* ]]
+}
+
+@test "brscand: queued jobs run shortest first and clients see their position" {
+    FAKE_DELAY_US=20000 start_daemon
+    shim mode=Color resolution=200 > "$TEST_TMPDIR/a.out" &
+    local a=$!
+    wait_log 'fake: start'
+    BROTHER_DEBUG=1 shim mode=Color resolution=200 > "$TEST_TMPDIR/b.out" 2> "$TEST_TMPDIR/b.err" &
+    local b=$!
+    wait_log 'queued scan 2'
+    BROTHER_DEBUG=1 shim > "$TEST_TMPDIR/c.out" 2> "$TEST_TMPDIR/c.err" &
+    local c=$!
+    wait_log 'queued scan 3'
+    wait "$a" "$b" "$c"
+
+    [[ "$(grep 'fake: start' "$TEST_TMPDIR/daemon.log")" == \
+       "$(printf 'fake: start mode=Color res=200\nfake: start mode=Gray res=100\nfake: start mode=Color res=200')" ]]
+    [[ "$(grep -o '[0-9] job(s) ahead' "$TEST_TMPDIR/b.err" | tr '\n' ' ')" == "1 job(s) ahead 2 job(s) ahead 1 job(s) ahead " ]]
+    grep -q '1 job(s) ahead' "$TEST_TMPDIR/c.err"
+    [[ "$(cat "$TEST_TMPDIR/b.out")" == "$(cat "$TEST_TMPDIR/a.out")" ]]
+    [[ "$(cat "$TEST_TMPDIR/c.out")" == "$(direct)" ]]
+}
+
+@test "brscand: a client that stalls mid-request holds up nobody else" {
+    # stall <seconds>: connects and sends half a request, then waits
+    cat > "$TEST_TMPDIR/stall.c" << 'EOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+int main(int argc, char **argv) {
+    struct sockaddr_un a = { .sun_family = AF_UNIX };
+    snprintf(a.sun_path, sizeof(a.sun_path), "%s", getenv("BROTHER_SCAND_SOCKET"));
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (argc < 2 || connect(fd, (struct sockaddr *)&a, sizeof(a)) != 0) return 1;
+    if (write(fd, "SCAN\n", 5) != 5) return 1;
+    sleep(atoi(argv[1]));
+    return 0;
+}
+EOF
+    gcc -O2 -Wall -Werror -o "$TEST_TMPDIR/stall" "$TEST_TMPDIR/stall.c"
+    start_daemon
+    "$TEST_TMPDIR/stall" 8 &
+    local stalled=$!
+    sleep 0.3
+    local t0=$SECONDS
+    run shim
+    [[ "$output" == "$(direct)" ]]
+    # the daemon drops a silent client after 10 s; this scan did not wait
+    [[ $((SECONDS - t0)) -lt 5 ]]
+    kill "$stalled" 2>/dev/null || true
+}
+
+@test "brscand: a job with the previous job's settings is not set up again" {
+    start_daemon
+    shim mode=Color > /dev/null
+    shim mode=Color > /dev/null
+    run awk '/fake: start/ { n++ } /fake: set/ && n == 1 { sets++ } END { print sets + 0 }' \
+        "$TEST_TMPDIR/daemon.log"
+    [[ "$output" == "0" ]]
+    grep -q 'job 2: .*settings unchanged' "$TEST_TMPDIR/daemon.log"
+    shim > /dev/null
+    [[ "$(grep 'fake: start' "$TEST_TMPDIR/daemon.log" | tail -1)" == "fake: start mode=Gray res=100" ]]
+}
+
+@test "brscand: shim reports an I/O error when the daemon is not running" {
+    run shim
+    [[ "$output" == "open: 9" ]]
+}
+
+@test "brscand: stopping the daemon closes the device and removes the socket" {
+    start_daemon
+    kill "$DAEMON_PID"
+    wait "$DAEMON_PID" || true
+    DAEMON_PID=
+    grep -q 'fake: close' "$TEST_TMPDIR/daemon.log"
+    [[ ! -e "$BROTHER_SCAND_SOCKET" ]]
+}
+
+@test "brscand: installer builds the daemon and switches dll.conf to the shim" {
+    grep -q 'BROTHER_SCAN_DAEMON' "$SCANNER_SCRIPT"
+    grep -q 'brscand.service' "$SCANNER_SCRIPT"
+    grep -q 'libsane-brscand.so.1' "$SCANNER_SCRIPT"
+}
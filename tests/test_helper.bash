@@ -12,6 +12,8 @@ export SCANNER_SCRIPT="$PROJECT_ROOT/install_scanner.sh"
 setup_test_tmpdir() {
     TEST_TMPDIR=$(mktemp -d)
     export TEST_TMPDIR
+    # Keep the print filter's USB turn-taking state out of /dev/shm
+    export BROTHER_USB_ARB_PATH="$TEST_TMPDIR/usb-arb"
 }
 
 teardown_test_tmpdir() {
@@ -44,3 +46,278 @@ source_scanner_functions() {
     source "$tmp_script"
     rm -f "$tmp_script"
 }
+
+# fake_libusb_fixture: stand-ins for libusb-0.1's usb.h and libusb-1.0's
+# libusb.h in $TEST_TMPDIR/inc, and a fake scanner behind them
+# (fake_usb.c, see fake_usb.h), so usb_async.c's HAVE_LIBUSB1 build can
+# run here.  Transfers complete in submission order from scripted data;
+# usbfs lookup is faked by overriding readlink().
+# fake_usb_build <name>: $TEST_TMPDIR/<name>.c + the fake + usb_async.c
+fake_libusb_fixture() {
+    mkdir -p "$TEST_TMPDIR/inc/libusb-1.0"
+    cat > "$TEST_TMPDIR/inc/usb.h" << 'CEOF'
+#define USB_ENDPOINT_IN 0x80
+struct usb_bus { char dirname[8]; };
+struct usb_device { char filename[8]; struct usb_bus *bus; };
+struct usb_dev_handle; typedef struct usb_dev_handle usb_dev_handle;
+struct usb_device *usb_device(usb_dev_handle *dev);
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int usb_close(usb_dev_handle *dev);
+CEOF
+    cat > "$TEST_TMPDIR/inc/libusb-1.0/libusb.h" << 'CEOF'
+#include <stdint.h>
+#include <sys/time.h>
+#define LIBUSB_CALL
+typedef struct libusb_context libusb_context;
+typedef struct libusb_device_handle libusb_device_handle;
+enum libusb_transfer_status {
+    LIBUSB_TRANSFER_COMPLETED, LIBUSB_TRANSFER_ERROR, LIBUSB_TRANSFER_TIMED_OUT,
+    LIBUSB_TRANSFER_CANCELLED, LIBUSB_TRANSFER_STALL, LIBUSB_TRANSFER_NO_DEVICE,
+    LIBUSB_TRANSFER_OVERFLOW
+};
+enum { LIBUSB_ERROR_NOT_FOUND = -5, LIBUSB_ERROR_INTERRUPTED = -10 };
+struct libusb_transfer;
+typedef void (LIBUSB_CALL *libusb_transfer_cb_fn)(struct libusb_transfer *);
+struct libusb_transfer {
+    libusb_device_handle *dev_handle;
+    unsigned char endpoint;
+    unsigned int timeout;
+    enum libusb_transfer_status status;
+    int length;
+    int actual_length;
+    libusb_transfer_cb_fn callback;
+    void *user_data;
+    unsigned char *buffer;
+    int fake_cancel;
+};
+int libusb_init(libusb_context **ctx);
+void libusb_exit(libusb_context *ctx);
+int libusb_wrap_sys_device(libusb_context *ctx, intptr_t fd, libusb_device_handle **h);
+void libusb_close(libusb_device_handle *h);
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets);
+void libusb_free_transfer(struct libusb_transfer *t);
+int libusb_submit_transfer(struct libusb_transfer *t);
+int libusb_cancel_transfer(struct libusb_transfer *t);
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv,
+                                           int *completed);
+static inline void libusb_fill_bulk_transfer(struct libusb_transfer *t,
+    libusb_device_handle *h, unsigned char ep, unsigned char *buf, int len,
+    libusb_transfer_cb_fn cb, void *user_data, unsigned int timeout) {
+    t->dev_handle = h; t->endpoint = ep; t->buffer = buf; t->length = len;
+    t->callback = cb; t->user_data = user_data; t->timeout = timeout;
+}
+CEOF
+    cat > "$TEST_TMPDIR/fake_usb.h" << 'CEOF'
+#include <usb.h>
+/* The scanner sends the stream 0, 1, ... 250, 0, 1, ... */
+void fake_data(long n, int chunk);   /* n more bytes, at most chunk per transfer */
+void fake_endless(int chunk, int us);/* no end of data, us per transfer */
+void fake_zlp(void);                 /* a zero-length packet */
+void fake_error(int status);         /* a transfer ends with status */
+int fake_posted(void);               /* transfers posted right now */
+int fake_arb_state(void);            /* holder | busy, 99 without arbitration */
+extern int fake_max_posted, fake_submits, fake_bad_state, fake_polled;
+usb_dev_handle *fake_open(void);     /* the backend's libusb-0.1 handle */
+int fake_check(const char *buf, int n); /* 1 if buf continues the stream */
+CEOF
+    cat > "$TEST_TMPDIR/fake_usb.c" << 'CEOF'
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include "fake_usb.h"
+#include "brother_usb_arb.h"
+#include <libusb-1.0/libusb.h>
+
+int fake_max_posted, fake_submits, fake_bad_state, fake_polled;
+static pthread_mutex_t mu = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t cv;
+static struct libusb_transfer *posted[64];
+static int nposted;
+static struct { int kind; long n; int chunk; } ev[64];   /* 0 data, 1 zlp, 2 error */
+static int nev;
+static int endless_chunk, endless_us;
+static uint64_t next_ready;
+static long sent, checked;
+static int fd = -1;
+static BRARB_CLIENT peek;
+static struct usb_bus bus = { "001" };
+static struct usb_device udev = { "005", &bus };
+
+static void add(int kind, long n, int chunk) {
+    pthread_mutex_lock(&mu);
+    ev[nev].kind = kind; ev[nev].n = n; ev[nev].chunk = chunk; nev++;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mu);
+}
+void fake_data(long n, int chunk) { add(0, n, chunk); }
+void fake_zlp(void) { add(1, 0, 0); }
+void fake_error(int status) { add(2, status, 0); }
+void fake_endless(int chunk, int us) {
+    pthread_mutex_lock(&mu);
+    endless_chunk = chunk; endless_us = us;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mu);
+}
+int fake_posted(void) {
+    pthread_mutex_lock(&mu);
+    int n = nposted;
+    pthread_mutex_unlock(&mu);
+    return n;
+}
+int fake_arb_state(void) {
+    return peek.seg ? (int)(__atomic_load_n(&peek.seg->state, __ATOMIC_ACQUIRE) & 7) : 99;
+}
+int fake_check(const char *buf, int n) {
+    for (int i = 0; i < n; i++, checked++)
+        if ((unsigned char)buf[i] != checked % 251)
+            return 0;
+    return 1;
+}
+
+/* Next piece of data, up to len bytes: length, or -1 with *status set
+ * to an error, or -2 for nothing yet (mu held) */
+static int take(unsigned char *buf, int len, int *status) {
+    *status = LIBUSB_TRANSFER_COMPLETED;
+    int n;
+    if (nev) {
+        if (ev[0].kind == 2) {
+            *status = (int)ev[0].n;
+            memmove(ev, ev + 1, --nev * sizeof(ev[0]));
+            return -1;
+        }
+        n = ev[0].kind == 1 ? 0 : ev[0].n < ev[0].chunk ? (int)ev[0].n : ev[0].chunk;
+        if (n > len)
+            n = len;
+        if ((ev[0].n -= n) == 0)
+            memmove(ev, ev + 1, --nev * sizeof(ev[0]));
+    } else if (endless_chunk && brarb_now_ns() >= next_ready) {
+        n = endless_chunk < len ? endless_chunk : len;
+        next_ready = brarb_now_ns() + (uint64_t)endless_us * 1000;
+    } else
+        return -2;
+    for (int i = 0; i < n; i++, sent++)
+        buf[i] = sent % 251;
+    if (n && peek.seg && fake_arb_state() != (int)(BRARB_BUSY | BRARB_SCAN))
+        fake_bad_state++;
+    return n;
+}
+
+usb_dev_handle *fake_open(void) {
+    pthread_condattr_t a;
+    pthread_condattr_init(&a);
+    pthread_condattr_setclock(&a, CLOCK_MONOTONIC);
+    pthread_cond_init(&cv, &a);
+    brarb_open(&peek, BRARB_PRINT);
+    fd = open("/dev/null", O_RDONLY);
+    return (usb_dev_handle *)&udev;
+}
+struct usb_device *usb_device(usb_dev_handle *dev) { return (struct usb_device *)dev; }
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout) {
+    int st;
+    (void)dev; (void)ep; (void)timeout;
+    pthread_mutex_lock(&mu);
+    fake_polled++;
+    int n = take((unsigned char *)bytes, size, &st);
+    pthread_mutex_unlock(&mu);
+    return n == -2 ? 0 : n;
+}
+int usb_close(usb_dev_handle *dev) { (void)dev; return 0; }
+
+/* The backend opened the device as /dev/bus/usb/001/005 */
+ssize_t readlink(const char *path, char *buf, size_t size) {
+    char want[32];
+    const char *target = "/dev/bus/usb/001/005";
+    snprintf(want, sizeof(want), "/proc/self/fd/%d", fd);
+    if (strcmp(path, want) != 0 || size < strlen(target))
+        return -1;
+    memcpy(buf, target, strlen(target));
+    return (ssize_t)strlen(target);
+}
+
+int libusb_init(libusb_context **ctx) { *ctx = (libusb_context *)&mu; return 0; }
+void libusb_exit(libusb_context *ctx) { (void)ctx; }
+int libusb_wrap_sys_device(libusb_context *ctx, intptr_t sys_fd, libusb_device_handle **h) {
+    (void)ctx;
+    if (sys_fd != fd)
+        return LIBUSB_ERROR_NOT_FOUND;
+    *h = (libusb_device_handle *)&udev;
+    return 0;
+}
+void libusb_close(libusb_device_handle *h) { (void)h; }
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets) {
+    (void)iso_packets;
+    return calloc(1, sizeof(struct libusb_transfer));
+}
+void libusb_free_transfer(struct libusb_transfer *t) { free(t); }
+int libusb_submit_transfer(struct libusb_transfer *t) {
+    pthread_mutex_lock(&mu);
+    t->fake_cancel = 0;
+    posted[nposted++] = t;
+    if (nposted > fake_max_posted)
+        fake_max_posted = nposted;
+    fake_submits++;
+    if (peek.seg && fake_arb_state() != (int)(BRARB_BUSY | BRARB_SCAN))
+        fake_bad_state++;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mu);
+    return 0;
+}
+int libusb_cancel_transfer(struct libusb_transfer *t) {
+    pthread_mutex_lock(&mu);
+    t->fake_cancel = 1;
+    pthread_cond_broadcast(&cv);
+    pthread_mutex_unlock(&mu);
+    return 0;
+}
+/* Completes one transfer (cancelled ones first, then the oldest) or
+ * waits for data until tv has passed */
+int libusb_handle_events_timeout_completed(libusb_context *ctx, struct timeval *tv,
+                                           int *completed) {
+    uint64_t end = brarb_now_ns() + tv->tv_sec * 1000000000ull + tv->tv_usec * 1000ull;
+    struct libusb_transfer *t = NULL;
+    (void)ctx;
+    pthread_mutex_lock(&mu);
+    while (!(completed && *completed)) {
+        int i, st;
+        for (i = 0; i < nposted && !posted[i]->fake_cancel; i++)
+            ;
+        if (i < nposted) {
+            t = posted[i];
+            t->status = LIBUSB_TRANSFER_CANCELLED;
+            t->actual_length = 0;
+        } else if (nposted) {
+            int n = take(posted[0]->buffer, posted[0]->length, &st);
+            if (n != -2) {
+                i = 0;
+                t = posted[0];
+                t->status = st;
+                t->actual_length = n < 0 ? 0 : n;
+            }
+        }
+        if (t) {
+            memmove(posted + i, posted + i + 1, (--nposted - i) * sizeof(posted[0]));
+            break;
+        }
+        uint64_t now = brarb_now_ns(), until = end;
+        if (now >= end)
+            break;
+        if (!nev && endless_chunk && nposted && next_ready < until)
+            until = next_ready;
+        struct timespec ts = { (time_t)(until / 1000000000ull), (long)(until % 1000000000ull) };
+        pthread_cond_timedwait(&cv, &mu, &ts);
+    }
+    pthread_mutex_unlock(&mu);
+    if (t)
+        t->callback(t);
+    return 0;
+}
+CEOF
+}
+
+fake_usb_build() {
+    gcc -O2 -Wall -DHAVE_LIBUSB1 -U_FORTIFY_SOURCE \
+        -I"$TEST_TMPDIR/inc" -I"$TEST_TMPDIR" -I"$PROJECT_ROOT/DCP-130C" \
+        -o "$TEST_TMPDIR/$1" "$TEST_TMPDIR/$1.c" "$TEST_TMPDIR/fake_usb.c" \
+        "$PROJECT_ROOT/DCP-130C/usb_async.c" -lpthread
+}
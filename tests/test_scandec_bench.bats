@@ -0,0 +1,314 @@
+#!/usr/bin/env bats
+# Tests for BROTHER_TRACE capture in scandec_stubs.c and its replay by
+# scandec_bench.c: synthetic traces, a captured session replayed to the
+# same output, and bad trace files.  Also the BROTHER_EVENTS ring and
+# its dump decoder, scandec_events.c.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    gcc -O2 -w -o "$TEST_TMPDIR/scandec_bench" \
+        "$PROJECT_ROOT/DCP-130C/scandec_bench.c" \
+        "$PROJECT_ROOT/DCP-130C/scandec_stubs.c" \
+        "$PROJECT_ROOT/DCP-130C/brcolor_stubs.c" -lpthread || skip "gcc unavailable"
+    gcc -O2 -w -o "$TEST_TMPDIR/scandec_events" \
+        "$PROJECT_ROOT/DCP-130C/scandec_events.c"
+}
+
+teardown() {
+    teardown_test_tmpdir
+}
+
+# Driver: capture <colortype> <pages> [tables]
+#   Scans pages of text-like PackBits and white lines, with tone tables
+#   when asked, and prints the FNV-1a hash of everything returned, as
+#   scandec_bench prints it.
+build_capture_driver() {
+    gcc -shared -fPIC -O2 -w -o "$TEST_TMPDIR/libscandec_test.so" \
+        "$PROJECT_ROOT/DCP-130C/scandec_stubs.c" -lpthread
+    cat > "$TEST_TMPDIR/capture.c" << 'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+typedef int BOOL; typedef int INT; typedef unsigned char BYTE;
+typedef unsigned long DWORD; typedef void *HANDLE;
+typedef struct {
+    INT nInResoX, nInResoY, nOutResoX, nOutResoY, nColorType;
+    DWORD dwInLinePixCnt; INT nOutDataKind; BOOL bLongBoundary;
+    DWORD dwOutLinePixCnt, dwOutLineByte, dwOutWriteMaxSize;
+} SCANDEC_OPEN;
+typedef struct {
+    INT nInDataComp, nInDataKind; BYTE *pLineData; DWORD dwLineDataSize;
+    BYTE *pWriteBuff; DWORD dwWriteBuffSize; BOOL bReverWrite;
+} SCANDEC_WRITE;
+extern BOOL ScanDecOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecClose(void);
+extern BOOL ScanDecPageStart(void);
+extern DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st);
+extern DWORD ScanDecPageEnd(SCANDEC_WRITE *w, INT *st);
+extern void ScanDecSetTblHandle(HANDLE h1, HANDLE h2);
+static unsigned hash = 2166136261u;
+static void take(const BYTE *p, DWORD n) { for (DWORD i = 0; i < n; i++) hash = (hash ^ p[i]) * 16777619u; }
+int main(int argc, char **argv) {
+    int ct = (int)strtol(argv[1], NULL, 0), pages = atoi(argv[2]);
+    int ch = ct & 0x0400 ? 3 : 1;
+    DWORD px = 517;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = op.nInResoY = op.nOutResoX = op.nOutResoY = 200;
+    op.nColorType = ct; op.dwInLinePixCnt = px; op.bLongBoundary = 1;
+    if (!ScanDecOpen(&op)) return 1;
+    static BYTE t1[256], t2[256];
+    for (int v = 0; v < 256; v++) { t1[v] = (BYTE)(255 - v); t2[v] = (BYTE)(v / 2 + 64); }
+    if (argc > 3) ScanDecSetTblHandle(t1, t2);
+    BYTE *buf = malloc(op.dwOutWriteMaxSize), line[517], comp[1100];
+    unsigned s = 5; INT st;
+    for (int pg = 0; pg < pages; pg++) {
+        ScanDecPageStart();
+        for (int y = 0; y < 120; y++)
+            for (int c = 0; c < ch; c++) {
+                DWORD n = 0;
+                for (DWORD x = 0; x < px; ) {
+                    s = s * 1103515245 + 12345;
+                    BYTE v = (BYTE)(s >> 16), len = 1 + (s >> 8) % 30;
+                    for (int k = 0; k < len && x < px; k++) line[x++] = v;
+                }
+                for (DWORD x = 0; x < px; x += 64) {
+                    DWORD r = px - x < 64 ? px - x : 64;
+                    comp[n++] = (BYTE)(r - 1); memcpy(comp + n, line + x, r); n += r;
+                }
+                SCANDEC_WRITE w = {y % 9 == 4 ? 1 : 3, ch == 3 ? 2 + c : 1, comp, n,
+                                   buf, op.dwOutWriteMaxSize, 0};
+                take(buf, ScanDecWrite(&w, &st));
+            }
+        SCANDEC_WRITE e = {0, 0, NULL, 0, buf, op.dwOutWriteMaxSize, 0};
+        take(buf, ScanDecPageEnd(&e, &st));
+    }
+    ScanDecClose();
+    printf("%08x\n", hash);
+    return 0;
+}
+CEOF
+    gcc -O1 -o "$TEST_TMPDIR/capture" "$TEST_TMPDIR/capture.c" \
+        "$TEST_TMPDIR/libscandec_test.so" -Wl,-rpath,"$TEST_TMPDIR"
+}
+
+# Output hash reported by a scandec_bench run
+bench_hash() {
+    [[ "$output" =~ output\ ([0-9a-f]{8}) ]] && echo "${BASH_REMATCH[1]}"
+}
+
+@test "scandec_bench: synthetic traces replay in every mode without allocating" {
+    local kind lines
+    for kind in colour gray bw; do
+        run "$TEST_TMPDIR/scandec_bench" -g "$kind" -d 150 -p 300 "$TEST_TMPDIR/$kind.trace"
+        [[ "$status" -eq 0 ]]
+        [[ "$output" == *"1275 px x 300 lines at 150 dpi"* ]]
+        run "$TEST_TMPDIR/scandec_bench" -n 2 "$TEST_TMPDIR/$kind.trace"
+        [[ "$status" -eq 0 ]]
+        [[ "$output" == *"1 session, 1 page,"* ]]
+        [[ "$output" =~ best\ of\ 2:\ [0-9.]+\ ms,\ 300\ lines,\ [0-9]+\ lines/s,\ [0-9.]+\ ns/byte,\ 0\ allocations ]]
+    done
+    run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/colour.trace"
+    [[ "$output" == *"24-bit RGB, 1275 px, 150x150 -> 150x150 dpi"* ]]
+}
+
+@test "scandec_bench: a captured session replays to the same output" {
+    build_capture_driver
+    local ct want
+    for ct in 0x0200 0x0402 0x0101; do
+        rm -f "$TEST_TMPDIR/cap.trace"
+        want=$(BROTHER_TRACE="$TEST_TMPDIR/cap.trace" "$TEST_TMPDIR/capture" "$ct" 2 tables)
+        run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/cap.trace"
+        [[ "$output" == *"1 session, 2 pages,"* ]]
+        [[ "$(bench_hash)" == "$want" ]]
+    done
+}
+
+@test "scandec_bench: decoder settings change the timing, not the output" {
+    build_capture_driver
+    BROTHER_TRACE="$TEST_TMPDIR/cap.trace" "$TEST_TMPDIR/capture" 0x0402 1 > "$TEST_TMPDIR/want"
+    local want
+    want=$(cat "$TEST_TMPDIR/want")
+    run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/cap.trace"
+    [[ "$(bench_hash)" == "$want" ]]
+    BROTHER_SIMD=0 run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/cap.trace"
+    [[ "$(bench_hash)" == "$want" ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/cap.trace"
+    [[ "$(bench_hash)" == "$want" ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/cap.trace"
+    [[ "$(bench_hash)" == "$want" ]]
+}
+
+@test "scandec: plain and instrumented line handlers decode alike" {
+    build_capture_driver
+    local ct tables want
+    for ct in 0x0200 0x0402 0x0101 0x0102; do
+        for tables in "" tables; do
+            want=$("$TEST_TMPDIR/capture" "$ct" 2 $tables)
+            [[ "$(BROTHER_DEBUG=1 "$TEST_TMPDIR/capture" "$ct" 2 $tables 2>/dev/null)" == "$want" ]]
+            [[ "$(BROTHER_TRACE="$TEST_TMPDIR/cap.trace" "$TEST_TMPDIR/capture" "$ct" 2 $tables)" == "$want" ]]
+            rm -f "$TEST_TMPDIR/cap.trace"
+        done
+    done
+}
+
+@test "scandec_bench: sessions are appended to one trace" {
+    build_capture_driver
+    BROTHER_TRACE="$TEST_TMPDIR/cap.trace" "$TEST_TMPDIR/capture" 0x0200 1
+    BROTHER_TRACE="$TEST_TMPDIR/cap.trace" "$TEST_TMPDIR/capture" 0x0101 2
+    run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/cap.trace"
+    [[ "$output" == *"2 sessions, 3 pages, 360 writes"* ]]
+    [[ "$output" == *"8-bit gray, 517 px, 200x200 -> 200x200 dpi"* ]]
+}
+
+@test "scandec_bench: colour matching is applied to colour traces with -l" {
+    mkdir -p "$TEST_TMPDIR/lut"
+    awk 'BEGIN { print "LUT_3D_SIZE 2"
+        for (b = 0; b < 2; b++) for (g = 0; g < 2; g++) for (r = 0; r < 2; r++)
+            print r, g, b }' > "$TEST_TMPDIR/lut/ident.cube"
+    "$TEST_TMPDIR/scandec_bench" -g colour -d 100 -p 100 "$TEST_TMPDIR/c.trace"
+    run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/c.trace"
+    local plain
+    plain=$(bench_hash)
+    BROTHER_LUT_DIR="$TEST_TMPDIR/lut" BROTHER_LUT_CACHE="$TEST_TMPDIR" \
+        run "$TEST_TMPDIR/scandec_bench" -n 1 -l ident.dat "$TEST_TMPDIR/c.trace"
+    [[ "$output" == *"colour matching:"*"ms of that"* ]]
+    [[ "$(bench_hash)" == "$plain" ]]
+}
+
+@test "scandec_bench: bad traces are rejected and truncated ones replayed" {
+    echo "not a trace" > "$TEST_TMPDIR/bad.trace"
+    run "$TEST_TMPDIR/scandec_bench" "$TEST_TMPDIR/bad.trace"
+    [[ "$status" -ne 0 ]]
+    [[ "$output" == *"not a version 1 scan decoder trace"* ]]
+    "$TEST_TMPDIR/scandec_bench" -g gray -d 100 -p 50 "$TEST_TMPDIR/g.trace"
+    head -c -100 "$TEST_TMPDIR/g.trace" > "$TEST_TMPDIR/short.trace"
+    run "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/short.trace"
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"of truncated trace"* ]]
+    BROTHER_TRACE="$TEST_TMPDIR/x" run "$TEST_TMPDIR/scandec_bench" "$TEST_TMPDIR/g.trace"
+    [[ "$status" -eq 2 ]]
+    [[ "$output" == *"unset BROTHER_TRACE"* ]]
+}
+
+@test "scandec: the trace file is created and reported with BROTHER_DEBUG" {
+    build_capture_driver
+    run bash -c "BROTHER_DEBUG=1 BROTHER_TRACE='$TEST_TMPDIR/t.trace' '$TEST_TMPDIR/capture' 0x0200 1 2>&1"
+    [[ "$output" == *"[SCANDEC] trace: capturing to $TEST_TMPDIR/t.trace"* ]]
+    [[ "$(head -c 8 "$TEST_TMPDIR/t.trace")" == "BRSCTRC1" ]]
+    run bash -c "BROTHER_DEBUG=1 BROTHER_TRACE='$TEST_TMPDIR/no/dir/t' '$TEST_TMPDIR/capture' 0x0200 1 2>&1"
+    [[ "$output" == *"trace: cannot open $TEST_TMPDIR/no/dir/t"* ]]
+    [[ "${lines[${#lines[@]}-1]}" =~ ^[0-9a-f]{8}$ ]]
+}
+
+# Driver: evsig <dump>
+#   Writes 10 gray lines, pausing 150 ms before the sixth, raises SIGUSR2
+#   and reports whether the dump exists before ScanDecClose().
+build_evsig_driver() {
+    gcc -shared -fPIC -O2 -w -o "$TEST_TMPDIR/libscandec_test.so" \
+        "$PROJECT_ROOT/DCP-130C/scandec_stubs.c" -lpthread
+    cat > "$TEST_TMPDIR/evsig.c" << 'CEOF'
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+typedef int BOOL; typedef int INT; typedef unsigned char BYTE; typedef unsigned long DWORD;
+typedef struct {
+    INT nInResoX, nInResoY, nOutResoX, nOutResoY, nColorType;
+    DWORD dwInLinePixCnt; INT nOutDataKind; BOOL bLongBoundary;
+    DWORD dwOutLinePixCnt, dwOutLineByte, dwOutWriteMaxSize;
+} SCANDEC_OPEN;
+typedef struct {
+    INT nInDataComp, nInDataKind; BYTE *pLineData; DWORD dwLineDataSize;
+    BYTE *pWriteBuff; DWORD dwWriteBuffSize; BOOL bReverWrite;
+} SCANDEC_WRITE;
+extern BOOL ScanDecOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecClose(void);
+extern BOOL ScanDecPageStart(void);
+extern DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st);
+extern DWORD ScanDecPageEnd(SCANDEC_WRITE *w, INT *st);
+int main(int argc, char **argv) {
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = op.nInResoY = op.nOutResoX = op.nOutResoY = 100;
+    op.nColorType = 0x0200; op.dwInLinePixCnt = 100; op.bLongBoundary = 1;
+    ScanDecOpen(&op);
+    static BYTE line[100], out[4096]; INT st;
+    ScanDecPageStart();
+    for (int y = 0; y < 10; y++) {
+        if (y == 5) usleep(150000);
+        SCANDEC_WRITE w = {2, 1, line, 100, out, sizeof(out), 0};
+        ScanDecWrite(&w, &st);
+    }
+    raise(SIGUSR2);
+    printf("%s\n", access(argv[1], F_OK) == 0 ? "dumped" : "missing");
+    SCANDEC_WRITE e = {0, 0, NULL, 0, out, sizeof(out), 0};
+    ScanDecPageEnd(&e, &st);
+    ScanDecClose();
+    return 0;
+}
+CEOF
+    gcc -O1 -o "$TEST_TMPDIR/evsig" "$TEST_TMPDIR/evsig.c" \
+        "$TEST_TMPDIR/libscandec_test.so" -Wl,-rpath,"$TEST_TMPDIR"
+}
+
+@test "scandec events: the ring is dumped at close and decoded offline" {
+    "$TEST_TMPDIR/scandec_bench" -g gray -d 100 -p 300 "$TEST_TMPDIR/g.trace"
+    BROTHER_EVENTS="$TEST_TMPDIR/ev.bin" "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/g.trace"
+    run "$TEST_TMPDIR/scandec_events" -s "$TEST_TMPDIR/ev.bin"
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"summary: 1 session(s), 1 page(s), 300 writes, 300 lines returned"* ]]
+    [[ "$output" == *"decode:     300 lines, mean"* ]]
+    [[ "$output" == *"call:       301 calls"* ]]
+    run "$TEST_TMPDIR/scandec_events" "$TEST_TMPDIR/ev.bin"
+    [[ "${lines[2]}" =~ ms\ \ open\ +colour\ type\ 0x0200,\ 850\ px$ ]]
+    [[ "${lines[3]}" == *"page 1 start"* ]]
+    [[ "$output" == *"write     white, 0 bytes"* ]]
+    [[ "$output" == *"write     pack, "* ]]
+    [[ "$output" == *"decode    1 line, "* ]]
+    [[ "$output" == *"close"* ]]
+}
+
+@test "scandec events: the pipeline worker records the decodes" {
+    "$TEST_TMPDIR/scandec_bench" -g colour -d 100 -p 100 "$TEST_TMPDIR/c.trace"
+    BROTHER_PIPELINE=1 BROTHER_EVENTS="$TEST_TMPDIR/ev.bin" \
+        "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/c.trace"
+    run "$TEST_TMPDIR/scandec_events" -s "$TEST_TMPDIR/ev.bin"
+    [[ "$output" == *"300 writes, 100 lines returned"* ]]
+    [[ "$output" == *"decode:     100 lines"* ]]
+}
+
+@test "scandec events: the ring keeps the newest BROTHER_EVENTS_SIZE events" {
+    "$TEST_TMPDIR/scandec_bench" -g bw -d 100 -p 300 "$TEST_TMPDIR/b.trace"
+    BROTHER_EVENTS_SIZE=200 BROTHER_EVENTS="$TEST_TMPDIR/ev.bin" \
+        "$TEST_TMPDIR/scandec_bench" -n 1 "$TEST_TMPDIR/b.trace"
+    run "$TEST_TMPDIR/scandec_events" "$TEST_TMPDIR/ev.bin"
+    [[ "${lines[0]}" == *": 256 events ("*" older ones overwritten), ring of 256" ]]
+    [[ "${lines[${#lines[@]}-5]}" == *"close" ]]
+}
+
+@test "scandec events: SIGUSR2 dumps mid-scan and long gaps are marked" {
+    build_evsig_driver
+    run env BROTHER_EVENTS="$TEST_TMPDIR/ev.bin" "$TEST_TMPDIR/evsig" "$TEST_TMPDIR/ev.bin"
+    [[ "$output" == "dumped" ]]
+    run "$TEST_TMPDIR/scandec_events" "$TEST_TMPDIR/ev.bin"
+    [[ "$output" =~ gap\ +1[5-9][0-9]\.[0-9]\ ms ]]
+    [[ "$output" == *"10 writes"* ]]
+    [[ "$output" == *"1 over 100 ms"* ]]
+    [[ "$output" == *"page 1 end"* ]]
+}
+
+@test "scandec events: no per-line progress output with BROTHER_DEBUG" {
+    "$TEST_TMPDIR/scandec_bench" -g gray -d 100 -p 300 "$TEST_TMPDIR/g.trace"
+    run bash -c "BROTHER_DEBUG=1 BROTHER_EVENTS='$TEST_TMPDIR/ev.bin' '$TEST_TMPDIR/scandec_bench' -n 1 '$TEST_TMPDIR/g.trace' 2>&1"
+    [[ "$output" != *"progress:"* ]]
+    [[ "$output" == *"[SCANDEC] events: recording the last 65536 events"* ]]
+    [[ "$output" == *"dumped to $TEST_TMPDIR/ev.bin"* ]]
+}
+
+@test "scandec events: a file that is not a dump is rejected" {
+    echo "not a dump" > "$TEST_TMPDIR/bad.bin"
+    run "$TEST_TMPDIR/scandec_events" "$TEST_TMPDIR/bad.bin"
+    [[ "$status" -eq 1 ]]
+    [[ "$output" == *"not a version 1 scan decoder event dump"* ]]
+}
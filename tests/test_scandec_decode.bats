@@ -0,0 +1,1750 @@
+#!/usr/bin/env bats
+# Tests for the scan decoder's data paths in scandec_stubs.c.
+# Each test compiles a small C driver against the stub library, feeds it
+# scanner lines through ScanDecWrite(), and checks the decoded output.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    gcc -shared -fPIC -O2 -w \
+        -o "$TEST_TMPDIR/libscandec_test.so" \
+        "$PROJECT_ROOT/DCP-130C/scandec_stubs.c" -lpthread || skip "gcc unavailable"
+}
+
+teardown() {
+    teardown_test_tmpdir
+}
+
+# Write the SCANDEC_* declarations shared by every driver program.
+write_scandec_prelude() {
+    cat << 'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+typedef int BOOL; typedef int INT; typedef unsigned char BYTE;
+typedef unsigned long DWORD; typedef void *HANDLE;
+typedef struct {
+    INT nInResoX, nInResoY, nOutResoX, nOutResoY, nColorType;
+    DWORD dwInLinePixCnt; INT nOutDataKind; BOOL bLongBoundary;
+    DWORD dwOutLinePixCnt, dwOutLineByte, dwOutWriteMaxSize;
+} SCANDEC_OPEN;
+typedef struct {
+    INT nInDataComp, nInDataKind; BYTE *pLineData; DWORD dwLineDataSize;
+    BYTE *pWriteBuff; DWORD dwWriteBuffSize; BOOL bReverWrite;
+} SCANDEC_WRITE;
+extern BOOL ScanDecOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecClose(void);
+extern DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st);
+extern DWORD ScanDecPageEnd(SCANDEC_WRITE *w, INT *st);
+extern void ScanDecSetTblHandle(HANDLE h1, HANDLE h2);
+typedef struct {
+    DWORD dwLines, dwWhiteLines, dwWhiteRuns, dwLongestRun, dwLongestRunStart;
+    DWORD dwTopMargin, dwBottomMargin; BOOL bBlankPage;
+} SCANDEC_PAGE_INFO;
+extern BOOL ScanDecGetPageInfo(SCANDEC_PAGE_INFO *info);
+extern void ScanDecSetWhiteRunCallback(void (*cb)(DWORD, DWORD, void *),
+                                       DWORD dwMinLines, void *pCtx);
+/* Deterministic pseudo-random bytes */
+static unsigned rnd_state = 1;
+static unsigned rnd(void) { rnd_state = rnd_state * 1103515245 + 12345; return rnd_state >> 8; }
+/* PackBits-encode px bytes of src into dst (mix of runs and literals) */
+static DWORD pack_line(const BYTE *src, DWORD px, BYTE *dst) {
+    DWORD i = 0, n = 0;
+    while (i < px) {
+        DWORD r = 1;
+        while (i + r < px && r < 128 && src[i + r] == src[i]) r++;
+        if (r >= 2) { dst[n++] = (BYTE)(1 - (int)r); dst[n++] = src[i]; i += r; continue; }
+        DWORD l = 1;
+        while (i + l < px && l < 128 && !(i + l + 1 < px && src[i + l] == src[i + l + 1])) l++;
+        dst[n++] = (BYTE)(l - 1); memcpy(dst + n, src + i, l); n += l; i += l;
+    }
+    return n;
+}
+/* Fill a gray line with text-like content: white runs and short dark strokes */
+static void make_gray_line(BYTE *g, DWORD px) {
+    for (DWORD i = 0; i < px; ) {
+        DWORD len = 1 + rnd() % 40;
+        BYTE v = (rnd() % 3) ? 0xF0 + rnd() % 16 : rnd() % 256;
+        for (DWORD k = 0; k < len && i < px; k++, i++)
+            g[i] = (rnd() % 4) ? v : (BYTE)rnd();
+    }
+}
+CEOF
+}
+
+# Compile a driver: body on stdin, output binary name in $1, then any
+# extra compiler flags.
+build_driver() {
+    local name="$1"
+    shift
+    { write_scandec_prelude; cat; } > "$TEST_TMPDIR/$name.c"
+    gcc -O1 -o "$TEST_TMPDIR/$name" "$TEST_TMPDIR/$name.c" \
+        "$TEST_TMPDIR/libscandec_test.so" -Wl,-rpath,"$TEST_TMPDIR" "$@"
+}
+
+# --- PackBits decoding ---
+
+@test "scandec: PackBits gray lines decode to the original pixels" {
+    build_driver test_packbits << 'CEOF'
+int main(void) {
+    DWORD widths[] = {1, 15, 16, 17, 300, 2550};
+    for (unsigned t = 0; t < sizeof(widths) / sizeof(widths[0]); t++) {
+        DWORD px = widths[t];
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = 0x0200; op.dwInLinePixCnt = px;
+        if (!ScanDecOpen(&op)) return 1;
+        BYTE *gray = malloc(px), *comp = malloc(px * 2 + 2), *out = malloc(px + 64);
+        for (int l = 0; l < 50; l++) {
+            make_gray_line(gray, px);
+            DWORD n = pack_line(gray, px, comp);
+            memset(out, 0xA5, px + 64);
+            SCANDEC_WRITE w = {3, 1, comp, n, out, px + 64, 0}; INT st;
+            if (ScanDecWrite(&w, &st) != px || st != 1) return 2;
+            if (memcmp(out, gray, px) != 0) return 3;
+        }
+        ScanDecClose();
+        free(gray); free(comp); free(out);
+    }
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_packbits"
+    [[ "$status" -eq 0 ]]
+    BROTHER_SIMD=0 run "$TEST_TMPDIR/test_packbits"
+    [[ "$status" -eq 0 ]]
+}
+
+@test "scandec: truncated PackBits line is zero-filled to the line end" {
+    build_driver test_short << 'CEOF'
+int main(void) {
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0200; op.dwInLinePixCnt = 64;
+    ScanDecOpen(&op);
+    BYTE comp[] = {0x03, 1, 2, 3, 4, 0xFB, 9};   /* 4 literals + run of 6 */
+    BYTE out[64]; memset(out, 0xA5, sizeof(out));
+    SCANDEC_WRITE w = {3, 1, comp, sizeof(comp), out, sizeof(out), 0}; INT st;
+    ScanDecWrite(&w, &st);
+    BYTE want[64] = {1, 2, 3, 4, 9, 9, 9, 9, 9, 9};
+    ScanDecClose();
+    return memcmp(out, want, sizeof(want)) != 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_short"
+    [[ "$status" -eq 0 ]]
+}
+
+@test "scandec: BROTHER_SIMD=0 forces the scalar PackBits decoder" {
+    build_driver test_simd << 'CEOF'
+int main(void) { ScanDecClose(); return 0; }
+CEOF
+    local stderr_out
+    stderr_out=$(BROTHER_DEBUG=1 BROTHER_SIMD=0 "$TEST_TMPDIR/test_simd" 2>&1 >/dev/null)
+    [[ "$stderr_out" == *"PackBits decoder: scalar"* ]]
+}
+
+@test "scandec: summary reports PackBits decode time" {
+    build_driver test_decode_ms << 'CEOF'
+int main(void) {
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0200; op.dwInLinePixCnt = 100;
+    ScanDecOpen(&op);
+    BYTE comp[] = {0xCF, 0xFF, 0xCF, 0x00};  /* 50 white + 50 black pixels */
+    BYTE out[100];
+    for (int i = 0; i < 10; i++) {
+        SCANDEC_WRITE w = {3, 1, comp, sizeof(comp), out, sizeof(out), 0}; INT st;
+        ScanDecWrite(&w, &st);
+    }
+    ScanDecClose();
+    return 0;
+}
+CEOF
+    local stderr_out
+    stderr_out=$(BROTHER_DEBUG=1 "$TEST_TMPDIR/test_decode_ms" 2>&1 >/dev/null)
+    [[ "$stderr_out" == *"PackBits:"*"for 10 lines"* ]]
+    [[ "$stderr_out" == *"decoder)"* ]]
+}
+
+@test "scandec: NEON decoder is guarded by a runtime HWCAP check on 32-bit ARM" {
+    grep -q 'HWCAP_NEON' "$PROJECT_ROOT/DCP-130C/scandec_stubs.c"
+    grep -q 'target("fpu=neon")' "$PROJECT_ROOT/DCP-130C/scandec_stubs.c"
+    grep -q 'decode_packbits_scalar' "$PROJECT_ROOT/DCP-130C/scandec_stubs.c"
+}
+
+# --- B&W (1-bit) output ---
+
+@test "scandec: PackBits B&W lines match the thresholded gray image" {
+    build_driver test_bw_pack << 'CEOF'
+int main(void) {
+    DWORD widths[] = {1, 7, 8, 9, 63, 300, 2550};
+    for (unsigned t = 0; t < sizeof(widths) / sizeof(widths[0]); t++) {
+        DWORD px = widths[t], ob = (px + 7) / 8;
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = 0x0101; op.dwInLinePixCnt = px;
+        if (!ScanDecOpen(&op) || op.dwOutLineByte != ob) return 1;
+        BYTE *gray = malloc(px), *comp = malloc(px * 2 + 2);
+        BYTE *out = malloc(ob + 8), *want = malloc(ob);
+        for (int l = 0; l < 50; l++) {
+            make_gray_line(gray, px);
+            memset(want, 0, ob);
+            for (DWORD i = 0; i < px; i++)
+                if (gray[i] >= 128) want[i / 8] |= 0x80 >> (i % 8);
+            DWORD n = pack_line(gray, px, comp);
+            memset(out, 0xA5, ob + 8);
+            SCANDEC_WRITE w = {3, 1, comp, n, out, ob + 8, 0}; INT st;
+            if (ScanDecWrite(&w, &st) != ob || st != 1) return 2;
+            if (memcmp(out, want, ob) != 0) return 3;
+            /* Same line uncompressed must give the same bits */
+            SCANDEC_WRITE r = {2, 1, gray, px, out, ob + 8, 0};
+            ScanDecWrite(&r, &st);
+            if (memcmp(out, want, ob) != 0) return 4;
+        }
+        ScanDecClose();
+        free(gray); free(comp); free(out); free(want);
+    }
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_bw_pack"
+    [[ "$status" -eq 0 ]]
+}
+
+@test "scandec: B&W PackBits lines do not allocate per line" {
+    build_driver test_bw_alloc << 'CEOF'
+extern void *__libc_malloc(size_t);
+static int g_counting = 0, g_allocs = 0;
+void *malloc(size_t n) { if (g_counting) g_allocs++; return __libc_malloc(n); }
+int main(void) {
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0101; op.dwInLinePixCnt = 2550;
+    ScanDecOpen(&op);
+    static BYTE gray[2550], comp[6000], out[400];
+    g_counting = 1;
+    for (int l = 0; l < 100; l++) {
+        make_gray_line(gray, 2550);
+        DWORD n = pack_line(gray, 2550, comp);
+        SCANDEC_WRITE w = {3, 1, comp, n, out, sizeof(out), 0}; INT st;
+        ScanDecWrite(&w, &st);
+    }
+    g_counting = 0;
+    ScanDecClose();
+    printf("%d\n", g_allocs);
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_bw_alloc"
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == "0" ]]
+    BROTHER_BW_DITHER=jarvis run "$TEST_TMPDIR/test_bw_alloc"
+    [[ "$output" == "0" ]]
+    BROTHER_BW_DITHER=bayer run "$TEST_TMPDIR/test_bw_alloc"
+    [[ "$output" == "0" ]]
+}
+
+# --- B&W rendering engines (BROTHER_BW_DITHER) ---
+
+# Driver: bw_engine <colortype> <gray level> [packbits]
+# Renders 96 lines of 203 pixels of one gray level and prints the share
+# of white pixels in permille plus the longest horizontal white run.
+build_bw_engine_driver() {
+    build_driver bw_engine << 'CEOF'
+int main(int argc, char **argv) {
+    DWORD px = 203, ob = (px + 7) / 8;
+    int level = atoi(argv[2]), pack = argc > 3;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = (INT)strtol(argv[1], NULL, 0); op.dwInLinePixCnt = px;
+    if (!ScanDecOpen(&op)) return 1;
+    static BYTE gray[203], comp[500], out[64];
+    memset(gray, level, px);
+    DWORD n = pack_line(gray, px, comp);
+    long white = 0, run = 0, longest = 0;
+    for (int l = 0; l < 96; l++) {
+        SCANDEC_WRITE w = {pack ? 3 : 2, 1, pack ? comp : gray, pack ? n : px,
+                           out, sizeof(out), 0};
+        INT st;
+        if (ScanDecWrite(&w, &st) != ob || st != 1) return 2;
+        run = 0;
+        for (DWORD i = 0; i < px; i++) {
+            int bit = (out[i / 8] >> (7 - i % 8)) & 1;
+            white += bit;
+            run = bit ? run + 1 : 0;
+            if (run > longest) longest = run;
+        }
+        for (DWORD i = px; i < ob * 8; i++)
+            if ((out[i / 8] >> (7 - i % 8)) & 1) return 3;
+    }
+    ScanDecClose();
+    printf("%ld %ld\n", white * 1000 / (96 * (long)px), longest);
+    return 0;
+}
+CEOF
+}
+
+@test "scandec: error diffusion and Bayer keep the mean gray level" {
+    build_bw_engine_driver
+    for engine in fs jarvis bayer; do
+        for level in 32 128 200; do
+            for pack in "" packbits; do
+                BROTHER_BW_DITHER=$engine run "$TEST_TMPDIR/bw_engine" 0x0101 $level $pack
+                [[ "$status" -eq 0 ]]
+                [[ "$output" =~ ^([0-9]+)\ ([0-9]+)$ ]]
+                local want=$(( level * 1000 / 255 )) got=${BASH_REMATCH[1]}
+                (( got > want - 20 && got < want + 20 ))
+                # A mid gray must not come out as solid white stretches
+                (( level != 128 || BASH_REMATCH[2] < 8 ))
+            done
+        done
+    done
+}
+
+# Driver: bw_doc [packbits]
+# A low-contrast "yellowed" page at 300 dpi: background 180..220 drifting
+# across and down the page, with 3-pixel text strokes 40 levels darker
+# than their surroundings.  Prints the share of stroke pixels that came
+# out black and of background pixels that came out white, in permille.
+build_bw_doc_driver() {
+    build_driver bw_doc << 'CEOF'
+int main(int argc, char **argv) {
+    DWORD px = 400, ob = (px + 7) / 8;
+    int pack = argc > 1;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0101; op.dwInLinePixCnt = px;
+    op.nInResoX = op.nOutResoX = op.nInResoY = op.nOutResoY = 300;
+    if (!ScanDecOpen(&op)) return 1;
+    static BYTE gray[400], comp[1000], out[64];
+    long text = 0, text_black = 0, bg = 0, bg_white = 0;
+    for (int l = 0; l < 300; l++) {
+        for (DWORD x = 0; x < px; x++) {
+            int b = 180 + (int)(x * 25 / px) + l / 20;
+            int stroke = l >= 100 && l < 200 && x % 20 < 3 && (l / 25) % 2 == 0;
+            gray[x] = (BYTE)(stroke ? b - 40 : b);
+        }
+        DWORD n = pack_line(gray, px, comp);
+        SCANDEC_WRITE w = {pack ? 3 : 2, 1, pack ? comp : gray, pack ? n : px,
+                           out, sizeof(out), 0};
+        INT st;
+        if (ScanDecWrite(&w, &st) != ob || st != 1) return 2;
+        for (DWORD x = 0; x < px; x++) {
+            int bit = (out[x / 8] >> (7 - x % 8)) & 1;
+            int stroke = l >= 100 && l < 200 && x % 20 < 3 && (l / 25) % 2 == 0;
+            if (stroke) { text++; text_black += !bit; }
+            else { bg++; bg_white += bit; }
+        }
+    }
+    ScanDecClose();
+    printf("%ld %ld\n", text_black * 1000 / text, bg_white * 1000 / bg);
+    return 0;
+}
+CEOF
+}
+
+@test "scandec: adaptive binarisation keeps low-contrast text" {
+    build_bw_doc_driver
+    # A fixed threshold turns the whole page white
+    run "$TEST_TMPDIR/bw_doc"
+    [[ "$output" =~ ^0\ 1000$ ]]
+    for engine in bradley sauvola; do
+        for pack in "" packbits; do
+            BROTHER_BW_DITHER=$engine run "$TEST_TMPDIR/bw_doc" $pack
+            [[ "$status" -eq 0 ]]
+            [[ "$output" =~ ^([0-9]+)\ ([0-9]+)$ ]]
+            (( BASH_REMATCH[1] >= 990 && BASH_REMATCH[2] >= 995 ))
+        done
+    done
+}
+
+@test "scandec: adaptive window follows the resolution and BROTHER_BW_WINDOW" {
+    build_bw_doc_driver
+    run bash -c "BROTHER_BW_DITHER=bradley BROTHER_DEBUG=1 '$TEST_TMPDIR/bw_doc' 2>&1"
+    [[ "$output" == *"B&W rendering: bradley, window 75 (BROTHER_BW_DITHER)"* ]]
+    run bash -c "BROTHER_BW_DITHER=sauvola BROTHER_BW_WINDOW=40 BROTHER_DEBUG=1 '$TEST_TMPDIR/bw_doc' 2>&1"
+    [[ "$output" == *"B&W rendering: sauvola, window 41"* ]]
+    [[ "${lines[${#lines[@]}-1]}" =~ ^([0-9]+)\ ([0-9]+)$ ]]
+    (( BASH_REMATCH[1] >= 990 && BASH_REMATCH[2] >= 995 ))
+}
+
+@test "scandec: SC_ED scans diffuse and SC_DTH scans dither by default" {
+    build_bw_engine_driver
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/bw_engine' 0x0102 100 2>&1"
+    [[ "$output" == *"B&W rendering: fs, level 128"* ]]
+    [[ "${lines[${#lines[@]}-1]}" =~ ^([0-9]+)\  ]]
+    (( BASH_REMATCH[1] > 370 && BASH_REMATCH[1] < 410 ))
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/bw_engine' 0x0104 100 2>&1"
+    [[ "$output" == *"B&W rendering: bayer"* ]]
+    # SC_BW keeps the plain threshold: level 100 is all black
+    run "$TEST_TMPDIR/bw_engine" 0x0101 100
+    [[ "$output" == "0 0" ]]
+    BROTHER_BW_DITHER=threshold run "$TEST_TMPDIR/bw_engine" 0x0102 100
+    [[ "$output" == "0 0" ]]
+}
+
+@test "scandec: BROTHER_BW_THRESHOLD moves the threshold level" {
+    build_bw_engine_driver
+    BROTHER_BW_THRESHOLD=90 run "$TEST_TMPDIR/bw_engine" 0x0101 100
+    [[ "$output" == "1000 203" ]]
+    BROTHER_BW_THRESHOLD=90 run "$TEST_TMPDIR/bw_engine" 0x0101 100 packbits
+    [[ "$output" == "1000 203" ]]
+    BROTHER_BW_THRESHOLD=101 run "$TEST_TMPDIR/bw_engine" 0x0101 100 packbits
+    [[ "$output" == "0 0" ]]
+}
+
+# --- 24-bit colour ---
+
+@test "scandec: RGB planes are interleaved into pixel order" {
+    build_driver test_rgb << 'CEOF'
+int main(void) {
+    DWORD widths[] = {1, 15, 16, 17, 33, 2550};
+    for (unsigned t = 0; t < sizeof(widths) / sizeof(widths[0]); t++) {
+        DWORD px = widths[t];
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = 0x0400; op.dwInLinePixCnt = px; op.bLongBoundary = 1;
+        if (!ScanDecOpen(&op)) return 1;
+        DWORD ob = op.dwOutLineByte;
+        BYTE *pl[3], *comp = malloc(px * 2 + 2), *out = malloc(ob + 64);
+        for (int c = 0; c < 3; c++) pl[c] = malloc(px);
+        for (int l = 0; l < 20; l++) {
+            memset(out, 0xA5, ob + 64);
+            INT st;
+            for (int c = 0; c < 3; c++) {
+                make_gray_line(pl[c], px);
+                /* Red and blue PackBits, green uncompressed */
+                DWORD n = (c == 1) ? px : pack_line(pl[c], px, comp);
+                SCANDEC_WRITE w = {c == 1 ? 2 : 3, 2 + c, c == 1 ? pl[c] : comp,
+                                   n, out, ob + 64, 0};
+                DWORD r = ScanDecWrite(&w, &st);
+                if (c < 2 && (r != 0 || st != 0)) return 2;
+                if (c == 2 && (r != ob || st != 1)) return 3;
+            }
+            for (DWORD i = 0; i < px; i++)
+                for (int c = 0; c < 3; c++)
+                    if (out[i * 3 + c] != pl[c][i]) return 4;
+            for (DWORD i = px * 3; i < ob; i++)
+                if (out[i] != 0) return 5;
+        }
+        ScanDecClose();
+        for (int c = 0; c < 3; c++) free(pl[c]);
+        free(comp); free(out);
+    }
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_rgb"
+    [[ "$status" -eq 0 ]]
+    BROTHER_SIMD=0 run "$TEST_TMPDIR/test_rgb"
+    [[ "$status" -eq 0 ]]
+}
+
+@test "scandec: RGB white and uncompressed planes assemble without allocating" {
+    build_driver test_rgb_ring << 'CEOF'
+extern void *__libc_malloc(size_t);
+static int g_counting = 0, g_allocs = 0;
+void *malloc(size_t n) { if (g_counting) g_allocs++; return __libc_malloc(n); }
+int main(void) {
+    DWORD px = 300;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0400; op.dwInLinePixCnt = px;
+    if (!ScanDecOpen(&op)) return 1;
+    static BYTE pl[3][300], comp[700], out[900];
+    g_counting = 1;
+    for (int l = 0; l < 40; l++) {
+        INT st;
+        for (int c = 0; c < 3; c++) {
+            int kind = (l + c) % 3;            /* 1=white, 2=raw, 3=PackBits */
+            make_gray_line(pl[c], px);
+            if (kind == 0) memset(pl[c], 0xFF, px);
+            DWORD n = (kind == 2) ? pack_line(pl[c], px, comp) : px;
+            SCANDEC_WRITE w = {kind + 1, 2 + c, kind == 2 ? comp : pl[c],
+                               n, out, sizeof(out), 0};
+            ScanDecWrite(&w, &st);
+        }
+        if (st != 1) return 2;
+        for (DWORD i = 0; i < px; i++)
+            for (int c = 0; c < 3; c++)
+                if (out[i * 3 + c] != pl[c][i]) return 3;
+    }
+    g_counting = 0;
+    ScanDecClose();
+    printf("%d\n", g_allocs);
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_rgb_ring"
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == "0" ]]
+}
+
+@test "scandec: uncompressed RGB planes survive the caller reusing its buffer" {
+    build_driver test_rgb_inplace << 'CEOF'
+typedef struct SCANDEC_CTX SCANDEC_CTX;
+extern SCANDEC_CTX *ScanDecCtxOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecCtxClose(SCANDEC_CTX *c);
+extern DWORD ScanDecCtxWrite(SCANDEC_CTX *c, SCANDEC_WRITE *w, INT *st);
+extern DWORD ScanDecCtxPageEnd(SCANDEC_CTX *c, SCANDEC_WRITE *w, INT *st);
+/* Every plane comes from one buffer, overwritten after each call as the
+ * backend's read buffer is; argv[1] "ctx" decodes through a handle,
+ * "default" through the default session */
+int main(int argc, char **argv) {
+    int ctx = argc > 1 && !strcmp(argv[1], "ctx");
+    DWORD px = 301, lines = 0;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0400; op.dwInLinePixCnt = px;
+    SCANDEC_CTX *c = NULL;
+    if (ctx ? !(c = ScanDecCtxOpen(&op)) : !ScanDecOpen(&op)) return 1;
+    static BYTE pl[200][3][301], in[301], out[904 * 16];
+    BYTE *got = malloc(200 * 903);
+    INT st;
+    for (int l = 0; l < 200; l++) {
+        for (int k = 0; k < 3; k++) {
+            make_gray_line(pl[l][k], px);
+            memcpy(in, pl[l][k], px);
+            SCANDEC_WRITE w = {2, 2 + k, in, px, out, sizeof(out), 0};
+            c ? ScanDecCtxWrite(c, &w, &st) : ScanDecWrite(&w, &st);
+            memset(in, 0x5A, px);
+            for (INT i = 0; i < st; i++)
+                memcpy(got + (lines + i) * 903, out + i * op.dwOutLineByte, 903);
+            lines += st;
+        }
+    }
+    SCANDEC_WRITE e = {0, 0, NULL, 0, out, sizeof(out), 0};
+    c ? ScanDecCtxPageEnd(c, &e, &st) : ScanDecPageEnd(&e, &st);
+    for (INT i = 0; i < st; i++)
+        memcpy(got + (lines + i) * 903, out + i * op.dwOutLineByte, 903);
+    lines += st;
+    c ? ScanDecCtxClose(c) : ScanDecClose();
+    if (lines != 200) return 2;
+    for (DWORD l = 0; l < 200; l++)
+        for (DWORD i = 0; i < px; i++)
+            for (int k = 0; k < 3; k++)
+                if (got[l * 903 + i * 3 + k] != pl[l][k][i]) return 3;
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_rgb_inplace" default
+    [[ "$status" -eq 0 ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_rgb_inplace" default
+    [[ "$status" -eq 0 ]]
+    run "$TEST_TMPDIR/test_rgb_inplace" ctx
+    [[ "$status" -eq 0 ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_rgb_inplace" ctx
+    [[ "$status" -eq 0 ]]
+}
+
+# --- Tone tables (ScanDecSetTblHandle) ---
+
+@test "scandec: tone tables are fused and applied in every 8-bit path" {
+    build_driver test_tone << 'CEOF'
+/* Gray and RGB lines in white, raw and PackBits form must come out as
+ * t2[t1[v]]; argv[1] = "id" passes identity tables instead. */
+int main(int argc, char **argv) {
+    int id = argc > 1 && !strcmp(argv[1], "id");
+    static BYTE t1[256], t2[256], map[256];
+    for (int v = 0; v < 256; v++) {
+        t1[v] = id ? v : (BYTE)(v * v / 255);   /* gamma 2 */
+        t2[v] = id ? v : (BYTE)(255 - v);       /* invert */
+        map[v] = t2[t1[v]];
+    }
+    DWORD px = 301;
+    for (int rgb = 0; rgb < 2; rgb++) {
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = rgb ? 0x0400 : 0x0200; op.dwInLinePixCnt = px;
+        if (!ScanDecOpen(&op)) return 1;
+        ScanDecSetTblHandle(t1, t2);
+        static BYTE pl[3][301], comp[700], out[903];
+        for (int l = 0; l < 30; l++) {
+            INT st = 0;
+            for (int c = 0; c < (rgb ? 3 : 1); c++) {
+                int kind = (l + c) % 3;        /* 0=white, 1=raw, 2=PackBits */
+                make_gray_line(pl[c], px);
+                if (kind == 0) memset(pl[c], 0xFF, px);
+                DWORD n = (kind == 2) ? pack_line(pl[c], px, comp) : px;
+                SCANDEC_WRITE w = {kind + 1, rgb ? 2 + c : 1,
+                                   kind == 2 ? comp : pl[c], n, out, sizeof(out), 0};
+                ScanDecWrite(&w, &st);
+            }
+            if (st != 1) return 2;
+            for (DWORD i = 0; i < px; i++)
+                for (int c = 0; c < (rgb ? 3 : 1); c++)
+                    if (out[i * (rgb ? 3 : 1) + c] != map[pl[c][i]]) return 3 + rgb;
+        }
+        ScanDecSetTblHandle(NULL, NULL);
+        ScanDecClose();
+    }
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_tone"
+    [[ "$status" -eq 0 ]]
+    BROTHER_SIMD=0 run "$TEST_TMPDIR/test_tone"
+    [[ "$status" -eq 0 ]]
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/test_tone' id 2>&1"
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"ScanDecSetTblHandle: h1=table h2=table, identity, skipped"* ]]
+}
+
+@test "scandec: without tone tables lines decode unchanged" {
+    build_driver test_tone_none << 'CEOF'
+int main(void) {
+    static BYTE t1[256];
+    for (int v = 0; v < 256; v++) t1[v] = 255 - v;
+    DWORD px = 64;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0200; op.dwInLinePixCnt = px;
+    ScanDecOpen(&op);
+    /* A table set and then cleared must leave no trace */
+    ScanDecSetTblHandle(t1, NULL);
+    ScanDecSetTblHandle(NULL, NULL);
+    BYTE line[64], out[64]; INT st;
+    make_gray_line(line, px);
+    SCANDEC_WRITE w = {2, 1, line, px, out, sizeof(out), 0};
+    ScanDecWrite(&w, &st);
+    ScanDecClose();
+    return memcmp(out, line, px) ? 1 : 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_tone_none"
+    [[ "$status" -eq 0 ]]
+}
+
+@test "scandec: tone tables set mid-session apply from the next line" {
+    build_driver test_tone_switch << 'CEOF'
+/* 1-bit and RGB sessions: lines before, with and after an inverting
+ * table must each come out through the table active when written. */
+int main(void) {
+    static BYTE inv[256], pl[3][301], comp[700], out[903];
+    for (int v = 0; v < 256; v++) inv[v] = (BYTE)(255 - v);
+    DWORD px = 301;
+    for (int rgb = 0; rgb < 2; rgb++) {
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = rgb ? 0x0400 : 0x0101; op.dwInLinePixCnt = px;
+        if (!ScanDecOpen(&op)) return 1;
+        for (int l = 0; l < 36; l++) {
+            int on = l / 12 == 1;              /* table for lines 12..23 */
+            if (l % 12 == 0)
+                ScanDecSetTblHandle(on ? inv : NULL, NULL);
+            INT st = 0;
+            for (int c = 0; c < (rgb ? 3 : 1); c++) {
+                int kind = (l + c) % 3;        /* 0=white, 1=raw, 2=PackBits */
+                make_gray_line(pl[c], px);
+                if (kind == 0) memset(pl[c], 0xFF, px);
+                DWORD n = (kind == 2) ? pack_line(pl[c], px, comp) : px;
+                SCANDEC_WRITE w = {kind + 1, rgb ? 2 + c : 1,
+                                   kind == 2 ? comp : pl[c], n, out, sizeof(out), 0};
+                ScanDecWrite(&w, &st);
+            }
+            if (st != 1) return 2;
+            for (DWORD i = 0; i < px; i++) {
+                if (!rgb) {
+                    BYTE g = on ? inv[pl[0][i]] : pl[0][i];
+                    if (((out[i / 8] >> (7 - i % 8)) & 1) != (g >= 128)) return 3;
+                    continue;
+                }
+                for (int c = 0; c < 3; c++)
+                    if (out[i * 3 + c] != (on ? inv[pl[c][i]] : pl[c][i])) return 4;
+            }
+        }
+        ScanDecClose();
+    }
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_tone_switch"
+    [[ "$status" -eq 0 ]]
+    BROTHER_DEBUG=1 run "$TEST_TMPDIR/test_tone_switch"
+    [[ "$status" -eq 0 ]]
+}
+
+# --- Resolution scaling (nInResoX/Y -> nOutResoX/Y) ---
+
+# Driver: scale <in x dpi> <in y dpi> <out x dpi> <out y dpi> <colortype> [packbits]
+# Feeds 60 lines of 120 pixels of the ramp f = x + 2y (plus 5 per RGB
+# channel), collects everything including ScanDecPageEnd, and prints
+# "<px> <lines> <max error>" where the error is measured against the
+# ramp at each output pixel centre, one pixel in from the edges.  In
+# 1-bit mode the last field is the number of black pixels instead.
+build_scale_driver() {
+    build_driver scale << 'CEOF'
+int main(int argc, char **argv) {
+    DWORD px = 120, lines = 60;
+    int ct = (int)strtol(argv[5], NULL, 0), pack = argc > 6;
+    int ch = ct & 0x0400 ? 3 : 1, bw = ct & 0x0100;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = atoi(argv[1]); op.nInResoY = atoi(argv[2]);
+    op.nOutResoX = atoi(argv[3]); op.nOutResoY = atoi(argv[4]);
+    op.nColorType = ct; op.dwInLinePixCnt = px;
+    if (!ScanDecOpen(&op)) return 1;
+    DWORD ob = op.dwOutLineByte, opx = op.dwOutLinePixCnt;
+    if (ob != (bw ? (opx + 7) / 8 : opx * ch)) return 2;
+    BYTE *img = calloc(1000, ob), *buf = malloc(op.dwOutWriteMaxSize);
+    static BYTE gray[120], comp[400];
+    DWORD got = 0; INT st;
+    for (DWORD y = 0; y < lines; y++) {
+        for (int c = 0; c < ch; c++) {
+            for (DWORD x = 0; x < px; x++) gray[x] = (BYTE)(x + 2 * y + 5 * c);
+            DWORD n = pack_line(gray, px, comp);
+            SCANDEC_WRITE w = {pack ? 3 : 2, ch == 3 ? 2 + c : 1, pack ? comp : gray,
+                               pack ? n : px, buf, op.dwOutWriteMaxSize, 0};
+            DWORD r = ScanDecWrite(&w, &st);
+            if (r != (DWORD)st * ob || got + st > 1000) return 3;
+            memcpy(img + got * ob, buf, r); got += st;
+        }
+    }
+    SCANDEC_WRITE e = {0, 0, NULL, 0, buf, op.dwOutWriteMaxSize, 0};
+    DWORD r = ScanDecPageEnd(&e, &st);
+    if (got + st > 1000) return 4;
+    memcpy(img + got * ob, buf, r); got += st;
+    ScanDecClose();
+    double worst = 0; long black = 0;
+    for (DWORD j = 0; j < got; j++) {
+        double yc = (j + 0.5) * op.nInResoY / op.nOutResoY - 0.5;
+        for (DWORD x = 0; x < opx; x++) {
+            if (bw) { black += !((img[j * ob + x / 8] >> (7 - x % 8)) & 1); continue; }
+            if (j < 1 || j + 1 >= got || x < 1 || x + 1 >= opx) continue;
+            double xc = (x + 0.5) * px / opx - 0.5;
+            for (int c = 0; c < ch; c++) {
+                double d = img[j * ob + x * ch + c] - (xc + 2 * yc + 5 * c);
+                if (d < 0) d = -d;
+                if (d > worst) worst = d;
+            }
+        }
+    }
+    if (bw) printf("%lu %lu %ld\n", (unsigned long)opx, (unsigned long)got, black);
+    else printf("%lu %lu %d\n", (unsigned long)opx, (unsigned long)got, (int)(worst + 0.999));
+    return 0;
+}
+CEOF
+}
+
+@test "scandec: equal input and output resolution is not resampled" {
+    build_scale_driver
+    run "$TEST_TMPDIR/scale" 300 300 300 300 0x0200
+    [[ "$output" == "120 60 0" ]]
+}
+
+@test "scandec: downscaling box-filters to the output resolution" {
+    build_scale_driver
+    run "$TEST_TMPDIR/scale" 300 300 150 150 0x0200 packbits
+    [[ "$output" =~ ^60\ 30\ [01]$ ]]
+    run "$TEST_TMPDIR/scale" 300 300 200 200 0x0200
+    [[ "$output" =~ ^80\ 40\ [01]$ ]]
+    run "$TEST_TMPDIR/scale" 300 600 100 200 0x0402
+    [[ "$output" =~ ^40\ 20\ [01]$ ]]
+}
+
+@test "scandec: upscaling interpolates and PageEnd returns the last lines" {
+    build_scale_driver
+    run "$TEST_TMPDIR/scale" 150 150 300 300 0x0200 packbits
+    [[ "$output" =~ ^240\ 120\ [01]$ ]]
+    run "$TEST_TMPDIR/scale" 200 200 300 300 0x0402
+    [[ "$output" =~ ^180\ 90\ [01]$ ]]
+    # Mixed: shrink across, stretch down
+    run "$TEST_TMPDIR/scale" 300 100 150 300 0x0200
+    [[ "$output" =~ ^60\ 180\ [01]$ ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/scale" 150 150 300 300 0x0200
+    [[ "$output" =~ ^240\ 120\ [01]$ ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/scale" 150 150 300 300 0x0402
+    [[ "$output" =~ ^240\ 120\ [01]$ ]]
+}
+
+@test "scandec: 1-bit scans are scaled as gray, then rendered" {
+    build_scale_driver
+    # Black where x + 2y < 128: about 56% of the page
+    run "$TEST_TMPDIR/scale" 300 300 150 150 0x0101
+    [[ "$output" =~ ^60\ 30\ ([0-9]+)$ ]]
+    (( BASH_REMATCH[1] > 60 * 30 / 2 && BASH_REMATCH[1] < 60 * 30 * 62 / 100 ))
+    BROTHER_BW_DITHER=fs run "$TEST_TMPDIR/scale" 150 150 300 300 0x0101 packbits
+    [[ "$output" =~ ^240\ 120\ ([0-9]+)$ ]]
+}
+
+@test "scandec: scaled lines the caller has no room for come back on later calls" {
+    build_driver test_scale_short << 'CEOF'
+/* 60 lines enlarged 4x down into a buffer of argv[1] lines; prints the
+ * line count and a checksum over everything returned, in order */
+int main(int argc, char **argv) {
+    DWORD px = 120, room = (DWORD)atoi(argv[1]);
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = 150; op.nInResoY = 150; op.nOutResoX = 150; op.nOutResoY = 600;
+    op.nColorType = 0x0200; op.dwInLinePixCnt = px;
+    if (argc < 2 || !ScanDecOpen(&op)) return 1;
+    DWORD ob = op.dwOutLineByte;
+    BYTE *buf = malloc(room * ob), line[120];
+    unsigned long got = 0, sum = 0; INT st;
+    for (DWORD y = 0; y < 60; y++) {
+        for (DWORD x = 0; x < px; x++) line[x] = (BYTE)(x + 2 * y);
+        SCANDEC_WRITE w = {2, 1, line, px, buf, room * ob, 0};
+        DWORD r = ScanDecWrite(&w, &st);
+        if (st < 0 || r != (DWORD)st * ob) return 2;
+        for (DWORD i = 0; i < r; i++) sum = sum * 31 + buf[i];
+        got += st;
+    }
+    for (int calls = 0; calls < 1000; calls++) {
+        SCANDEC_WRITE e = {0, 0, NULL, 0, buf, room * ob, 0};
+        DWORD r = ScanDecPageEnd(&e, &st);
+        if (st <= 0) break;
+        for (DWORD i = 0; i < r; i++) sum = sum * 31 + buf[i];
+        got += st;
+    }
+    ScanDecClose();
+    printf("%lu %lx\n", got, sum);
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_scale_short" 16
+    [[ "$status" -eq 0 ]]
+    [[ "$output" =~ ^240\  ]]
+    local full="$output"
+    for room in 1 3; do
+        run "$TEST_TMPDIR/test_scale_short" "$room"
+        [[ "$output" == "$full" ]]
+        BROTHER_BATCH_LINES=4 run "$TEST_TMPDIR/test_scale_short" "$room"
+        [[ "$output" == "$full" ]]
+    done
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/test_scale_short' 1 2>&1"
+    [[ "$output" == *"0 lines never returned"* ]]
+}
+
+# --- White runs and blank pages ---
+
+# Driver: blank <colortype> <inReso> <outReso> <page>
+#   page is a list of <kind><lines>: W = SCIDC_WHITE lines, D = white
+#   paper with two dust specks (first plane only), T = text.  Prints the page info, then a
+#   "run <first> <lines>" line per white run of at least 12 lines.
+build_blank_driver() {
+    build_driver blank << 'CEOF'
+static void on_run(DWORD first, DWORD n, void *ctx) {
+    printf("run %lu %lu\n", (unsigned long)first, (unsigned long)n);
+    ++*(int *)ctx;
+}
+int main(int argc, char **argv) {
+    DWORD px = 1000;
+    int ct = (int)strtol(argv[1], NULL, 0), ch = ct & 0x0400 ? 3 : 1, runs = 0;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = op.nInResoY = atoi(argv[2]);
+    op.nOutResoX = op.nOutResoY = atoi(argv[3]);
+    op.nColorType = ct; op.dwInLinePixCnt = px;
+    if (!ScanDecOpen(&op)) return 1;
+    ScanDecSetWhiteRunCallback(on_run, 12, &runs);
+    BYTE *buf = malloc(op.dwOutWriteMaxSize);
+    static BYTE gray[1000], comp[2000];
+    INT st;
+    for (const char *p = argv[4]; *p; ) {
+        char kind = *p++;
+        long n = strtol(p, (char **)&p, 10);
+        while (*p == ' ') p++;
+        for (long y = 0; y < n; y++) {
+            for (int c = 0; c < ch; c++) {
+                memset(gray, 0xF8, px);
+                if (kind == 'D' && !c) gray[rnd() % px] = gray[rnd() % px] = 0x20;
+                if (kind == 'T') make_gray_line(gray, px);
+                DWORD len = pack_line(gray, px, comp);
+                SCANDEC_WRITE w = {kind == 'W' ? 1 : 3, ch == 3 ? 2 + c : 1,
+                                   comp, len, buf, op.dwOutWriteMaxSize, 0};
+                ScanDecWrite(&w, &st);
+            }
+        }
+    }
+    SCANDEC_WRITE e = {0, 0, NULL, 0, buf, op.dwOutWriteMaxSize, 0};
+    ScanDecPageEnd(&e, &st);
+    SCANDEC_PAGE_INFO pi;
+    if (!ScanDecGetPageInfo(&pi)) return 2;
+    ScanDecClose();
+    fflush(stdout);
+    printf("lines %lu white %lu runs %lu longest %lu@%lu margins %lu %lu blank %d\n",
+           (unsigned long)pi.dwLines, (unsigned long)pi.dwWhiteLines,
+           (unsigned long)pi.dwWhiteRuns, (unsigned long)pi.dwLongestRun,
+           (unsigned long)pi.dwLongestRunStart, (unsigned long)pi.dwTopMargin,
+           (unsigned long)pi.dwBottomMargin, pi.bBlankPage);
+    return 0;
+}
+CEOF
+}
+
+@test "scandec: white runs and margins are tracked across lines" {
+    build_blank_driver
+    local want="lines 55 white 45 runs 3 longest 20@15 margins 10 15 blank 0"
+    for ct in 0x0200 0x0101 0x0402; do
+        run "$TEST_TMPDIR/blank" "$ct" 300 300 "W10 T5 D20 T5 W15"
+        [[ "${lines[0]}" == "run 15 20" ]]
+        [[ "${lines[1]}" == "run 40 15" ]]
+        [[ "${lines[2]}" == "$want" ]]
+    done
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/blank" 0x0200 300 300 "W10 T5 D20 T5 W15"
+    [[ "${lines[2]}" == "$want" ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/blank" 0x0402 300 300 "W10 T5 D20 T5 W15"
+    [[ "${lines[2]}" == "$want" ]]
+}
+
+@test "scandec: a page of white lines and dust is blank" {
+    build_blank_driver
+    for ct in 0x0200 0x0101 0x0402; do
+        run "$TEST_TMPDIR/blank" "$ct" 300 300 "W30 D20"
+        [[ "${lines[0]}" == "run 0 50" ]]
+        [[ "${lines[1]}" == "lines 50 white 50 runs 1 longest 50@0 margins 50 50 blank 1" ]]
+    done
+    run "$TEST_TMPDIR/blank" 0x0200 300 300 "W30 T1 D20"
+    [[ "${lines[2]}" == *"blank 0" ]]
+}
+
+@test "scandec: white runs are counted in output lines when scaling" {
+    build_blank_driver
+    run "$TEST_TMPDIR/blank" 0x0200 300 150 "W10 T10 W20"
+    [[ "${lines[0]}" == "lines 20 white 15 runs 2 longest 10@10 margins 5 10 blank 0" ]]
+    run "$TEST_TMPDIR/blank" 0x0200 150 300 "W10 T10 W20"
+    [[ "${lines[0]}" == "run 0 20" ]]
+    [[ "${lines[1]}" == "run 40 40" ]]
+    [[ "${lines[2]}" == "lines 80 white 60 runs 2 longest 40@40 margins 20 40 blank 0" ]]
+}
+
+@test "scandec: debug summary reports white lines and the blank verdict" {
+    build_blank_driver
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/blank' 0x0200 300 300 'W8 D4' 2>&1"
+    [[ "$output" == *"[SCANDEC] page: 12 lines, 12 white in 1 runs (longest 12 from line 0), margins top 12 bottom 12, blank page: yes"* ]]
+}
+
+@test "scandec: ink is counted exactly at every line width" {
+    build_driver test_ink_width << 'CEOF'
+/* At 1000..1071 px a line with 2 ink pixels is white and one with 3 is
+ * not; prints the widths where the page info disagrees */
+int main(int argc, char **argv) {
+    int ct = (int)strtol(argv[1], NULL, 0), ch = ct & 0x0400 ? 3 : 1, bad = 0;
+    static BYTE pl[3][1100], comp[2400], out[4 * 1100];
+    for (DWORD px = 1000; px < 1072; px++) {
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = ct; op.dwInLinePixCnt = px; op.bLongBoundary = 1;
+        if (!ScanDecOpen(&op)) return 1;
+        /* 2 pixels inked in one channel each; 3 pixels; 2 pixels inked
+         * in every channel */
+        DWORD at[3][3] = {{0, px - 1, px - 1}, {0, px / 2, px - 1}, {5, 5, px - 2}};
+        INT st;
+        for (int y = 0; y < 3; y++) {
+            for (int c = 0; c < ch; c++) {
+                memset(pl[c], 0xF0, px);
+                for (int k = 0; k < 3; k++)
+                    if (y == 2 || ch == 1 || k == c)
+                        pl[c][at[y][k]] = 0x10;
+                int pack = y != 1;
+                DWORD n = pack ? pack_line(pl[c], px, comp) : px;
+                SCANDEC_WRITE w = {pack ? 3 : 2, ch == 3 ? 2 + c : 1,
+                                   pack ? comp : pl[c], n, out, sizeof(out), 0};
+                ScanDecWrite(&w, &st);
+            }
+        }
+        SCANDEC_WRITE e = {0, 0, NULL, 0, out, sizeof(out), 0};
+        ScanDecPageEnd(&e, &st);
+        SCANDEC_PAGE_INFO pi;
+        ScanDecGetPageInfo(&pi);
+        ScanDecClose();
+        if (pi.dwLines != 3 || pi.dwWhiteLines != 2 || pi.dwTopMargin != 1) {
+            printf("%lu ", (unsigned long)px);
+            bad = 1;
+        }
+    }
+    printf(bad ? "wrong\n" : "ok\n");
+    return 0;
+}
+CEOF
+    for ct in 0x0200 0x0101 0x0402; do
+        run "$TEST_TMPDIR/test_ink_width" "$ct"
+        [[ "$output" == "ok" ]]
+    done
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_ink_width" 0x0402
+    [[ "$output" == "ok" ]]
+}
+
+# --- Compressed output (BROTHER_ENCODE) ---
+
+# Driver: enc <colortype> <px> <sink|env> [pages]
+#   Scans pages of black, white and text lines (a gradient for 8-bit
+#   modes).  With "sink" the stream goes to a ScanDecSetEncoder() sink
+#   and is decoded again: G4 with the decoder below, JPEG with libjpeg
+#   (built with -DHAVE_LIBJPEG).  Prints
+#   "<format> <px>x<lines> <bytes> <error>", where the error is the
+#   number of wrong pixels (G4) or the mean difference (JPEG).
+build_enc_driver() {
+    build_driver enc "$@" << 'CEOF'
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#endif
+static BYTE *stream; static long slen, scap;
+static BOOL sink(const BYTE *p, DWORD n, void *ctx) {
+    (void)ctx;
+    if (slen + (long)n > scap) stream = realloc(stream, scap = (slen + n) * 2);
+    memcpy(stream + slen, p, n); slen += n;
+    return 1;
+}
+extern BOOL ScanDecSetEncoder(BOOL on, INT q, BOOL (*fn)(const BYTE *, DWORD, void *), void *ctx);
+extern BOOL ScanDecPageStart(void);
+/* T.4 code words, as written in the standard */
+static const char *codes[5] = {
+    /* white 0..63 */
+    "00110101 000111 0111 1000 1011 1100 1110 1111 10011 10100 00111 01000 001000 000011 110100 "
+    "110101 101010 101011 0100111 0001100 0001000 0010111 0000011 0000100 0101000 0101011 0010011 "
+    "0100100 0011000 00000010 00000011 00011010 00011011 00010010 00010011 00010100 00010101 "
+    "00010110 00010111 00101000 00101001 00101010 00101011 00101100 00101101 00000100 00000101 "
+    "00001010 00001011 01010010 01010011 01010100 01010101 00100100 00100101 01011000 01011001 "
+    "01011010 01011011 01001010 01001011 00110010 00110011 00110100",
+    /* white 64..1728 */
+    "11011 10010 010111 0110111 00110110 00110111 01100100 01100101 01101000 01100111 011001100 "
+    "011001101 011010010 011010011 011010100 011010101 011010110 011010111 011011000 011011001 "
+    "011011010 011011011 010011000 010011001 010011010 011000 010011011",
+    /* black 0..63 */
+    "0000110111 010 11 10 011 0011 0010 00011 000101 000100 0000100 0000101 0000111 00000100 "
+    "00000111 000011000 0000010111 0000011000 0000001000 00001100111 00001101000 00001101100 "
+    "00000110111 00000101000 00000010111 00000011000 000011001010 000011001011 000011001100 "
+    "000011001101 000001101000 000001101001 000001101010 000001101011 000011010010 000011010011 "
+    "000011010100 000011010101 000011010110 000011010111 000001101100 000001101101 000011011010 "
+    "000011011011 000001010100 000001010101 000001010110 000001010111 000001100100 000001100101 "
+    "000001010010 000001010011 000000100100 000000110111 000000111000 000000100111 000000101000 "
+    "000001011000 000001011001 000000101011 000000101100 000001011010 000001100110 000001100111",
+    /* black 64..1728 */
+    "0000001111 000011001000 000011001001 000001011011 000000110011 000000110100 000000110101 "
+    "0000001101100 0000001101101 0000001001010 0000001001011 0000001001100 0000001001101 "
+    "0000001110010 0000001110011 0000001110100 0000001110101 0000001110110 0000001110111 "
+    "0000001010010 0000001010011 0000001010100 0000001010101 0000001011010 0000001011011 "
+    "0000001100100 0000001100101",
+    /* either colour 1792..2560 */
+    "00000001000 00000001100 00000001101 000000010010 000000010011 000000010100 000000010101 "
+    "000000010110 000000010111 000000011100 000000011101 000000011110 000000011111",
+};
+static long bitpos;
+static int bit(long i) { return i / 8 < slen ? stream[i / 8] >> (7 - i % 8) & 1 : 0; }
+static int take(const char *c, int len) {
+    for (int i = 0; i < len; i++) if (bit(bitpos + i) != c[i] - '0') return 0;
+    bitpos += len; return 1;
+}
+/* Index of the code word in table t that comes next, or -1 */
+static int take_code(int t) {
+    const char *p = codes[t];
+    for (int i = 0; *p; i++) {
+        int len = (int)strcspn(p, " ");
+        if (take(p, len)) return i;
+        p += len; while (*p == ' ') p++;
+    }
+    return -1;
+}
+static long run(int black) {
+    long total = 0; int i;
+    for (;;) {
+        if ((i = take_code(black ? 2 : 0)) >= 0) return total + i;
+        if ((i = take_code(black ? 3 : 1)) >= 0) { total += (i + 1) * 64; continue; }
+        if ((i = take_code(4)) >= 0) { total += (i + 28) * 64; continue; }
+        return -100000;
+    }
+}
+/* Next changing element right of a0 (from 0 for a0 = -1) */
+static long change(const BYTE *l, long a0, long w) {
+    for (long i = a0 + 1; i < w; i++)
+        if (l[i] != (i ? l[i - 1] : 0)) return i;
+    return w;
+}
+/* Decode lines of w pixels (1 = black) into img; returns the line count */
+static long g4_decode(BYTE *img, long w, long max) {
+    static BYTE ref[4000];
+    static const char *vc[7] = {"0000010", "000010", "010", "1", "011", "000011", "0000011"};
+    memset(ref, 0, w);
+    long y = 0;
+    while (y < max && !take("000000000001000000000001", 24)) {
+        BYTE *cur = img + y * w;
+        long a0 = -1; int colour = 0;
+        while (a0 < w) {
+            long b1 = change(ref, a0, w);
+            if (b1 < w && ref[b1] == colour) b1 = change(ref, b1, w);
+            long b2 = change(ref, b1, w), s = a0 < 0 ? 0 : a0;
+            if (take("0001", 4)) {
+                for (long i = s; i < b2; i++) cur[i] = colour;
+                a0 = b2; continue;
+            }
+            if (take("001", 3)) {
+                long r1 = run(colour), r2 = run(!colour);
+                if (r1 < 0 || r2 < 0 || s + r1 + r2 > w) return -1;
+                for (long i = 0; i < r1 + r2; i++) cur[s + i] = i < r1 ? colour : !colour;
+                a0 = s + r1 + r2; continue;
+            }
+            int d = 0;
+            while (d < 7 && !take(vc[d], (int)strlen(vc[d]))) d++;
+            long a1 = b1 + d - 3;
+            if (d == 7 || a1 < s || a1 > w) return -1;
+            for (long i = s; i < a1; i++) cur[i] = colour;
+            a0 = a1; colour = !colour;
+        }
+        memcpy(ref, cur, w); y++;
+    }
+    return y;
+}
+int main(int argc, char **argv) {
+    int ct = (int)strtol(argv[1], NULL, 0), ch = ct & 0x0400 ? 3 : 1, bw = ct & 0x0100;
+    DWORD px = atoi(argv[2]), lines = 90;
+    int pages = argc > 4 ? atoi(argv[4]) : 1;
+    if (!strcmp(argv[3], "sink")) ScanDecSetEncoder(1, 90, sink, NULL);
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = op.nInResoY = op.nOutResoX = op.nOutResoY = 300;
+    op.nColorType = ct; op.dwInLinePixCnt = px; op.bLongBoundary = 1;
+    if (!ScanDecOpen(&op)) return 1;
+    DWORD ob = op.dwOutLineByte;
+    BYTE *img = calloc(lines, ob), *buf = malloc(op.dwOutWriteMaxSize);
+    BYTE *gray = malloc(px), *comp = malloc(2 * px + 16);
+    DWORD got = 0; INT st;
+    for (int pg = 0; pg < pages; pg++) {
+        ScanDecPageStart();
+        got = 0; rnd_state = 1;
+        for (DWORD y = 0; y < lines; y++) {
+            for (int c = 0; c < ch; c++) {
+                int kind = y % 30 == 3 ? 1 : 3;
+                if (bw) {
+                    memset(gray, y % 30 == 7 ? 0 : 0xFF, px);
+                    if (y % 30 > 10) make_gray_line(gray, px);
+                } else {
+                    for (DWORD x = 0; x < px; x++) gray[x] = (BYTE)(x / 4 + y + 40 * c);
+                }
+                DWORD n = pack_line(gray, px, comp);
+                SCANDEC_WRITE w = {kind, ch == 3 ? 2 + c : 1, comp, n, buf,
+                                   op.dwOutWriteMaxSize, 0};
+                DWORD r = ScanDecWrite(&w, &st);
+                memcpy(img + got * ob, buf, r); got += st;
+            }
+        }
+        SCANDEC_WRITE e = {0, 0, NULL, 0, buf, op.dwOutWriteMaxSize, 0};
+        ScanDecPageEnd(&e, &st);
+    }
+    ScanDecClose();
+    if (strcmp(argv[3], "sink")) return 0;
+    if (bw) {
+        BYTE *dec = calloc(lines + 1, px);
+        long n = g4_decode(dec, px, lines + 1), bad = 0;
+        if (n < 0) { printf("G4 decode error at bit %ld\n", bitpos); return 1; }
+        for (long y = 0; y < n && y < (long)got; y++)
+            for (DWORD x = 0; x < px; x++)
+                bad += dec[y * px + x] != !((img[y * ob + x / 8] >> (7 - x % 8)) & 1);
+        printf("G4 %lux%ld %ld %ld\n", (unsigned long)px, n, slen, bad);
+        return 0;
+    }
+#ifdef HAVE_LIBJPEG
+    struct jpeg_decompress_struct d; struct jpeg_error_mgr jerr;
+    d.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&d);
+    jpeg_mem_src(&d, stream, slen);
+    jpeg_read_header(&d, TRUE);
+    jpeg_start_decompress(&d);
+    BYTE *row = malloc(d.output_width * d.output_components);
+    double sum = 0;
+    while (d.output_scanline < d.output_height) {
+        DWORD y = d.output_scanline;
+        jpeg_read_scanlines(&d, &row, 1);
+        for (DWORD i = 0; i < px * ch; i++) {
+            int e = row[i] - img[y * ob + i];
+            sum += e < 0 ? -e : e;
+        }
+    }
+    printf("JPEG %ux%u %ld %.1f\n", d.output_width, d.output_height, slen,
+           sum / ((double)px * ch * d.output_height));
+    jpeg_finish_decompress(&d);
+#else
+    printf("none %ld\n", slen);
+#endif
+    return 0;
+}
+CEOF
+}
+
+# Library and driver with JPEG support, when libjpeg is installed
+build_enc_jpeg() {
+    printf '#include <stdio.h>\n#include <jpeglib.h>\n' | gcc -E - &>/dev/null ||
+        skip "libjpeg headers not installed"
+    gcc -shared -fPIC -O2 -w -DHAVE_LIBJPEG \
+        -o "$TEST_TMPDIR/libscandec_test.so" \
+        "$PROJECT_ROOT/DCP-130C/scandec_stubs.c" -lpthread -ljpeg
+    build_enc_driver -DHAVE_LIBJPEG -ljpeg
+}
+
+@test "scandec: 1-bit pages are encoded as G4 that decodes to the raster" {
+    build_enc_driver
+    run "$TEST_TMPDIR/enc" 0x0101 1000 sink
+    [[ "$output" =~ ^G4\ 1000x90\ ([0-9]+)\ 0$ ]]
+    (( BASH_REMATCH[1] < 90 * 125 ))
+    # Odd width with padding, and runs past the 2560 make-up codes
+    run "$TEST_TMPDIR/enc" 0x0101 2701 sink
+    [[ "$output" =~ ^G4\ 2701x90\ [0-9]+\ 0$ ]]
+    BROTHER_BW_DITHER=fs run "$TEST_TMPDIR/enc" 0x0101 777 sink
+    [[ "$output" =~ ^G4\ 777x90\ [0-9]+\ 0$ ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/enc" 0x0101 1000 sink
+    [[ "$output" =~ ^G4\ 1000x90\ [0-9]+\ 0$ ]]
+}
+
+@test "scandec: gray and colour pages are encoded as JPEG with the page height" {
+    build_enc_jpeg
+    run "$TEST_TMPDIR/enc" 0x0200 640 sink
+    [[ "$output" =~ ^JPEG\ 640x90\ ([0-9]+)\ ([0-9.]+)$ ]]
+    (( BASH_REMATCH[1] < 640 * 90 / 4 ))
+    awk -v e="${BASH_REMATCH[2]}" 'BEGIN { exit !(e < 2.0) }'
+    run "$TEST_TMPDIR/enc" 0x0402 333 sink
+    [[ "$output" =~ ^JPEG\ 333x90\ [0-9]+\ ([0-9.]+)$ ]]
+    awk -v e="${BASH_REMATCH[1]}" 'BEGIN { exit !(e < 3.0) }'
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/enc" 0x0402 333 sink
+    [[ "$output" =~ ^JPEG\ 333x90\ [0-9]+\ [0-9.]+$ ]]
+}
+
+@test "scandec: BROTHER_ENCODE writes one stream per page to BROTHER_ENCODE_OUT" {
+    build_enc_driver
+    BROTHER_ENCODE=1 BROTHER_ENCODE_OUT="$TEST_TMPDIR/page%d.g4" \
+        run "$TEST_TMPDIR/enc" 0x0101 500 env 2
+    [[ "$status" -eq 0 ]]
+    [[ -s "$TEST_TMPDIR/page1.g4" && -s "$TEST_TMPDIR/page2.g4" ]]
+    cmp "$TEST_TMPDIR/page1.g4" "$TEST_TMPDIR/page2.g4"
+    run "$TEST_TMPDIR/enc" 0x0101 500 env
+    [[ ! -e "$TEST_TMPDIR/page3.g4" ]]
+}
+
+@test "scandec: without libjpeg gray pages are not encoded" {
+    build_enc_driver
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/enc' 0x0200 300 sink 2>&1"
+    [[ "$output" == *"encoder: JPEG not built in (HAVE_LIBJPEG)"* ]]
+    [[ "${lines[${#lines[@]}-1]}" == "none 0" ]]
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/enc' 0x0101 300 sink 2>&1"
+    [[ "$output" == *"encoder: page 1, G4 300x90,"* ]]
+    [[ "$output" == *"[SCANDEC]   encoder:       1 pages"* ]]
+}
+
+# --- Progressive delivery (BROTHER_PREVIEW) ---
+
+# Driver: prv <colortype> <px> <lines> [pages]
+#   Scans gradient pages with BROTHER_PREVIEW set by the test and reads
+#   the shared file back like a frontend would.  While scanning it
+#   checks that every completed band holds the lines already returned;
+#   at the end it checks the remaining bands and the preview against
+#   the returned lines.  Prints "page <n> lines <done> bands <ok>
+#   preview <w>x<rows> err <max> first <lines before the first band>".
+build_prv_driver() {
+    build_driver prv << 'CEOF'
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+typedef struct {
+    char magic[8];
+    unsigned version, generation, page, page_done, lines_done, preview_rows;
+    unsigned width, line_bytes, bpp, reso_x, reso_y;
+    unsigned band_lines, bands, band_offset, band_stride;
+    unsigned preview_width, preview_channels, preview_offset, preview_max_rows;
+    unsigned reserved[11];
+} PRV_HEADER;
+typedef struct { unsigned seq, first_line, lines, reserved; } PRV_BAND;
+static BYTE *map; static PRV_HEADER *h;
+static BYTE *img; static DWORD ob, got;
+/* Check band k against the returned lines; 1 if it matches */
+static int check_band(unsigned k) {
+    PRV_BAND *b = (PRV_BAND *)(map + h->band_offset + (k % h->bands) * h->band_stride);
+    unsigned seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1 || b->first_line != k * h->band_lines) return 0;
+    int ok = !memcmp(b + 1, img + (size_t)b->first_line * ob, (size_t)b->lines * ob);
+    return ok && __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE) == seq;
+}
+static unsigned pixel(DWORD y, DWORD x, int c, int bpp) {
+    const BYTE *l = img + y * ob;
+    if (bpp == 0) return (l[x / 8] >> (7 - x % 8) & 1) * 255;
+    return l[x * (bpp == 3 ? 3 : 1) + c];
+}
+int main(int argc, char **argv) {
+    int ct = (int)strtol(argv[1], NULL, 0), ch = ct & 0x0400 ? 3 : 1;
+    DWORD px = atoi(argv[2]), lines = atoi(argv[3]);
+    int pages = argc > 4 ? atoi(argv[4]) : 1;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nInResoX = op.nInResoY = op.nOutResoX = op.nOutResoY = 300;
+    op.nColorType = ct; op.dwInLinePixCnt = px;
+    if (!ScanDecOpen(&op)) return 1;
+    int fd = open(getenv("BROTHER_PREVIEW"), O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st)) return 2;
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    h = (PRV_HEADER *)map;
+    if (map == MAP_FAILED || memcmp(h->magic, "BRPRVW01", 8) || h->generation & 1) return 3;
+    ob = op.dwOutLineByte;
+    img = calloc(lines + 16, ob);
+    BYTE *buf = malloc(op.dwOutWriteMaxSize), *gray = malloc(px), *comp = malloc(2 * px + 16);
+    long first = -1, bad = 0; INT st2;
+    extern BOOL ScanDecPageStart(void);
+    for (int pg = 0; pg < pages; pg++) {
+        ScanDecPageStart();
+        got = 0; first = -1;
+        for (DWORD y = 0; y < lines; y++) {
+            for (int c = 0; c < ch; c++) {
+                for (DWORD x = 0; x < px; x++) gray[x] = (BYTE)((x * 3 + y * 2 + 60 * c + pg) & 0xFF);
+                DWORD n = pack_line(gray, px, comp);
+                SCANDEC_WRITE w = {3, ch == 3 ? 2 + c : 1, comp, n, buf, op.dwOutWriteMaxSize, 0};
+                DWORD r = ScanDecWrite(&w, &st2);
+                memcpy(img + got * ob, buf, r); got += st2;
+            }
+            unsigned done = __atomic_load_n(&h->lines_done, __ATOMIC_ACQUIRE);
+            if (done && first < 0) first = got;
+            if (done && done <= got && !check_band((done - 1) / h->band_lines)) bad++;
+        }
+        SCANDEC_WRITE e = {0, 0, NULL, 0, buf, op.dwOutWriteMaxSize, 0};
+        DWORD r = ScanDecPageEnd(&e, &st2);
+        memcpy(img + got * ob, buf, r); got += st2;
+    }
+    if (!h->page_done || h->lines_done != got) return 4;
+    unsigned nb = (got + h->band_lines - 1) / h->band_lines, ok = 0;
+    for (unsigned k = nb > h->bands ? nb - h->bands : 0; k < nb; k++) ok += check_band(k);
+    int worst = 0;
+    const BYTE *pv = map + h->preview_offset;
+    for (unsigned r = 0; r < h->preview_rows; r++)
+        for (unsigned x = 0; x < h->preview_width; x++)
+            for (unsigned c = 0; c < h->preview_channels; c++) {
+                unsigned sum = 0, n = 0;
+                for (DWORD y = r * 8; y < r * 8 + 8 && y < got; y++)
+                    for (DWORD i = x * 8; i < x * 8 + 8 && i < px; i++, n++)
+                        sum += pixel(y, i, c, h->bpp);
+                int e = abs((int)pv[(r * h->preview_width + x) * h->preview_channels + c] -
+                            (int)((sum + n / 2) / n));
+                if (e > worst) worst = e;
+            }
+    ScanDecClose();
+    printf("page %u lines %u bands %u/%u preview %ux%u err %d first %ld bad %ld\n",
+           h->page, h->lines_done, ok, nb > h->bands ? h->bands : nb,
+           h->preview_width, h->preview_rows, worst, first, bad);
+    return 0;
+}
+CEOF
+}
+
+@test "scandec: completed bands and a 1/8 preview are published while scanning" {
+    build_prv_driver
+    export BROTHER_PREVIEW="$TEST_TMPDIR/preview" BROTHER_PREVIEW_BAND=16
+    run "$TEST_TMPDIR/prv" 0x0200 203 100
+    [[ "$output" == "page 1 lines 100 bands 7/7 preview 26x13 err 0 first 16 bad 0" ]]
+    run "$TEST_TMPDIR/prv" 0x0402 120 150
+    [[ "$output" == "page 1 lines 150 bands 8/8 preview 15x19 err 0 first 16 bad 0" ]]
+    run "$TEST_TMPDIR/prv" 0x0101 100 40
+    [[ "$output" == "page 1 lines 40 bands 3/3 preview 13x5 err 0 first 16 bad 0" ]]
+}
+
+@test "scandec: preview file follows pages, batches and the pipeline" {
+    build_prv_driver
+    export BROTHER_PREVIEW="$TEST_TMPDIR/preview"
+    run "$TEST_TMPDIR/prv" 0x0200 64 200 3
+    [[ "$output" == "page 3 lines 200 bands 4/4 preview 8x25 err 0 first 64 bad 0" ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/prv" 0x0402 64 100
+    [[ "$output" =~ ^page\ 1\ lines\ 100\ bands\ 2/2\ preview\ 8x13\ err\ 0\ first\ [0-9]+\ bad\ 0$ ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/prv" 0x0200 64 100
+    [[ "$output" =~ ^page\ 1\ lines\ 100\ bands\ 2/2\ preview\ 8x13\ err\ 0\ first\ [0-9]+\ bad\ 0$ ]]
+}
+
+@test "scandec: an unusable BROTHER_PREVIEW path does not stop the scan" {
+    build_driver plain << 'CEOF'
+int main(void) {
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0200; op.dwInLinePixCnt = 50;
+    if (!ScanDecOpen(&op)) return 1;
+    BYTE line[50], out[50]; memset(line, 7, sizeof(line));
+    INT st;
+    SCANDEC_WRITE w = {2, 1, line, 50, out, 50, 0};
+    DWORD r = ScanDecWrite(&w, &st);
+    ScanDecClose();
+    printf("%lu %d\n", (unsigned long)r, out[10]);
+    return 0;
+}
+CEOF
+    run bash -c "BROTHER_DEBUG=1 BROTHER_PREVIEW='$TEST_TMPDIR/no/such/dir/p' '$TEST_TMPDIR/plain' 2>&1"
+    [[ "$output" == *"preview: cannot use $TEST_TMPDIR/no/such/dir/p"* ]]
+    [[ "${lines[${#lines[@]}-1]}" == "50 7" ]]
+}
+
+# --- Batched output (BROTHER_BATCH_LINES) ---
+
+@test "scandec: batched output returns the same lines in groups" {
+    build_driver test_batch << 'CEOF'
+/* Decode 50 gray lines, appending returned data to img; print the
+ * largest line count seen in one return and whether img matches. */
+int main(int argc, char **argv) {
+    DWORD px = 100, cap = (DWORD)atoi(argv[1]);
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0200; op.dwInLinePixCnt = px;
+    ScanDecOpen(&op);
+    static BYTE src[50][100], comp[300], img[50 * 100], buf[100 * 32];
+    DWORD got = 0; INT st, most = 0;
+    for (int l = 0; l < 50; l++) {
+        make_gray_line(src[l], px);
+        DWORD n = pack_line(src[l], px, comp);
+        SCANDEC_WRITE w = {3, 1, comp, n, buf, px * cap, 0};
+        DWORD r = ScanDecWrite(&w, &st);
+        if (r != (DWORD)st * px) return 1;
+        memcpy(img + got, buf, r); got += r;
+        if (st > most) most = st;
+    }
+    SCANDEC_WRITE e = {0, 0, NULL, 0, buf, sizeof(buf), 0};
+    DWORD r = ScanDecPageEnd(&e, &st);
+    memcpy(img + got, buf, r); got += r;
+    ScanDecClose();
+    printf("%d %s\n", most, got == sizeof(img) && !memcmp(img, src, sizeof(img)) ? "ok" : "bad");
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_batch" 32
+    [[ "$output" == "1 ok" ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/test_batch" 32
+    [[ "$output" == "8 ok" ]]
+    # Never more than dwOutWriteMaxSize (16 lines) per return
+    BROTHER_BATCH_LINES=64 run "$TEST_TMPDIR/test_batch" 32
+    [[ "$output" == "16 ok" ]]
+    # ... nor more than the caller's buffer holds
+    BROTHER_BATCH_LINES=16 run "$TEST_TMPDIR/test_batch" 3
+    [[ "$output" == "3 ok" ]]
+}
+
+@test "scandec: batched lines decode in place and a short page end drains later" {
+    build_driver test_batch_drain << 'CEOF'
+/* Gray 100 px at 300 dpi out to argv[1] dpi down.  Page 1: 5 lines into
+ * buffer a, then ScanDecPageEnd() into b with room for 2 lines until it
+ * returns 0.  Page 2: 20 lines into a and b in turn, then ScanDecPageEnd()
+ * until 0.  Prints whether page 1's pending lines were already in a (when
+ * not scaled), the page 1 ScanDecPageEnd() line counts, the lines
+ * returned and their hash. */
+static BYTE comp[300], a[100 * 16], b[100 * 16];
+static unsigned hash = 2166136261u;
+static DWORD lines;
+static void take(BYTE *buf, DWORD r) {
+    for (DWORD i = 0; i < r; i++) hash = (hash ^ buf[i]) * 16777619u;
+    lines += r / 100;
+}
+int main(int argc, char **argv) {
+    static BYTE src[25][100];
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = 0x0200; op.dwInLinePixCnt = 100;
+    op.nInResoX = op.nInResoY = op.nOutResoX = 300;
+    op.nOutResoY = atoi(argv[1]);
+    if (!ScanDecOpen(&op) || op.dwOutLineByte != 100) return 1;
+    INT st; DWORD r;
+    int inplace = 1;
+    for (int l = 0; l < 25; l++) make_gray_line(src[l], 100);
+    for (int l = 0; l < 5; l++) {
+        SCANDEC_WRITE w = {3, 1, comp, pack_line(src[l], 100, comp), a, sizeof(a), 0};
+        take(a, ScanDecWrite(&w, &st));
+        if (st == 0 && memcmp(a + l * 100, src[l], 100)) inplace = 0;
+    }
+    printf("%s", inplace ? "inplace" : "copied");
+    SCANDEC_WRITE e = {0, 0, NULL, 0, b, 200, 0};
+    do { r = ScanDecPageEnd(&e, &st); take(b, r); printf(" %d", st); } while (r);
+    for (int l = 5; l < 25; l++) {
+        BYTE *buf = l % 3 ? a : b;
+        SCANDEC_WRITE w = {3, 1, comp, pack_line(src[l], 100, comp), buf, sizeof(a), 0};
+        take(buf, ScanDecWrite(&w, &st));
+    }
+    e.pWriteBuff = a; e.dwWriteBuffSize = sizeof(a);
+    do { r = ScanDecPageEnd(&e, &st); take(a, r); } while (r);
+    ScanDecClose();
+    printf(", %lu %08x\n", lines, hash);
+    return 0;
+}
+CEOF
+    local plain
+    plain=$("$TEST_TMPDIR/test_batch_drain" 300)
+    [[ "$plain" == "inplace 0, 25 "* ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/test_batch_drain" 300
+    [[ "$output" == "inplace 2 2 1 0, ${plain#*, }" ]]
+    # doubled lines: the tail the scale owes at the page end spills too
+    plain=$("$TEST_TMPDIR/test_batch_drain" 600)
+    [[ "$plain" == *", 50 "* ]]
+    BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/test_batch_drain" 600
+    [[ "${output#*, }" == "${plain#*, }" ]]
+}
+
+# --- Pipelined decode (BROTHER_PIPELINE) ---
+
+@test "scandec: pipelined decode returns every line in order" {
+    build_driver test_pipeline << 'CEOF'
+/* Feed 200 lines (gray PackBits, or RGB raw planes with argv[2] = "rgb")
+ * through ScanDecWrite with room for argv[1] lines per call, then
+ * ScanDecPageEnd; print whether the collected image matches. */
+int main(int argc, char **argv) {
+    DWORD px = 300, cap = (DWORD)atoi(argv[1]);
+    int rgb = argc > 2 && !strcmp(argv[2], "rgb");
+    DWORD bpl = rgb ? px * 3 : px;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = rgb ? 0x0400 : 0x0200; op.dwInLinePixCnt = px;
+    ScanDecOpen(&op);
+    static BYTE src[200][900], comp[1000], img[200 * 900], buf[900 * 16];
+    DWORD got = 0; INT st;
+    for (int l = 0; l < 200; l++) {
+        for (int c = 0; c < (rgb ? 3 : 1); c++) {
+            BYTE g[300];
+            make_gray_line(g, px);
+            SCANDEC_WRITE w = {2, rgb ? 2 + c : 1, comp, px, buf, bpl * cap, 0};
+            if (rgb) {
+                for (DWORD i = 0; i < px; i++) src[l][i * 3 + c] = g[i];
+                memcpy(comp, g, px);
+            } else {
+                memcpy(src[l], g, px);
+                w.nInDataComp = 3; w.dwLineDataSize = pack_line(g, px, comp);
+            }
+            DWORD r = ScanDecWrite(&w, &st);
+            if (r != (DWORD)st * bpl || got + r > sizeof(img)) return 1;
+            memcpy(img + got, buf, r); got += r;
+        }
+    }
+    SCANDEC_WRITE e = {0, 0, NULL, 0, buf, sizeof(buf), 0};
+    DWORD r = ScanDecPageEnd(&e, &st);
+    memcpy(img + got, buf, r); got += r;
+    ScanDecClose();
+    int ok = got == 200 * bpl;
+    for (int l = 0; ok && l < 200; l++)
+        ok = !memcmp(img + l * bpl, src[l], bpl);
+    printf("%s\n", ok ? "ok" : "bad");
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_pipeline" 1
+    [[ "$output" == "ok" ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_pipeline" 1
+    [[ "$output" == "ok" ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_pipeline" 16
+    [[ "$output" == "ok" ]]
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_pipeline" 1 rgb
+    [[ "$output" == "ok" ]]
+    BROTHER_PIPELINE=1 BROTHER_DEBUG=1 run "$TEST_TMPDIR/test_pipeline" 4 rgb
+    [[ "$output" == *"pipeline:"*"0 dropped"* ]]
+    [[ "$output" == *"ok" ]]
+}
+
+# --- Sessions (ScanDecCtx*) ---
+
+@test "scandec: pipelined lines come back one call behind, too-long lines are refused" {
+    build_driver test_pipe_lag << 'CEOF'
+/* 60 gray PackBits lines, or RGB raw planes with argv[1] = "rgb"; input
+ * line 30 (its blue plane for RGB) is padded with 2000 no-op bytes.
+ * Prints the calls that returned no lines, the *st of the padded write
+ * and whether the other 59 lines came back in order. */
+int main(int argc, char **argv) {
+    DWORD px = 300;
+    int rgb = argc > 1 && !strcmp(argv[1], "rgb");
+    DWORD bpl = rgb ? px * 3 : px;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = rgb ? 0x0400 : 0x0200; op.dwInLinePixCnt = px;
+    if (!ScanDecOpen(&op)) return 1;
+    static BYTE src[60][900], comp[3000], img[60 * 900], buf[900 * 16];
+    DWORD got = 0; INT st, padded = 0; int empty = 0;
+    for (int l = 0; l < 60; l++) {
+        for (int c = 0; c < (rgb ? 3 : 1); c++) {
+            BYTE g[300];
+            make_gray_line(g, px);
+            for (DWORD i = 0; i < px; i++) src[l][rgb ? i * 3 + c : i] = g[i];
+            DWORD n = pack_line(g, px, comp);
+            if (l == 30 && c == (rgb ? 2 : 0)) {
+                memset(comp + n, 0x80, 2000);
+                n += 2000;
+            }
+            SCANDEC_WRITE w = {3, rgb ? 2 + c : 1, comp, n, buf, sizeof(buf), 0};
+            DWORD r = ScanDecWrite(&w, &st);
+            if (l == 30 && c == (rgb ? 2 : 0)) { padded = st; continue; }
+            if (st < 0 || r != (DWORD)st * bpl) return 2;
+            if (!st) empty++;
+            memcpy(img + got, buf, r); got += r;
+        }
+    }
+    SCANDEC_WRITE e = {0, 0, NULL, 0, buf, sizeof(buf), 0};
+    DWORD r = ScanDecPageEnd(&e, &st);
+    memcpy(img + got, buf, r); got += r;
+    ScanDecClose();
+    int ok = got == 59 * bpl;
+    for (int l = 0, k = 0; ok && l < 60; l++)
+        if (l != 30) ok = !memcmp(img + k++ * bpl, src[l], bpl);
+    printf("%d %d %s\n", empty, padded, ok ? "ok" : "bad");
+    return 0;
+}
+CEOF
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_pipe_lag"
+    [[ "$output" == "1 -1 ok" ]]
+    # red and green planes return nothing, every blue the line before
+    BROTHER_PIPELINE=1 run "$TEST_TMPDIR/test_pipe_lag" rgb
+    [[ "$output" == "$((60 * 2 + 1)) -1 ok" ]]
+}
+
+@test "scandec: sessions decode side by side as they do alone" {
+    build_driver test_sessions -lpthread << 'CEOF'
+#include <pthread.h>
+typedef struct SCANDEC_CTX SCANDEC_CTX;
+extern SCANDEC_CTX *ScanDecCtxOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecCtxClose(SCANDEC_CTX *c);
+extern DWORD ScanDecCtxWrite(SCANDEC_CTX *c, SCANDEC_WRITE *w, INT *st);
+extern DWORD ScanDecCtxPageEnd(SCANDEC_CTX *c, SCANDEC_WRITE *w, INT *st);
+extern void ScanDecCtxSetTblHandle(SCANDEC_CTX *c, HANDLE h1, HANDLE h2);
+extern BOOL ScanDecCtxGetPageInfo(SCANDEC_CTX *c, SCANDEC_PAGE_INFO *info);
+/* One session per colour mode: B&W (error diffusion), gray with a tone
+ * table, RGB planes.  Each has its own input generator and output hash. */
+static const INT types[3] = {0x0102, 0x0200, 0x0400};
+typedef struct {
+    int kind; SCANDEC_CTX *c; unsigned rng, hash; DWORD lines, in_lines;
+    BYTE tone[256], comp[2000], buf[900 * 16];
+} SESSION;
+static unsigned next(SESSION *s) { s->rng = s->rng * 1103515245 + 12345; return s->rng >> 8; }
+static void take(SESSION *s, DWORD r, INT st) {
+    for (DWORD i = 0; i < r; i++) s->hash = (s->hash ^ s->buf[i]) * 16777619u;
+    s->lines += st;
+}
+static void open_session(SESSION *s, int kind, int legacy) {
+    memset(s, 0, sizeof(*s));
+    s->kind = kind; s->rng = 7 + kind; s->hash = 2166136261u;
+    SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+    op.nColorType = types[kind]; op.dwInLinePixCnt = 300;
+    for (int i = 0; i < 256; i++) s->tone[i] = (BYTE)(255 - i);
+    if (legacy) {
+        /* tone tables outlast a session, so set them every time */
+        ScanDecOpen(&op);
+        ScanDecSetTblHandle(kind == 1 ? s->tone : NULL, NULL);
+    } else {
+        s->c = ScanDecCtxOpen(&op);
+        ScanDecCtxSetTblHandle(s->c, kind == 1 ? s->tone : NULL, NULL);
+    }
+}
+/* Feed one scanner line (three planes for RGB) */
+static void feed(SESSION *s) {
+    for (int p = 0; p < (s->kind == 2 ? 3 : 1); p++) {
+        BYTE g[300];
+        for (int i = 0; i < 300; i++) g[i] = next(s) % 3 ? 0xF8 : (BYTE)next(s);
+        if (s->in_lines % 40 < 5) memset(g, 0xFF, sizeof(g));
+        SCANDEC_WRITE w = {3, s->kind == 2 ? 2 + p : 1, s->comp, pack_line(g, 300, s->comp),
+                           s->buf, sizeof(s->buf), 0};
+        INT st;
+        DWORD r = s->c ? ScanDecCtxWrite(s->c, &w, &st) : ScanDecWrite(&w, &st);
+        take(s, r, st);
+    }
+    s->in_lines++;
+}
+static void close_session(SESSION *s) {
+    SCANDEC_WRITE e = {0, 0, NULL, 0, s->buf, sizeof(s->buf), 0};
+    SCANDEC_PAGE_INFO info; INT st;
+    DWORD r = s->c ? ScanDecCtxPageEnd(s->c, &e, &st) : ScanDecPageEnd(&e, &st);
+    take(s, r, st);
+    if (s->c) { ScanDecCtxGetPageInfo(s->c, &info); ScanDecCtxClose(s->c); }
+    else { ScanDecGetPageInfo(&info); ScanDecClose(); }
+    printf("%d %lu %lu %08x\n", s->kind, s->lines, info.dwWhiteLines, s->hash);
+}
+static void *run_alone(void *arg) {
+    for (int l = 0; l < 200; l++) feed(arg);
+    return NULL;
+}
+/* argv[1]: legacy (one session after another through ScanDec*), ctx
+ * (all open at once, lines interleaved on one thread) or threads */
+int main(int argc, char **argv) {
+    static SESSION s[3];
+    if (!strcmp(argv[1], "legacy")) {
+        for (int k = 0; k < 3; k++) { open_session(&s[k], k, 1); run_alone(&s[k]); close_session(&s[k]); }
+        return 0;
+    }
+    for (int k = 0; k < 3; k++) {
+        open_session(&s[k], k, 0);
+        if (!s[k].c) return 1;
+    }
+    if (!strcmp(argv[1], "threads")) {
+        pthread_t t[3];
+        for (int k = 0; k < 3; k++) pthread_create(&t[k], NULL, run_alone, &s[k]);
+        for (int k = 0; k < 3; k++) pthread_join(t[k], NULL);
+    } else {
+        for (int l = 0; l < 200; l++)
+            for (int k = 0; k < 3; k++) feed(&s[k]);
+    }
+    for (int k = 0; k < 3; k++) close_session(&s[k]);
+    /* the default session is untouched and still usable */
+    open_session(&s[0], 1, 1); run_alone(&s[0]); close_session(&s[0]);
+    return 0;
+}
+CEOF
+    local legacy
+    legacy=$("$TEST_TMPDIR/test_sessions" legacy)
+    [[ "$(printf '%s\n' "$legacy" | wc -l)" -eq 3 ]]
+    [[ "$legacy" == *"0 200 25 "* ]]
+    local expect="$legacy"$'\n'"$(printf '%s\n' "$legacy" | sed -n 2p)"
+    run "$TEST_TMPDIR/test_sessions" ctx
+    [[ "$output" == "$expect" ]]
+    run "$TEST_TMPDIR/test_sessions" threads
+    [[ "$output" == "$expect" ]]
+    BROTHER_PIPELINE=1 BROTHER_BATCH_LINES=8 run "$TEST_TMPDIR/test_sessions" threads
+    [[ "$output" == "$expect" ]]
+    # each handle traces to a file of its own, the default session to the name
+    BROTHER_TRACE="$TEST_TMPDIR/t" run "$TEST_TMPDIR/test_sessions" threads
+    [[ "$output" == "$expect" ]]
+    for f in t t.1 t.2 t.3; do
+        [[ -s "$TEST_TMPDIR/$f" ]]
+    done
+    [[ ! -e "$TEST_TMPDIR/t.4" ]]
+}
+
+@test "scandec: a session that fails to open returns no handle" {
+    build_driver test_session_fail << 'CEOF'
+typedef struct SCANDEC_CTX SCANDEC_CTX;
+extern SCANDEC_CTX *ScanDecCtxOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecCtxClose(SCANDEC_CTX *c);
+extern DWORD ScanDecCtxWrite(SCANDEC_CTX *c, SCANDEC_WRITE *w, INT *st);
+int main(void) {
+    if (ScanDecCtxOpen(NULL) != NULL) return 1;
+    SCANDEC_WRITE w = {1, 1, NULL, 0, NULL, 0, 0}; INT st = 0;
+    if (ScanDecCtxWrite(NULL, &w, &st) != 0 || st != -1) return 2;
+    if (ScanDecCtxClose(NULL)) return 3;
+    return 0;
+}
+CEOF
+    run "$TEST_TMPDIR/test_session_fail"
+    [[ "$status" -eq 0 ]]
+}
+
+@test "scandec: an open that runs out of memory frees what it took" {
+    build_driver test_open_oom -I"$PROJECT_ROOT/DCP-130C" << 'CEOF'
+#include "brother_stats.h"
+typedef struct SCANDEC_CTX SCANDEC_CTX;
+extern SCANDEC_CTX *ScanDecCtxOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecCtxClose(SCANDEC_CTX *c);
+/* Allocation number g_fail fails; g_live counts blocks not yet freed */
+extern void *__libc_malloc(size_t), *__libc_calloc(size_t, size_t);
+extern void *__libc_memalign(size_t, size_t);
+extern void __libc_free(void *);
+static int g_fail, g_calls, g_live;
+static void *count(void *p) { if (p) g_live++; return p; }
+static int failing(void) { return g_fail && ++g_calls == g_fail; }
+void *malloc(size_t n) { return failing() ? NULL : count(__libc_malloc(n)); }
+void *calloc(size_t n, size_t k) { return failing() ? NULL : count(__libc_calloc(n, k)); }
+int posix_memalign(void **p, size_t a, size_t n) {
+    if (failing()) return 12;
+    *p = count(__libc_memalign(a, n));
+    return *p ? 0 : 12;
+}
+void free(void *p) { if (p) g_live--; __libc_free(p); }
+int main(int argc, char **argv) {
+    FILE *f = fopen(getenv("BROTHER_STATS_PATH"), "w");
+    static BRSTATS init;
+    memcpy(init.magic, BRSTATS_MAGIC, 8); init.version = BRSTATS_VERSION;
+    fwrite(&init, sizeof(init), 1, f); fclose(f);
+    BRSTATS *seg = brstats_attach();
+    if (!seg) return 1;
+    /* colour planes, scaling and batching; then an adaptive 1-bit engine,
+     * each through a handle and through the default session */
+    static const INT types[2] = {0x0400, 0x0102};
+    for (int t = 0; t < 4; t++) {
+        int failed = 0;
+        for (g_fail = 1; ; g_fail++) {
+            SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+            op.nColorType = types[t % 2]; op.dwInLinePixCnt = 300;
+            op.nInResoX = op.nInResoY = 300; op.nOutResoX = op.nOutResoY = 200;
+            int live = g_live;
+            g_calls = 0;
+            SCANDEC_CTX *c = t < 2 ? ScanDecCtxOpen(&op)
+                                   : ScanDecOpen(&op) ? (SCANDEC_CTX *)&op : NULL;
+            if (c) {
+                if (seg->scan_active != 1) return 2;
+                if (t < 2) ScanDecCtxClose(c); else ScanDecClose();
+            }
+            if (g_live != live) { printf("leak %d at %d\n", g_live - live, g_fail); return 3; }
+            if (seg->scan_active != 0) return 4;
+            if (c && g_calls < g_fail) break;
+            failed += !c;
+        }
+        printf("%d\n", failed);
+    }
+    return 0;
+}
+CEOF
+    BROTHER_STATS_PATH="$TEST_TMPDIR/stats" BROTHER_BATCH_LINES=8 \
+        BROTHER_BW_DITHER=sauvola BROTHER_PREVIEW="$TEST_TMPDIR/preview" \
+        run "$TEST_TMPDIR/test_open_oom"
+    [[ "$status" -eq 0 ]]
+    # every allocation the open needs was made to fail at least once
+    for n in "${lines[@]}"; do
+        [[ "$n" -ge 5 ]]
+    done
+    [[ "${#lines[@]}" -eq 4 ]]
+}
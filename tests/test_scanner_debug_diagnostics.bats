@@ -274,6 +274,111 @@ CEOF
     [[ "$stderr_out" == *"[BROTHER2] usb:"* ]]
 }
 
+# Build backend_init.c against a fake sysfs tree with one DCP-130C at
+# 1-1 (devnum 5, Full-Speed, interface 1-1:1.0 bound to usblp) and a
+# Brsane2.ini requesting compression, plus a program that loads it.
+build_fake_sysfs_backend() {
+    local sys="$TEST_TMPDIR/sys"
+    mkdir -p "$sys/1" "$sys/1-1" "$sys/1-1:1.0" "$TEST_TMPDIR/drivers/usblp"
+    echo 04f9 > "$sys/1-1/idVendor"
+    echo 01a8 > "$sys/1-1/idProduct"
+    echo DCP-130C > "$sys/1-1/product"
+    echo 12 > "$sys/1-1/speed"
+    echo " 2.00" > "$sys/1-1/version"
+    echo 5 > "$sys/1-1/devnum"
+    echo 480 > "$sys/1/speed"
+    ln -s "$TEST_TMPDIR/drivers/usblp" "$sys/1-1:1.0/driver"
+    printf '[Driver]\ncompression=1\n' > "$TEST_TMPDIR/Brsane2.ini"
+    gcc -shared -fPIC -O2 -w -DUSB_DEVICES_DIR="\"$sys\"" \
+        -DBROTHER_INI_PATH="\"$TEST_TMPDIR/Brsane2.ini\"" \
+        -o "$TEST_TMPDIR/libbackend_fake.so" "$PROJECT_ROOT/DCP-130C/backend_init.c"
+    echo 'int main(void) { return 0; }' > "$TEST_TMPDIR/test_main.c"
+    gcc -o "$TEST_TMPDIR/test_main" "$TEST_TMPDIR/test_main.c"
+}
+
+# Load the fake-sysfs backend once; prints its stderr
+load_fake_backend() {
+    BROTHER_DEBUG=1 BROTHER_PROBE_CACHE="$TEST_TMPDIR/usbprobe.cache" \
+        LD_PRELOAD="$TEST_TMPDIR/libbackend_fake.so" "$TEST_TMPDIR/test_main" 2>&1 >/dev/null
+}
+
+@test "backend_init: caches the USB probe and reports the same from the cache" {
+    build_fake_sysfs_backend
+    run load_fake_backend
+    [[ "$output" == *"probe: USB environment probed"*"cached in $TEST_TMPDIR/usbprobe.cache"* ]]
+    [[ "$output" == *"usb: found DCP-130C (04f9:01a8) at 1-1, speed: USB 2.0 Full-Speed (12 Mbit/s)"* ]]
+    [[ "$output" == *"usblp driver is bound to 1-1:1.0"* ]]
+    [[ "$output" == *"compression=1 (C=RLENGTH requested)"* ]]
+    [[ "$output" == *"host port speed: 480 Mbit/s"* ]]
+    [[ -f "$TEST_TMPDIR/usbprobe.cache" ]]
+    local probed
+    probed=$(printf '%s\n' "$output" | grep -v 'probe:' | sed 's/^[0-9:.]* //')
+
+    run load_fake_backend
+    [[ "$output" == *"probe: using results cached in $TEST_TMPDIR/usbprobe.cache"* ]]
+    [[ "$(printf '%s\n' "$output" | grep -v 'probe:' | sed 's/^[0-9:.]* //')" == "$probed" ]]
+}
+
+@test "backend_init: cached USB probe is refreshed after a replug or ini change" {
+    build_fake_sysfs_backend
+    load_fake_backend > /dev/null
+    echo 6 > "$TEST_TMPDIR/sys/1-1/devnum"
+    run load_fake_backend
+    [[ "$output" == *"probe: USB environment probed"* ]]
+    run load_fake_backend
+    [[ "$output" == *"probe: using results cached"* ]]
+
+    printf '[Driver]\ncompression=0\n' > "$TEST_TMPDIR/Brsane2.ini"
+    touch -d '1 hour ago' "$TEST_TMPDIR/Brsane2.ini"
+    run load_fake_backend
+    [[ "$output" == *"probe: USB environment probed"* ]]
+    [[ "$output" == *"compression=0 (C=NONE"* ]]
+}
+
+@test "backend_init: BROTHER_PROBE_CACHE_AGE=0 always probes and writes no cache" {
+    build_fake_sysfs_backend
+    export BROTHER_PROBE_CACHE_AGE=0
+    run load_fake_backend
+    [[ "$output" == *"probe: USB environment probed"*"not cached"* ]]
+    [[ "$output" == *"usb: found DCP-130C"* ]]
+    [[ ! -e "$TEST_TMPDIR/usbprobe.cache" ]]
+}
+
+@test "backend_init: sysfs names too long for the probe cache are skipped" {
+    local long
+    long=$(printf '1-%.0s1.' $(seq 40))1
+    # A Brother device and a usblp interface with 161-character names
+    mkdir -p "$TEST_TMPDIR/sys/$long" "$TEST_TMPDIR/sys/$long:1.0" "$TEST_TMPDIR/drivers/usblp"
+    echo 04f9 > "$TEST_TMPDIR/sys/$long/idVendor"
+    echo 5 > "$TEST_TMPDIR/sys/$long/devnum"
+    ln -s "$TEST_TMPDIR/drivers/usblp" "$TEST_TMPDIR/sys/$long:1.0/driver"
+    build_fake_sysfs_backend
+    run load_fake_backend
+    [[ "$output" == *"usb: found DCP-130C (04f9:01a8) at 1-1,"* ]]
+    # ... and only that one: no device under a cut-off name
+    [[ "$(printf '%s\n' "$output" | grep -c 'usb: found')" -eq 1 ]]
+    # The cache written without them reads back
+    run load_fake_backend
+    [[ "$output" == *"probe: using results cached"* ]]
+    [[ "$output" == *"usblp driver is bound to 1-1:1.0"* ]]
+}
+
+@test "backend_init: a probe cache in a directory everyone can write is not used" {
+    build_fake_sysfs_backend
+    load_fake_backend > /dev/null
+    chmod 777 "$TEST_TMPDIR"
+    run load_fake_backend
+    [[ "$output" == *"probe: $TEST_TMPDIR/usbprobe.cache is in a directory everyone can write, not using it"* ]]
+    [[ "$output" == *"probe: USB environment probed"*"not cached"* ]]
+    [[ "$output" == *"usb: found DCP-130C"* ]]
+}
+
+@test "backend_init: udev rule drops the probe cache on Brother hotplug" {
+    grep -q '61-brother-probe-cache.rules' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'ENV{PRODUCT}=="4f9/\*".*rm -f /var/cache/brother2/usbprobe.cache' \
+        "$PROJECT_ROOT/install_scanner.sh"
+}
+
 @test "backend_init: reads USB version sysfs attribute" {
     # Verify the code reads the 'version' sysfs attribute by checking
     # that the source contains the version reading logic
@@ -442,6 +547,80 @@ CEOF
     [[ "$stderr_out" == *"stall detection"* ]]
 }
 
+# Driver: test_hist <sessions>
+#   41 gray writes per session, 2 ms apart except one 60 ms gap
+build_hist_driver() {
+    cat > "$TEST_TMPDIR/test_hist.c" << 'CEOF'
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+typedef int BOOL; typedef int INT; typedef unsigned char BYTE;
+typedef unsigned long DWORD; typedef void *HANDLE;
+typedef struct {
+    INT nInResoX, nInResoY, nOutResoX, nOutResoY, nColorType;
+    DWORD dwInLinePixCnt; INT nOutDataKind; BOOL bLongBoundary;
+    DWORD dwOutLinePixCnt, dwOutLineByte, dwOutWriteMaxSize;
+} SCANDEC_OPEN;
+typedef struct {
+    INT nInDataComp, nInDataKind; BYTE *pLineData; DWORD dwLineDataSize;
+    BYTE *pWriteBuff; DWORD dwWriteBuffSize; BOOL bReverWrite;
+} SCANDEC_WRITE;
+extern BOOL ScanDecOpen(SCANDEC_OPEN *p);
+extern BOOL ScanDecClose(void);
+extern DWORD ScanDecWrite(SCANDEC_WRITE *w, INT *st);
+int main(int argc, char **argv) {
+    for (int s = 0; s < atoi(argv[1]); s++) {
+        SCANDEC_OPEN op; memset(&op, 0, sizeof(op));
+        op.nColorType = 0x0200; op.dwInLinePixCnt = 100;
+        ScanDecOpen(&op);
+        BYTE line[100], out[200]; memset(line, 128, 100);
+        for (int i = 0; i < 41; i++) {
+            if (i) usleep(i == 20 ? 60000 : 2000);
+            SCANDEC_WRITE w = {2, 0, line, 100, out, 200, 0}; INT st;
+            ScanDecWrite(&w, &st);
+        }
+        ScanDecClose();
+    }
+    return 0;
+}
+CEOF
+    gcc -o "$TEST_TMPDIR/test_hist" "$TEST_TMPDIR/test_hist.c" \
+        "$TEST_TMPDIR/libscandec_test.so" -Wl,-rpath,"$TEST_TMPDIR"
+}
+
+@test "scandec: summary shows gap and line time percentiles" {
+    build_hist_driver
+    run bash -c "BROTHER_DEBUG=1 '$TEST_TMPDIR/test_hist' 1 2>&1 >/dev/null"
+    [[ "$output" =~ gap\ dist:\ +p50\ ([0-9.]+)\ +p90\ [0-9.]+\ +p99\ [0-9.]+\ +p99.9\ ([0-9.]+)\ +max\ ([0-9.]+)\ ms\ \(40\ gaps\) ]]
+    local p50="${BASH_REMATCH[1]}" p999="${BASH_REMATCH[2]}" max="${BASH_REMATCH[3]}"
+    # The 2 ms sleeps dominate; the one 60 ms gap is the tail
+    awk -v p="$p50" 'BEGIN { exit !(p >= 1.9 && p < 10) }'
+    awk -v p="$p999" -v m="$max" 'BEGIN { exit !(p == m && m >= 60) }'
+    [[ "$output" =~ line\ dist:\ +p50\ [0-9.]+\ .*\ us\ \(41\ lines\) ]]
+}
+
+@test "scandec: BROTHER_STATS_JSON appends one histogram object per session" {
+    command -v python3 >/dev/null || skip "python3 unavailable"
+    build_hist_driver
+    BROTHER_DEBUG=1 BROTHER_STATS_JSON="$TEST_TMPDIR/stats.json" \
+        "$TEST_TMPDIR/test_hist" 2 2>/dev/null
+    run python3 - "$TEST_TMPDIR/stats.json" << 'PYEOF'
+import json, sys
+for line in open(sys.argv[1]):
+    d = json.loads(line)
+    g, l = d["gap_ns"], d["line_ns"]
+    assert d["mode"] == "8-bit gray" and d["lines"] == 41, d
+    assert g["count"] == 40 and l["count"] == 41
+    assert sum(b[2] for b in g["buckets"]) == 40
+    assert all(lo <= hi for lo, hi, _ in g["buckets"])
+    assert g["p50"] <= g["p90"] <= g["p99"] <= g["p999"] <= g["max"]
+    assert g["max"] >= 60000000
+    print("ok")
+PYEOF
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == $'ok\nok' ]]
+}
+
 @test "scandec: summary shows human-readable diagnosis" {
     cat > "$TEST_TMPDIR/test_diag.c" << 'CEOF'
 #include <string.h>
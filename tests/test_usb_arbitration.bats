@@ -0,0 +1,367 @@
+#!/usr/bin/env bats
+# Tests for the scan/print turn-taking on the shared USB link
+# (DCP-130C/brother_usb_arb.h): bounded waits and interleaving under load,
+# link use, priority, idle handover, transfers never taken over, a killed
+# holder, the off switch, the exporter's wait counters, and the two places
+# that bracket real transfers: brusb_bulk_read() (usb_async.c), polled or
+# with its queue of posted transfers, and the CUPS usb backend preload
+# (usb_print_arb.c) behind the brusb backend.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    # arb_sim <scan|print> <ms> <us per transfer> [done]: transfers for
+    # <ms> (at least one), each a sleep standing in for the USB write or
+    # read between brarb_enter() and brarb_leave(); then brarb_done()
+    # unless done is 0
+    cat > "$TEST_TMPDIR/arb_sim.c" << 'CEOF'
+#include <stdio.h>
+#include "brother_stats.h"
+#include "brother_usb_arb.h"
+int main(int argc, char **argv) {
+    unsigned side = strcmp(argv[1], "scan") == 0 ? BRARB_SCAN : BRARB_PRINT;
+    uint64_t end = brarb_now_ns() + (uint64_t)atol(argv[2]) * 1000000ull;
+    long us = atol(argv[3]);
+    BRARB_CLIENT c;
+    unsigned long n = 0;
+    brarb_open(&c, side);
+    do {
+        brarb_enter(&c);
+        usleep(us);
+        brarb_leave(&c);
+        n++;
+    } while (brarb_now_ns() < end);
+    if (argc < 5 || atoi(argv[4]))
+        brarb_done(&c);
+    BRSTATS *st = brstats_attach();
+    if (st) {
+        BRSTATS_ADD(st, arb_scan_waits, side == BRARB_SCAN ? c.waits : 0);
+        BRSTATS_ADD(st, arb_print_waits, side == BRARB_PRINT ? c.waits : 0);
+        BRSTATS_ADD(st, arb_scan_wait_ns, side == BRARB_SCAN ? c.wait_ns : 0);
+        BRSTATS_ADD(st, arb_print_wait_ns, side == BRARB_PRINT ? c.wait_ns : 0);
+    }
+    printf("transfers=%lu waits=%lu max_wait_ms=%.0f handovers=%lu\n", n,
+           (unsigned long)c.waits, c.max_wait_ns / 1e6,
+           c.seg ? (unsigned long)c.seg->handovers : 0ul);
+    return 0;
+}
+CEOF
+    gcc -O2 -Wall -Werror -I"$PROJECT_ROOT/DCP-130C" \
+        -o "$TEST_TMPDIR/arb_sim" "$TEST_TMPDIR/arb_sim.c" || skip "gcc unavailable"
+}
+
+teardown() {
+    teardown_test_tmpdir
+}
+
+# field <name> <file>: value of name=... in arb_sim's output
+field() {
+    sed -n "s/.*$1=\([0-9]*\).*/\1/p" "$2"
+}
+
+# both [env...]: a scan and a print side contending for 800 ms
+both() {
+    env "$@" "$TEST_TMPDIR/arb_sim" scan 800 2000 > "$TEST_TMPDIR/scan.out" &
+    env "$@" "$TEST_TMPDIR/arb_sim" print 800 2000 > "$TEST_TMPDIR/print.out"
+    wait
+}
+
+@test "usb_arb: both sides finish, taking turns, with bounded waits" {
+    both BROTHER_USB_SLICE_MS=20
+    [[ "$(field transfers "$TEST_TMPDIR/scan.out")" -gt 20 ]]
+    [[ "$(field transfers "$TEST_TMPDIR/print.out")" -gt 20 ]]
+    [[ "$(field handovers "$TEST_TMPDIR/print.out")" -ge 8 ]]
+    # a slice, one transfer and the polling interval; generous for load
+    [[ "$(field max_wait_ms "$TEST_TMPDIR/scan.out")" -lt 80 ]]
+    [[ "$(field max_wait_ms "$TEST_TMPDIR/print.out")" -lt 80 ]]
+}
+
+@test "usb_arb: sharing keeps the link about as busy as one side alone" {
+    "$TEST_TMPDIR/arb_sim" scan 800 2000 > "$TEST_TMPDIR/solo.out"
+    both
+    local solo shared
+    solo=$(field transfers "$TEST_TMPDIR/solo.out")
+    shared=$(( $(field transfers "$TEST_TMPDIR/scan.out") +
+               $(field transfers "$TEST_TMPDIR/print.out") ))
+    [[ $(( shared * 10 )) -ge $(( solo * 8 )) ]]
+}
+
+@test "usb_arb: BROTHER_USB_PRIORITY=scan gives scanning the larger share" {
+    both BROTHER_USB_SLICE_MS=20 BROTHER_USB_PRIORITY=scan
+    local scan print
+    scan=$(field transfers "$TEST_TMPDIR/scan.out")
+    print=$(field transfers "$TEST_TMPDIR/print.out")
+    [[ "$print" -gt 0 ]]
+    [[ "$scan" -ge $(( print * 2 )) ]]
+}
+
+@test "usb_arb: a holder gone quiet loses the link without waiting out its slice" {
+    # print takes the link and stops without giving it up
+    "$TEST_TMPDIR/arb_sim" print 0 1000 0 > /dev/null
+    BROTHER_USB_SLICE_MS=2000 "$TEST_TMPDIR/arb_sim" scan 0 1000 > "$TEST_TMPDIR/scan.out"
+    [[ "$(field max_wait_ms "$TEST_TMPDIR/scan.out")" -lt 500 ]]
+}
+
+@test "usb_arb: BROTHER_USB_ARB=0 creates nothing and never waits" {
+    BROTHER_USB_ARB=0 both
+    [[ ! -e "$BROTHER_USB_ARB_PATH" ]]
+    [[ "$(field waits "$TEST_TMPDIR/scan.out")" == "0" ]]
+    [[ "$(field waits "$TEST_TMPDIR/print.out")" == "0" ]]
+}
+
+@test "usb_arb: the state file is shared across users" {
+    "$TEST_TMPDIR/arb_sim" scan 0 0 > /dev/null
+    [[ "$(stat -c %a "$BROTHER_USB_ARB_PATH")" == "666" ]]
+}
+
+@test "usb_arb: exporter reports the waits per side" {
+    gcc -O2 -Wall -Werror -o "$TEST_TMPDIR/brother_exporter" \
+        "$PROJECT_ROOT/DCP-130C/brother_exporter.c"
+    export BROTHER_STATS_PATH="$TEST_TMPDIR/stats"
+    "$TEST_TMPDIR/brother_exporter" -o > /dev/null
+    both BROTHER_USB_SLICE_MS=20
+    run "$TEST_TMPDIR/brother_exporter" -o
+    local scan print
+    scan=$(printf '%s\n' "$output" | awk '$1 == "brother_usb_arbitration_waits_total{side=\"scan\"}" { print $2 }')
+    print=$(printf '%s\n' "$output" | awk '$1 == "brother_usb_arbitration_waits_total{side=\"print\"}" { print $2 }')
+    [[ "$scan" == "$(field waits "$TEST_TMPDIR/scan.out")" ]]
+    [[ "$print" == "$(field waits "$TEST_TMPDIR/print.out")" ]]
+    [[ "$scan" -gt 0 ]]
+    [[ "$output" == *'brother_usb_arbitration_wait_seconds_total{side="print"}'* ]]
+}
+
+@test "usb_arb: a transfer in progress is never taken over" {
+    # print holds the link for one 600 ms transfer; scan's 20 ms slice
+    # does not cut it short
+    BROTHER_USB_SLICE_MS=20 "$TEST_TMPDIR/arb_sim" print 0 600000 > "$TEST_TMPDIR/print.out" &
+    sleep 0.1
+    BROTHER_USB_SLICE_MS=20 "$TEST_TMPDIR/arb_sim" scan 0 1000 > "$TEST_TMPDIR/scan.out"
+    wait
+    [[ "$(field max_wait_ms "$TEST_TMPDIR/scan.out")" -ge 400 ]]
+}
+
+@test "usb_arb: a holder killed during a transfer loses the link" {
+    "$TEST_TMPDIR/arb_sim" print 0 30000000 > /dev/null &
+    local pid=$!
+    sleep 0.1
+    kill -9 "$pid"
+    wait "$pid" || true
+    run timeout 10 "$TEST_TMPDIR/arb_sim" scan 0 1000
+    [[ "$status" -eq 0 ]]
+    # BRARB_STALE_MS, then the pid check
+    [[ "$(field max_wait_ms <(echo "$output"))" -lt 3000 ]]
+}
+
+@test "usb_arb: scan reads hold the link only while each read runs" {
+    mkdir -p "$TEST_TMPDIR/inc"
+    cat > "$TEST_TMPDIR/inc/usb.h" << 'CEOF'
+#define USB_ENDPOINT_IN 0x80
+struct usb_dev_handle; typedef struct usb_dev_handle usb_dev_handle;
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int usb_close(usb_dev_handle *dev);
+CEOF
+    cat > "$TEST_TMPDIR/scan_reads.c" << 'CEOF'
+#include <stdio.h>
+#include "usb.h"
+#include "brother_usb_arb.h"
+#include "usb_async.h"
+#undef usb_bulk_read
+#undef usb_close
+static BRARB_CLIENT peek;
+static unsigned long state(void) { return peek.seg ? peek.seg->state & 7 : 99; }
+/* every other read fails, as a read on an unplugged scanner would */
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout) {
+    static int n;
+    (void)dev; (void)ep; (void)bytes; (void)timeout;
+    printf("in read: %lu\n", state());
+    return n++ % 2 ? -1 : size;
+}
+int usb_close(usb_dev_handle *dev) { (void)dev; return 0; }
+int main(void) {
+    char buf[16];
+    usb_dev_handle *h = (usb_dev_handle *)buf;
+    brarb_open(&peek, BRARB_PRINT);
+    for (int i = 0; i < 2; i++) {
+        int r = brusb_bulk_read(h, 0x84, buf, sizeof(buf), 100);
+        printf("after read %d: %lu\n", r, state());
+    }
+    brusb_close(h);
+    printf("after close: %lu\n", state());
+    return 0;
+}
+CEOF
+    gcc -O2 -Wall -I"$TEST_TMPDIR/inc" -I"$PROJECT_ROOT/DCP-130C" \
+        -o "$TEST_TMPDIR/scan_reads" "$TEST_TMPDIR/scan_reads.c" \
+        "$PROJECT_ROOT/DCP-130C/usb_async.c"
+    run "$TEST_TMPDIR/scan_reads"
+    [[ "$status" -eq 0 ]]
+    # 5 = BRARB_BUSY | BRARB_SCAN, 1 = turn kept between reads, 0 = free
+    [[ "${lines[0]}" == "in read: 5" ]]
+    [[ "${lines[1]}" == "after read 16: 1" ]]
+    [[ "${lines[2]}" == "in read: 5" ]]
+    [[ "${lines[3]}" == "after read -1: 1" ]]
+    [[ "${lines[4]}" == "after close: 0" ]]
+}
+
+@test "usb_arb: async scan reads move no data while printing holds the link" {
+    fake_libusb_fixture
+    cat > "$TEST_TMPDIR/scan_async.c" << 'CEOF'
+#include <pthread.h>
+#include <stdio.h>
+#include "fake_usb.h"
+#include "brother_usb_arb.h"
+#include "usb_async.h"
+#undef usb_bulk_read
+#undef usb_close
+static volatile int stop;
+static int turns, posted_in_turn;
+static BRARB_CLIENT print;
+/* a print job writing 20 ms at a time, checking nothing is posted */
+static void *print_side(void *arg) {
+    (void)arg;
+    brarb_open(&print, BRARB_PRINT);
+    usleep(50000);
+    while (!stop) {
+        brarb_enter(&print);
+        if (fake_posted())
+            posted_in_turn++;
+        usleep(20000);
+        if (fake_posted())
+            posted_in_turn++;
+        brarb_leave(&print);
+        brarb_done(&print);
+        turns++;
+        usleep(5000);
+    }
+    return NULL;
+}
+int main(void) {
+    usb_dev_handle *h = fake_open();
+    static char buf[5000];
+    long got = 0;
+    int ok = 1, empty = 0;
+    pthread_t th;
+    fake_endless(16384, 1000);
+    pthread_create(&th, NULL, print_side, NULL);
+    uint64_t end = brarb_now_ns() + 600000000ull;
+    while (brarb_now_ns() < end) {
+        int n = brusb_bulk_read(h, 0x84, buf, sizeof(buf), 1000);
+        if (n <= 0)
+            empty++;
+        else
+            ok &= fake_check(buf, n);
+        got += n > 0 ? n : 0;
+    }
+    stop = 1;
+    pthread_join(th, NULL);
+    int active = brusb_async_active();
+    brusb_close(h);
+    printf("turns=%d posted_in_turn=%d bad_state=%d ok=%d empty=%d kb=%ld "
+           "active=%d print_wait_ms=%.0f state=%d\n", turns, posted_in_turn,
+           fake_bad_state, ok, empty, got / 1024, active,
+           print.max_wait_ns / 1e6, fake_arb_state());
+    return 0;
+}
+CEOF
+    fake_usb_build scan_async
+    local mode
+    for mode in 0 1; do
+        BROTHER_USB_ASYNC=1 BROTHER_USB_THREAD=$mode BROTHER_USB_SLICE_MS=20             run "$TEST_TMPDIR/scan_async"
+        [[ "$status" -eq 0 ]]
+        [[ "$output" == *" posted_in_turn=0 bad_state=0 ok=1 empty=0 "* ]]
+        [[ "$output" == *" active=1 "* ]]
+        # both sides got turns, and printing waited about a slice at most
+        [[ "$(field turns <(echo "$output"))" -ge 5 ]]
+        [[ "$(field kb <(echo "$output"))" -ge 100 ]]
+        [[ "$(field print_wait_ms <(echo "$output"))" -lt 80 ]]
+        # closing cancels what is posted and frees the link
+        [[ "$output" == *" state=0" ]]
+    done
+}
+
+# usb_backend_fixture: a fake libusb-1.0 and a fake CUPS usb backend that
+# writes 1000 bytes and reads the backchannel once, plus libbrusbarb.so
+usb_backend_fixture() {
+    cat > "$TEST_TMPDIR/fake_libusb.c" << 'CEOF'
+#include <stdio.h>
+#include "brother_usb_arb.h"
+typedef struct libusb_device_handle libusb_device_handle;
+/* Writes go out 300 bytes per call, then time out like a printer that
+ * is busy moving paper */
+int libusb_bulk_transfer(libusb_device_handle *h, unsigned char ep,
+                         unsigned char *data, int length, int *transferred,
+                         unsigned int timeout) {
+    BRARB_CLIENT peek;
+    (void)h; (void)data;
+    brarb_open(&peek, BRARB_SCAN);
+    int n = ep & 0x80 || length < 300 ? length : 300;
+    printf("transfer ep=0x%02x len=%d timeout=%u state=%lu\n", ep, length,
+           timeout, (unsigned long)(peek.seg->state & 7));
+    *transferred = n;
+    return n < length ? -7 : 0;
+}
+CEOF
+    cat > "$TEST_TMPDIR/fake_usb_backend.c" << 'CEOF'
+#include <stdio.h>
+#include <stdlib.h>
+typedef struct libusb_device_handle libusb_device_handle;
+int libusb_bulk_transfer(libusb_device_handle *, unsigned char, unsigned char *,
+                         int, int *, unsigned int);
+int main(int argc, char **argv) {
+    static unsigned char buf[1000];
+    int n = 0;
+    printf("argc=%d uri=%s\n", argc, getenv("DEVICE_URI"));
+    int r = libusb_bulk_transfer(NULL, 0x02, buf, sizeof(buf), &n, 0);
+    printf("write r=%d n=%d\n", r, n);
+    libusb_bulk_transfer(NULL, 0x84, buf, 64, &n, 0);
+    return 0;
+}
+CEOF
+    gcc -shared -fPIC -O2 -Wall -I"$PROJECT_ROOT/DCP-130C" \
+        -o "$TEST_TMPDIR/libusb-1.0.so" "$TEST_TMPDIR/fake_libusb.c"
+    gcc -O2 -Wall -o "$TEST_TMPDIR/usb" "$TEST_TMPDIR/fake_usb_backend.c" \
+        -L"$TEST_TMPDIR" -lusb-1.0 -Wl,-rpath,"$TEST_TMPDIR"
+}
+
+@test "usb_arb: brusb backend preloads the print side into the usb backend" {
+    usb_backend_fixture
+    source_functions
+    sudo() { "$@"; }
+    SCRIPT_DIR="$PROJECT_ROOT"
+    CUPS_USB_BACKEND="$TEST_TMPDIR/usb"
+    USB_ARB_LIB="$TEST_TMPDIR/libbrusbarb.so"
+    USB_ARB_BACKEND="$TEST_TMPDIR/brusb"
+    install_usb_arbitration
+    [[ "$USB_ARB_OK" -eq 1 ]]
+    [[ "$(stat -c %a "$USB_ARB_BACKEND")" == "700" ]]
+
+    # discovery: nothing listed twice
+    run "$USB_ARB_BACKEND"
+    [[ "$status" -eq 0 ]]
+    [[ -z "$output" ]]
+
+    DEVICE_URI="brusb://Brother/DCP-130C?serial=X" BROTHER_USB_SLICE_MS=50 \
+        run "$USB_ARB_BACKEND" 1 user title 1 ""
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "argc=6 uri=usb://Brother/DCP-130C?serial=X" ]]
+    # each piece of the write runs inside a print turn (6 = busy | print)
+    # with the slice as its timeout; the backchannel read is not gated
+    [[ "${lines[1]}" == "transfer ep=0x02 len=1000 timeout=50 state=6" ]]
+    [[ "${lines[2]}" == "transfer ep=0x02 len=700 timeout=50 state=6" ]]
+    [[ "${lines[3]}" == "transfer ep=0x02 len=400 timeout=50 state=6" ]]
+    [[ "${lines[4]}" == "transfer ep=0x02 len=100 timeout=50 state=6" ]]
+    [[ "${lines[5]}" == "write r=0 n=1000" ]]
+    [[ "${lines[6]}" == "transfer ep=0x84 len=64 timeout=0 state=2" ]]
+}
+
+@test "usb_arb: configure_printer sends jobs to the brusb backend" {
+    grep -q 'PRINTER_URI="brusb:${PRINTER_URI#usb:}"' "$PROJECT_ROOT/install_printer.sh"
+    grep -q '^    install_usb_arbitration ||' "$PROJECT_ROOT/install_printer.sh"
+}
+
+@test "usb_arb: the ReadDeviceData patch leaves the turns to the USB wrappers" {
+    run grep -c 'brarb_' "$PROJECT_ROOT/install_scanner.sh"
+    [[ "$output" == "0" ]]
+    grep -q 'brusb_link_done();' "$PROJECT_ROOT/install_scanner.sh"
+}
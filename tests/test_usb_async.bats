@@ -0,0 +1,280 @@
+#!/usr/bin/env bats
+# Tests for the event-driven USB read wrappers in usb_async.c and the
+# install_scanner.sh patch that routes brother_devaccs.c through them.
+# The sandbox has no libusb headers: the pass-through build runs against
+# a minimal usb.h stand-in, and the HAVE_LIBUSB1 build against the fake
+# libusb-1.0 of fake_libusb_fixture, driven by usb_replay.
+
+load test_helper
+
+setup() {
+    setup_test_tmpdir
+    cat > "$TEST_TMPDIR/usb.h" << 'CEOF'
+#define USB_ENDPOINT_IN 0x80
+struct usb_dev_handle; typedef struct usb_dev_handle usb_dev_handle;
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout);
+int usb_close(usb_dev_handle *dev);
+CEOF
+    # usb_replay <step>...: script the scanner and the backend's reads
+    #   data:<n>[:<chunk>]  the scanner sends n bytes, chunk per transfer
+    #   later:<ms>:<n>      the same, from another thread after ms
+    #   zlp, error          a zero-length packet, a failed transfer
+    #   read:<size>[:<timeout>]   one brusb_bulk_read() (timeout 1000)
+    #   drain:<n>:<size>    reads of size until n bytes or an empty read
+    #   sleep:<ms>, state, close
+    fake_libusb_fixture
+    cat > "$TEST_TMPDIR/usb_replay.c" << 'CEOF'
+#include <pthread.h>
+#include <stdio.h>
+#include "fake_usb.h"
+#include "brother_usb_arb.h"
+#include <libusb-1.0/libusb.h>
+#include "usb_async.h"
+#undef usb_bulk_read
+#undef usb_close
+static long later_ms, later_n;
+static void *later(void *arg) {
+    (void)arg;
+    usleep(later_ms * 1000);
+    fake_data(later_n, 16384);
+    return NULL;
+}
+int main(int argc, char **argv) {
+    static char buf[1 << 20];
+    usb_dev_handle *h = fake_open();
+    pthread_t th;
+    for (int i = 1; i < argc; i++) {
+        long x = 0, y = 0;
+        int k;
+        if ((k = sscanf(argv[i], "data:%ld:%ld", &x, &y)) >= 1) {
+            fake_data(x, k == 2 ? (int)y : 16384);
+        } else if (sscanf(argv[i], "later:%ld:%ld", &later_ms, &later_n) == 2) {
+            pthread_create(&th, NULL, later, NULL);
+        } else if (strcmp(argv[i], "zlp") == 0) {
+            fake_zlp();
+        } else if (strcmp(argv[i], "error") == 0) {
+            fake_error(LIBUSB_TRANSFER_ERROR);
+        } else if ((k = sscanf(argv[i], "read:%ld:%ld", &x, &y)) >= 1) {
+            uint64_t t0 = brarb_now_ns();
+            int n = brusb_bulk_read(h, 0x84, buf, (int)x, k == 2 ? (int)y : 1000);
+            double ms = (brarb_now_ns() - t0) / 1e6;
+            printf("read n=%d ms=%.0f stalled=%d ok=%d posted=%d active=%d\n", n, ms,
+                   brusb_stalled(), n <= 0 || fake_check(buf, n), fake_posted(),
+                   brusb_async_active());
+        } else if (sscanf(argv[i], "drain:%ld:%ld", &x, &y) == 2) {
+            long got = 0;
+            int reads = 0, ok = 1, n;
+            while (got < x && (n = brusb_bulk_read(h, 0x84, buf, (int)y, 1000)) > 0) {
+                ok &= fake_check(buf, n);
+                got += n;
+                reads++;
+            }
+            printf("drain bytes=%ld reads=%d ok=%d\n", got, reads, ok);
+        } else if (sscanf(argv[i], "sleep:%ld", &x) == 1) {
+            usleep(x * 1000);
+        } else if (strcmp(argv[i], "state") == 0) {
+            printf("state posted=%d link=%d\n", fake_posted(), fake_arb_state());
+        } else if (strcmp(argv[i], "close") == 0) {
+            brusb_close(h);
+            printf("close posted=%d max_posted=%d polled=%d link=%d\n", fake_posted(),
+                   fake_max_posted, fake_polled, fake_arb_state());
+        }
+    }
+    return 0;
+}
+CEOF
+    fake_usb_build usb_replay
+}
+
+teardown() {
+    teardown_test_tmpdir
+}
+
+@test "usb_async: pass-through build forwards reads to usb_bulk_read" {
+    cat > "$TEST_TMPDIR/test_passthru.c" << 'CEOF'
+#include <stdio.h>
+#include <string.h>
+#include "usb.h"
+#include "usb_async.h"
+#undef usb_bulk_read
+#undef usb_close
+int usb_bulk_read(usb_dev_handle *dev, int ep, char *bytes, int size, int timeout) {
+    (void)dev; memset(bytes, 'x', size);
+    printf("read ep=0x%02x size=%d timeout=%d\n", ep, size, timeout);
+    return size;
+}
+int usb_close(usb_dev_handle *dev) { (void)dev; printf("close\n"); return 0; }
+int main(void) {
+    char buf[64];
+    usb_dev_handle *h = (usb_dev_handle *)buf;
+    int n = brusb_bulk_read(h, 0x84, buf, 32, 2000);
+    printf("n=%d active=%d stalled=%d stall_ms=%d\n",
+           n, brusb_async_active(), brusb_stalled(), brusb_stall_ms());
+    return brusb_close(h);
+}
+CEOF
+    gcc -O1 -I"$TEST_TMPDIR" -I"$PROJECT_ROOT/DCP-130C" \
+        -o "$TEST_TMPDIR/test_passthru" "$TEST_TMPDIR/test_passthru.c" \
+        "$PROJECT_ROOT/DCP-130C/usb_async.c" || skip "gcc unavailable"
+    BROTHER_USB_ASYNC=1 BROTHER_USB_STALL_MS=250 run "$TEST_TMPDIR/test_passthru"
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read ep=0x84 size=32 timeout=2000" ]]
+    [[ "${lines[1]}" == "n=32 active=0 stalled=0 stall_ms=250" ]]
+    [[ "${lines[2]}" == "close" ]]
+}
+
+# field <name> <line>: value of name=... in a usb_replay line
+field() {
+    sed -n "s/.* $1=\([0-9-]*\).*/\1/p" <<< " $2"
+}
+
+@test "usb_async: a read sleeps until the scanner sends, on the backend's usbfs descriptor" {
+    BROTHER_USB_ASYNC=1 run "$TEST_TMPDIR/usb_replay" later:150:5000 read:8192:2000 close
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=5000 "*" stalled=0 ok=1 posted=4 active=1" ]]
+    [[ "$(field ms "${lines[0]}")" -ge 140 ]]
+    [[ "$(field ms "${lines[0]}")" -lt 1000 ]]
+    [[ "${lines[1]}" == "close posted=0 max_posted=4 polled=0 link=0" ]]
+}
+
+@test "usb_async: warm-up waits out the caller's timeout, data the stall timeout" {
+    BROTHER_USB_ASYNC=1 run "$TEST_TMPDIR/usb_replay" \
+        read:100:150 data:3000 read:4096 read:4096:5000 read:100:150
+    [[ "$status" -eq 0 ]]
+    # no data yet: the caller's timeout, and no stall
+    [[ "${lines[0]}" == "read n=0 "*" stalled=0 ok=1 "* ]]
+    [[ "$(field ms "${lines[0]}")" -ge 140 ]]
+    [[ "${lines[1]}" == "read n=3000 "*" stalled=0 ok=1 "* ]]
+    # then quiet: 400 ms (the old 200 x 2 ms budget), not the 5 s timeout
+    [[ "${lines[2]}" == "read n=0 "*" stalled=1 ok=1 "* ]]
+    [[ "$(field ms "${lines[2]}")" -ge 380 ]]
+    [[ "$(field ms "${lines[2]}")" -lt 1500 ]]
+    # the next page starts with the caller's timeout again
+    [[ "${lines[3]}" == "read n=0 "*" stalled=0 ok=1 "* ]]
+    [[ "$(field ms "${lines[3]}")" -lt 380 ]]
+}
+
+@test "usb_async: BROTHER_USB_STALL_MS sets the stall timeout" {
+    BROTHER_USB_ASYNC=1 BROTHER_USB_STALL_MS=100 run "$TEST_TMPDIR/usb_replay" \
+        data:3000 read:4096 read:4096:5000
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[1]}" == "read n=0 "*" stalled=1 ok=1 "* ]]
+    [[ "$(field ms "${lines[1]}")" -ge 90 ]]
+    [[ "$(field ms "${lines[1]}")" -lt 380 ]]
+}
+
+@test "usb_async: zero-length packets are skipped and posted again" {
+    BROTHER_USB_ASYNC=1 run "$TEST_TMPDIR/usb_replay" zlp zlp data:100 read:4096 close
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=100 "*" stalled=0 ok=1 posted=4 active=1" ]]
+    [[ "${lines[1]}" == "close posted=0 max_posted=4 polled=0 link=0" ]]
+}
+
+@test "usb_async: a failed transfer falls back to polled usb_bulk_read" {
+    BROTHER_USB_ASYNC=1 run "$TEST_TMPDIR/usb_replay" \
+        data:100 read:4096 error read:4096 data:50 read:4096 close
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=100 "*" ok=1 posted=4 active=1" ]]
+    # the failed read is retried polled, on a scanner with nothing to send
+    [[ "${lines[1]}" == "read n=0 "*" ok=1 posted=0 active=0" ]]
+    [[ "${lines[2]}" == "read n=50 "*" ok=1 posted=0 active=0" ]]
+    [[ "${lines[3]}" == "close posted=0 max_posted=4 polled=2 link=0" ]]
+}
+
+@test "usb_async: without BROTHER_USB_ASYNC=1 reads stay polled" {
+    run "$TEST_TMPDIR/usb_replay" data:100 read:4096 close
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=100 "*" ok=1 posted=0 active=0" ]]
+    [[ "${lines[1]}" == "close posted=0 max_posted=0 polled=1 link=0" ]]
+}
+
+@test "scanner: ReadDeviceData patch routes reads through usb_async.h" {
+    grep -q '#include "usb_async.h"' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'brusb_async_active()' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'brusb_stalled()' "$PROJECT_ROOT/install_scanner.sh"
+}
+
+@test "scanner: usb_async.c is compiled and linked into the backend" {
+    grep -q 'usb_async.o' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q '\-DHAVE_LIBUSB1' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q '\-lusb-1.0' "$PROJECT_ROOT/install_scanner.sh"
+    grep -q 'libusb-1.0-0-dev' "$PROJECT_ROOT/install_scanner.sh"
+}
+
+@test "usb_async: keeps BROTHER_USB_QUEUE_DEPTH transfers posted, re-posting drained ones" {
+    BROTHER_USB_ASYNC=1 BROTHER_USB_QUEUE_DEPTH=3 run "$TEST_TMPDIR/usb_replay" \
+        read:100:50 data:40000 read:10000 read:10000 read:30000 close
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=0 "*" posted=3 active=1" ]]
+    # the first transfer is handed out in two reads and then posted again
+    [[ "${lines[1]}" == "read n=10000 "*" ok=1 posted=2 active=1" ]]
+    [[ "${lines[2]}" == "read n=6384 "*" ok=1 posted=3 active=1" ]]
+    [[ "${lines[3]}" == "read n=16384 "*" ok=1 posted=3 active=1" ]]
+    [[ "${lines[4]}" == "close posted=0 max_posted=3 polled=0 link=0" ]]
+}
+
+@test "usb_async: the queue depth defaults to 4 and stops at 16" {
+    BROTHER_USB_ASYNC=1 run "$TEST_TMPDIR/usb_replay" read:100:50
+    [[ "${lines[0]}" == "read n=0 "*" posted=4 active=1" ]]
+    BROTHER_USB_ASYNC=1 BROTHER_USB_QUEUE_DEPTH=40 run "$TEST_TMPDIR/usb_replay" read:100:50
+    [[ "${lines[0]}" == "read n=0 "*" posted=16 active=1" ]]
+}
+
+@test "usb_async: data comes out in order across transfers and partial reads" {
+    BROTHER_USB_ASYNC=1 run "$TEST_TMPDIR/usb_replay" data:100000:10000 drain:100000:7000
+    [[ "$status" -eq 0 ]]
+    # each 10000-byte transfer is two reads of 7000 and 3000
+    [[ "${lines[0]}" == "drain bytes=100000 reads=20 ok=1" ]]
+}
+
+@test "usb_async: the debug stats count how often the queue ran dry" {
+    BROTHER_DEBUG=1 BROTHER_USB_ASYNC=1 BROTHER_USB_QUEUE_DEPTH=1 \
+        run "$TEST_TMPDIR/usb_replay" data:100000:10000 drain:100000:7000 close
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"10 transfers, 100000 bytes"*"queue depth 1, bus idle 10 times"* ]]
+    BROTHER_DEBUG=1 BROTHER_USB_ASYNC=1 \
+        run "$TEST_TMPDIR/usb_replay" data:100000:10000 drain:100000:7000 close
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"queue depth 4, bus idle 0 times"* ]]
+}
+
+@test "usb_async: reader thread keeps taking data while the backend is not reading" {
+    BROTHER_DEBUG=1 BROTHER_USB_ASYNC=1 BROTHER_USB_THREAD=1 BROTHER_USB_RING_KB=64 \
+        run "$TEST_TMPDIR/usb_replay" read:100:50 data:200000 sleep:300 state \
+        drain:200000:1000 close
+    [[ "$status" -eq 0 ]]
+    # the ring filled up; what does not fit stays in completed transfers,
+    # with nothing posted and the link free for printing
+    [[ "$output" == *"state posted=0 link=1"* ]]
+    [[ "$output" == *"drain bytes=200000 reads="*" ok=1"* ]]
+    [[ "$output" == *"ring 64 KB, high-water 64 KB (100%), ring full "[1-9]*" times"* ]]
+    [[ "$output" == *"close posted=0 max_posted=4 polled=0 link=0"* ]]
+}
+
+@test "usb_async: reader thread's ring hands data out in order as it wraps" {
+    BROTHER_DEBUG=1 BROTHER_USB_ASYNC=1 BROTHER_USB_THREAD=1 BROTHER_USB_RING_KB=64 \
+        run "$TEST_TMPDIR/usb_replay" data:300000:5000 drain:300000:7777 close
+    [[ "$status" -eq 0 ]]
+    [[ "$output" == *"drain bytes=300000 reads="*" ok=1"* ]]
+    [[ "$output" == *" transfers, 300000 bytes"* ]]
+}
+
+@test "usb_async: reader thread still ends the data after the stall timeout" {
+    BROTHER_USB_ASYNC=1 BROTHER_USB_THREAD=1 BROTHER_USB_STALL_MS=150 \
+        run "$TEST_TMPDIR/usb_replay" data:1000 read:4096 read:4096:5000
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=1000 "*" ok=1 "*" active=1" ]]
+    [[ "${lines[1]}" == "read n=0 "*" stalled=1 ok=1 "* ]]
+    [[ "$(field ms "${lines[1]}")" -ge 140 ]]
+    [[ "$(field ms "${lines[1]}")" -lt 1000 ]]
+}
+
+@test "usb_async: reader thread's failed transfer falls back to polled reads" {
+    BROTHER_USB_ASYNC=1 BROTHER_USB_THREAD=1 run "$TEST_TMPDIR/usb_replay" \
+        data:100 read:4096 error sleep:50 read:4096 data:70 read:4096 close
+    [[ "$status" -eq 0 ]]
+    [[ "${lines[0]}" == "read n=100 "*" ok=1 "*" active=1" ]]
+    [[ "${lines[1]}" == "read n=0 "*" ok=1 posted=0 active=0" ]]
+    [[ "${lines[2]}" == "read n=70 "*" ok=1 posted=0 active=0" ]]
+    [[ "${lines[3]}" == "close posted=0 max_posted=4 polled=2 link=0" ]]
+}